@@ -15,5 +15,11 @@ OptionParser.new { |opt|
 
 have_library( "jpeg")
 have_header( "jpeglib.h")
+have_const( "JCS_RGB565", ["stdio.h", "jpeglib.h"])
+
+have_func( "rb_ext_ractor_safe", "ruby.h")
+
+have_header( "ruby/io/buffer.h")
+have_func( "rb_io_buffer_get_bytes_for_writing", ["ruby.h", "ruby/io/buffer.h"])
 
 create_makefile( "jpeg/jpeg")
@@ -6,15 +6,39 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <math.h>
 #include <strings.h>
 #include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <jpeglib.h>
+#include <jerror.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
 
 #include "ruby.h"
 #include "ruby/encoding.h"
+#include "ruby/thread.h"
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif
 
 #define UNIT_LINES                 10
+#define CTX_POOL_SIZE              8
+#define PARALLEL_DECODE_THRESHOLD  (2048 * 1024)
+#define DEFAULT_BAND_ROWS          16
 
 #ifdef DEFAULT_QUALITY
 #undef DEFAULT_QUALITY
@@ -30,6 +54,12 @@
 #define F_PARSE_EXIF               0x00000004
 #define F_APPLY_ORIENTATION        0x00000008
 #define F_DITHER                   0x00000010
+#define F_CROP                     0x00000020
+#define F_FIT                      0x00000040
+#define F_FILL                     0x00000080
+#define F_PREFER_THUMB             0x00000100
+#define F_RESIZE                   0x00000200
+#define F_RESAMPLE                 (F_FIT | F_FILL | F_RESIZE)
 
 #define SET_FLAG(ptr, msk)         ((ptr)->flags |= (msk))
 #define CLR_FLAG(ptr, msk)         ((ptr)->flags &= ~(msk))
@@ -47,6 +77,18 @@
 
 #define FMT_YVU                    20     /* original extend */
 
+/*
+ * RGB565の出力にlibjpeg-turboのJCS_RGB565を使うか否か (JCS_RGB565は
+ * ネイティブのバイト順で書き出されるので、リトルエンディアンの場合のみ)
+ */
+#if defined(HAVE_CONST_JCS_RGB565) && !defined(WORDS_BIGENDIAN)
+#define USE_JCS_RGB565
+#endif
+
+#define PACK_NONE                  0
+#define PACK_ROWS                  1      /* pack each row while reading */
+#define PACK_IMAGE                 2      /* pack whole image after rotation */
+
 #define JPEG_APP1                  0xe1   /* Exif marker */
 
 #define N(x)                       (sizeof(x)/sizeof(*x))
@@ -65,11 +107,6 @@
                                        (((ci)->out_color_components == 1) || \
                                         ((ci)->out_color_components == 3)))
 
-#define ALLOC_ARRAY() \
-        ((JSAMPARRAY)xmalloc(sizeof(JSAMPROW) * UNIT_LINES))
-#define ALLOC_ROWS(w,c) \
-        ((JSAMPROW)xmalloc(sizeof(JSAMPLE) * (w) * (c) * UNIT_LINES))
-
 #define EQ_STR(val,str)            (rb_to_id(val) == rb_intern(str))
 #define EQ_INT(val,n)              (FIX2INT(val) == n)
 
@@ -81,6 +118,10 @@ static VALUE decoder_klass;
 static VALUE meta_klass;
 static VALUE decerr_klass;
 
+#ifdef USE_AVX2_DISPATCH
+static int have_avx2;        // 実行中のCPUがAVX2を持つか (Init_jpeg()で設定)
+#endif /* defined(USE_AVX2_DISPATCH) */
+
 static ID id_meta;
 static ID id_width;
 static ID id_stride;
@@ -91,9 +132,21 @@ static ID id_ncompo;
 static ID id_exif_tags;
 static ID id_colormap;
 
+static ID id_exif;
+static ID id_gps;
+static ID id_i14y;
+static ID id_thumbnail;
+static ID id_thumb_data;
+static ID id_thumb_offset;
+static ID id_thumb_size;
+static ID id_strip_bang;
+static ID id_readpartial;
+static ID id_write;
+
 typedef struct {
   int tag;
   const char* name;
+  ID id;                      // interned at Init_jpeg()
 } tag_entry_t;
 
 tag_entry_t tag_tiff[] = {
@@ -252,12 +305,20 @@ tag_entry_t tag_i14y[] = {
   {0x1001, "related_image_width",          },
 };
 
+typedef struct {
+  struct jpeg_error_mgr jerr;
+
+  char msg[JMSG_LENGTH_MAX+10];
+  jmp_buf jmpbuf;
+} ext_error_t;
+
 static const char* encoder_opts_keys[] = {
   "pixel_format",             // {str}
   "quality",                  // {integer}
   "scale",                    // {rational} or {float}
   "dct_method",               // {str}
-  "orientation"               // {integer}
+  "orientation",              // {integer}
+  "threads",                  // {integer}
 };
 
 static ID encoder_opts_ids[N(encoder_opts_keys)];
@@ -267,18 +328,122 @@ typedef struct {
   int width;
   int height;
 
+  int image_width;            // size of the output image (:scale applied)
+  int image_height;
+
   int data_size;
   J_DCT_METHOD dct_method;
 
-  struct jpeg_compress_struct cinfo;
-  struct jpeg_error_mgr jerr;
-
-  JSAMPARRAY array;
-  JSAMPROW rows;
+  J_COLOR_SPACE color_space;
+  int components;
+  int quality;
 
   int orientation;
+
+  int threads;                // number of stripes compressed in parallel
+
+  size_t size_hint;           // output size of the last encode
+
+  /*
+   * 圧縮の作業領域のプール (デコーダと同様にアトミック操作で出し入れ
+   * するので、freezeされたオブジェクトから並行して使用できる)
+   */
+  struct encode_ctx* pool[CTX_POOL_SIZE];
+
+  struct encode_stream* stream;   // state of #start (or NULL)
 } jpeg_encode_t;
 
+/*
+ * 圧縮データの出力先 (伸長可能なバッファ)
+ *
+ * growは容量を拡張してバッファの先頭アドレスを返す (失敗時はNULL)。
+ * Rubyの文字列に直接書き込む場合とmalloc()で確保した領域に書き込む
+ * 場合の二種類がある。
+ */
+typedef struct output_buf output_buf_t;
+
+struct output_buf {
+  struct jpeg_destination_mgr pub;
+
+  unsigned char* (*grow)(output_buf_t* out, size_t capa);
+
+  unsigned char* buf;
+  size_t capa;
+  size_t size;
+
+  VALUE str;
+};
+
+/*
+ * 圧縮処理の作業領域
+ *
+ * cinfoはエンコーダのプールに戻して次の呼び出しで再利用する (permanent
+ * プールとアリーナに保持されたimageプールの領域がそのまま使われる)。
+ * それ以外のバッファは一回の圧縮毎に確保して解放する。
+ */
+typedef struct encode_ctx {
+  struct jpeg_compress_struct cinfo;
+  ext_error_t err_mgr;
+  int active;                 // cinfo is created
+
+  JSAMPROW array[UNIT_LINES];
+  JSAMPROW rows;              // staging buffer (NULL if not needed)
+
+  /*
+   * :scaleによる縮小の状態 (縮小しない場合はxmapがNULL)
+   */
+  int* xmap;                  // column boundaries of the boxes
+  uint32_t* acc;              // sums of the current output row
+  JSAMPROW line;              // converted input row (staged formats only)
+  int sy;                     // next input row
+  int oy;                     // current output row
+  int filled;                 // number of rows in array[] or plane[]
+
+  /*
+   * YUYVを4:2:2のままlibjpegに渡す場合の作業領域 (使用しない場合は
+   * planesがNULL)
+   */
+  JSAMPROW planes;
+  JSAMPROW plane[3][DCTSIZE]; // Y, Cb, Cr
+} encode_ctx_t;
+
+/*
+ * GVLを解放した処理で使う作業領域の組 (GVL保持中にプールから取り出し、
+ * GVLの再取得後に返却する)
+ */
+typedef struct {
+  jpeg_encode_t* owner;       // encoder object (owner of the pool)
+  encode_ctx_t** ctx;
+  int n;
+  int next;                   // next context to be taken by a worker
+} encode_ctx_set_t;
+
+typedef struct {
+  jpeg_encode_t* ptr;
+  uint8_t* data;
+
+  encode_ctx_set_t set;
+  output_buf_t out;
+
+  char msg[JMSG_LENGTH_MAX+10];
+  int status;
+} encode_job_t;
+
+typedef struct {
+  encode_job_t* job;
+
+  int mcu_ht;                 // height of MCU row (in pixels)
+  int mcus_per_row;
+  int stripe_rows;            // MCU rows per stripe (except last)
+  int nstripes;
+
+  output_buf_t* stripes;
+
+  int next;
+  int failed;
+  char msg[JMSG_LENGTH_MAX+10];
+} stripe_plan_t;
+
 static const char* decoder_opts_keys[] = {
   "pixel_format",             // {str}
   "output_gamma",             // {float}
@@ -296,17 +461,48 @@ static const char* decoder_opts_keys[] = {
   "dct_method",               // {str}
   "with_exif",                // {bool}
   "with_exif_tags",           // {bool}
-  "orientation"               // {bool}
+  "orientation",              // {bool}
+  "threads",                  // {integer}
+  "max_scans",                // {integer}
+  "crop",                     // {array}
+  "fit",                      // {array}
+  "fill",                     // {array}
+  "prefer_thumbnail",         // {integer} or {array}
+  "resize",                   // {array}
 };
 
 static ID decoder_opts_ids[N(decoder_opts_keys)];
 
+static const char* batch_opts_keys[] = {
+  "threads",                  // {integer}
+};
+
+static ID batch_opts_ids[N(batch_opts_keys)];
+
+static const char* decode_into_opts_keys[] = {
+  "offset",                   // {integer}
+  "stride",                   // {integer}
+};
+
+static ID decode_into_opts_ids[N(decode_into_opts_keys)];
+
+static const char* each_band_opts_keys[] = {
+  "rows",                     // {integer}
+};
+
+static ID each_band_opts_ids[N(each_band_opts_keys)];
+
+/*
+ * 伸長処理一回分の作業領域 (デコーダオブジェクトの設定値とは分離する)
+ */
 typedef struct {
-  struct jpeg_error_mgr jerr;
+  struct jpeg_decompress_struct cinfo;
+  ext_error_t err_mgr;
 
-  char msg[JMSG_LENGTH_MAX+10];
-  jmp_buf jmpbuf;
-} ext_error_t;
+  JSAMPROW array[UNIT_LINES];
+
+  int active;                 // cinfo has been created (kept across calls)
+} decode_ctx_t;
 
 typedef struct {
   int flags;
@@ -329,15 +525,105 @@ typedef struct {
   boolean enable_external_quant;
   boolean enable_2pass_quant;
 
-  struct jpeg_decompress_struct cinfo;
-  ext_error_t err_mgr;
+  int threads;                // 0 means "auto"
+  int max_scans;              // 0 means "all scans"
+  int crop[4];                // x, y, width, height (if F_CROP is set)
+  int box[2];                 // width, height (if F_RESAMPLE is set)
+  int filter;                 // resampling filter (RESAMPLE_*)
+  int thumb[2];               // minimum size of the thumbnail to use
 
-  struct {
-    int value;
-    VALUE buf;
-  } orientation;
+  /*
+   * 作業領域のフリーリスト。スロットの取り出しと返却はアトミック操作
+   * で行うのでロックは不要 (設定値の複製に含まれるこの配列は参照しない
+   * こと)
+   */
+  decode_ctx_t* pool[CTX_POOL_SIZE];
+
+  struct decode_stream* stream;   // state of #feed (or NULL)
 } jpeg_decode_t;
 
+/*
+ * GVLを解放した処理で使う作業領域の組 (GVL保持中にプールから取り出し、
+ * GVLの再取得後に返却する)
+ */
+typedef struct {
+  jpeg_decode_t* owner;       // decoder object (owner of the pool)
+  decode_ctx_t** ctx;
+  int n;
+  int next;                   // next context to be taken by a worker
+} decode_ctx_set_t;
+
+/*
+ * リサンプリングのフィルタ
+ */
+enum {
+  RESAMPLE_BILINEAR = 0,      // triangle (default)
+  RESAMPLE_BICUBIC,           // Catmull-Rom
+  RESAMPLE_LANCZOS,           // Lanczos-3
+};
+
+/*
+ * :fit/:fill/:resizeの処理計画 (plan_fit()で求める)
+ */
+typedef struct {
+  int num;                    // DCT scaling factor (num/8), 0 if not used
+  int sw;                     // size of the DCT scaled image
+  int sh;
+  int cw;                     // size of the resampled image (before trim)
+  int ch;
+  int x0;                     // trimming offset (:fill)
+  int y0;
+  int tw;                     // output size
+  int th;
+  int filter;
+} fit_plan_t;
+
+/*
+ * :prefer_thumbnailで選んだサムネイル (probe_thumbnail()で求める)
+ */
+typedef struct {
+  VALUE data;                 // JPEG data of the thumbnail (or Qnil)
+  int o9n;                    // orientation of the main image
+  VALUE exif;                 // Exif tags of the main image (or Qnil)
+} thumb_t;
+
+typedef struct {
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  JSAMPARRAY array;
+  int o9n;
+
+  uint8_t* raw;               // scanline destination
+  uint8_t* cmap;              // destination of expand colormap (or NULL)
+  uint8_t* rot;               // work buffer for transpose (or NULL)
+  size_t stride;
+  int pack;                   // PACK_NONE, PACK_ROWS or PACK_IMAGE
+  JSAMPARRAY stage;           // rows read before packing (PACK_ROWS)
+
+  uint8_t* jpg;               // input data (for parallel decoding)
+  size_t jpg_sz;
+  int threads;                // number of threads for parallel decoding
+  int parallel;               // decoded by decode_in_parallel()
+  int limited;                // input was not read to the end (:max_scans)
+  fit_plan_t fit;
+
+  decode_ctx_set_t set;       // contexts for the parallel decoding
+
+  int status;
+} decode_job_t;
+
+/*
+ * decode_into()の出力先
+ */
+typedef struct {
+  VALUE buf;                  // String or IO::Buffer
+  uint8_t* ptr;
+  size_t size;
+  size_t offset;
+  size_t stride;              // 0 means "same as the row size"
+  size_t row;                 // bytes per row of the decoded image
+} decode_dest_t;
+
 
 static VALUE
 lookup_tag_symbol(tag_entry_t* tbl, size_t n, int tag)
@@ -367,7 +653,7 @@ lookup_tag_symbol(tag_entry_t* tbl, size_t n, int tag)
       continue;
     }
 
-    ret = (p->name)? ID2SYM(rb_intern(p->name)): Qnil;
+    ret = (p->name)? ID2SYM(p->id): Qnil;
     break;
   }
 
@@ -390,2617 +676,10114 @@ encode_output_message(j_common_ptr cinfo)
 static void
 encode_error_exit(j_common_ptr cinfo)
 {
-  char msg[JMSG_LENGTH_MAX];
-
-  (*cinfo->err->format_message)(cinfo, msg);
+  ext_error_t* err;
 
-  jpeg_destroy_compress((j_compress_ptr)cinfo);
-  rb_raise(encerr_klass, "%s", msg);
+  /*
+   * GVLを解放した状態で呼び出される場合があるので、ここでは例外を
+   * 発生させずにメッセージを保存してlongjmpで呼び出し元に戻る
+   */
+  err = (ext_error_t*)cinfo->err;
+  (*err->jerr.format_message)(cinfo, err->msg);
+  longjmp(err->jmpbuf, 1);
 }
 
-
-static void
-rb_encoder_free( void* _ptr)
+static int
+get_ncpus(void)
 {
-  jpeg_encode_t* ptr;
-
-  ptr = (jpeg_encode_t*)_ptr;
-
-  if (ptr->array != NULL) xfree(ptr->array);
-  if (ptr->rows != NULL) xfree(ptr->rows);
+  long ret;
 
-  jpeg_destroy_compress(&ptr->cinfo);
+  ret = sysconf(_SC_NPROCESSORS_ONLN);
 
-  free(_ptr);
+  return (ret > 0)? (int)ret: 1;
 }
 
-static VALUE
-rb_encoder_alloc(VALUE self)
+static int
+eval_threads_opt(VALUE opt)
 {
-  jpeg_encode_t* ptr;
+  int ret;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+  case T_NIL:
+    ret = get_ncpus();
+    break;
+
+  case T_FIXNUM:
+    ret = FIX2INT(opt);
+    if (ret < 1) {
+      RANGE_ERROR(":threads shall be 1 or more.");
+    }
+    break;
 
-  ptr = ALLOC(jpeg_encode_t);
-  memset(ptr, 0, sizeof(*ptr));
+  default:
+    TYPE_ERROR("Unsupportd :threads option value.");
+    break;
+  }
 
-  return Data_Wrap_Struct(encoder_klass, 0, rb_encoder_free, ptr);
+  return ret;
 }
 
 static void
-set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
+run_workers(void* (*func)(void*), void* arg, int n)
 {
-  VALUE opts[N(encoder_opts_ids)];
-  int format;
-  int color_space;
-  int components;
-  int data_size;
-  int quality;
-  int scale_num;
-  int scale_denom;
-  int i;
-
   /*
-   * parse options
+   * n個のワーカでfuncを実行する (呼び出しスレッド自身もワーカの一つとして
+   * 動作する)。GVLを解放した状態で呼び出すこと。
    */
-  rb_get_kwargs(opt, encoder_opts_ids, 0, N(encoder_opts_ids), opts);
 
-  /*
-   * eval :pixel_format option
-   */
-  if (opts[0] == Qundef||EQ_STR(opts[0], "YUV422")||EQ_STR(opts[0], "YUYV")) {
-    format      = FMT_YUV422;
-    color_space = JCS_YCbCr;
-    components  = 3;
-    data_size   = (wd * ht * 2);
+  pthread_t* th;
+  int m;
+  int i;
 
-  } else if (EQ_STR(opts[0], "RGB565")) {
-    format      = FMT_RGB565;
-    color_space = JCS_RGB;
-    components  = 3;
-    data_size   = (wd * ht * 2);
+  th = (n > 1)? (pthread_t*)malloc(sizeof(pthread_t) * (n - 1)): NULL;
+  m  = 0;
 
-  } else if (EQ_STR(opts[0], "RGB") || EQ_STR(opts[0], "RGB24")) {
-    format      = FMT_RGB;
-    color_space = JCS_RGB;
-    components  = 3;
-    data_size   = (wd * ht * 3);
+  if (th != NULL) {
+    for (m = 0; m < n - 1; m++) {
+      if (pthread_create(th + m, NULL, func, arg)) break;
+    }
+  }
 
-  } else if (EQ_STR(opts[0], "BGR") || EQ_STR(opts[0], "BGR24")) {
-    format      = FMT_BGR;
-    color_space = JCS_EXT_BGR;
-    components  = 3;
-    data_size   = (wd * ht * 3);
+  func(arg);
 
-  } else if (EQ_STR(opts[0], "YUV444") || EQ_STR(opts[0], "YCbCr")) {
-    format      = FMT_YUV;
-    color_space = JCS_YCbCr;
-    components  = 3;
-    data_size   = (wd * ht * 3);
+  for (i = 0; i < m; i++) {
+    pthread_join(th[i], NULL);
+  }
 
-  } else if (EQ_STR(opts[0], "RGBX") || EQ_STR(opts[0], "RGB32")) {
-    format      = FMT_RGB32;
-    color_space = JCS_EXT_RGBX;
-    components  = 4;
-    data_size   = (wd * ht * 4);
+  if (th != NULL) free(th);
+}
 
 
-  } else if (EQ_STR(opts[0], "BGRX") || EQ_STR(opts[0], "BGR32")) {
-    format      = FMT_BGR32;
-    color_space = JCS_EXT_BGRX;
-    components  = 4;
-    data_size   = (wd * ht * 4);
+/*
+ * libjpegのメモリマネージャ (アリーナ方式)
+ *
+ * 標準のメモリマネージャはプールの領域を画像毎にmalloc()/free()する
+ * ため、長時間稼働させるとヒープが断片化する。ここではcinfo->memを
+ * 置き換え、確保したチャンクを画像間で保持して使い回す。imageプールの
+ * 解放はカーソルを先頭のチャンクに戻すだけなのでO(1)で行える。
+ * 仮想配列は常にメモリ上に展開する (一時ファイルは使用しない)。
+ *
+ * GVLを解放した状態 (ワーカスレッドを含む) で使用されるのでRubyの
+ * APIは呼び出さない。メモリ使用量の通知はGVLを保持している呼び出し元
+ * でupdate_memory_usage()を使って行う。
+ */
 
+#define ARENA_ALIGN                64
+#define ARENA_CHUNK_SIZE           (64 * 1024)
+#define ARENA_KEEP_MAX             (32 * 1024 * 1024)
 
-  } else if (EQ_STR(opts[0], "GRAYSCALE")) {
-    format      = FMT_GRAYSCALE;
-    color_space = JCS_GRAYSCALE;
-    components  = 1;
-    data_size   = (wd * ht);
+#define ARENA_ROUND_UP(n)          (((n) + (ARENA_ALIGN - 1)) & \
+                                    ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_HEADER_SIZE          ARENA_ROUND_UP(sizeof(arena_chunk_t))
 
-  } else {
-    ARGUMENT_ERROR("Unsupportd :pixel_format option value.");
-  }
+typedef struct arena_chunk arena_chunk_t;
 
-  /*
-   * eval :quality option
-   */
-  if (opts[1] == Qundef) {
-    quality = DEFAULT_QUALITY;
+struct arena_chunk {
+  arena_chunk_t* next;
+  size_t size;                // usable bytes (excluding the header)
+  size_t used;
+};
 
-  } else {
-    if (TYPE(opts[1]) != T_FIXNUM) {
-      ARGUMENT_ERROR("Unsupportd :quality option value.");
+typedef struct {
+  arena_chunk_t* head;
+  arena_chunk_t* cur;         // chunk currently allocated from
+  size_t total;               // bytes held by the chunks
+} arena_pool_t;
+
+struct jvirt_sarray_control {
+  JSAMPARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION samplesperrow;
+  JDIMENSION maxaccess;
+  JDIMENSION first_undef_row;
+  boolean pre_zero;
+  jvirt_sarray_ptr next;
+};
 
-    } else {
-      quality = FIX2INT(opts[1]);
-    }
+struct jvirt_barray_control {
+  JBLOCKARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION blocksperrow;
+  JDIMENSION maxaccess;
+  JDIMENSION first_undef_row;
+  boolean pre_zero;
+  jvirt_barray_ptr next;
+};
 
-    if (quality < 0) {
-      ARGUMENT_ERROR(":quality value is to little.");
+typedef struct {
+  struct jpeg_memory_mgr pub;
+  struct jpeg_memory_mgr* orig;       // memory manager of libjpeg
 
-    } else if (quality > 100) {
-      ARGUMENT_ERROR(":quality value is to big.");
-    }
-  }
-  
-  /*
-   * eval scale option
-   */
-  (void)scale_num;
-  (void)scale_denom;
+  arena_pool_t pool[JPOOL_NUMPOOLS];
 
-  switch (TYPE(opts[2])) {
-  case T_UNDEF:
-    // Nothing
-    break;
+  jvirt_sarray_ptr virt_sarray_list;
+  jvirt_barray_ptr virt_barray_list;
 
-  case T_FLOAT:
-    scale_num   = (int)(NUM2DBL(opts[2]) * 1000.0);
-    scale_denom = 1000;
-    break;
+  size_t reported;                    // bytes notified to GC
+} arena_mgr_t;
 
-  case T_RATIONAL:
-    scale_num   = FIX2INT(rb_rational_num(opts[2]));
-    scale_denom = FIX2INT(rb_rational_den(opts[2]));
-    break;
+static void
+release_arena_pool(arena_pool_t* pool)
+{
+  arena_chunk_t* c;
+  arena_chunk_t* next;
 
-  default:
-    ARGUMENT_ERROR("Unsupportd :scale option value.");
-    break;
+  for (c = pool->head; c != NULL; c = next) {
+    next = c->next;
+    free(c);
   }
 
-  /*
-   * eval dct_method option
-   */
-  if (opts[3] == Qundef || EQ_STR(opts[3], "FASTEST")) {
-    ptr->dct_method = JDCT_FASTEST;
+  pool->head  = NULL;
+  pool->cur   = NULL;
+  pool->total = 0;
+}
 
-  } else if (EQ_STR(opts[3], "ISLOW")) {
-    ptr->dct_method = JDCT_ISLOW;
+static void*
+arena_alloc(j_common_ptr cinfo, int pool_id, size_t size)
+{
+  arena_mgr_t* mgr;
+  arena_pool_t* pool;
+  arena_chunk_t* c;
+  arena_chunk_t* n;
+  size_t csz;
+  void* ret;
 
-  } else if (EQ_STR(opts[3], "IFAST")) {
-    ptr->dct_method = JDCT_IFAST;
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  } else if (EQ_STR(opts[3], "FLOAT")) {
-    ptr->dct_method = JDCT_FLOAT;
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
 
-  } else {
-    ARGUMENT_ERROR("Unsupportd :dct_method option value.");
+  if (size > SIZE_MAX / 2) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
   }
 
-  /*
-   * eval orientation option
-   */
-  switch (TYPE(opts[4])) {
-  case T_UNDEF:
-    ptr->orientation = 0;
-    break;
+  pool = mgr->pool + pool_id;
+  size = (size > 0)? ARENA_ROUND_UP(size): ARENA_ALIGN;
 
-  case T_FIXNUM:
-    ptr->orientation = FIX2INT(opts[4]);
-    if (ptr->orientation < 1 || ptr->orientation > 8) {
-      RANGE_ERROR("orientation is ouf range");
-    } 
-    break;
+  /* 保持しているチャンクを先頭から順に使用する */
+  c = pool->cur;
 
-  default:
-    ARGUMENT_ERROR("Unsupportd :orientation option value.");
+  while (c != NULL && c->used + size > c->size && c->next != NULL) {
+    c       = c->next;
+    c->used = 0;
   }
 
-  /*
-   * set context
-   */
-  ptr->format    = format;
-  ptr->width     = wd;
-  ptr->height    = ht;
-  ptr->data_size = data_size;
-  ptr->array     = ALLOC_ARRAY();
-  ptr->rows      = ALLOC_ROWS(wd, components);
+  if (c == NULL || c->used + size > c->size) {
+    csz = (size > ARENA_CHUNK_SIZE)? size: ARENA_CHUNK_SIZE;
+    ret = NULL;
 
-  for (i = 0; i < UNIT_LINES; i++) {
-    ptr->array[i] = ptr->rows + (i * components * wd);
-  }
+    if (posix_memalign(&ret, ARENA_ALIGN, ARENA_HEADER_SIZE + csz)) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 2);
+    }
 
-  jpeg_create_compress(&ptr->cinfo);
+    n       = (arena_chunk_t*)ret;
+    n->next = NULL;
+    n->size = csz;
+    n->used = 0;
 
-  ptr->cinfo.err              = jpeg_std_error(&ptr->jerr);
-  ptr->jerr.output_message    = encode_output_message;
-  ptr->jerr.error_exit        = encode_error_exit;
+    if (c == NULL) {
+      pool->head = n;
+    } else {
+      c->next = n;
+    }
 
-  ptr->cinfo.image_width      = wd;
-  ptr->cinfo.image_height     = ht;
-  ptr->cinfo.in_color_space   = color_space;
-  ptr->cinfo.input_components = components;
+    pool->total += ARENA_HEADER_SIZE + n->size;
+    c            = n;
+  }
 
-  ptr->cinfo.optimize_coding  = TRUE;
-  ptr->cinfo.arith_code       = TRUE;
-  ptr->cinfo.raw_data_in      = FALSE;
-  ptr->cinfo.dct_method       = ptr->dct_method;
+  pool->cur = c;
+  ret       = (uint8_t*)c + ARENA_HEADER_SIZE + c->used;
+  c->used  += size;
 
-  jpeg_set_defaults(&ptr->cinfo);
-  jpeg_set_quality(&ptr->cinfo, quality, TRUE);
-  jpeg_suppress_tables(&ptr->cinfo, TRUE);
+  return ret;
 }
 
-/**
- * initialize encoder object
- *
- * @overload initialize(width, height, opts)
- *
- *   @param width [Integer] width of input image (px)
- *   @param height [Integer] height of input image (px)
- *   @param opts [Hash] options to initialize object
- *
- *   @option opts [Symbol] :pixel_format
- *     specifies the format of the input image. possible values are:
- *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
- *     RGBX RGB32 BGRX BGR32 GRAYSCALE
- *
- *   @option opts [Integer] :quality
- *     specifies the quality of the compressed image.
- *     You can specify from 0 (lowest) to 100 (best).
- *
- *   @option opts [Symbol] :dct_method
- *     specifies how encoding is handled. possible values are:
- *     FASTEST ISLOW IFAST FLOAT
- */
-static VALUE
-rb_encoder_initialize(int argc, VALUE *argv, VALUE self)
+static void*
+arena_alloc_n(j_common_ptr cinfo, int pool_id, size_t n, size_t size)
 {
-  jpeg_encode_t* ptr;
-  VALUE wd;
-  VALUE ht;
-  VALUE opt;
+  if (size > 0 && n > SIZE_MAX / size) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 3);
+  }
 
-  /*
-   * initialize
-   */
-  Data_Get_Struct(self, jpeg_encode_t, ptr);
+  return arena_alloc(cinfo, pool_id, n * size);
+}
 
+static JSAMPARRAY
+arena_alloc_sarray(j_common_ptr cinfo, int pool_id,
+                   JDIMENSION samplesperrow, JDIMENSION numrows)
+{
   /*
-   * parse arguments
+   * libjpeg-turboのSIMD実装は行末を越えて読み書きする場合があるので、
+   * 標準のメモリマネージャと同様に各行をARENA_ALIGNの倍数に揃える
    */
-  rb_scan_args(argc, argv, "21", &wd, &ht, &opt);
 
-  Check_Type(wd, T_FIXNUM);
-  Check_Type(ht, T_FIXNUM);
-  if (opt != Qnil) Check_Type(opt, T_HASH);
+  JSAMPARRAY ret;
+  JSAMPROW work;
+  size_t stride;
+  JDIMENSION i;
 
-  /*
-   * set context
-   */ 
-  set_encoder_context(ptr, FIX2INT(wd), FIX2INT(ht), opt);
+  stride = ARENA_ROUND_UP((size_t)samplesperrow * sizeof(JSAMPLE));
+  ret    = (JSAMPARRAY)arena_alloc_n(cinfo, pool_id, numrows,
+                                     sizeof(JSAMPROW));
+  work   = (JSAMPROW)arena_alloc_n(cinfo, pool_id, numrows, stride);
 
-  return Qtrue;
+  for (i = 0; i < numrows; i++) {
+    ret[i] = work + (i * stride);
+  }
+
+  return ret;
 }
 
-static int
-push_rows_yuv422(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+static JBLOCKARRAY
+arena_alloc_barray(j_common_ptr cinfo, int pool_id,
+                   JDIMENSION blocksperrow, JDIMENSION numrows)
 {
-  int size;
-  int i;
+  JBLOCKARRAY ret;
+  JBLOCKROW work;
+  JDIMENSION i;
 
-  size = wd * nrow;
-
-  for (i = 0; i < size; i += 2) {
-    rows[0] = data[0];
-    rows[1] = data[1];
-    rows[2] = data[3];
-    rows[3] = data[2];
-    rows[4] = data[1];
-    rows[5] = data[3];
+  ret  = (JBLOCKARRAY)arena_alloc_n(cinfo, pool_id, numrows,
+                                    sizeof(JBLOCKROW));
+  work = (JBLOCKROW)arena_alloc_n(cinfo, pool_id, numrows,
+                                  (size_t)blocksperrow * sizeof(JBLOCK));
 
-    rows += 6;
-    data += 4;
+  for (i = 0; i < numrows; i++) {
+    ret[i] = work + ((size_t)i * blocksperrow);
   }
 
-  return (size * 2);
+  return ret;
 }
 
-static int
-push_rows_rgb565(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+static jvirt_sarray_ptr
+arena_request_virt_sarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                          JDIMENSION samplesperrow, JDIMENSION numrows,
+                          JDIMENSION maxaccess)
 {
-  int size;
-  int i;
-
-  size = wd * nrow;
+  arena_mgr_t* mgr;
+  jvirt_sarray_ptr ret;
 
-  for (i = 0; i < size; i += 1) {
-    rows[0] = data[1] & 0xf8;
-    rows[1] = ((data[1] << 5) & 0xe0) | ((data[0] >> 3) & 0x1c);
-    rows[2] = (data[0] << 3) & 0xf8;
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-    rows += 3;
-    data += 2;
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
   }
 
-  return (size * 2);
-}
+  ret = (jvirt_sarray_ptr)arena_alloc(cinfo, pool_id, sizeof(*ret));
 
-static int
-push_rows_comp3(JSAMPROW rows, int wd, uint8_t* data, int nrow)
-{
-  int size;
+  ret->mem_buffer       = NULL;
+  ret->rows_in_array    = numrows;
+  ret->samplesperrow    = samplesperrow;
+  ret->maxaccess        = maxaccess;
+  ret->first_undef_row  = 0;
+  ret->pre_zero         = pre_zero;
+  ret->next             = mgr->virt_sarray_list;
 
-  size = wd * nrow * 3;
-  memcpy(rows, data, size);
+  mgr->virt_sarray_list = ret;
 
-  return size;
+  return ret;
 }
 
-static int
-push_rows_comp4(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+static jvirt_barray_ptr
+arena_request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+                          JDIMENSION blocksperrow, JDIMENSION numrows,
+                          JDIMENSION maxaccess)
 {
-  int size;
+  arena_mgr_t* mgr;
+  jvirt_barray_ptr ret;
 
-  size = wd * nrow * 4;
-  memcpy(rows, data, size);
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  return size;
-}
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+  }
 
+  ret = (jvirt_barray_ptr)arena_alloc(cinfo, pool_id, sizeof(*ret));
 
+  ret->mem_buffer       = NULL;
+  ret->rows_in_array    = numrows;
+  ret->blocksperrow     = blocksperrow;
+  ret->maxaccess        = maxaccess;
+  ret->first_undef_row  = 0;
+  ret->pre_zero         = pre_zero;
+  ret->next             = mgr->virt_barray_list;
 
-static int
-push_rows_grayscale(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+  mgr->virt_barray_list = ret;
+
+  return ret;
+}
+
+static void
+arena_realize_virt_arrays(j_common_ptr cinfo)
 {
-  int size;
+  arena_mgr_t* mgr;
+  jvirt_sarray_ptr sptr;
+  jvirt_barray_ptr bptr;
 
-  size = wd * nrow;
-  memcpy(rows, data, size);
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  return size;
+  for (sptr = mgr->virt_sarray_list; sptr != NULL; sptr = sptr->next) {
+    if (sptr->mem_buffer == NULL) {
+      sptr->mem_buffer = arena_alloc_sarray(cinfo, JPOOL_IMAGE,
+                                            sptr->samplesperrow,
+                                            sptr->rows_in_array);
+    }
+  }
+
+  for (bptr = mgr->virt_barray_list; bptr != NULL; bptr = bptr->next) {
+    if (bptr->mem_buffer == NULL) {
+      bptr->mem_buffer = arena_alloc_barray(cinfo, JPOOL_IMAGE,
+                                            bptr->blocksperrow,
+                                            bptr->rows_in_array);
+    }
+  }
 }
 
-static int
-push_rows(jpeg_encode_t* ptr, uint8_t* data, int nrow)
+static JDIMENSION
+check_virt_access(j_common_ptr cinfo, JDIMENSION* first_undef_row,
+                  JDIMENSION rows_in_array, JDIMENSION maxaccess,
+                  boolean pre_zero, JDIMENSION start_row, JDIMENSION num_rows,
+                  boolean writable)
 {
-  int ret;
+  /*
+   * アクセス範囲を検査し、ゼロクリアが必要な最初の行を返す (不要な場合
+   * は開始行+行数を返す)。判定はlibjpegのjmemmgr.cと同じ。
+   */
 
-  switch (ptr->format) {
-  case FMT_YUV422:
-    ret = push_rows_yuv422(ptr->rows, ptr->width, data, nrow);
-    break;
+  JDIMENSION end_row;
+  JDIMENSION ret;
 
-  case FMT_RGB565:
-    ret = push_rows_rgb565(ptr->rows, ptr->width, data, nrow);
-    break;
+  end_row = start_row + num_rows;
 
-  case FMT_YUV:
-  case FMT_RGB:
-  case FMT_BGR:
-    ret = push_rows_comp3(ptr->rows, ptr->width, data, nrow);
-    break;
+  if (end_row > rows_in_array || num_rows > maxaccess) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
 
-  case FMT_RGB32:
-  case FMT_BGR32:
-    ret = push_rows_comp4(ptr->rows, ptr->width, data, nrow);
-    break;
+  ret = end_row;
 
-  case FMT_GRAYSCALE:
-    ret = push_rows_grayscale(ptr->rows, ptr->width, data, nrow);
-    break;
+  if (*first_undef_row < end_row) {
+    if (*first_undef_row < start_row) {
+      /* 書き込み時に未定義の領域を飛び越す事はできない */
+      if (writable) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+      ret = start_row;
 
-  default:
-    RUNTIME_ERROR("Really?");
+    } else {
+      ret = *first_undef_row;
+    }
+
+    if (writable) *first_undef_row = end_row;
+
+    if (!pre_zero) {
+      /* 未定義の領域は読み出せない */
+      if (!writable) ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+      ret = end_row;
+    }
   }
 
   return ret;
 }
 
-static void
-put_exif_tags(jpeg_encode_t* ptr)
+static JSAMPARRAY
+arena_access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+                         JDIMENSION start_row, JDIMENSION num_rows,
+                         boolean writable)
 {
-  uint8_t data[] = {
-    /* Exif header */
-    'E',  'x',  'i',  'f', 0x00, 0x00,
-    'M',  'M',
-    0x00, 0x2a,
-    0x00, 0x00, 0x00, 0x08,
-    0x00, 0x01,
+  JDIMENSION row;
 
-    /* orieatation */
-    0x01, 0x12,
-    0x00, 0x03,
-    0x00, 0x00, 0x00, 0x01,
-    0x00, 0x00,
-    0x00, 0x00,
+  if (ptr->mem_buffer == NULL) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
 
-    /* end mark */
-    0x00, 0x00, 0x00, 0x00,
-  };
+  row = check_virt_access(cinfo, &ptr->first_undef_row, ptr->rows_in_array,
+                          ptr->maxaccess, ptr->pre_zero,
+                          start_row, num_rows, writable);
 
-  data[24] = (ptr->orientation >> 8) & 0xff;
-  data[25] = (ptr->orientation >> 0) & 0xff;
+  for (; row < start_row + num_rows; row++) {
+    memset(ptr->mem_buffer[row], 0, ptr->samplesperrow * sizeof(JSAMPLE));
+  }
 
-  jpeg_write_marker(&ptr->cinfo, JPEG_APP1, data, sizeof(data));
+  return ptr->mem_buffer + start_row;
 }
 
-static VALUE
-do_encode(jpeg_encode_t* ptr, uint8_t* data)
+static JBLOCKARRAY
+arena_access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+                         JDIMENSION start_row, JDIMENSION num_rows,
+                         boolean writable)
 {
-  VALUE ret;
+  JDIMENSION row;
 
-  unsigned char* buf;
-  unsigned long buf_size;
-  int nrow;
+  if (ptr->mem_buffer == NULL) {
+    ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+  }
 
-  buf = NULL;
+  row = check_virt_access(cinfo, &ptr->first_undef_row, ptr->rows_in_array,
+                          ptr->maxaccess, ptr->pre_zero,
+                          start_row, num_rows, writable);
+
+  for (; row < start_row + num_rows; row++) {
+    memset(ptr->mem_buffer[row], 0, ptr->blocksperrow * sizeof(JBLOCK));
+  }
+
+  return ptr->mem_buffer + start_row;
+}
 
-  jpeg_mem_dest(&ptr->cinfo, &buf, &buf_size); 
+static void
+arena_free_pool(j_common_ptr cinfo, int pool_id)
+{
+  arena_mgr_t* mgr;
+  arena_pool_t* pool;
 
-  jpeg_start_compress(&ptr->cinfo, TRUE);
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  if (ptr->orientation != 0) {
-    put_exif_tags(ptr);
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
   }
 
-  while (ptr->cinfo.next_scanline < ptr->cinfo.image_height) {
-    nrow = ptr->cinfo.image_height - ptr->cinfo.next_scanline;
-    if (nrow > UNIT_LINES) nrow = UNIT_LINES;
+  pool = mgr->pool + pool_id;
 
-    data += push_rows(ptr, data, nrow);
-    jpeg_write_scanlines(&ptr->cinfo, ptr->array, nrow);
+  if (pool_id == JPOOL_IMAGE) {
+    mgr->virt_sarray_list = NULL;
+    mgr->virt_barray_list = NULL;
   }
 
-  jpeg_finish_compress(&ptr->cinfo);
+  if (pool_id == JPOOL_PERMANENT || pool->total > ARENA_KEEP_MAX) {
+    /* 巨大な画像の後は保持し続けずに解放する */
+    release_arena_pool(pool);
 
-  /*
-   * create return data
-   */
-  ret = rb_str_buf_new(buf_size);
-  rb_str_set_len(ret, buf_size);
+  } else {
+    pool->cur = pool->head;
+    if (pool->cur != NULL) pool->cur->used = 0;
+  }
+}
+
+static void
+arena_self_destruct(j_common_ptr cinfo)
+{
+  arena_mgr_t* mgr;
+  int i;
+
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  memcpy(RSTRING_PTR(ret), buf, buf_size);
+  for (i = 0; i < JPOOL_NUMPOOLS; i++) {
+    release_arena_pool(mgr->pool + i);
+  }
 
   /*
-   * post process
+   * jpeg_create_*()の中で確保された領域は元のメモリマネージャの管理下
+   * にあるので、元のマネージャに戻して破棄させる
    */
-  free(buf);
+  cinfo->mem = mgr->orig;
+  free(mgr);
 
-  return ret;
+  (*cinfo->mem->self_destruct)(cinfo);
 }
 
-/**
- * encode data
- *
- * @overload encode(raw)
- *
- *   @param raw [String]  raw image data to encode.
- *
- *   @return [String] encoded JPEG data.
- */
-static VALUE
-rb_encoder_encode(VALUE self, VALUE data)
+static void
+install_arena(j_common_ptr cinfo)
 {
-  VALUE ret;
-  jpeg_encode_t* ptr;
-
   /*
-   * initialize
+   * jpeg_create_*()の直後に呼び出すこと
    */
-  Data_Get_Struct(self, jpeg_encode_t, ptr);
 
-  /*
-   * argument check
-   */
-  Check_Type(data, T_STRING);
+  arena_mgr_t* mgr;
 
-  if (RSTRING_LEN(data) < ptr->data_size) {
-    ARGUMENT_ERROR("raw image data is too short.");
+  mgr = (arena_mgr_t*)malloc(sizeof(arena_mgr_t));
+  if (mgr == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
   }
 
-  if (RSTRING_LEN(data) > ptr->data_size) {
-    ARGUMENT_ERROR("raw image data is too large.");
-  }
+  memset(mgr, 0, sizeof(*mgr));
+
+  mgr->pub.alloc_small         = arena_alloc;
+  mgr->pub.alloc_large         = arena_alloc;
+  mgr->pub.alloc_sarray        = arena_alloc_sarray;
+  mgr->pub.alloc_barray        = arena_alloc_barray;
+  mgr->pub.request_virt_sarray = arena_request_virt_sarray;
+  mgr->pub.request_virt_barray = arena_request_virt_barray;
+  mgr->pub.realize_virt_arrays = arena_realize_virt_arrays;
+  mgr->pub.access_virt_sarray  = arena_access_virt_sarray;
+  mgr->pub.access_virt_barray  = arena_access_virt_barray;
+  mgr->pub.free_pool           = arena_free_pool;
+  mgr->pub.self_destruct       = arena_self_destruct;
+  mgr->pub.max_memory_to_use   = cinfo->mem->max_memory_to_use;
+  mgr->pub.max_alloc_chunk     = cinfo->mem->max_alloc_chunk;
+
+  mgr->orig                    = cinfo->mem;
+  cinfo->mem                   = &mgr->pub;
+}
 
+static void
+update_memory_usage(j_common_ptr cinfo)
+{
   /*
-   * do encode
+   * アリーナが保持している領域の増減をGCに通知する (GVL保持)
    */
-  ret = do_encode(ptr, (uint8_t*)RSTRING_PTR(data));
 
-  return ret;
-}
+  arena_mgr_t* mgr;
+  size_t total;
+  int i;
 
-static void
-rb_decoder_free(void* ptr)
-{
-  //jpeg_destroy_decompress(&(((jpeg_decode_t*)ptr)->cinfo));
-  free(ptr);
+  mgr   = (arena_mgr_t*)cinfo->mem;
+  total = sizeof(arena_mgr_t);
+
+  for (i = 0; i < JPOOL_NUMPOOLS; i++) {
+    total += mgr->pool[i].total;
+  }
+
+  if (total != mgr->reported) {
+    rb_gc_adjust_memory_usage((ssize_t)total - (ssize_t)mgr->reported);
+    mgr->reported = total;
+  }
 }
 
 static void
-rb_decoder_mark(void* _ptr)
+forget_memory_usage(j_common_ptr cinfo)
 {
-  jpeg_decode_t* ptr;
+  /*
+   * 破棄する前にGCに通知済みの領域を取り消す (GVL保持)
+   */
+
+  arena_mgr_t* mgr;
 
-  ptr = (jpeg_decode_t*)_ptr; 
+  mgr = (arena_mgr_t*)cinfo->mem;
 
-  if (ptr->orientation.buf != Qnil) {
-    rb_gc_mark(ptr->orientation.buf);
+  if (mgr->reported > 0) {
+    rb_gc_adjust_memory_usage(-(ssize_t)mgr->reported);
+    mgr->reported = 0;
   }
 }
 
+static void mark_encode_stream(struct encode_stream* st);
+static void free_encode_stream(struct encode_stream* st);
+static void free_encode_context(struct encode_ctx* ctx);
+
 static void
-decode_output_message(j_common_ptr cinfo)
+rb_encoder_mark(void* _ptr)
 {
-  ext_error_t* err;
+  jpeg_encode_t* ptr;
 
-  err = (ext_error_t*)cinfo->err;
+  ptr = (jpeg_encode_t*)_ptr;
 
-  (*err->jerr.format_message)(cinfo, err->msg);
+  if (ptr->stream != NULL) mark_encode_stream(ptr->stream);
 }
 
 static void
-decode_emit_message(j_common_ptr cinfo, int msg_level)
+rb_encoder_free( void* _ptr)
 {
-  ext_error_t* err;
+  jpeg_encode_t* ptr;
+  int i;
 
-  if (msg_level < 0) {
-    err = (ext_error_t*)cinfo->err;
-    (*err->jerr.format_message)(cinfo, err->msg);
-    /*
-     * 以前はemit_messageが呼ばれるとエラー扱いしていたが、
-     * Logicoolの一部のモデルなどで問題が出るので無視する
-     * ようにした。
-     * また本来であれば、警告表示を行うべきでもあるが一部
-     * のモデルで大量にemitされる場合があるので表示しない
-     * ようにしている。
-     * 問題が発生した際は、最後のメッセージをオブジェクト
-     * のインスタンスとして持たすべき。
-     */
-    // longjmp(err->jmpbuf, 1);
+  ptr = (jpeg_encode_t*)_ptr;
+
+  if (ptr->stream != NULL) free_encode_stream(ptr->stream);
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] != NULL) free_encode_context(ptr->pool[i]);
   }
+
+  xfree(_ptr);
 }
 
-static void
-decode_error_exit(j_common_ptr cinfo)
+static size_t
+rb_encoder_size(const void* _ptr)
 {
-  ext_error_t* err;
+  const jpeg_encode_t* ptr;
+  size_t ret;
+  int i;
 
-  err = (ext_error_t*)cinfo->err;
-  (*err->jerr.format_message)(cinfo, err->msg);
-  longjmp(err->jmpbuf, 1);
+  ptr = (const jpeg_encode_t*)_ptr;
+  ret = sizeof(jpeg_encode_t);
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] != NULL) ret += sizeof(*ptr->pool[i]);
+  }
+
+  return ret;
 }
 
+/*
+ * エンコーダオブジェクトは設定値と作業領域のプールのみを保持し、圧縮
+ * 処理は呼び出し毎にプールから取り出した作業領域で行う。このため
+ * freezeしたオブジェクトはRactor間で共有できる。
+ */
+static const rb_data_type_t jpeg_encoder_data_type = {
+  "JPEG::Encoder",
+  {rb_encoder_mark, rb_encoder_free, rb_encoder_size},
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
 static VALUE
-rb_decoder_alloc(VALUE self)
+rb_encoder_alloc(VALUE self)
 {
-  jpeg_decode_t* ptr;
-
-  ptr = ALLOC(jpeg_decode_t);
-  memset(ptr, 0, sizeof(*ptr));
-
-  ptr->flags                    = DEFAULT_FLAGS;
-  ptr->format                   = FMT_RGB;
+  jpeg_encode_t* ptr;
 
-  ptr->out_color_space          = JCS_RGB;
+  return TypedData_Make_Struct(encoder_klass, jpeg_encode_t,
+                               &jpeg_encoder_data_type, ptr);
+}
 
-  ptr->scale_num                = 1;
-  ptr->scale_denom              = 1;
+static int
+is_raw_yuv422(jpeg_encode_t* ptr)
+{
+  /*
+   * YUYV入力をjpeg_write_raw_data()で渡すか否か。行の途中で画素の組が
+   * 分かれる奇数幅と、縮小する場合は4:4:4に展開して渡す。
+   */
+  return (ptr->format == FMT_YUV422 && (ptr->width % 2) == 0 &&
+          ptr->image_width == ptr->width && ptr->image_height == ptr->height);
+}
 
-  ptr->out_color_components     = 3;
-  ptr->output_gamma             = 0.0;
-  ptr->buffered_image           = FALSE;
-  ptr->do_fancy_upsampling      = FALSE;
-  ptr->do_block_smoothing       = FALSE;
-  ptr->quantize_colors          = FALSE;
-  ptr->dither_mode              = JDITHER_NONE;
-  ptr->dct_method               = JDCT_FASTEST;
-  ptr->desired_number_of_colors = 0;
-  ptr->enable_1pass_quant       = FALSE;
-  ptr->enable_external_quant    = FALSE;
-  ptr->enable_2pass_quant       = FALSE;
+static void
+create_compress(struct jpeg_compress_struct* cinfo, ext_error_t* err)
+{
+  /*
+   * jpeg_create_compress()はerrフィールドを保存するので、エラー
+   * マネージャは生成前に設定しておく
+   */
+  cinfo->err                  = jpeg_std_error(&err->jerr);
+  err->jerr.output_message    = encode_output_message;
+  err->jerr.error_exit        = encode_error_exit;
 
-  ptr->orientation.value        = 0;
-  ptr->orientation.buf          = Qnil;
+  jpeg_create_compress(cinfo);
+  install_arena((j_common_ptr)cinfo);
+}
 
-  return Data_Wrap_Struct(decoder_klass, rb_decoder_mark, rb_decoder_free, ptr);
+static void
+init_compress(jpeg_encode_t* ptr, struct jpeg_compress_struct* cinfo)
+{
+  /*
+   * set_encoder_context()で評価した設定を使ってcinfoを初期化する (再利用
+   * するcinfoの前回の設定はjpeg_set_defaults()で上書きされる)
+   */
+  cinfo->image_width          = ptr->image_width;
+  cinfo->image_height         = ptr->image_height;
+  cinfo->in_color_space       = ptr->color_space;
+  cinfo->input_components     = ptr->components;
+
+  cinfo->optimize_coding      = TRUE;
+  cinfo->arith_code           = TRUE;
+  cinfo->raw_data_in          = FALSE;
+  cinfo->dct_method           = ptr->dct_method;
+
+  jpeg_set_defaults(cinfo);
+  jpeg_set_quality(cinfo, ptr->quality, TRUE);
+  jpeg_suppress_tables(cinfo, TRUE);
+
+  if (is_raw_yuv422(ptr)) {
+    /* 入力の標本化 (4:2:2) のまま圧縮する */
+    cinfo->raw_data_in                = TRUE;
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = 1;
+    cinfo->comp_info[1].h_samp_factor = 1;
+    cinfo->comp_info[1].v_samp_factor = 1;
+    cinfo->comp_info[2].h_samp_factor = 1;
+    cinfo->comp_info[2].v_samp_factor = 1;
+  }
 }
 
 static void
-eval_decoder_opt_pixel_format(jpeg_decode_t* ptr, VALUE opt)
+set_encoder_context(jpeg_encode_t* ptr, int wd, int ht, VALUE opt)
 {
+  VALUE opts[N(encoder_opts_ids)];
   int format;
   int color_space;
   int components;
+  int data_size;
+  int quality;
+  int scale_num;
+  int scale_denom;
+  double scale;
 
-  if (opt != Qundef) {
-    if(EQ_STR(opt, "RGB") || EQ_STR(opt, "RGB24")) {
-      format      = FMT_RGB;
-      color_space = JCS_RGB;
-      components  = 3;
+  /*
+   * parse options
+   */
+  rb_get_kwargs(opt, encoder_opts_ids, 0, N(encoder_opts_ids), opts);
 
-    } else if (EQ_STR(opt, "YUV422") || EQ_STR(opt, "YUYV")) {
-      format      = FMT_YUV422;
-      color_space = JCS_YCbCr;
-      components  = 3;
+  /*
+   * eval :pixel_format option
+   */
+  if (opts[0] == Qundef||EQ_STR(opts[0], "YUV422")||EQ_STR(opts[0], "YUYV")) {
+    format      = FMT_YUV422;
+    color_space = JCS_YCbCr;
+    components  = 3;
+    data_size   = (wd * ht * 2);
 
-      NOT_IMPLEMENTED_ERROR( "not implemented colorspace");
+  } else if (EQ_STR(opts[0], "RGB565")) {
+    /* RGBXに展開してlibjpegに渡す */
+    format      = FMT_RGB565;
+    color_space = JCS_EXT_RGBX;
+    components  = 4;
+    data_size   = (wd * ht * 2);
 
-    } else if (EQ_STR(opt, "RGB565")) {
-      format      = FMT_RGB565;
-      color_space = JCS_RGB;
-      components  = 3;
+  } else if (EQ_STR(opts[0], "RGB") || EQ_STR(opts[0], "RGB24")) {
+    format      = FMT_RGB;
+    color_space = JCS_RGB;
+    components  = 3;
+    data_size   = (wd * ht * 3);
 
-      NOT_IMPLEMENTED_ERROR( "not implemented colorspace");
+  } else if (EQ_STR(opts[0], "BGR") || EQ_STR(opts[0], "BGR24")) {
+    format      = FMT_BGR;
+    color_space = JCS_EXT_BGR;
+    components  = 3;
+    data_size   = (wd * ht * 3);
 
-    } else if (EQ_STR(opt, "GRAYSCALE")) {
-      format      = FMT_GRAYSCALE;
-      color_space = JCS_GRAYSCALE;
-      components  = 1;
+  } else if (EQ_STR(opts[0], "YUV444") || EQ_STR(opts[0], "YCbCr")) {
+    format      = FMT_YUV;
+    color_space = JCS_YCbCr;
+    components  = 3;
+    data_size   = (wd * ht * 3);
 
-    } else if (EQ_STR(opt, "YUV444") || EQ_STR(opt, "YCbCr")) {
-      format      = FMT_YUV;
-      color_space = JCS_YCbCr;
-      components  = 3;
+  } else if (EQ_STR(opts[0], "RGBX") || EQ_STR(opts[0], "RGB32")) {
+    format      = FMT_RGB32;
+    color_space = JCS_EXT_RGBX;
+    components  = 4;
+    data_size   = (wd * ht * 4);
 
-    } else if (EQ_STR(opt, "BGR") || EQ_STR(opt, "BGR24")) {
-      format      = FMT_BGR;
-      color_space = JCS_EXT_BGR;
-      components  = 3;
 
-    } else if (EQ_STR(opt, "YVU444") || EQ_STR(opt, "YCrCb")) {
-      format      = FMT_YVU;
-      color_space = JCS_YCbCr;
-      components  = 3;
+  } else if (EQ_STR(opts[0], "BGRX") || EQ_STR(opts[0], "BGR32")) {
+    format      = FMT_BGR32;
+    color_space = JCS_EXT_BGRX;
+    components  = 4;
+    data_size   = (wd * ht * 4);
 
-    } else if (EQ_STR(opt, "RGBX") || EQ_STR(opt, "RGB32")) {
-      format      = FMT_RGB32;
-      color_space = JCS_EXT_RGBX;
-      components  = 4;
 
-    } else if (EQ_STR(opt, "BGRX") || EQ_STR(opt, "BGR32")) {
-      format      = FMT_BGR32;
-      color_space = JCS_EXT_BGRX;
-      components  = 4;
+  } else if (EQ_STR(opts[0], "GRAYSCALE")) {
+    format      = FMT_GRAYSCALE;
+    color_space = JCS_GRAYSCALE;
+    components  = 1;
+    data_size   = (wd * ht);
+
+  } else {
+    ARGUMENT_ERROR("Unsupportd :pixel_format option value.");
+  }
+
+  /*
+   * eval :quality option
+   */
+  if (opts[1] == Qundef) {
+    quality = DEFAULT_QUALITY;
+
+  } else {
+    if (TYPE(opts[1]) != T_FIXNUM) {
+      ARGUMENT_ERROR("Unsupportd :quality option value.");
 
     } else {
-      ARGUMENT_ERROR("Unsupportd :pixel_format option value.");
+      quality = FIX2INT(opts[1]);
     }
 
-    ptr->format                = format;
-    ptr->out_color_space       = color_space;
-    ptr->out_color_components  = components;
-  }
-}
+    if (quality < 0) {
+      ARGUMENT_ERROR(":quality value is to little.");
 
-static void
-eval_decoder_opt_output_gamma(jpeg_decode_t* ptr, VALUE opt)
-{
-  switch (TYPE(opt)) {
+    } else if (quality > 100) {
+      ARGUMENT_ERROR(":quality value is to big.");
+    }
+  }
+  
+  /*
+   * eval scale option
+   */
+  switch (TYPE(opts[2])) {
   case T_UNDEF:
-    // Nothing
+  case T_NIL:
+    scale_num   = 1;
+    scale_denom = 1;
     break;
 
-  case T_FIXNUM:
   case T_FLOAT:
-    ptr->output_gamma = NUM2DBL(opt);
+    scale       = NUM2DBL(opts[2]);
+    if (scale <= 0.0 || scale > 1.0) {
+      RANGE_ERROR(":scale shall be greater than 0 and 1 or less.");
+    }
+
+    scale_num   = (int)(scale * 1000.0);
+    scale_denom = 1000;
+
+    if (scale_num < 1) scale_num = 1;
     break;
 
-  default:
-    TYPE_ERROR("Unsupportd :output_gamma option value.");
+  case T_RATIONAL:
+    scale_num   = NUM2INT(rb_rational_num(opts[2]));
+    scale_denom = NUM2INT(rb_rational_den(opts[2]));
+
+    if (scale_num <= 0 || scale_num > scale_denom) {
+      RANGE_ERROR(":scale shall be greater than 0 and 1 or less.");
+    }
     break;
-  }
-}
 
-static void
-eval_decoder_opt_do_fancy_upsampling(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef) {
-    ptr->do_fancy_upsampling = (RTEST(opt))? TRUE: FALSE;
+  default:
+    ARGUMENT_ERROR("Unsupportd :scale option value.");
+    break;
   }
-}
 
-static void
-eval_decoder_opt_do_smoothing(jpeg_decode_t* ptr, VALUE opt)
+  /*
+   * eval dct_method option
+   */
+  if (opts[3] == Qundef || EQ_STR(opts[3], "FASTEST")) {
+    ptr->dct_method = JDCT_FASTEST;
+
+  } else if (EQ_STR(opts[3], "ISLOW")) {
+    ptr->dct_method = JDCT_ISLOW;
+
+  } else if (EQ_STR(opts[3], "IFAST")) {
+    ptr->dct_method = JDCT_IFAST;
+
+  } else if (EQ_STR(opts[3], "FLOAT")) {
+    ptr->dct_method = JDCT_FLOAT;
+
+  } else {
+    ARGUMENT_ERROR("Unsupportd :dct_method option value.");
+  }
+
+  /*
+   * eval orientation option
+   */
+  switch (TYPE(opts[4])) {
+  case T_UNDEF:
+    ptr->orientation = 0;
+    break;
+
+  case T_FIXNUM:
+    ptr->orientation = FIX2INT(opts[4]);
+    if (ptr->orientation < 1 || ptr->orientation > 8) {
+      RANGE_ERROR("orientation is ouf range");
+    } 
+    break;
+
+  default:
+    ARGUMENT_ERROR("Unsupportd :orientation option value.");
+  }
+
+  /*
+   * eval threads option
+   */
+  switch (TYPE(opts[5])) {
+  case T_UNDEF:
+    ptr->threads = 1;
+    break;
+
+  default:
+    ptr->threads = eval_threads_opt(opts[5]);
+    break;
+  }
+
+  /*
+   * set context
+   */
+  ptr->format       = format;
+  ptr->width        = wd;
+  ptr->height       = ht;
+  ptr->image_width  = (int)((((long)wd * scale_num) + scale_denom - 1) /
+                                                                scale_denom);
+  ptr->image_height = (int)((((long)ht * scale_num) + scale_denom - 1) /
+                                                                scale_denom);
+  ptr->data_size   = data_size;
+  ptr->color_space = color_space;
+  ptr->components  = components;
+  ptr->quality     = quality;
+}
+
+/**
+ * initialize encoder object
+ *
+ * @overload initialize(width, height, opts)
+ *
+ *   @param width [Integer] width of input image (px)
+ *   @param height [Integer] height of input image (px)
+ *   @param opts [Hash] options to initialize object
+ *
+ *   @option opts [Symbol] :pixel_format
+ *     specifies the format of the input image. possible values are:
+ *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
+ *     RGBX RGB32 BGRX BGR32 GRAYSCALE
+ *     YUV422 (YUYV) input of even width is compressed with 4:2:2
+ *     sampling as it is (no color conversion and no resampling).
+ *     for odd width, the pixels are paired from the head of each row
+ *     and the last pixel uses the Cr of the previous pair.
+ *
+ *   @option opts [Integer] :quality
+ *     specifies the quality of the compressed image.
+ *     You can specify from 0 (lowest) to 100 (best).
+ *
+ *   @option opts [Rational, Float] :scale
+ *     specifies the scale factor (0 < scale <= 1) of the output image.
+ *     the input is reduced with a box filter while the rows are passed
+ *     to libjpeg, so no reduced copy of the input is made. the output
+ *     size is ceil(width * scale) x ceil(height * scale). the input data
+ *     is still given in the original size.
+ *
+ *   @option opts [Symbol] :dct_method
+ *     specifies how encoding is handled. possible values are:
+ *     FASTEST ISLOW IFAST FLOAT
+ *
+ *   @option opts [Integer] :orientation
+ *     specifies the Exif orientation value (1-8) to embed.
+ *
+ *   @option opts [Integer] :threads
+ *     specifies the number of threads used to encode one image. when
+ *     2 or more, the input is split into horizontal stripes aligned to
+ *     MCU rows which are compressed in parallel and joined with restart
+ *     markers (the output has a restart interval of one MCU row).
+ *     nil means the number of processors. default is 1.
+ */
+static VALUE
+rb_encoder_initialize(int argc, VALUE *argv, VALUE self)
+{
+  jpeg_encode_t* ptr;
+  VALUE wd;
+  VALUE ht;
+  VALUE opt;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "21", &wd, &ht, &opt);
+
+  Check_Type(wd, T_FIXNUM);
+  Check_Type(ht, T_FIXNUM);
+  if (opt != Qnil) Check_Type(opt, T_HASH);
+
+  /*
+   * set context
+   */ 
+  set_encoder_context(ptr, FIX2INT(wd), FIX2INT(ht), opt);
+
+  return Qtrue;
+}
+
+#if defined(__SSE2__)
+static void
+store_rgb24_sse2(uint8_t* dst, __m128i c0, __m128i c1, __m128i c2)
+{
+  /*
+   * 成分毎の16画素を3成分×16画素 (48バイト) に並べる。load_rgb24_sse2()
+   * の1回分の交互配置を偶数/奇数バイトの分離で逆にたどる。
+   */
+
+  __m128i mask;
+  __m128i u0;
+  __m128i u1;
+  int i;
+
+  mask = _mm_set1_epi16(0x00ff);
+
+  for (i = 0; i < 4; i++) {
+    u0 = _mm_packus_epi16(_mm_and_si128(c0, mask), _mm_and_si128(c1, mask));
+    u1 = _mm_packus_epi16(_mm_and_si128(c2, mask), _mm_srli_epi16(c0, 8));
+    c2 = _mm_packus_epi16(_mm_srli_epi16(c1, 8), _mm_srli_epi16(c2, 8));
+    c0 = u0;
+    c1 = u1;
+  }
+
+  _mm_storeu_si128((__m128i*)(dst + 0), c0);
+  _mm_storeu_si128((__m128i*)(dst + 16), c1);
+  _mm_storeu_si128((__m128i*)(dst + 32), c2);
+}
+#endif /* defined(__SSE2__) */
+
+#ifdef USE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static int
+expand_yuyv_avx2(JSAMPROW row, uint8_t* data, int wd)
+{
+  /*
+   * expand_yuyv()のAVX2版 (32画素ずつ)。Y/U/Vへの分離を256bitで行い、
+   * 3成分の並べ替えは128bit毎にstore_rgb24_sse2()で行う。処理した画素数
+   * を返す。
+   */
+
+  __m256i a;
+  __m256i b;
+  __m256i y;
+  __m256i uv;
+  __m256i u;
+  __m256i v;
+  __m256i mask;
+  int i;
+
+  mask = _mm256_set1_epi16(0x00ff);
+
+  for (i = 0; i + 32 <= wd; i += 32) {
+    a  = _mm256_loadu_si256((__m256i*)(data + 0));
+    b  = _mm256_loadu_si256((__m256i*)(data + 32));
+
+    /* packusは128bitのレーン毎なので64bit単位で並べ直す */
+    y  = _mm256_permute4x64_epi64(
+             _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                 _mm256_and_si256(b, mask)), 0xd8);
+    uv = _mm256_permute4x64_epi64(
+             _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                 _mm256_srli_epi16(b, 8)), 0xd8);
+
+    /* 色差は組になる2画素に複製する */
+    u  = _mm256_and_si256(uv, mask);
+    u  = _mm256_or_si256(u, _mm256_slli_epi16(u, 8));
+    v  = _mm256_srli_epi16(uv, 8);
+    v  = _mm256_or_si256(v, _mm256_slli_epi16(v, 8));
+
+    store_rgb24_sse2(row + 0,
+                     _mm256_castsi256_si128(y),
+                     _mm256_castsi256_si128(u),
+                     _mm256_castsi256_si128(v));
+    store_rgb24_sse2(row + 48,
+                     _mm256_extracti128_si256(y, 1),
+                     _mm256_extracti128_si256(u, 1),
+                     _mm256_extracti128_si256(v, 1));
+
+    row  += 96;
+    data += 64;
+  }
+
+  return i;
+}
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+static void
+expand_yuyv(JSAMPROW row, uint8_t* data, int wd)
+{
+  /*
+   * YUYVの一行を画素毎のYCbCrに展開する。画素の組は行毎に先頭から作る。
+   * SSE2/NEONが使える場合は16画素ずつ、AVX2が使える場合は32画素ずつ
+   * 処理する。
+   */
+
+  int i;
+
+  i = 0;
+
+#ifdef USE_AVX2_DISPATCH
+  if (have_avx2) {
+    i     = expand_yuyv_avx2(row, data, wd);
+    row  += i * 3;
+    data += i * 2;
+  }
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+#if defined(__SSE2__)
+  {
+    __m128i a;
+    __m128i b;
+    __m128i uv;
+    __m128i u;
+    __m128i v;
+    __m128i mask;
+
+    mask = _mm_set1_epi16(0x00ff);
+
+    for (; i + 16 <= wd; i += 16) {
+      a  = _mm_loadu_si128((__m128i*)(data + 0));
+      b  = _mm_loadu_si128((__m128i*)(data + 16));
+
+      /* split_yuyv()と同じ分離を行い、色差を2画素に複製する */
+      uv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+      u  = _mm_and_si128(uv, mask);
+      v  = _mm_srli_epi16(uv, 8);
+
+      store_rgb24_sse2(row,
+                       _mm_packus_epi16(_mm_and_si128(a, mask),
+                                        _mm_and_si128(b, mask)),
+                       _mm_or_si128(u, _mm_slli_epi16(u, 8)),
+                       _mm_or_si128(v, _mm_slli_epi16(v, 8)));
+
+      row  += 48;
+      data += 32;
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint8x8x4_t src;
+    uint8x8x2_t yy;
+    uint8x8x2_t uu;
+    uint8x8x2_t vv;
+    uint8x8x3_t dst;
+
+    for (; i + 16 <= wd; i += 16) {
+      src        = vld4_u8(data);
+
+      yy         = vzip_u8(src.val[0], src.val[2]);
+      uu         = vzip_u8(src.val[1], src.val[1]);
+      vv         = vzip_u8(src.val[3], src.val[3]);
+
+      dst.val[0] = yy.val[0];
+      dst.val[1] = uu.val[0];
+      dst.val[2] = vv.val[0];
+      vst3_u8(row + 0, dst);
+
+      dst.val[0] = yy.val[1];
+      dst.val[1] = uu.val[1];
+      dst.val[2] = vv.val[1];
+      vst3_u8(row + 24, dst);
+
+      row  += 48;
+      data += 32;
+    }
+  }
+#endif
+
+  for (; i + 2 <= wd; i += 2) {
+    row[0] = data[0];
+    row[1] = data[1];
+    row[2] = data[3];
+    row[3] = data[2];
+    row[4] = data[1];
+    row[5] = data[3];
+
+    row  += 6;
+    data += 4;
+  }
+
+  if (i < wd) {
+    /* 奇数幅の右端は組にならないのでCrを直前の組から借りる */
+    row[0] = data[0];
+    row[1] = data[1];
+    row[2] = (i > 0)? data[-1]: 0x80;
+  }
+}
+
+static int
+push_rows_yuv422(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+{
+  /*
+   * YUYVを4:4:4に展開して渡す (奇数幅や縮小する場合)。行を分割して
+   * 渡されても同じ結果になるよう、画素の組は行毎に作る。
+   */
+
+  int i;
+
+  for (i = 0; i < nrow; i++) {
+    expand_yuyv(rows, data, wd);
+
+    rows += wd * 3;
+    data += wd * 2;
+  }
+
+  return (wd * nrow * 2);
+}
+
+static int
+push_rows_rgb565(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+{
+  /*
+   * RGB565 (リトルエンディアン) をRGBXに展開する。SSE2/NEONが使える
+   * 場合は8画素ずつ処理する。
+   */
+
+  int size;
+  int i;
+
+  size = wd * nrow;
+  i    = 0;
+
+#if defined(__SSE2__)
+  {
+    __m128i src;
+    __m128i r;
+    __m128i g;
+    __m128i b;
+    __m128i rg;
+    __m128i bx;
+    __m128i zero;
+    __m128i mask;
+
+    zero = _mm_setzero_si128();
+    mask = _mm_set1_epi16(0x00f8);
+
+    for (; i + 8 <= size; i += 8) {
+      src = _mm_loadu_si128((__m128i*)data);
+
+      r   = _mm_and_si128(_mm_srli_epi16(src, 8), mask);
+      g   = _mm_and_si128(_mm_srli_epi16(src, 3), _mm_set1_epi16(0x00fc));
+      b   = _mm_and_si128(_mm_slli_epi16(src, 3), mask);
+
+      /* 16bitの各要素を8bitに詰めてRGBXの順に並べる */
+      rg  = _mm_unpacklo_epi8(_mm_packus_epi16(r, zero),
+                              _mm_packus_epi16(g, zero));
+      bx  = _mm_unpacklo_epi8(_mm_packus_epi16(b, zero), zero);
+
+      _mm_storeu_si128((__m128i*)(rows + 0), _mm_unpacklo_epi16(rg, bx));
+      _mm_storeu_si128((__m128i*)(rows + 16), _mm_unpackhi_epi16(rg, bx));
+
+      rows += 32;
+      data += 16;
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint16x8_t src;
+    uint8x8x4_t dst;
+
+    dst.val[3] = vdup_n_u8(0);
+
+    for (; i + 8 <= size; i += 8) {
+      src        = vld1q_u16((uint16_t*)data);
+
+      dst.val[0] = vand_u8(vshrn_n_u16(src, 8), vdup_n_u8(0xf8));
+      dst.val[1] = vand_u8(vshrn_n_u16(src, 3), vdup_n_u8(0xfc));
+      dst.val[2] = vshl_n_u8(vmovn_u16(src), 3);
+
+      vst4_u8(rows, dst);
+
+      rows += 32;
+      data += 16;
+    }
+  }
+#endif
+
+  for (; i < size; i++) {
+    rows[0] = data[1] & 0xf8;
+    rows[1] = ((data[1] << 5) & 0xe0) | ((data[0] >> 3) & 0x1c);
+    rows[2] = (data[0] << 3) & 0xf8;
+    rows[3] = 0;
+
+    rows += 4;
+    data += 2;
+  }
+
+  return (size * 2);
+}
+
+#ifdef USE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static int
+split_yuyv_avx2(uint8_t* data, JSAMPROW y, JSAMPROW cb, JSAMPROW cr, int wd)
+{
+  /*
+   * split_yuyv()のAVX2版 (32画素ずつ)。処理した画素数を返す。
+   */
+
+  __m256i a;
+  __m256i b;
+  __m256i uv;
+  __m256i mask;
+  int i;
+
+  mask = _mm256_set1_epi16(0x00ff);
+
+  for (i = 0; i + 32 <= wd; i += 32) {
+    a  = _mm256_loadu_si256((__m256i*)(data + 0));
+    b  = _mm256_loadu_si256((__m256i*)(data + 32));
+
+    /* packusは128bitのレーン毎なので64bit単位で並べ直す */
+    _mm256_storeu_si256((__m256i*)(y + i),
+                        _mm256_permute4x64_epi64(
+                            _mm256_packus_epi16(_mm256_and_si256(a, mask),
+                                                _mm256_and_si256(b, mask)),
+                            0xd8));
+
+    uv = _mm256_permute4x64_epi64(
+             _mm256_packus_epi16(_mm256_srli_epi16(a, 8),
+                                 _mm256_srli_epi16(b, 8)), 0xd8);
+
+    _mm_storeu_si128((__m128i*)(cb + (i / 2)),
+                     _mm256_castsi256_si128(_mm256_permute4x64_epi64(
+                         _mm256_packus_epi16(_mm256_and_si256(uv, mask),
+                                             mask), 0xd8)));
+    _mm_storeu_si128((__m128i*)(cr + (i / 2)),
+                     _mm256_castsi256_si128(_mm256_permute4x64_epi64(
+                         _mm256_packus_epi16(_mm256_srli_epi16(uv, 8),
+                                             mask), 0xd8)));
+
+    data += 64;
+  }
+
+  return i;
+}
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+static void
+split_yuyv(uint8_t* data, JSAMPROW y, JSAMPROW cb, JSAMPROW cr, int wd)
+{
+  /*
+   * YUYVの一行をY, Cb, Crの各面に分ける (幅は偶数であること)。
+   * SSE2/NEONが使える場合は16画素ずつ、AVX2が使える場合は32画素ずつ
+   * 処理する。
+   */
+
+  int i;
+
+  i = 0;
+
+#ifdef USE_AVX2_DISPATCH
+  if (have_avx2) {
+    i     = split_yuyv_avx2(data, y, cb, cr, wd);
+    data += i * 2;
+  }
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+#if defined(__SSE2__)
+  {
+    __m128i a;
+    __m128i b;
+    __m128i uv;
+    __m128i mask;
+
+    mask = _mm_set1_epi16(0x00ff);
+
+    for (; i + 16 <= wd; i += 16) {
+      a  = _mm_loadu_si128((__m128i*)(data + 0));
+      b  = _mm_loadu_si128((__m128i*)(data + 16));
+
+      /* 偶数バイトがY、奇数バイトがU/Vの交互 */
+      _mm_storeu_si128((__m128i*)(y + i),
+                       _mm_packus_epi16(_mm_and_si128(a, mask),
+                                        _mm_and_si128(b, mask)));
+
+      uv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+
+      _mm_storel_epi64((__m128i*)(cb + (i / 2)),
+                       _mm_packus_epi16(_mm_and_si128(uv, mask), mask));
+      _mm_storel_epi64((__m128i*)(cr + (i / 2)),
+                       _mm_packus_epi16(_mm_srli_epi16(uv, 8), mask));
+
+      data += 32;
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint8x8x4_t src;
+    uint8x8x2_t yy;
+
+    for (; i + 16 <= wd; i += 16) {
+      src       = vld4_u8(data);
+
+      yy.val[0] = src.val[0];
+      yy.val[1] = src.val[2];
+
+      vst2_u8(y + i, yy);
+      vst1_u8(cb + (i / 2), src.val[1]);
+      vst1_u8(cr + (i / 2), src.val[3]);
+
+      data += 32;
+    }
+  }
+#endif
+
+  for (; i < wd; i += 2) {
+    y[i + 0]     = data[0];
+    cb[i / 2]    = data[1];
+    y[i + 1]     = data[2];
+    cr[i / 2]    = data[3];
+
+    data += 4;
+  }
+}
+
+static int
+push_rows_comp3(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+{
+  int size;
+
+  size = wd * nrow * 3;
+  memcpy(rows, data, size);
+
+  return size;
+}
+
+static int
+push_rows_comp4(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+{
+  int size;
+
+  size = wd * nrow * 4;
+  memcpy(rows, data, size);
+
+  return size;
+}
+
+
+
+static int
+push_rows_grayscale(JSAMPROW rows, int wd, uint8_t* data, int nrow)
+{
+  int size;
+
+  size = wd * nrow;
+  memcpy(rows, data, size);
+
+  return size;
+}
+
+static int
+need_conversion(jpeg_encode_t* ptr)
+{
+  /*
+   * 入力の変換が必要なフォーマットか否か
+   */
+  return (ptr->format == FMT_YUV422 || ptr->format == FMT_RGB565);
+}
+
+static int
+is_scaled(jpeg_encode_t* ptr)
+{
+  return (ptr->image_width != ptr->width || ptr->image_height != ptr->height);
+}
+
+static int
+need_staging(jpeg_encode_t* ptr)
+{
+  /*
+   * libjpegに渡す行を作業領域に用意する必要があるか否か (それ以外は入力
+   * をそのままlibjpegに渡せる)
+   */
+  return (need_conversion(ptr) || is_scaled(ptr));
+}
+
+static int
+source_row(jpeg_encode_t* ptr, int y)
+{
+  /*
+   * 出力の行yに対応する縮小領域の先頭の入力行
+   */
+  return (int)(((long)y * ptr->height) / ptr->image_height);
+}
+
+static int
+map_rows(jpeg_encode_t* ptr, JSAMPARRAY array, uint8_t* data, int nrow)
+{
+  /*
+   * 変換が不要なフォーマットでは複写を行わず、入力データの各行を直接
+   * 指す様に行ポインタを設定する (入力はfrozenな文字列であること)
+   */
+
+  int line;
+  int i;
+
+  line = ptr->width * ptr->components;
+
+  for (i = 0; i < nrow; i++) {
+    array[i] = (JSAMPROW)(data + (i * line));
+  }
+
+  return line * nrow;
+}
+
+static int
+push_rows(jpeg_encode_t* ptr, JSAMPROW rows, uint8_t* data, int nrow)
+{
+  int ret;
+
+  switch (ptr->format) {
+  case FMT_YUV422:
+    ret = push_rows_yuv422(rows, ptr->width, data, nrow);
+    break;
+
+  case FMT_RGB565:
+    ret = push_rows_rgb565(rows, ptr->width, data, nrow);
+    break;
+
+  case FMT_YUV:
+  case FMT_RGB:
+  case FMT_BGR:
+    ret = push_rows_comp3(rows, ptr->width, data, nrow);
+    break;
+
+  case FMT_RGB32:
+  case FMT_BGR32:
+    ret = push_rows_comp4(rows, ptr->width, data, nrow);
+    break;
+
+  case FMT_GRAYSCALE:
+    ret = push_rows_grayscale(rows, ptr->width, data, nrow);
+    break;
+
+  default:
+    /* not reached (checked by set_encoder_context()) */
+    ret = 0;
+    break;
+  }
+
+  return ret;
+}
+
+static void
+push_raw_rows(jpeg_encode_t* ptr, encode_ctx_t* ctx, uint8_t* data, int nrow)
+{
+  /*
+   * YUYVの行をY, Cb, Crの面に分けて蓄え、iMCU行 (8行) 揃う毎に
+   * jpeg_write_raw_data()で渡す。右端はMCUの幅まで、最後のiMCU行は
+   * 最終行を複製して埋める (通常の圧縮でlibjpegが行う処理と同じ)。
+   */
+
+  struct jpeg_compress_struct* cinfo;
+  JSAMPARRAY image[3];
+  JSAMPROW* row;
+  int pw;
+  int wd;
+  int i;
+  int x;
+  int c;
+
+  cinfo    = &ctx->cinfo;
+  wd       = ptr->width;
+  pw       = (wd + 15) & ~15;
+
+  image[0] = ctx->plane[0];
+  image[1] = ctx->plane[1];
+  image[2] = ctx->plane[2];
+
+  while (nrow-- > 0) {
+    i   = ctx->filled++;
+    row = &ctx->plane[0][i];
+
+    split_yuyv(data, ctx->plane[0][i], ctx->plane[1][i], ctx->plane[2][i], wd);
+    data += wd * 2;
+
+    for (x = wd; x < pw; x++) row[0][x] = row[0][wd - 1];
+
+    for (x = wd / 2; x < pw / 2; x++) {
+      ctx->plane[1][i][x] = ctx->plane[1][i][(wd / 2) - 1];
+      ctx->plane[2][i][x] = ctx->plane[2][i][(wd / 2) - 1];
+    }
+
+    if (ctx->filled < DCTSIZE &&
+        cinfo->next_scanline + ctx->filled < cinfo->image_height) continue;
+
+    for (i = ctx->filled; i < DCTSIZE; i++) {
+      for (c = 0; c < 3; c++) {
+        memcpy(ctx->plane[c][i], ctx->plane[c][i - 1], (c == 0)? pw: pw / 2);
+      }
+    }
+
+    jpeg_write_raw_data(cinfo, image, DCTSIZE);
+    ctx->filled = 0;
+  }
+}
+
+static void
+put_exif_tags(jpeg_encode_t* ptr, struct jpeg_compress_struct* cinfo)
+{
+  uint8_t data[] = {
+    /* Exif header */
+    'E',  'x',  'i',  'f', 0x00, 0x00,
+    'M',  'M',
+    0x00, 0x2a,
+    0x00, 0x00, 0x00, 0x08,
+    0x00, 0x01,
+
+    /* orieatation */
+    0x01, 0x12,
+    0x00, 0x03,
+    0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00,
+    0x00, 0x00,
+
+    /* end mark */
+    0x00, 0x00, 0x00, 0x00,
+  };
+
+  data[24] = (ptr->orientation >> 8) & 0xff;
+  data[25] = (ptr->orientation >> 0) & 0xff;
+
+  jpeg_write_marker(cinfo, JPEG_APP1, data, sizeof(data));
+}
+
+static void
+free_encode_buffers(encode_ctx_t* ctx)
+{
+  free(ctx->rows);
+  free(ctx->xmap);
+  free(ctx->acc);
+  free(ctx->line);
+  free(ctx->planes);
+}
+
+static void
+reset_scaler(jpeg_encode_t* ptr, encode_ctx_t* ctx, int y)
+{
+  /*
+   * 出力の行yから縮小を始める (帯状分割の場合は帯の先頭行を指定する)
+   */
+  ctx->oy     = y;
+  ctx->sy     = source_row(ptr, y);
+  ctx->filled = 0;
+
+  memset(ctx->acc, 0,
+         sizeof(uint32_t) * ptr->image_width * ptr->components);
+}
+
+static void
+scale_rows(jpeg_encode_t* ptr, encode_ctx_t* ctx, uint8_t* data, int nrow)
+{
+  /*
+   * :scaleによる縮小 (箱型フィルタ)
+   *
+   * 入力を一行ずつ受け取り、出力の各画素が覆う領域の和を求める。出力の
+   * 一行分が揃う毎に平均を作業領域に書き出し、UNIT_LINES行溜まるか画像
+   * (帯) の最後に達した時点でlibjpegに渡す。行を順に受け取れれば良いので
+   * #write_rowsの様に入力が分割されていても同じ結果になる。
+   */
+
+  struct jpeg_compress_struct* cinfo;
+  uint8_t* src;
+  uint32_t* acc;
+  JSAMPROW dst;
+  int line;
+  int nc;
+  int wd;
+  int ey;
+  int n;
+  int x;
+  int i;
+  int c;
+
+  cinfo = &ctx->cinfo;
+  line  = ptr->data_size / ptr->height;
+  nc    = ptr->components;
+  wd    = ptr->image_width;
+
+  while (nrow-- > 0) {
+    /* 横方向の和を加算 */
+    if (ctx->line != NULL) {
+      push_rows(ptr, ctx->line, data, 1);
+      src = ctx->line;
+    } else {
+      src = data;
+    }
+
+    data += line;
+    acc   = ctx->acc;
+
+    for (x = 0; x < wd; x++) {
+      for (i = ctx->xmap[x]; i < ctx->xmap[x + 1]; i++) {
+        for (c = 0; c < nc; c++) acc[c] += src[(i * nc) + c];
+      }
+
+      acc += nc;
+    }
+
+    /* 出力の行が揃ったら平均を書き出す */
+    ctx->sy++;
+    ey = source_row(ptr, ctx->oy + 1);
+
+    if (ctx->sy < ey) continue;
+
+    acc = ctx->acc;
+    dst = ctx->array[ctx->filled++];
+    n   = ey - source_row(ptr, ctx->oy);
+
+    for (x = 0; x < wd; x++) {
+      i = n * (ctx->xmap[x + 1] - ctx->xmap[x]);
+
+      for (c = 0; c < nc; c++) {
+        *dst++  = (JSAMPLE)((acc[c] + (i / 2)) / i);
+        acc[c]  = 0;
+      }
+
+      acc += nc;
+    }
+
+    ctx->oy++;
+
+    if (ctx->filled == UNIT_LINES ||
+        cinfo->next_scanline + ctx->filled >= cinfo->image_height) {
+      jpeg_write_scanlines(cinfo, ctx->array, ctx->filled);
+      ctx->filled = 0;
+    }
+  }
+}
+
+static int
+open_encode_context(jpeg_encode_t* ptr, encode_ctx_t* ctx)
+{
+  /*
+   * 作業領域の初期化 (GVLを解放した状態でも呼び出される)
+   * GVLを保持していない場合があるのでxmalloc()は使用しないこと。
+   */
+
+  int ret;
+  int wd;
+  int pw;
+  int i;
+
+  wd        = ptr->image_width;
+
+  ctx->rows   = NULL;
+  ctx->xmap   = NULL;
+  ctx->acc    = NULL;
+  ctx->line   = NULL;
+  ctx->planes = NULL;
+  ctx->filled = 0;
+
+  if (is_raw_yuv422(ptr)) {
+    /* Y (MCUの幅に揃える) とCb, Cr (その半分) を8行ずつ */
+    pw          = (wd + 15) & ~15;
+    ctx->planes = (JSAMPROW)malloc(sizeof(JSAMPLE) * pw * 2 * DCTSIZE);
+
+    if (ctx->planes == NULL) goto alloc_error;
+
+    for (i = 0; i < DCTSIZE; i++) {
+      ctx->plane[0][i] = ctx->planes + (i * pw * 2);
+      ctx->plane[1][i] = ctx->plane[0][i] + pw;
+      ctx->plane[2][i] = ctx->plane[1][i] + (pw / 2);
+    }
+
+  } else if (need_staging(ptr)) {
+    ctx->rows = (JSAMPROW)malloc(sizeof(JSAMPLE) *
+                                 wd * ptr->components * UNIT_LINES);
+
+    if (ctx->rows == NULL) goto alloc_error;
+
+    for (i = 0; i < UNIT_LINES; i++) {
+      ctx->array[i] = ctx->rows + (i * ptr->components * wd);
+    }
+
+  } else {
+    /* 行ポインタは圧縮時にmap_rows()で入力データを指す様に設定する */
+  }
+
+  if (is_scaled(ptr)) {
+    ctx->xmap = (int*)malloc(sizeof(int) * (wd + 1));
+    ctx->acc  = (uint32_t*)malloc(sizeof(uint32_t) * wd * ptr->components);
+
+    if (ctx->xmap == NULL || ctx->acc == NULL) goto alloc_error;
+
+    if (need_conversion(ptr)) {
+      ctx->line = (JSAMPROW)malloc(sizeof(JSAMPLE) *
+                                   ptr->width * ptr->components);
+      if (ctx->line == NULL) goto alloc_error;
+    }
+
+    for (i = 0; i <= wd; i++) {
+      ctx->xmap[i] = (int)(((long)i * ptr->width) / wd);
+    }
+
+    reset_scaler(ptr, ctx, 0);
+  }
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    /*
+     * 生成の途中 (install_arena()を含む) で失敗した場合はcinfoを破棄
+     * する。再利用中のcinfoは状態を戻してプールに返せる様にしておく。
+     */
+    if (ctx->active) {
+      jpeg_abort_compress(&ctx->cinfo);
+    } else {
+      jpeg_destroy_compress(&ctx->cinfo);
+    }
+
+    free_encode_buffers(ctx);
+    ret = !0;
+
+  } else {
+    if (!ctx->active) {
+      create_compress(&ctx->cinfo, &ctx->err_mgr);
+      ctx->active = !0;
+    }
+
+    init_compress(ptr, &ctx->cinfo);
+    ret = 0;
+  }
+
+  return ret;
+
+ alloc_error:
+  free_encode_buffers(ctx);
+  sprintf(ctx->err_mgr.msg, "memory allocation failed.");
+
+  return !0;
+}
+
+static void
+close_encode_context(encode_ctx_t* ctx)
+{
+  /* cinfoはrelease_encode_context()でプールに戻すので破棄しない */
+  free_encode_buffers(ctx);
+}
+
+static void
+free_encode_context(encode_ctx_t* ctx)
+{
+  if (ctx->active) {
+    forget_memory_usage((j_common_ptr)&ctx->cinfo);
+    jpeg_destroy_compress(&ctx->cinfo);
+  }
+
+  xfree(ctx);
+}
+
+static encode_ctx_t*
+acquire_encode_context(jpeg_encode_t* ptr)
+{
+  encode_ctx_t* ret;
+  int i;
+
+  ret = NULL;
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] == NULL) continue;
+
+    ret = __atomic_exchange_n(ptr->pool + i, NULL, __ATOMIC_ACQUIRE);
+    if (ret != NULL) break;
+  }
+
+  if (ret == NULL) {
+    ret         = ALLOC(encode_ctx_t);
+    ret->active = 0;
+  }
+
+  return ret;
+}
+
+static void
+release_encode_context(jpeg_encode_t* ptr, encode_ctx_t* ctx)
+{
+  encode_ctx_t* empty;
+  int i;
+
+  /*
+   * cinfoはリセットのみ行って次回の呼び出しで再利用する。アリーナが
+   * 保持している領域の増減はここでGCに通知する (GVL保持)。
+   */
+  if (ctx->active) {
+    jpeg_abort_compress(&ctx->cinfo);
+    update_memory_usage((j_common_ptr)&ctx->cinfo);
+  }
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    empty = NULL;
+
+    if (__atomic_compare_exchange_n(ptr->pool + i, &empty, ctx, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+
+  /* プールが一杯の場合は破棄する */
+  free_encode_context(ctx);
+}
+
+static encode_ctx_t*
+take_encode_context(encode_ctx_set_t* set)
+{
+  /*
+   * 組から作業領域を一つ取り出す (GVL解放中のワーカから呼び出される)
+   */
+  return set->ctx[__atomic_fetch_add(&set->next, 1, __ATOMIC_RELAXED)];
+}
+
+typedef struct {
+  encode_ctx_set_t* set;
+  void* (*func)(void*);
+  void* arg;
+} encode_call_t;
+
+static VALUE
+encode_call_body(VALUE _call)
+{
+  encode_call_t* call;
+  encode_ctx_set_t* set;
+  int i;
+
+  call = (encode_call_t*)_call;
+  set  = call->set;
+
+  set->ctx = ALLOC_N(encode_ctx_t*, set->n);
+  memset(set->ctx, 0, sizeof(encode_ctx_t*) * set->n);
+
+  for (i = 0; i < set->n; i++) {
+    set->ctx[i] = acquire_encode_context(set->owner);
+  }
+
+  rb_thread_call_without_gvl(call->func, call->arg, NULL, NULL);
+
+  return Qnil;
+}
+
+static VALUE
+encode_call_ensure(VALUE _call)
+{
+  encode_ctx_set_t* set;
+  int i;
+
+  set = ((encode_call_t*)_call)->set;
+
+  if (set->ctx != NULL) {
+    for (i = 0; i < set->n; i++) {
+      if (set->ctx[i] != NULL) release_encode_context(set->owner, set->ctx[i]);
+    }
+
+    xfree(set->ctx);
+    set->ctx = NULL;
+  }
+
+  return Qnil;
+}
+
+static void
+call_without_gvl_with_contexts(encode_ctx_set_t* set,
+                               void* (*func)(void*), void* arg)
+{
+  /*
+   * set->n個の作業領域をプールから取り出してfuncをGVL解放状態で呼び
+   * 出す。作業領域は例外発生時も含めて必ずプールに返却する。
+   */
+
+  encode_call_t call;
+
+  call.set  = set;
+  call.func = func;
+  call.arg  = arg;
+
+  rb_ensure(encode_call_body, (VALUE)&call, encode_call_ensure, (VALUE)&call);
+}
+
+/*
+ * 出力先マネージャ
+ *
+ * jpeg_mem_dest()は出力をmalloc()した領域に書き出すため、Rubyの文字列を
+ * 返すには最後に全体の複製が必要になる。ここでは出力先を伸長可能な
+ * バッファとして抽象化し、通常の圧縮では戻り値の文字列のバッファに直接
+ * 書き込む。
+ */
+
+#define OUTPUT_MIN_CAPA     4096
+
+static unsigned char*
+grow_heap_output(output_buf_t* out, size_t capa)
+{
+  unsigned char* buf;
+
+  buf = (unsigned char*)realloc(out->buf, capa);
+  if (buf != NULL) {
+    out->buf  = buf;
+    out->capa = capa;
+  }
+
+  return buf;
+}
+
+static VALUE
+resize_string(VALUE _out)
+{
+  output_buf_t* out;
+
+  out = (output_buf_t*)_out;
+  rb_str_resize(out->str, out->capa);
+
+  return Qnil;
+}
+
+static void*
+resize_string_with_gvl(void* _out)
+{
+  output_buf_t* out;
+  int state;
+
+  out = (output_buf_t*)_out;
+
+  rb_protect(resize_string, (VALUE)out, &state);
+
+  if (state) {
+    rb_set_errinfo(Qnil);
+    return NULL;
+  }
+
+  return RSTRING_PTR(out->str);
+}
+
+static unsigned char*
+grow_string_output(output_buf_t* out, size_t capa)
+{
+  /*
+   * GVLを解放した状態で呼び出されるので、文字列の伸長はGVLを再取得して
+   * 行う。文字列はまだRuby側に公開されていないので他のスレッドから参照
+   * されることは無い。
+   */
+
+  size_t old;
+  unsigned char* buf;
+
+  old       = out->capa;
+  out->capa = capa;
+
+  buf = (unsigned char*)rb_thread_call_with_gvl(resize_string_with_gvl, out);
+
+  if (buf == NULL) {
+    out->capa = old;
+  } else {
+    out->buf  = buf;
+  }
+
+  return buf;
+}
+
+static void
+init_output_buf(output_buf_t* out, VALUE str)
+{
+  memset(out, 0, sizeof(*out));
+
+  if (NIL_P(str)) {
+    out->grow = grow_heap_output;
+
+  } else {
+    out->grow = grow_string_output;
+    out->buf  = (unsigned char*)RSTRING_PTR(str);
+    out->capa = rb_str_capacity(str);
+  }
+
+  out->str = str;
+}
+
+static void
+expand_output(j_compress_ptr cinfo, output_buf_t* out, size_t capa)
+{
+  if (out->grow(out, capa) == NULL) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 10);
+  }
+}
+
+static void
+init_destination(j_compress_ptr cinfo)
+{
+  output_buf_t* out;
+
+  out = (output_buf_t*)cinfo->dest;
+
+  if (out->capa < OUTPUT_MIN_CAPA) {
+    expand_output(cinfo, out, OUTPUT_MIN_CAPA);
+  }
+
+  out->pub.next_output_byte = out->buf;
+  out->pub.free_in_buffer   = out->capa;
+  out->size                 = 0;
+}
+
+static boolean
+empty_output_buffer(j_compress_ptr cinfo)
+{
+  /*
+   * このコールバックが呼ばれた時点でバッファは全て使用済み
+   */
+
+  output_buf_t* out;
+  size_t used;
+
+  out  = (output_buf_t*)cinfo->dest;
+  used = out->capa;
+
+  expand_output(cinfo, out, used * 2);
+
+  out->pub.next_output_byte = out->buf + used;
+  out->pub.free_in_buffer   = out->capa - used;
+
+  return TRUE;
+}
+
+static void
+term_destination(j_compress_ptr cinfo)
+{
+  output_buf_t* out;
+
+  out       = (output_buf_t*)cinfo->dest;
+  out->size = out->capa - out->pub.free_in_buffer;
+}
+
+static void
+write_image(jpeg_encode_t* ptr, encode_ctx_t* ctx, uint8_t* data, int y,
+            output_buf_t* out, int exif)
+{
+  struct jpeg_compress_struct* cinfo;
+  int nrow;
+
+  cinfo = &ctx->cinfo;
+
+  out->pub.init_destination    = init_destination;
+  out->pub.empty_output_buffer = empty_output_buffer;
+  out->pub.term_destination    = term_destination;
+
+  cinfo->dest = &out->pub;
+
+  jpeg_start_compress(cinfo, TRUE);
+
+  if (exif && ptr->orientation != 0) {
+    put_exif_tags(ptr, cinfo);
+  }
+
+  if (ctx->xmap != NULL) {
+    /* 縮小する場合は対応する範囲の入力行を渡す */
+    reset_scaler(ptr, ctx, y);
+    scale_rows(ptr, ctx, data,
+               source_row(ptr, y + cinfo->image_height) - ctx->sy);
+
+  } else if (ctx->planes != NULL) {
+    ctx->filled = 0;
+    push_raw_rows(ptr, ctx, data, cinfo->image_height);
+  }
+
+  while (cinfo->next_scanline < cinfo->image_height) {
+    nrow = cinfo->image_height - cinfo->next_scanline;
+    if (nrow > UNIT_LINES) nrow = UNIT_LINES;
+
+    if (ctx->rows != NULL) {
+      data += push_rows(ptr, ctx->rows, data, nrow);
+    } else {
+      data += map_rows(ptr, ctx->array, data, nrow);
+    }
+
+    jpeg_write_scanlines(cinfo, ctx->array, nrow);
+  }
+
+  jpeg_finish_compress(cinfo);
+}
+
+static int
+compress_image(jpeg_encode_t* ptr, encode_ctx_t* ctx, uint8_t* data, int y,
+               output_buf_t* out, int exif)
+{
+  /*
+   * 圧縮処理本体。GVLを解放した状態で呼び出される。
+   * dataは出力の行yに対応する入力行 (帯状分割でない場合は0行目) を指す。
+   * エラーはステータスとして返し、メッセージはctx->err_mgr.msgに残す。
+   */
+
+  int ret;
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    jpeg_abort_compress(&ctx->cinfo);
+    ret = !0;
+
+  } else {
+    write_image(ptr, ctx, data, y, out, exif);
+    ret = 0;
+  }
+
+  return ret;
+}
+
+/*
+ * 帯状分割による並列圧縮
+ *
+ * 入力をMCU行の境界で帯状に分割して各帯を別スレッドで圧縮し、一つの
+ * JPEGデータに連結する。リスタート間隔を1MCU行としているので帯の境界は
+ * リスタートマーカの位置と一致し、連結時にRSTnの番号を振り直すだけで
+ * 正しいJPEGデータになる。
+ * 全ての帯で量子化テーブルとハフマンテーブルが同一である必要がある。
+ * (jpeg_set_defaults()によりoptimize_codingは無効になっているので、
+ * 標準のハフマンテーブルが使われる)
+ */
+
+static int
+make_stripe_plan(stripe_plan_t* plan, encode_ctx_t* ctx)
+{
+  struct jpeg_compress_struct* cinfo;
+  int max_h;
+  int max_v;
+  int mcu_rows;
+  int i;
+
+  cinfo = &ctx->cinfo;
+  max_h = 1;
+  max_v = 1;
+
+  if (cinfo->num_components > 1) {
+    for (i = 0; i < cinfo->num_components; i++) {
+      if (cinfo->comp_info[i].h_samp_factor > max_h) {
+        max_h = cinfo->comp_info[i].h_samp_factor;
+      }
+
+      if (cinfo->comp_info[i].v_samp_factor > max_v) {
+        max_v = cinfo->comp_info[i].v_samp_factor;
+      }
+    }
+  }
+
+  plan->mcu_ht       = max_v * DCTSIZE;
+  plan->mcus_per_row = (cinfo->image_width + (max_h * DCTSIZE) - 1) /
+                                                          (max_h * DCTSIZE);
+
+  mcu_rows           = (cinfo->image_height + plan->mcu_ht - 1) /
+                                                          plan->mcu_ht;
+  plan->stripe_rows  = (mcu_rows + plan->job->ptr->threads - 1) /
+                                                 plan->job->ptr->threads;
+  plan->nstripes     = (mcu_rows + plan->stripe_rows - 1) /
+                                                 plan->stripe_rows;
+
+  return (plan->nstripes < 2);
+}
+
+static void*
+encode_stripe_worker(void* _plan)
+{
+  stripe_plan_t* plan;
+  jpeg_encode_t* ptr;
+  encode_ctx_t* ctx;
+  uint8_t* data;
+  size_t line;
+  int y;
+  int ht;
+  int i;
+
+  plan = (stripe_plan_t*)_plan;
+  ptr  = plan->job->ptr;
+  line = ptr->data_size / ptr->height;
+  ctx  = take_encode_context(&plan->job->set);
+
+  if (open_encode_context(ptr, ctx)) {
+    plan->failed = !0;
+    memcpy(plan->msg, ctx->err_mgr.msg, sizeof(plan->msg));
+    return NULL;
+  }
+
+  while ((i = __atomic_fetch_add(&plan->next, 1, __ATOMIC_RELAXED)) <
+                                                            plan->nstripes) {
+    if (plan->failed) break;
+
+    y  = i * plan->stripe_rows * plan->mcu_ht;
+    ht = plan->stripe_rows * plan->mcu_ht;
+    if (y + ht > ptr->image_height) ht = ptr->image_height - y;
+
+    data = plan->job->data + (source_row(ptr, y) * line);
+
+    /* jpeg_set_defaults()の後で設定すること */
+    ctx->cinfo.image_height     = ht;
+    ctx->cinfo.restart_interval = plan->mcus_per_row;
+
+    init_output_buf(plan->stripes + i, Qnil);
+
+    if (compress_image(ptr, ctx, data, y, plan->stripes + i, (i == 0))) {
+      plan->failed = !0;
+      memcpy(plan->msg, ctx->err_mgr.msg, sizeof(plan->msg));
+    }
+  }
+
+  close_encode_context(ctx);
+
+  return NULL;
+}
+
+static size_t
+find_scan_data(unsigned char* buf, size_t size, size_t* sof)
+{
+  /*
+   * 圧縮結果のヘッダを走査し、エントロピー符号化データの開始位置を返す
+   * (libjpegの出力なのでマーカの並びは既知のものとして扱う)
+   */
+
+  size_t pos;
+  int m;
+
+  pos = 2;
+
+  while (pos + 4 <= size) {
+    m = buf[pos + 1];
+
+    if (m == 0xc0 || m == 0xc1) *sof = pos;
+
+    pos += 2 + ((buf[pos + 2] << 8) | buf[pos + 3]);
+
+    if (m == 0xda) break;
+  }
+
+  return pos;
+}
+
+static unsigned char*
+copy_scan_data(unsigned char* dst, unsigned char* src, size_t size, int* rst)
+{
+  /*
+   * エントロピー符号化データをコピーし、RSTnマーカの番号を振り直す
+   */
+
+  unsigned char* p;
+  size_t len;
+
+  while (size > 0) {
+    p = memchr(src, 0xff, size);
+    if (p == NULL || p + 1 >= src + size) {
+      memcpy(dst, src, size);
+      dst += size;
+      break;
+    }
+
+    len = (p - src) + 2;
+    memcpy(dst, src, len);
+
+    if (p[1] >= 0xd0 && p[1] <= 0xd7) {
+      dst[len - 1] = 0xd0 + (*rst & 7);
+      *rst += 1;
+    }
+
+    dst  += len;
+    src  += len;
+    size -= len;
+  }
+
+  return dst;
+}
+
+static int
+join_stripes(stripe_plan_t* plan)
+{
+  output_buf_t* out;
+  unsigned char* buf;
+  unsigned char* p;
+  unsigned char* s;
+  size_t sof;
+  size_t head;
+  size_t size;
+  int rst;
+  int i;
+
+  out  = &plan->job->out;
+  sof  = 0;
+  head = find_scan_data(plan->stripes[0].buf, plan->stripes[0].size, &sof);
+  size = head;
+
+  if (sof == 0) {
+    sprintf(plan->msg, "SOF marker not found.");
+    return !0;
+  }
+
+  for (i = 0; i < plan->nstripes; i++) {
+    size += plan->stripes[i].size;
+  }
+
+  /* 連結結果は出力先に直接書き込む (RSTの挿入分を考慮する) */
+  size += plan->nstripes * 2;
+
+  if (out->capa < size && out->grow(out, size) == NULL) {
+    sprintf(plan->msg, "memory allocation failed.");
+    return !0;
+  }
+
+  buf = out->buf;
+
+  /* 先頭の帯のヘッダ (SOFの高さを全体の高さに書き換える) */
+  memcpy(buf, plan->stripes[0].buf, head);
+
+  buf[sof + 5] = (plan->job->ptr->image_height >> 8) & 0xff;
+  buf[sof + 6] = (plan->job->ptr->image_height >> 0) & 0xff;
+
+  p   = buf + head;
+  rst = 0;
+
+  for (i = 0; i < plan->nstripes; i++) {
+    s    = plan->stripes[i].buf;
+    size = plan->stripes[i].size;
+    head = find_scan_data(s, size, &sof);
+
+    if (i > 0) {
+      *p++ = 0xff;
+      *p++ = 0xd0 + (rst & 7);
+      rst++;
+    }
+
+    /* EOIを除いたエントロピー符号化データ */
+    p = copy_scan_data(p, s + head, size - head - 2, &rst);
+  }
+
+  *p++ = 0xff;
+  *p++ = 0xd9;
+
+  out->size = p - buf;
+
+  return 0;
+}
+
+static int
+encode_in_stripes(encode_job_t* job)
+{
+  /*
+   * 並列圧縮を行う。帯に分割できない場合は非0を返すので、呼び出し元で
+   * 通常の圧縮を行うこと。エラーの場合はjob->statusを設定する。
+   */
+
+  int ret;
+  stripe_plan_t plan;
+  encode_ctx_t* ctx;
+  int i;
+
+  memset(&plan, 0, sizeof(plan));
+  plan.job = job;
+  ctx      = job->set.ctx[0];
+
+  if (open_encode_context(job->ptr, ctx)) {
+    return !0;
+  }
+
+  ret = make_stripe_plan(&plan, ctx);
+  close_encode_context(ctx);
+
+  if (ret) return ret;
+
+  /* 帯のワーカは組の先頭から作業領域を取り出す (帯の数 <= 組の数) */
+  job->set.next = 0;
+
+  plan.stripes = calloc(plan.nstripes, sizeof(*plan.stripes));
+  if (plan.stripes == NULL) return !0;
+
+  run_workers(encode_stripe_worker, &plan,
+              (job->ptr->threads < plan.nstripes)?
+                                      job->ptr->threads: plan.nstripes);
+
+  if (plan.failed || join_stripes(&plan)) {
+    memcpy(job->msg, plan.msg, sizeof(job->msg));
+    job->status = !0;
+  } else {
+    job->status = 0;
+  }
+
+  for (i = 0; i < plan.nstripes; i++) {
+    if (plan.stripes[i].buf != NULL) free(plan.stripes[i].buf);
+  }
+
+  free(plan.stripes);
+
+  return 0;
+}
+
+static void*
+encode_body(void* _job)
+{
+  /*
+   * GVLを解放した状態で実行される部分。
+   * エラーはステータスとして呼び出し元に返し、例外の発生はGVLを再取得
+   * した後に行う。
+   */
+
+  encode_job_t* job;
+  encode_ctx_t* ctx;
+
+  job = (encode_job_t*)_job;
+
+  if (job->ptr->threads > 1 && !encode_in_stripes(job)) {
+    return NULL;
+  }
+
+  ctx = job->set.ctx[0];
+
+  if (open_encode_context(job->ptr, ctx)) {
+    job->status = !0;
+
+  } else {
+    job->status = compress_image(job->ptr, ctx, job->data, 0,
+                                 &job->out, !0);
+    close_encode_context(ctx);
+  }
+
+  if (job->status) {
+    memcpy(job->msg, ctx->err_mgr.msg, sizeof(job->msg));
+  }
+
+  return NULL;
+}
+
+static VALUE
+do_encode(jpeg_encode_t* owner, jpeg_encode_t* ptr, uint8_t* data)
+{
+  VALUE ret;
+  encode_job_t job;
+  size_t capa;
+
+  /*
+   * create return data
+   *
+   * 圧縮データは戻り値の文字列に直接書き込む。初期容量は前回の出力
+   * サイズを目安にし、初回は入力サイズから見積もる (不足した場合は
+   * 伸長する)。
+   */
+  if (ptr->size_hint > 0) {
+    capa = ptr->size_hint + (ptr->size_hint >> 3);
+  } else {
+    capa = ptr->data_size / 8;
+  }
+
+  if (capa < OUTPUT_MIN_CAPA) capa = OUTPUT_MIN_CAPA;
+
+  ret = rb_str_buf_new(capa);
+
+  memset(&job, 0, sizeof(job));
+  job.ptr       = ptr;
+  job.data      = data;
+  job.set.owner = owner;
+  job.set.n     = (ptr->threads > 1)? ptr->threads: 1;
+
+  init_output_buf(&job.out, ret);
+
+  /*
+   * 圧縮処理本体 (GVL解放)
+   */
+  call_without_gvl_with_contexts(&job.set, encode_body, &job);
+
+  if (job.status) {
+    rb_raise(encerr_klass, "%s", job.msg);
+  }
+
+  /*
+   * post process
+   *
+   * 見積もりが大きく外れた場合は余分な領域を解放しておく
+   */
+  if (job.out.capa - job.out.size > (job.out.size >> 1) + OUTPUT_MIN_CAPA) {
+    rb_str_resize(ret, job.out.size);
+  } else {
+    rb_str_set_len(ret, job.out.size);
+  }
+
+  return ret;
+}
+
+/**
+ * encode data
+ *
+ * @overload encode(raw)
+ *
+ *   @param raw [String]  raw image data to encode.
+ *
+ *   @return [String] encoded JPEG data.
+ *
+ *   @note The compression itself runs without holding the GVL, so other
+ *     Ruby threads keep running while a large image is encoded.
+ *     The working state is allocated per call, so one encoder object
+ *     can be used from several threads (or Ractors, once made
+ *     shareable) at the same time.
+ */
+static VALUE
+rb_encoder_encode(VALUE self, VALUE data)
+{
+  VALUE ret;
+  jpeg_encode_t* ptr;
+  jpeg_encode_t cfg;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  if (RSTRING_LEN(data) < ptr->data_size) {
+    ARGUMENT_ERROR("raw image data is too short.");
+  }
+
+  if (RSTRING_LEN(data) > ptr->data_size) {
+    ARGUMENT_ERROR("raw image data is too large.");
+  }
+
+  /*
+   * do encode
+   *
+   * GVLを解放している間にdataが変更されない様にロックしておく。また
+   * 設定値は処理中に変更されても影響を受けない様に複製して使用する。
+   */
+  cfg  = *ptr;
+  data = rb_str_new_frozen(data);
+  ret  = do_encode(ptr, &cfg, (uint8_t*)RSTRING_PTR(data));
+
+  /*
+   * 次回の出力先の容量の目安として出力サイズを記録しておく。共有された
+   * (frozenな) エンコーダから同時に呼ばれた場合でも目安として使うだけ
+   * なので、どの値が残っても問題は無い。
+   */
+  __atomic_store_n(&ptr->size_hint, (size_t)RSTRING_LEN(ret),
+                   __ATOMIC_RELAXED);
+
+  RB_GC_GUARD(data);
+
+  return ret;
+}
+
+typedef struct {
+  VALUE data;
+
+  output_buf_t out;
+
+  char msg[JMSG_LENGTH_MAX+10];
+  int status;
+} encode_item_t;
+
+typedef struct {
+  jpeg_encode_t cfg;
+  encode_ctx_set_t set;
+
+  encode_item_t* items;
+  int n;
+  int next;
+} encode_batch_t;
+
+static void
+rb_encode_batch_mark(void* _batch)
+{
+  encode_batch_t* batch;
+  int i;
+
+  batch = (encode_batch_t*)_batch;
+
+  for (i = 0; i < batch->n; i++) {
+    rb_gc_mark(batch->items[i].data);
+  }
+}
+
+static void
+rb_encode_batch_free(void* _batch)
+{
+  encode_batch_t* batch;
+  int i;
+
+  batch = (encode_batch_t*)_batch;
+
+  if (batch->items != NULL) {
+    for (i = 0; i < batch->n; i++) {
+      if (batch->items[i].out.buf != NULL) free(batch->items[i].out.buf);
+    }
+
+    xfree(batch->items);
+  }
+
+  xfree(batch);
+}
+
+static void*
+encode_batch_worker(void* _batch)
+{
+  /*
+   * バッチ処理のワーカ (GVL解放状態で実行される)
+   * ワーカ毎に固有の作業領域を持ち、入力を順次取り出して処理する。
+   */
+
+  encode_batch_t* batch;
+  encode_ctx_t* ctx;
+  encode_item_t* item;
+  int failed;
+  int i;
+
+  batch  = (encode_batch_t*)_batch;
+  ctx    = take_encode_context(&batch->set);
+  failed = open_encode_context(&batch->cfg, ctx);
+
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+                                                                  batch->n) {
+    item = batch->items + i;
+
+    if (failed) {
+      item->status = !0;
+    } else {
+      item->status = compress_image(&batch->cfg, ctx,
+                                    (uint8_t*)RSTRING_PTR(item->data), 0,
+                                    &item->out, !0);
+    }
+
+    if (item->status) {
+      memcpy(item->msg, ctx->err_mgr.msg, sizeof(item->msg));
+    }
+  }
+
+  if (!failed) close_encode_context(ctx);
+
+  return NULL;
+}
+
+typedef struct {
+  encode_batch_t* batch;
+  int threads;
+} encode_run_t;
+
+static void*
+encode_batch_body(void* _run)
+{
+  encode_run_t* run;
+
+  run = (encode_run_t*)_run;
+  run_workers(encode_batch_worker, run->batch, run->threads);
+
+  return NULL;
+}
+
+static VALUE
+do_encode_batch(jpeg_encode_t* ptr, VALUE list, int threads)
+{
+  VALUE ret;
+  VALUE obj;
+  VALUE data;
+  encode_batch_t* batch;
+  encode_item_t* item;
+  encode_run_t run;
+  VALUE str;
+  int i;
+
+  /*
+   * create batch context
+   */
+  batch = ALLOC(encode_batch_t);
+  memset(batch, 0, sizeof(*batch));
+
+  obj   = Data_Wrap_Struct(0, rb_encode_batch_mark, rb_encode_batch_free,
+                           batch);
+
+  batch->cfg   = *ptr;
+  batch->items = ALLOC_N(encode_item_t, RARRAY_LEN(list));
+  memset(batch->items, 0, sizeof(encode_item_t) * RARRAY_LEN(list));
+
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    data = RARRAY_AREF(list, i);
+    Check_Type(data, T_STRING);
+
+    if (RSTRING_LEN(data) < ptr->data_size) {
+      ARGUMENT_ERROR("raw image data is too short.");
+    }
+
+    if (RSTRING_LEN(data) > ptr->data_size) {
+      ARGUMENT_ERROR("raw image data is too large.");
+    }
+
+    /*
+     * GVLを解放している間にdataが変更されない様にロックしておく
+     */
+    batch->items[i].data = rb_str_new_frozen(data);
+    init_output_buf(&batch->items[i].out, Qnil);
+    batch->n++;
+  }
+
+  /*
+   * encode (without GVL)
+   */
+  run.batch   = batch;
+  run.threads = (threads < batch->n)? threads: batch->n;
+
+  if (run.threads > 0) {
+    batch->set.owner = ptr;
+    batch->set.n     = run.threads;
+
+    call_without_gvl_with_contexts(&batch->set, encode_batch_body, &run);
+  }
+
+  /*
+   * create result
+   */
+  ret = rb_ary_new_capa(batch->n);
+
+  for (i = 0; i < batch->n; i++) {
+    item = batch->items + i;
+
+    if (item->status) {
+      rb_ary_push(ret, rb_exc_new_cstr(encerr_klass, item->msg));
+
+    } else {
+      str = rb_str_new((char*)item->out.buf, item->out.size);
+
+      rb_ary_push(ret, str);
+    }
+  }
+
+  RB_GC_GUARD(obj);
+
+  return ret;
+}
+
+/**
+ * encode multiple raw frames in parallel
+ *
+ * @overload encode_batch(frames, threads: nil)
+ *
+ *   @param frames [Array<String>]  raw image data to encode. each frame
+ *     shall have the width, height and pixel format given to the
+ *     constructor.
+ *
+ *   @param threads [Integer]  number of native worker threads.
+ *     defaults to the number of online processors.
+ *
+ *   @return [Array<String, JPEG::EncodeError>]
+ *     encoded JPEG data in the same order as the input. an entry that
+ *     could not be encoded is a JPEG::EncodeError object.
+ *
+ *   @note Each worker has its own libjpeg context configured with the
+ *     same settings as #encode (quality, dct_method, orientation).
+ *     The workers run without holding the GVL.
+ */
+static VALUE
+rb_encoder_encode_batch(int argc, VALUE* argv, VALUE self)
+{
+  VALUE ret;
+  jpeg_encode_t* ptr;
+  VALUE list;
+  VALUE opt;
+  VALUE opts[N(batch_opts_ids)];
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "1:", &list, &opt);
+
+  Check_Type(list, T_ARRAY);
+  rb_get_kwargs(opt, batch_opts_ids, 0, N(batch_opts_ids), opts);
+
+  /*
+   * do encode
+   */
+  list = rb_ary_dup(list);
+  ret  = do_encode_batch(ptr, list, eval_threads_opt(opts[0]));
+
+  RB_GC_GUARD(list);
+
+  return ret;
+}
+
+/*
+ * 逐次圧縮 (start / write_rows / finish)
+ *
+ * 入力を行単位で受け取ってその都度圧縮し、圧縮データはバッファが一杯に
+ * なる毎にIOに書き出す。画像全体の入力も出力も保持しない。
+ */
+
+#define STREAM_WRITE_SIZE   65536
+
+enum {
+  ENCODE_START = 0,
+  ENCODE_ROWS,
+  ENCODE_FINISH,
+};
+
+typedef struct encode_stream {
+  struct jpeg_destination_mgr pub;
+
+  jpeg_encode_t cfg;
+  jpeg_encode_t* owner;       // encoder object (owner of ctx's pool)
+  encode_ctx_t* ctx;
+  int opened;                 // ctx is initialized
+  int busy;                   // a call is in progress
+
+  VALUE io;
+  JOCTET* buf;
+  size_t flush;               // number of bytes to write
+  size_t written;             // number of bytes written to io
+  int exc;                    // tag of the exception raised by io.write
+
+  int op;
+  uint8_t* data;
+  int nrow;
+  int rows;                   // number of input rows written
+  int status;
+} encode_stream_t;
+
+static VALUE
+write_output_body(VALUE _st)
+{
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)_st;
+
+  rb_funcall(st->io, id_write, 1, rb_str_new((char*)st->buf, st->flush));
+
+  return Qnil;
+}
+
+static void*
+write_output_with_gvl(void* _st)
+{
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)_st;
+
+  rb_protect(write_output_body, (VALUE)st, &st->exc);
+
+  return NULL;
+}
+
+static void
+flush_encode_stream(j_compress_ptr cinfo, size_t size)
+{
+  /*
+   * バッファの内容をIOに書き出す。GVLを解放した状態で呼び出されるので
+   * GVLを再取得して行う。IO側で発生した例外はタグを保存しておき、GVLを
+   * 再取得した後に改めて送出する。
+   */
+
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)cinfo->dest;
+
+  if (size == 0) return;
+
+  st->flush = size;
+  rb_thread_call_with_gvl(write_output_with_gvl, st);
+
+  if (st->exc) {
+    ERREXIT(cinfo, JERR_FILE_WRITE);
+  }
+
+  st->written += size;
+}
+
+static void
+stream_init_destination(j_compress_ptr cinfo)
+{
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)cinfo->dest;
+
+  st->pub.next_output_byte = st->buf;
+  st->pub.free_in_buffer   = STREAM_WRITE_SIZE;
+}
+
+static boolean
+stream_empty_output_buffer(j_compress_ptr cinfo)
+{
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)cinfo->dest;
+
+  flush_encode_stream(cinfo, STREAM_WRITE_SIZE);
+
+  st->pub.next_output_byte = st->buf;
+  st->pub.free_in_buffer   = STREAM_WRITE_SIZE;
+
+  return TRUE;
+}
+
+static void
+stream_term_destination(j_compress_ptr cinfo)
+{
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)cinfo->dest;
+
+  flush_encode_stream(cinfo, STREAM_WRITE_SIZE - st->pub.free_in_buffer);
+}
+
+static void
+mark_encode_stream(encode_stream_t* st)
+{
+  rb_gc_mark(st->io);
+}
+
+static void
+free_encode_stream(encode_stream_t* st)
+{
+  /* プールに返却していない作業領域はここで破棄する */
+  if (st->opened) close_encode_context(st->ctx);
+  if (st->ctx != NULL) free_encode_context(st->ctx);
+  if (st->buf != NULL) xfree(st->buf);
+
+  xfree(st);
+}
+
+static void
+write_stream_rows(encode_stream_t* st)
+{
+  uint8_t* data;
+  int nrow;
+  int n;
+
+  data = st->data;
+  nrow = st->nrow;
+
+  if (st->ctx->xmap != NULL) {
+    scale_rows(&st->cfg, st->ctx, data, nrow);
+    return;
+  }
+
+  if (st->ctx->planes != NULL) {
+    push_raw_rows(&st->cfg, st->ctx, data, nrow);
+    return;
+  }
+
+  while (nrow > 0) {
+    n = (nrow < UNIT_LINES)? nrow: UNIT_LINES;
+
+    if (st->ctx->rows != NULL) {
+      data += push_rows(&st->cfg, st->ctx->rows, data, n);
+    } else {
+      data += map_rows(&st->cfg, st->ctx->array, data, n);
+    }
+
+    jpeg_write_scanlines(&st->ctx->cinfo, st->ctx->array, n);
+    nrow -= n;
+  }
+}
+
+static void
+run_encode_stream(encode_stream_t* st)
+{
+  struct jpeg_compress_struct* cinfo;
+
+  cinfo = &st->ctx->cinfo;
+
+  switch (st->op) {
+  case ENCODE_START:
+    cinfo->dest = &st->pub;
+    jpeg_start_compress(cinfo, TRUE);
+
+    if (st->cfg.orientation != 0) {
+      put_exif_tags(&st->cfg, cinfo);
+    }
+    break;
+
+  case ENCODE_ROWS:
+    write_stream_rows(st);
+    break;
+
+  case ENCODE_FINISH:
+    jpeg_finish_compress(cinfo);
+    break;
+  }
+}
+
+static void*
+encode_stream_body(void* _st)
+{
+  /*
+   * 圧縮処理 (GVL解放)
+   * エラーはst->statusで返し、メッセージはst->ctx->err_mgr.msgに残す
+   */
+
+  encode_stream_t* st;
+
+  st = (encode_stream_t*)_st;
+
+  if (setjmp(st->ctx->err_mgr.jmpbuf)) {
+    st->status = !0;
+
+  } else {
+    run_encode_stream(st);
+    st->status = 0;
+  }
+
+  return NULL;
+}
+
+static void
+close_encode_stream(jpeg_encode_t* ptr, encode_stream_t* st)
+{
+  ptr->stream = NULL;
+
+  if (st->opened) {
+    close_encode_context(st->ctx);
+    st->opened = 0;
+  }
+
+  release_encode_context(st->owner, st->ctx);
+  st->ctx = NULL;
+
+  free_encode_stream(st);
+}
+
+static void
+step_encode_stream(jpeg_encode_t* ptr, encode_stream_t* st, int op)
+{
+  char msg[JMSG_LENGTH_MAX+10];
+  int exc;
+
+  st->op   = op;
+  st->busy = !0;
+
+  rb_thread_call_without_gvl(encode_stream_body, st, NULL, NULL);
+
+  st->busy = 0;
+
+  /*
+   * エラーが発生した場合は圧縮を中断する (途中まで書き出したデータは
+   * 取り消さない)
+   */
+  if (st->status) {
+    exc = st->exc;
+    memcpy(msg, st->ctx->err_mgr.msg, sizeof(msg));
+
+    close_encode_stream(ptr, st);
+
+    if (exc) rb_jump_tag(exc);
+    rb_raise(encerr_klass, "%s", msg);
+  }
+}
+
+static encode_stream_t*
+get_encode_stream(jpeg_encode_t* ptr)
+{
+  encode_stream_t* st;
+
+  if (ptr->stream == NULL) {
+    RUNTIME_ERROR("encoding is not started.");
+  }
+
+  st = ptr->stream;
+
+  if (st->busy) {
+    RUNTIME_ERROR("encoder is busy.");
+  }
+
+  return st;
+}
+
+/**
+ * start incremental encoding
+ *
+ * @overload start(io)
+ *
+ *   @param io [IO]  output stream. the compressed data is passed to
+ *     `write` whenever the internal buffer (64KiB) becomes full.
+ *
+ *   @return [JPEG::Encoder] self
+ *
+ *   @note The image is fed by #write_rows and completed by #finish.
+ *     The encoder keeps the state of the stream between calls, so a
+ *     frozen encoder can not be used. The :threads option is ignored.
+ */
+static VALUE
+rb_encoder_start(VALUE self, VALUE io)
+{
+  jpeg_encode_t* ptr;
+  encode_stream_t* st;
+  char msg[JMSG_LENGTH_MAX+10];
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  rb_check_frozen(self);
+
+  if (!rb_respond_to(io, id_write)) {
+    TYPE_ERROR("output stream must respond to write.");
+  }
+
+  if (ptr->stream != NULL) {
+    RUNTIME_ERROR("encoding is already started.");
+  }
+
+  /*
+   * create stream state
+   */
+  st  = ALLOC(encode_stream_t);
+  memset(st, 0, sizeof(*st));
+
+  st->io    = io;
+  st->cfg   = *ptr;
+  st->owner = ptr;
+  st->buf   = ALLOC_N(JOCTET, STREAM_WRITE_SIZE);
+  st->ctx   = acquire_encode_context(ptr);
+
+  st->pub.init_destination    = stream_init_destination;
+  st->pub.empty_output_buffer = stream_empty_output_buffer;
+  st->pub.term_destination    = stream_term_destination;
+
+  if (open_encode_context(&st->cfg, st->ctx)) {
+    memcpy(msg, st->ctx->err_mgr.msg, sizeof(msg));
+
+    release_encode_context(ptr, st->ctx);
+    st->ctx = NULL;
+    free_encode_stream(st);
+
+    rb_raise(encerr_klass, "%s", msg);
+  }
+
+  st->opened  = !0;
+  ptr->stream = st;
+
+  /*
+   * write headers
+   */
+  step_encode_stream(ptr, st, ENCODE_START);
+
+  return self;
+}
+
+/**
+ * feed rows of raw image data
+ *
+ * @overload write_rows(raw)
+ *
+ *   @param raw [String]  raw image data of one or more whole rows, in
+ *     the pixel format given to the constructor.
+ *
+ *   @return [JPEG::Encoder] self
+ */
+static VALUE
+rb_encoder_write_rows(VALUE self, VALUE data)
+{
+  jpeg_encode_t* ptr;
+  encode_stream_t* st;
+  long line;
+  long nrow;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+  rb_check_frozen(self);
+
+  st   = get_encode_stream(ptr);
+  line = st->cfg.data_size / st->cfg.height;
+
+  if (RSTRING_LEN(data) % line != 0) {
+    ARGUMENT_ERROR("raw image data is not a multiple of the row size.");
+  }
+
+  nrow = RSTRING_LEN(data) / line;
+
+  if (nrow > (long)(st->cfg.height - st->rows)) {
+    ARGUMENT_ERROR("raw image data exceeds the image height.");
+  }
+
+  /*
+   * do encode
+   *
+   * GVLを解放している間にdataが変更されない様にロックしておく
+   */
+  if (nrow > 0) {
+    data     = rb_str_new_frozen(data);
+    st->data = (uint8_t*)RSTRING_PTR(data);
+    st->nrow = (int)nrow;
+
+    step_encode_stream(ptr, st, ENCODE_ROWS);
+
+    st->data  = NULL;
+    st->rows += (int)nrow;
+  }
+
+  RB_GC_GUARD(data);
+
+  return self;
+}
+
+/**
+ * finish incremental encoding
+ *
+ * @overload finish
+ *
+ *   @return [Integer] total number of bytes written to the output stream.
+ *
+ *   @raise [JPEG::EncodeError] if not all rows have been written.
+ */
+static VALUE
+rb_encoder_finish(VALUE self)
+{
+  VALUE ret;
+  jpeg_encode_t* ptr;
+  encode_stream_t* st;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  rb_check_frozen(self);
+
+  st  = get_encode_stream(ptr);
+
+  if (st->rows < st->cfg.height) {
+    rb_raise(encerr_klass, "image is not completed (%d of %d rows written).",
+             st->rows, st->cfg.height);
+  }
+
+  /*
+   * flush remaining data
+   */
+  step_encode_stream(ptr, st, ENCODE_FINISH);
+
+  ret = SIZET2NUM(st->written);
+  close_encode_stream(ptr, st);
+
+  return ret;
+}
+
+/**
+ * freeze the encoder
+ *
+ * @return [JPEG::Encoder] self
+ *
+ * @raise [RuntimeError] if incremental encoding is in progress.
+ *
+ * @note A frozen encoder can be shared between Ractors. While encoding
+ *   is started by #start, the encoder refers to the output stream, so
+ *   it can not be frozen until #finish is called.
+ */
+static VALUE
+rb_encoder_freeze(VALUE self)
+{
+  jpeg_encode_t* ptr;
+
+  TypedData_Get_Struct(self, jpeg_encode_t, &jpeg_encoder_data_type, ptr);
+
+  /* Ractor.make_shareable()で出力先のIOまでfreezeされない様に拒否する */
+  if (ptr->stream != NULL) {
+    RUNTIME_ERROR("encoding is in progress (call #finish first).");
+  }
+
+  return rb_call_super(0, NULL);
+}
+
+static void
+free_decode_context(decode_ctx_t* ctx)
+{
+  if (ctx->active) {
+    forget_memory_usage((j_common_ptr)&ctx->cinfo);
+    jpeg_destroy_decompress(&ctx->cinfo);
+  }
+
+  xfree(ctx);
+}
+
+static void mark_decode_stream(struct decode_stream* st);
+static void free_decode_stream(struct decode_stream* st);
+
+static void
+rb_decoder_mark(void* _ptr)
+{
+  jpeg_decode_t* ptr;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  if (ptr->stream != NULL) mark_decode_stream(ptr->stream);
+}
+
+static void
+rb_decoder_free(void* _ptr)
+{
+  jpeg_decode_t* ptr;
+  int i;
+
+  ptr = (jpeg_decode_t*)_ptr;
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] != NULL) free_decode_context(ptr->pool[i]);
+  }
+
+  if (ptr->stream != NULL) free_decode_stream(ptr->stream);
+
+  xfree(_ptr);
+}
+
+static size_t
+rb_decoder_size(const void* _ptr)
+{
+  const jpeg_decode_t* ptr;
+  size_t ret;
+  int i;
+
+  ptr = (const jpeg_decode_t*)_ptr;
+  ret = sizeof(jpeg_decode_t);
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] != NULL) ret += sizeof(decode_ctx_t);
+  }
+
+  return ret;
+}
+
+/*
+ * デコーダオブジェクトは設定値と作業領域のプールのみを保持し、伸長処理
+ * は呼び出し毎にプールから取り出した作業領域で行う。このためfreezeした
+ * オブジェクトはRactor間で共有でき、スレッド間でも排他なしで使用できる。
+ */
+static const rb_data_type_t jpeg_decoder_data_type = {
+  "JPEG::Decoder",
+  {rb_decoder_mark, rb_decoder_free, rb_decoder_size},
+  NULL,
+  NULL,
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void
+decode_output_message(j_common_ptr cinfo)
+{
+  ext_error_t* err;
+
+  err = (ext_error_t*)cinfo->err;
+
+  (*err->jerr.format_message)(cinfo, err->msg);
+}
+
+static void
+decode_emit_message(j_common_ptr cinfo, int msg_level)
+{
+  ext_error_t* err;
+
+  if (msg_level < 0) {
+    err = (ext_error_t*)cinfo->err;
+    (*err->jerr.format_message)(cinfo, err->msg);
+    /*
+     * 以前はemit_messageが呼ばれるとエラー扱いしていたが、
+     * Logicoolの一部のモデルなどで問題が出るので無視する
+     * ようにした。
+     * また本来であれば、警告表示を行うべきでもあるが一部
+     * のモデルで大量にemitされる場合があるので表示しない
+     * ようにしている。
+     * 問題が発生した際は、最後のメッセージをオブジェクト
+     * のインスタンスとして持たすべき。
+     */
+    // longjmp(err->jmpbuf, 1);
+  }
+}
+
+static void
+decode_error_exit(j_common_ptr cinfo)
+{
+  ext_error_t* err;
+
+  err = (ext_error_t*)cinfo->err;
+  (*err->jerr.format_message)(cinfo, err->msg);
+  longjmp(err->jmpbuf, 1);
+}
+
+static void
+create_decompress(struct jpeg_decompress_struct* cinfo, ext_error_t* err)
+{
+  /*
+   * jpeg_create_decompress()はerrフィールドを保存するので、エラー
+   * マネージャは生成前に設定しておく
+   */
+  cinfo->err                 = jpeg_std_error(&err->jerr);
+  err->jerr.output_message   = decode_output_message;
+  err->jerr.emit_message     = decode_emit_message;
+  err->jerr.error_exit       = decode_error_exit;
+
+  jpeg_create_decompress(cinfo);
+  install_arena((j_common_ptr)cinfo);
+}
+
+static decode_ctx_t*
+acquire_decode_context(jpeg_decode_t* ptr)
+{
+  decode_ctx_t* ret;
+  int i;
+
+  ret = NULL;
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    if (ptr->pool[i] == NULL) continue;
+
+    ret = __atomic_exchange_n(ptr->pool + i, NULL, __ATOMIC_ACQUIRE);
+    if (ret != NULL) break;
+  }
+
+  if (ret == NULL) {
+    ret         = ALLOC(decode_ctx_t);
+    ret->active = 0;
+  }
+
+  return ret;
+}
+
+static void
+release_decode_context(jpeg_decode_t* ptr, decode_ctx_t* ctx)
+{
+  decode_ctx_t* empty;
+  int i;
+
+  /*
+   * cinfoは破棄せずにリセットのみ行い、次回の呼び出しで再利用する。
+   * (libjpegのpermanentプールに確保された領域がそのまま使われ、image
+   * プールのチャンクもアリーナに保持される)
+   */
+  if (ctx->active) {
+    jpeg_abort_decompress(&ctx->cinfo);
+    update_memory_usage((j_common_ptr)&ctx->cinfo);
+  }
+
+  for (i = 0; i < CTX_POOL_SIZE; i++) {
+    empty = NULL;
+
+    if (__atomic_compare_exchange_n(ptr->pool + i, &empty, ctx, 0,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+
+  /* プールが一杯の場合は破棄する */
+  free_decode_context(ctx);
+}
+
+static int
+open_decode_context(decode_ctx_t* ctx)
+{
+  int ret;
+
+  if (ctx->active) return 0;
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    jpeg_destroy_decompress(&ctx->cinfo);
+    ctx->active = 0;
+    ret = !0;
+  } else {
+    ctx->active = !0;
+    create_decompress(&ctx->cinfo, &ctx->err_mgr);
+    ret = 0;
+  }
+
+  return ret;
+}
+
+static decode_ctx_t*
+take_decode_context(decode_ctx_set_t* set)
+{
+  /*
+   * 組から作業領域を一つ取り出す (GVL解放中のワーカから呼び出される)
+   */
+  return set->ctx[__atomic_fetch_add(&set->next, 1, __ATOMIC_RELAXED)];
+}
+
+typedef struct {
+  decode_ctx_set_t* set;
+  void* (*func)(void*);
+  void* arg;
+} decode_call_t;
+
+static VALUE
+decode_call_body(VALUE _call)
+{
+  decode_call_t* call;
+  decode_ctx_set_t* set;
+  int i;
+
+  call = (decode_call_t*)_call;
+  set  = call->set;
+
+  set->ctx = ALLOC_N(decode_ctx_t*, set->n);
+  memset(set->ctx, 0, sizeof(decode_ctx_t*) * set->n);
+
+  for (i = 0; i < set->n; i++) {
+    set->ctx[i] = acquire_decode_context(set->owner);
+  }
+
+  rb_thread_call_without_gvl(call->func, call->arg, NULL, NULL);
+
+  return Qnil;
+}
+
+static VALUE
+decode_call_ensure(VALUE _call)
+{
+  decode_ctx_set_t* set;
+  int i;
+
+  set = ((decode_call_t*)_call)->set;
+
+  if (set->ctx != NULL) {
+    for (i = 0; i < set->n; i++) {
+      if (set->ctx[i] != NULL) release_decode_context(set->owner, set->ctx[i]);
+    }
+
+    xfree(set->ctx);
+    set->ctx = NULL;
+  }
+
+  return Qnil;
+}
+
+static void
+call_without_gvl_with_decode_contexts(decode_ctx_set_t* set,
+                                      void* (*func)(void*), void* arg)
+{
+  /*
+   * set->n個の作業領域をプールから取り出してfuncをGVL解放状態で呼び
+   * 出す。作業領域は例外発生時も含めて必ずプールに返却する。
+   */
+
+  decode_call_t call;
+
+  call.set  = set;
+  call.func = func;
+  call.arg  = arg;
+
+  rb_ensure(decode_call_body, (VALUE)&call, decode_call_ensure, (VALUE)&call);
+}
+
+static VALUE
+rb_decoder_alloc(VALUE self)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+
+  ret = TypedData_Make_Struct(decoder_klass, jpeg_decode_t,
+                              &jpeg_decoder_data_type, ptr);
+
+  ptr->flags                    = DEFAULT_FLAGS;
+  ptr->format                   = FMT_RGB;
+
+  ptr->out_color_space          = JCS_RGB;
+
+  ptr->scale_num                = 1;
+  ptr->scale_denom              = 1;
+
+  ptr->out_color_components     = 3;
+  ptr->output_gamma             = 0.0;
+  ptr->buffered_image           = FALSE;
+  ptr->do_fancy_upsampling      = FALSE;
+  ptr->do_block_smoothing       = FALSE;
+  ptr->quantize_colors          = FALSE;
+  ptr->dither_mode              = JDITHER_NONE;
+  ptr->dct_method               = JDCT_FASTEST;
+  ptr->desired_number_of_colors = 0;
+  ptr->enable_1pass_quant       = FALSE;
+  ptr->enable_external_quant    = FALSE;
+  ptr->enable_2pass_quant       = FALSE;
+
+  return ret;
+}
+
+static void
+eval_decoder_opt_pixel_format(jpeg_decode_t* ptr, VALUE opt)
+{
+  int format;
+  int color_space;
+  int components;
+
+  if (opt != Qundef) {
+    if(EQ_STR(opt, "RGB") || EQ_STR(opt, "RGB24")) {
+      format      = FMT_RGB;
+      color_space = JCS_RGB;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YUV422") || EQ_STR(opt, "YUYV")) {
+      /* YCbCrで伸長してYUYVに詰める */
+      format      = FMT_YUV422;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "RGB565")) {
+      format      = FMT_RGB565;
+#ifdef USE_JCS_RGB565
+      color_space = JCS_RGB565;
+#else /* defined(USE_JCS_RGB565) */
+      color_space = JCS_RGB;
+#endif /* defined(USE_JCS_RGB565) */
+      components  = 3;
+
+    } else if (EQ_STR(opt, "GRAYSCALE")) {
+      format      = FMT_GRAYSCALE;
+      color_space = JCS_GRAYSCALE;
+      components  = 1;
+
+    } else if (EQ_STR(opt, "YUV444") || EQ_STR(opt, "YCbCr")) {
+      format      = FMT_YUV;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "BGR") || EQ_STR(opt, "BGR24")) {
+      format      = FMT_BGR;
+      color_space = JCS_EXT_BGR;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "YVU444") || EQ_STR(opt, "YCrCb")) {
+      format      = FMT_YVU;
+      color_space = JCS_YCbCr;
+      components  = 3;
+
+    } else if (EQ_STR(opt, "RGBX") || EQ_STR(opt, "RGB32")) {
+      format      = FMT_RGB32;
+      color_space = JCS_EXT_RGBX;
+      components  = 4;
+
+    } else if (EQ_STR(opt, "BGRX") || EQ_STR(opt, "BGR32")) {
+      format      = FMT_BGR32;
+      color_space = JCS_EXT_BGRX;
+      components  = 4;
+
+    } else {
+      ARGUMENT_ERROR("Unsupportd :pixel_format option value.");
+    }
+
+    ptr->format                = format;
+    ptr->out_color_space       = color_space;
+    ptr->out_color_components  = components;
+  }
+}
+
+static void
+eval_decoder_opt_output_gamma(jpeg_decode_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_FIXNUM:
+  case T_FLOAT:
+    ptr->output_gamma = NUM2DBL(opt);
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :output_gamma option value.");
+    break;
+  }
+}
+
+static void
+eval_decoder_opt_do_fancy_upsampling(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    ptr->do_fancy_upsampling = (RTEST(opt))? TRUE: FALSE;
+  }
+}
+
+static void
+eval_decoder_opt_do_smoothing(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    ptr->do_block_smoothing = (RTEST(opt))? TRUE: FALSE;
+  }
+}
+
+static void
+eval_decoder_opt_dither( jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE dmode;
+  VALUE pass2;
+  VALUE n_col;
+
+  if (opt != Qundef) {
+    if (TYPE(opt) != T_ARRAY) {
+      TYPE_ERROR("Unsupportd :dither option value.");
+    }
+
+    if (RARRAY_LEN(opt) != 3) {
+      ARGUMENT_ERROR(":dither is illeagal length (shall be 3 entries).");
+    }
+
+    dmode = RARRAY_AREF(opt, 0);
+    pass2 = RARRAY_AREF(opt, 1);
+    n_col = RARRAY_AREF(opt, 2);
+    
+    if (EQ_STR(dmode, "NONE")) {
+      ptr->dither_mode     = JDITHER_NONE;
+      ptr->quantize_colors = FALSE;
+
+    } else if(EQ_STR(dmode, "ORDERED")) {
+      ptr->dither_mode     = JDITHER_ORDERED;
+      ptr->quantize_colors = TRUE;
+
+    } else if(EQ_STR(dmode, "FS")) {
+      ptr->dither_mode     = JDITHER_FS;
+      ptr->quantize_colors = TRUE;
+
+    } else {
+      ARGUMENT_ERROR("dither mode is illeagal value.");
+    }
+
+    ptr->two_pass_quantize = (RTEST(pass2))? TRUE: FALSE;
+
+    if (TYPE(n_col) == T_FIXNUM) {
+      ptr->desired_number_of_colors = FIX2INT(n_col);
+
+      if (ptr->desired_number_of_colors < 8 ||
+          ptr->desired_number_of_colors > 256) {
+        RANGE_ERROR("number of dithered colors shall be from 8 to 256.");
+      } 
+
+    } else {
+      TYPE_ERROR("number of dithered colors is illeagal value.");
+    }
+
+    SET_FLAG(ptr, F_DITHER);
+  }
+}
+
+#if 0
+static void
+eval_decoder_opt_use_1pass_quantizer(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      ptr->enable_1pass_quant = TRUE;
+      ptr->buffered_image     = TRUE;
+    } else {
+      ptr->enable_1pass_quant = FALSE;
+    }
+  }
+}
+
+static void
+eval_decoder_opt_use_external_colormap(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      ptr->enable_external_quant = TRUE;
+      ptr->buffered_image        = TRUE;
+    } else {
+      ptr->enable_external_quant = FALSE;
+    }
+  }
+}
+
+static void
+eval_decoder_opt_use_2pass_quantizer(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      ptr->enable_2pass_quant = TRUE;
+      ptr->buffered_image     = TRUE;
+    } else {
+      ptr->enable_2pass_quant = FALSE;
+    }
+  }
+}
+#endif
+
+static void
+eval_decoder_opt_without_meta(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      CLR_FLAG(ptr, F_NEED_META);
+    } else {
+      SET_FLAG(ptr, F_NEED_META);
+    }
+  }
+}
+
+static void
+eval_decoder_opt_expand_colormap(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      SET_FLAG(ptr, F_EXPAND_COLORMAP);
+    } else {
+      CLR_FLAG(ptr, F_EXPAND_COLORMAP);
+    }
+  }
+}
+
+static void
+eval_decoder_opt_scale(jpeg_decode_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_FLOAT:
+    ptr->scale_num   = (int)(NUM2DBL(opt) * 1000.0);
+    ptr->scale_denom = 1000;
+    break;
+
+  case T_RATIONAL:
+    ptr->scale_num   = FIX2INT(rb_rational_num(opt));
+    ptr->scale_denom = FIX2INT(rb_rational_den(opt));
+    break;
+
+  case T_ARRAY:
+    if (RARRAY_LEN(opt) != 2) {
+      ARGUMENT_ERROR("invalid length");
+    }
+    ptr->scale_num   = FIX2INT(RARRAY_AREF(opt, 0));
+    ptr->scale_denom = FIX2INT(RARRAY_AREF(opt, 1));
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :exapnd_colormap option value.");
+    break;
+  }
+}
+
+static void
+eval_decoder_opt_dct_method(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (EQ_STR(opt, "ISLOW")) {
+      ptr->dct_method = JDCT_ISLOW;
+
+    } else if (EQ_STR(opt, "IFAST")) {
+      ptr->dct_method = JDCT_IFAST;
+
+    } else if (EQ_STR(opt, "FLOAT")) {
+      ptr->dct_method = JDCT_FLOAT;
+
+    } else if (EQ_STR(opt, "FASTEST")) {
+      ptr->dct_method = JDCT_FASTEST;
+
+    } else {
+      ARGUMENT_ERROR("Unsupportd :dct_method option value.");
+    }
+  }
+}
+
+static void
+eval_decoder_opt_with_exif_tags(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      SET_FLAG(ptr, F_PARSE_EXIF);
+    } else {
+      CLR_FLAG(ptr, F_PARSE_EXIF);
+    }
+  }
+}
+
+static void
+eval_decoder_opt_orientation(jpeg_decode_t* ptr, VALUE opt)
+{
+  if (opt != Qundef) {
+    if (RTEST(opt)) {
+      SET_FLAG(ptr, F_APPLY_ORIENTATION);
+    } else {
+      CLR_FLAG(ptr, F_APPLY_ORIENTATION);
+    }
+  }
+}
+
+static void
+eval_decoder_opt_threads(jpeg_decode_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_NIL:
+    ptr->threads = 0;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2INT(opt) < 1) {
+      RANGE_ERROR(":threads shall be 1 or more.");
+    }
+    ptr->threads = FIX2INT(opt);
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :threads option value.");
+    break;
+  }
+}
+
+static void
+eval_decoder_opt_max_scans(jpeg_decode_t* ptr, VALUE opt)
+{
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_NIL:
+    ptr->max_scans = 0;
+    break;
+
+  case T_FIXNUM:
+    if (FIX2INT(opt) < 1) {
+      RANGE_ERROR(":max_scans shall be 1 or more.");
+    }
+    ptr->max_scans = FIX2INT(opt);
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :max_scans option value.");
+    break;
+  }
+}
+
+static void
+eval_decoder_opt_crop(jpeg_decode_t* ptr, VALUE opt)
+{
+  int i;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_NIL:
+    CLR_FLAG(ptr, F_CROP);
+    break;
+
+  case T_ARRAY:
+    if (RARRAY_LEN(opt) != 4) {
+      ARGUMENT_ERROR(":crop is illeagal length (shall be 4 entries).");
+    }
+
+    for (i = 0; i < 4; i++) {
+      if (TYPE(RARRAY_AREF(opt, i)) != T_FIXNUM) {
+        TYPE_ERROR(":crop entries shall be integer.");
+      }
+    }
+
+    if (FIX2LONG(RARRAY_AREF(opt, 0)) < 0 ||
+        FIX2LONG(RARRAY_AREF(opt, 1)) < 0) {
+      RANGE_ERROR(":crop position shall be 0 or more.");
+    }
+
+    if (FIX2LONG(RARRAY_AREF(opt, 2)) < 1 ||
+        FIX2LONG(RARRAY_AREF(opt, 3)) < 1) {
+      RANGE_ERROR(":crop size shall be 1 or more.");
+    }
+
+    for (i = 0; i < 4; i++) {
+      ptr->crop[i] = NUM2INT(RARRAY_AREF(opt, i));
+    }
+
+    SET_FLAG(ptr, F_CROP);
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :crop option value.");
+    break;
+  }
+}
+
+static int
+eval_resample_filter(VALUE opt, const char* name)
+{
+  int ret;
+
+  switch (TYPE(opt)) {
+  case T_NIL:
+    ret = RESAMPLE_BILINEAR;
+    break;
+
+  case T_STRING:
+  case T_SYMBOL:
+    if (EQ_STR(opt, "BILINEAR") || EQ_STR(opt, "TRIANGLE")) {
+      ret = RESAMPLE_BILINEAR;
+
+    } else if (EQ_STR(opt, "BICUBIC")) {
+      ret = RESAMPLE_BICUBIC;
+
+    } else if (EQ_STR(opt, "LANCZOS") || EQ_STR(opt, "LANCZOS3")) {
+      ret = RESAMPLE_LANCZOS;
+
+    } else {
+      rb_raise(rb_eArgError, "Unsupportd %s filter.", name);
+    }
+    break;
+
+  default:
+    rb_raise(rb_eTypeError, "%s filter shall be String or Symbol.", name);
+    break;
+  }
+
+  return ret;
+}
+
+static void
+eval_decoder_opt_box(jpeg_decode_t* ptr, VALUE opt, int flag, const char* name)
+{
+  int i;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_NIL:
+    CLR_FLAG(ptr, flag);
+    break;
+
+  case T_ARRAY:
+    if (RARRAY_LEN(opt) != 2 && RARRAY_LEN(opt) != 3) {
+      rb_raise(rb_eArgError,
+               "%s is illeagal length (shall be 2 or 3 entries).", name);
+    }
+
+    for (i = 0; i < 2; i++) {
+      if (TYPE(RARRAY_AREF(opt, i)) != T_FIXNUM) {
+        rb_raise(rb_eTypeError, "%s entries shall be integer.", name);
+      }
+
+      if (FIX2LONG(RARRAY_AREF(opt, i)) < 1 ||
+          FIX2LONG(RARRAY_AREF(opt, i)) > 65500) {
+        rb_raise(rb_eRangeError, "%s size shall be from 1 to 65500.", name);
+      }
+    }
+
+    ptr->box[0] = FIX2INT(RARRAY_AREF(opt, 0));
+    ptr->box[1] = FIX2INT(RARRAY_AREF(opt, 1));
+    ptr->filter = (RARRAY_LEN(opt) == 3)?
+                    eval_resample_filter(RARRAY_AREF(opt, 2), name):
+                    RESAMPLE_BILINEAR;
+
+    /* :fit, :fill, :resizeは後から指定したものを使う */
+    CLR_FLAG(ptr, F_RESAMPLE);
+    SET_FLAG(ptr, flag);
+    break;
+
+  default:
+    rb_raise(rb_eTypeError, "Unsupportd %s option value.", name);
+    break;
+  }
+}
+
+static void
+eval_decoder_opt_prefer_thumbnail(jpeg_decode_t* ptr, VALUE opt)
+{
+  int i;
+
+  switch (TYPE(opt)) {
+  case T_UNDEF:
+    // Nothing
+    break;
+
+  case T_NIL:
+  case T_FALSE:
+    CLR_FLAG(ptr, F_PREFER_THUMB);
+    break;
+
+  case T_FIXNUM:
+    if (FIX2LONG(opt) < 1 || FIX2LONG(opt) > 65500) {
+      RANGE_ERROR(":prefer_thumbnail size shall be from 1 to 65500.");
+    }
+
+    ptr->thumb[0] = FIX2INT(opt);
+    ptr->thumb[1] = FIX2INT(opt);
+
+    SET_FLAG(ptr, F_PREFER_THUMB);
+    break;
+
+  case T_ARRAY:
+    if (RARRAY_LEN(opt) != 2) {
+      ARGUMENT_ERROR(":prefer_thumbnail is illeagal length "
+                     "(shall be 2 entries).");
+    }
+
+    for (i = 0; i < 2; i++) {
+      if (TYPE(RARRAY_AREF(opt, i)) != T_FIXNUM) {
+        TYPE_ERROR(":prefer_thumbnail entries shall be integer.");
+      }
+
+      if (FIX2LONG(RARRAY_AREF(opt, i)) < 1 ||
+          FIX2LONG(RARRAY_AREF(opt, i)) > 65500) {
+        RANGE_ERROR(":prefer_thumbnail size shall be from 1 to 65500.");
+      }
+    }
+
+    ptr->thumb[0] = FIX2INT(RARRAY_AREF(opt, 0));
+    ptr->thumb[1] = FIX2INT(RARRAY_AREF(opt, 1));
+
+    SET_FLAG(ptr, F_PREFER_THUMB);
+    break;
+
+  default:
+    TYPE_ERROR("Unsupportd :prefer_thumbnail option value.");
+    break;
+  }
+}
+
+static void
+set_decoder_context( jpeg_decode_t* ptr, VALUE opt)
+{
+  VALUE opts[N(decoder_opts_ids)];
+
+  /*
+   * parse options
+   */
+  rb_get_kwargs(opt, decoder_opts_ids, 0, N(decoder_opts_ids), opts);
+
+  /*
+   * set context
+   */
+  eval_decoder_opt_pixel_format(ptr, opts[0]);
+  eval_decoder_opt_output_gamma(ptr, opts[1]);
+  eval_decoder_opt_do_fancy_upsampling(ptr, opts[2]);
+  eval_decoder_opt_do_smoothing(ptr, opts[3]);
+  eval_decoder_opt_dither(ptr, opts[4]);
+#if 0
+  eval_decoder_opt_use_1pass_quantizer(ptr, opts[5]);
+  eval_decoder_opt_use_external_colormap(ptr, opts[6]);
+  eval_decoder_opt_use_2pass_quantizer(ptr, opts[7]);
+#endif
+  eval_decoder_opt_without_meta(ptr, opts[5]);
+  eval_decoder_opt_expand_colormap(ptr, opts[6]);
+  eval_decoder_opt_scale(ptr, opts[7]);
+  eval_decoder_opt_dct_method(ptr, opts[8]);
+  eval_decoder_opt_with_exif_tags(ptr, opts[9]);
+  eval_decoder_opt_with_exif_tags(ptr, opts[10]);
+  eval_decoder_opt_orientation(ptr, opts[11]);
+  eval_decoder_opt_threads(ptr, opts[12]);
+  eval_decoder_opt_max_scans(ptr, opts[13]);
+  eval_decoder_opt_crop(ptr, opts[14]);
+  eval_decoder_opt_box(ptr, opts[15], F_FIT, ":fit");
+  eval_decoder_opt_box(ptr, opts[16], F_FILL, ":fill");
+  eval_decoder_opt_prefer_thumbnail(ptr, opts[17]);
+  eval_decoder_opt_box(ptr, opts[18], F_RESIZE, ":resize");
+}
+
+/**
+ * initialize decoder object
+ *
+ * @overload initialize(opts)
+ *
+ *   @param opts [Hash] options to initialize object
+ *
+ *   @option opts [Symbol] :pixel_format
+ *     specifies the format of the output image. possible values are:
+ *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
+ *     RGBX RGB32 BGRX BGR32 GRAYSCALE
+ *     YUV422 (YUYV) and RGB565 (little endian) are 2 bytes per pixel.
+ *     a row of YUYV is rounded up to an even number of pixels. these
+ *     formats can not be used with :dither.
+ *
+ *   @option opts [Float] :output_gamma
+ *
+ *   @option opts [Boolean] :fancy_upsampling
+ *
+ *   @option opts [Boolean] :do_smoothing
+ *
+ *   @option opts [Array] :dither
+ *     specifies dithering parameters. A 3-elements array.
+ *     specify the dither type as a string for the 1st element,
+ *     whether to use 2-pass quantize for the 2nd element as a boolean,
+ *     and the number of colors used for the 3rd element as an integer
+ *     from 16 to 256.
+ *
+ *   @option opts [Boolean] :without_meta
+ *     specifies whether or not to include meta information in the
+ *     output data. If true, no meta-information is output.
+ *
+ *   @option opts [Boolean] :expand_colormap
+ *     specifies whether to expand the color map. If dither is specified,
+ *     the output will be a color number of 1 byte per pixel, but if this
+ *     option is set to true, the output will be expanded to color information.
+ *
+ *   @option opts [Ratioanl] :scale
+ *
+ *   @option opts [Symbol] :dct_method
+ *     specifies how decoding is handled. possible values are:
+ *     FASTEST ISLOW IFAST FLOAT
+ *
+ *   @option opts [Boolean] :with_exif_tags
+ *     specifies whether to include Exif tag information in the output data.
+ *     set this option to true to parse the Exif tag information and include
+ *     it in the meta information output.
+ *
+ *   @option opts [Boolean] :with_exif
+ *     alias to :with_exif_tags option.
+ *
+ *   @option opts [Integer] :threads
+ *     specifies the number of threads used to decode one image. a
+ *     sequential JPEG that has restart markers aligned to MCU rows is
+ *     split into bands which are decoded in parallel. if nil (default),
+ *     all processors are used for large images (2M pixels or more).
+ *     other images are decoded serially.
+ *
+ *   @option opts [Integer] :max_scans
+ *     for a progressive JPEG, stops reading the input after the given
+ *     number of scans and outputs the image refined so far (combine with
+ *     :scale for a quick low quality preview). sequential JPEGs are not
+ *     affected. nil (default) reads all scans. ignored by #feed,
+ *     #decode_io and #each_band.
+ *
+ *   @option opts [Array<Integer>] :crop
+ *     specifies the region to decode as [x, y, width, height] on the
+ *     decoded (scaled) image, before :orientation is applied. only the
+ *     MCU columns and rows that cover the region are decoded. nil
+ *     (default) decodes the whole image. #decode, #decode_into and
+ *     #decode_batch support this option.
+ *
+ *   @option opts [Array<Integer>] :fit
+ *     specifies a box as [width, height]. the image is scaled, keeping
+ *     the aspect ratio, to the largest size that fits in the box (after
+ *     :orientation is applied). the smallest DCT scaling that covers the
+ *     size is used and the result is resampled to the exact size.
+ *     :scale is ignored. same methods as :crop support this option.
+ *
+ *   @option opts [Array<Integer>] :fill
+ *     like :fit, but the image is scaled to cover the box and the center
+ *     part is trimmed, so the output is exactly [width, height].
+ *
+ *   @option opts [Array] :resize
+ *     like :fit, but the image is scaled to exactly [width, height]
+ *     without keeping the aspect ratio.
+ *
+ *     :fit, :fill and :resize take an optional 3rd entry to choose the
+ *     resampling filter: BILINEAR (default), BICUBIC or LANCZOS (3-lobed).
+ *     the resampling is done while the rows are decoded, so the whole
+ *     DCT scaled image is never held in memory.
+ *
+ *   @option opts [Integer, Array<Integer>] :prefer_thumbnail
+ *     specifies the minimum size as [width, height] (an integer means
+ *     the same value for both). if the Exif data has a thumbnail of this
+ *     size or larger (after :orientation is applied), the thumbnail is
+ *     decoded instead of the main image. the orientation and the Exif
+ *     tags of the main image are used for the thumbnail, and the other
+ *     options are applied to the thumbnail. #decode, #decode_into and
+ *     #decode_batch support this option (other methods ignore it).
+ */
+static VALUE
+rb_decoder_initialize( int argc, VALUE *argv, VALUE self)
+{
+  jpeg_decode_t* ptr;
+  VALUE opt;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * parse arguments
+   */
+  rb_scan_args( argc, argv, "01", &opt);
+
+  if (opt != Qnil) Check_Type(opt, T_HASH);
+
+  /*
+   * set context
+   */ 
+  set_decoder_context(ptr, opt);
+
+  return Qtrue;
+}
+
+static VALUE
+rb_decoder_set(VALUE self, VALUE opt)
+{
+  jpeg_decode_t* ptr;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * check argument
+   */
+  Check_Type(opt, T_HASH);
+  rb_check_frozen(self);
+
+  /*
+   * set context
+   */ 
+  set_decoder_context(ptr, opt);
+
+  return Qtrue;
+}
+
+static VALUE
+get_colorspace_str( J_COLOR_SPACE cs)
+{
+  const char* cstr;
+
+  switch (cs) {
+  case JCS_GRAYSCALE:
+    cstr = "GRAYSCALE";
+    break;
+
+  case JCS_RGB:
+    cstr = "RGB";
+    break;
+
+  case JCS_YCbCr:
+    cstr = "YCbCr";
+    break;
+
+  case JCS_CMYK:
+    cstr = "CMYK";
+    break;
+
+  case JCS_YCCK:
+    cstr = "YCCK";
+    break;
+#if JPEG_LIB_VERSION < 90
+  case JCS_EXT_RGB:
+    cstr = "RGB";
+    break;
+
+  case JCS_EXT_RGBX:
+    cstr = "RGBX";
+    break;
+
+  case JCS_EXT_BGR:
+    cstr = "BGR";
+    break;
+
+  case JCS_EXT_BGRX:
+    cstr = "BGRX";
+    break;
+
+  case JCS_EXT_XBGR:
+    cstr = "XBGR";
+    break;
+
+  case JCS_EXT_XRGB:
+    cstr = "XRGB";
+    break;
+
+  case JCS_EXT_RGBA:
+    cstr = "RGBA";
+    break;
+
+  case JCS_EXT_BGRA:
+    cstr = "BGRA";
+    break;
+
+  case JCS_EXT_ABGR:
+    cstr = "ABGR";
+    break;
+
+  case JCS_EXT_ARGB:
+    cstr = "ARGB";
+    break;
+#endif /* JPEG_LIB_VERSION < 90 */
+
+  default:
+    cstr = "UNKNOWN";
+    break;
+  }
+
+  return rb_str_new_cstr(cstr);
+}
+
+typedef struct {
+  int be;
+  uint8_t* head;
+  uint8_t* cur;
+  size_t size;
+
+  struct {
+    tag_entry_t* tbl;
+    size_t n;
+  } tags;
+
+  int next;
+} exif_t;
+
+static uint16_t
+get_u16(uint8_t* src, int be)
+{
+  uint16_t ret;
+
+  if (be) {
+    ret = (((src[0] << 8) & 0xff00)|
+           ((src[1] << 0) & 0x00ff));
+  } else {
+    ret = (((src[1] << 8) & 0xff00)|
+           ((src[0] << 0) & 0x00ff));
+  }
+
+  return ret;
+}
+
+/*
+static int16_t
+get_s16(uint8_t* src, int be)
+{
+  int16_t ret;
+
+  if (be) {
+    ret = (((src[0] << 8) & 0xff00)|
+           ((src[1] << 0) & 0x00ff));
+  } else {
+    ret = (((src[1] << 8) & 0xff00)|
+           ((src[0] << 0) & 0x00ff));
+  }
+
+  return ret;
+}
+*/
+
+static uint32_t
+get_u32(uint8_t* src, int be)
+{
+  uint32_t ret;
+
+  if (be) {
+    ret = (((src[0] << 24) & 0xff000000)|
+           ((src[1] << 16) & 0x00ff0000)|
+           ((src[2] <<  8) & 0x0000ff00)|
+           ((src[3] <<  0) & 0x000000ff));
+  } else {
+    ret = (((src[3] << 24) & 0xff000000)|
+           ((src[2] << 16) & 0x00ff0000)|
+           ((src[1] <<  8) & 0x0000ff00)|
+           ((src[0] <<  0) & 0x000000ff));
+  }
+
+  return ret;
+}
+
+static int32_t
+get_s32(uint8_t* src, int be)
+{
+  int32_t ret;
+
+  if (be) {
+    ret = (((src[0] << 24) & 0xff000000)|
+           ((src[1] << 16) & 0x00ff0000)|
+           ((src[2] <<  8) & 0x0000ff00)|
+           ((src[3] <<  0) & 0x000000ff));
+  } else {
+    ret = (((src[3] << 24) & 0xff000000)|
+           ((src[2] << 16) & 0x00ff0000)|
+           ((src[1] <<  8) & 0x0000ff00)|
+           ((src[0] <<  0) & 0x000000ff));
+  }
+
+  return ret;
+}
+
+static void
+exif_increase(exif_t* ptr, size_t size)
+{
+  ptr->cur  += size;
+  ptr->size -= size;
+}
+
+static void
+exif_init(exif_t* ptr, uint8_t* src, size_t size)
+{
+  int be;
+  uint16_t ident;
+  uint32_t off;
+
+  /*
+   * Check Exif identifier
+   */
+  if (memcmp(src, "Exif\0\0", 6)) {
+    rb_raise(decerr_klass, "invalid exif identifier");
+  }
+
+  /*
+   * Check TIFF header and judge endian
+   */
+  do {
+    if (!memcmp(src + 6, "MM", 2)) {
+      be = !0;
+      break;
+    }
+
+    if (!memcmp(src + 6, "II", 2)) {
+      be = 0;
+      break;
+    }
+
+    rb_raise(decerr_klass, "invalid tiff header");
+  } while (0);
+
+  /*
+   * Check TIFF identifier
+   */
+  ident = get_u16(src + 8, be);
+  if (ident != 0x002a) {
+    rb_raise(decerr_klass, "invalid tiff identifier");
+  }
+
+  /*
+   * get offset for 0th IFD
+   */
+  off = get_u32(src + 10, be);
+  if (off < 8 || off >= size - 6) {
+    rb_raise(decerr_klass, "invalid offset dentifier");
+  }
+
+  /*
+   * initialize Exif context
+   */
+  ptr->be       = be;
+  ptr->head     = src + 6;
+  ptr->cur      = ptr->head + off;
+  ptr->size     = size - (6 + off);
+  ptr->tags.tbl = tag_tiff;
+  ptr->tags.n   = N(tag_tiff);
+  ptr->next     = 0;
+}
+
+static void
+exif_fetch_tag_header(exif_t* ptr, uint16_t* tag, uint16_t* type)
+{
+  *tag  = get_u16(ptr->cur + 0, ptr->be);
+  *type = get_u16(ptr->cur + 2, ptr->be);
+}
+
+
+static void
+exif_fetch_byte_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(*p);
+    break;
+
+  default:
+    p = ptr->head + get_u32(p, ptr->be);
+
+  case 2:
+  case 3:
+  case 4:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(p[i]));
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_ascii_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  if (n > 4) {
+    p = ptr->head + get_u32(p, ptr->be);
+  }
+
+  obj = rb_utf8_str_new((char*)p, n);
+  rb_funcall(obj, id_strip_bang, 0);
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_short_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_u16(p, ptr->be));
+    break;
+
+  default:
+    p = ptr->head + get_u32(p, ptr->be);
+
+  case 2:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_u16(p, ptr->be)));
+      p += 2;
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_long_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_u32(p, ptr->be));
+    break;
+
+  default:
+    p   = ptr->head + get_u32(p, ptr->be);
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_u32(p, ptr->be)));
+      p += 4;
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_rational_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+  uint32_t deno;
+  uint32_t num;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    num  = get_u32(p + 0, ptr->be);
+    deno = get_u32(p + 4, ptr->be);
+    if (num == 0 && deno == 0) {
+      deno = 1;
+    }
+    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+    break;
+
+  default:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      num  = get_u32(p + 0, ptr->be);
+      deno = get_u32(p + 4, ptr->be);
+      if (num == 0 && deno == 0) {
+        deno = 1;
+      }
+      rb_ary_push(obj, rb_rational_new(INT2FIX(num), INT2FIX(deno)));
+      p += 8;
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_undefined_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  if (n > 4) {
+    p = ptr->head + get_u32(p, ptr->be);
+  }
+
+  obj = rb_enc_str_new((char*)p, n, rb_ascii8bit_encoding());
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_slong_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->cur + 8;
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    obj = INT2FIX(get_s32(p, ptr->be));
+    break;
+
+  default:
+    p   = ptr->head + get_u32(p, ptr->be);
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      rb_ary_push(obj, INT2FIX(get_s32(p, ptr->be)));
+      p += 4;
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_srational_data(exif_t* ptr, VALUE* dst)
+{
+  VALUE obj;
+
+  int i;
+  uint32_t n;
+  uint8_t* p;
+  uint32_t deno;
+  uint32_t num;
+
+  n = get_u32(ptr->cur + 4, ptr->be);
+  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+
+  switch (n) {
+  case 0:
+    obj = Qnil;
+    break;
+
+  case 1:
+    num  = get_s32(p + 0, ptr->be);
+    deno = get_s32(p + 4, ptr->be);
+    if (num == 0 && deno == 0) {
+      deno = 1;
+    }
+    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
+    break;
+
+  default:
+    obj = rb_ary_new_capa(n);
+    for (i = 0; i < (int)n; i++) {
+      num  = get_s32(p + 0, ptr->be);
+      deno = get_s32(p + 4, ptr->be);
+      if (num == 0 && deno == 0) {
+        deno = 1;
+      }
+      rb_ary_push(obj, rb_rational_new(INT2FIX(num), INT2FIX(deno)));
+      p += 8;
+    }
+    break;
+  }
+
+  *dst = obj;
+}
+
+static void
+exif_fetch_child_ifd(exif_t* ptr, tag_entry_t* tbl, size_t n, exif_t* dst)
+{
+  uint32_t off;
+
+  off = get_u32(ptr->cur + 8, ptr->be); 
+
+  dst->be       = ptr->be;
+  dst->head     = ptr->head;
+  dst->cur      = ptr->head + off;
+  dst->size     = ptr->size - off;
+  dst->tags.tbl = tbl;
+  dst->tags.n   = n;
+  dst->next     = 0;
+}
+
+static int
+exif_read(exif_t* ptr, VALUE dst)
+{
+  int ret;
+  int i;
+  uint16_t ntag;
+  uint16_t tag;
+  uint16_t type;
+  uint32_t off;
+
+  exif_t child;
+
+  VALUE key;
+  VALUE val;
+
+  ntag = get_u16(ptr->cur, ptr->be);
+  exif_increase(ptr, 2);
+
+  for (i = 0; i < ntag; i++) {
+    exif_fetch_tag_header(ptr, &tag, &type);
+
+    switch (tag) {
+    case 34665: // ExifIFDPointer
+      key = ID2SYM(id_exif);
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_exif, N(tag_exif), &child);
+      exif_read(&child, val);
+      break;
+
+    case 34853: // GPSInfoIFDPointer
+      key = ID2SYM(id_gps);
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_gps, N(tag_gps), &child);
+      exif_read(&child, val);
+      break;
+
+    case 40965: // InteroperabilityIFDPointer
+      key = ID2SYM(id_i14y);
+      val = rb_hash_new();
+
+      exif_fetch_child_ifd(ptr, tag_i14y, N(tag_i14y), &child);
+      exif_read(&child, val);
+      break;
+
+    default:
+      key = lookup_tag_symbol(ptr->tags.tbl, ptr->tags.n, tag);
+
+      switch (type) {
+      case 1:  // when BYTE
+        exif_fetch_byte_data(ptr, &val);
+        break;
+
+      case 2:  // when ASCII
+        exif_fetch_ascii_data(ptr, &val);
+        break;
+
+      case 3:  // when SHORT
+        exif_fetch_short_data(ptr, &val);
+        break;
+
+      case 4:  // when LONG
+        exif_fetch_long_data(ptr, &val);
+        break;
+
+      case 5:  // when RATIONAL
+        exif_fetch_rational_data(ptr, &val);
+        break;
+
+      case 7:  // when UNDEFINED
+        exif_fetch_undefined_data(ptr, &val);
+        break;
+
+      case 9:  // when SLONG
+        exif_fetch_slong_data(ptr, &val);
+        break;
+
+      case 10: // when SRATIONAL
+        exif_fetch_srational_data(ptr, &val);
+        break;
+
+      default:
+        rb_raise(decerr_klass, "invalid tag data type");
+      }
+    }
+
+    rb_hash_aset(dst, key, val);
+    exif_increase(ptr, 12);
+  }
+
+  off = get_u32(ptr->cur, ptr->be);
+  if (off != 0) {
+    ptr->cur  = ptr->head + off;
+    ptr->next = !0;
+  }
+
+  return ret;
+}
+
+#define THUMBNAIL_OFFSET    ID2SYM(id_thumb_offset)
+#define THUMBNAIL_SIZE      ID2SYM(id_thumb_size)
+
+static VALUE
+create_exif_tags_hash(struct jpeg_decompress_struct* cinfo)
+{
+  VALUE ret;
+  jpeg_saved_marker_ptr marker;
+  exif_t exif;
+
+  ret = rb_hash_new();
+
+  for (marker = cinfo->marker_list;
+            marker != NULL; marker = marker->next) {
+
+    if (marker->data_length < 14) continue;
+    if (memcmp(marker->data, "Exif\0\0", 6)) continue;
+
+    /* 0th IFD */
+    exif_init(&exif, marker->data, marker->data_length);
+    exif_read(&exif, ret);
+
+    if (exif.next) {
+      /* when 1th IFD (tumbnail) exist */
+      VALUE info;
+      VALUE off;
+      VALUE size;
+      VALUE data;
+
+      info = rb_hash_new();
+
+      exif_read(&exif, info);
+
+      off  = rb_hash_lookup(info, THUMBNAIL_OFFSET);
+      size = rb_hash_lookup(info, THUMBNAIL_SIZE);
+
+      if (TYPE(off) == T_FIXNUM && TYPE(size) == T_FIXNUM) {
+        data = rb_enc_str_new((char*)exif.head + FIX2INT(off),
+                              FIX2INT(size), rb_ascii8bit_encoding());
+
+        rb_hash_lookup(info, THUMBNAIL_OFFSET);
+        rb_hash_lookup(info, THUMBNAIL_SIZE);
+        rb_hash_aset(info, ID2SYM(id_thumb_data), data);
+        rb_hash_aset(ret, ID2SYM(id_thumbnail), info);
+      }
+    }
+    break;
+  }
+
+  return ret;
+}
+
+static int
+pick_exif_orientation(struct jpeg_decompress_struct* cinfo)
+{
+  jpeg_saved_marker_ptr marker;
+  int o9n;
+  uint8_t* p;
+  int be;
+  uint32_t off;
+  int i;
+  int n;
+
+  o9n = 0;
+
+  for (marker = cinfo->marker_list;
+            marker != NULL; marker = marker->next) {
+
+    if (marker->data_length < 14) continue;
+
+    p = marker->data;
+
+    /*
+     * check Exif identifier
+     */
+    if (memcmp(p, "Exif\0\0", 6)) continue;
+
+    /*
+     * check endian marker
+     */
+    if (!memcmp(p + 6, "MM", 2)) {
+      be = !0;
+
+    } else if (!memcmp(p + 6, "II", 2)) {
+      be = 0;
+
+    } else {
+      continue;
+    }
+
+    /*
+     * check TIFF identifier
+     */
+    if (get_u16(p + 8, be) != 0x002a) continue;
+
+    /*
+     * set 0th IFD address
+     */
+    off = get_u32(p + 10, be);
+    if (off < 8 || off >= marker->data_length - 6) continue;
+
+    p += (6 + off);
+
+    /* ここまでくればAPP1がExifタグなので
+     * 0th IFDをなめてOrientationタグを探す */
+
+    n = get_u16(p, be);
+    p += 2;
+
+    for (i = 0; i < n; i++) {
+      int tag;
+      int type;
+      int num;
+
+      tag  = get_u16(p + 0, be);
+      type = get_u16(p + 2, be);
+      num  = get_u32(p + 4, be);
+
+      if (tag == 0x0112) {
+        if (type == 3 && num == 1) {
+          o9n = get_u16(p + 8, be);
+          goto loop_out;
+
+        } else {
+          fprintf(stderr,
+                  "Illeagal orientation tag found [type:%d, num:%d]\n",
+                  type,
+                  num);
+        }
+      }
+
+      p += 12;
+    }
+  }
+  loop_out:
+
+  return (o9n >= 1 && o9n <= 8)? (o9n - 1): 0;
+}
+
+static int
+pick_exif_thumbnail(struct jpeg_decompress_struct* cinfo,
+                    uint8_t** thumb, size_t* size)
+{
+  jpeg_saved_marker_ptr marker;
+  uint8_t* head;
+  uint8_t* p;
+  size_t len;
+  uint32_t off;
+  uint32_t pos;
+  uint32_t sz;
+  int be;
+  int i;
+  int n;
+
+  for (marker = cinfo->marker_list;
+            marker != NULL; marker = marker->next) {
+
+    if (marker->data_length < 14) continue;
+
+    /*
+     * check Exif identifier and endian marker
+     */
+    if (memcmp(marker->data, "Exif\0\0", 6)) continue;
+
+    head = marker->data + 6;
+    len  = marker->data_length - 6;
+
+    if (!memcmp(head, "MM", 2)) {
+      be = !0;
+
+    } else if (!memcmp(head, "II", 2)) {
+      be = 0;
+
+    } else {
+      continue;
+    }
+
+    if (get_u16(head + 2, be) != 0x002a) continue;
+
+    /*
+     * 0th IFDを読み飛ばして1st IFD (サムネイル) の位置を得る
+     */
+    off = get_u32(head + 4, be);
+    if (off < 8 || off > len - 2) continue;
+
+    n = get_u16(head + off, be);
+    if ((size_t)off + 2 + (n * 12) + 4 > len) continue;
+
+    off = get_u32(head + off + 2 + (n * 12), be);
+    if (off < 8 || off > len - 2) continue;
+
+    n = get_u16(head + off, be);
+    if ((size_t)off + 2 + (n * 12) > len) continue;
+
+    /*
+     * JPEGInterchangeFormat / JPEGInterchangeFormatLengthを探す
+     */
+    p   = head + off + 2;
+    pos = 0;
+    sz  = 0;
+
+    for (i = 0; i < n; i++) {
+      if (get_u16(p + 2, be) == 4 && get_u32(p + 4, be) == 1) {
+        switch (get_u16(p + 0, be)) {
+        case 0x0201:
+          pos = get_u32(p + 8, be);
+          break;
+
+        case 0x0202:
+          sz  = get_u32(p + 8, be);
+          break;
+        }
+      }
+
+      p += 12;
+    }
+
+    if (pos < 8 || sz == 0 || pos > len || sz > len - pos) continue;
+
+    *thumb = head + pos;
+    *size  = sz;
+
+    return !0;
+  }
+
+  return 0;
+}
+
+static VALUE
+create_colormap(JSAMPARRAY map, int ncolors, int ncompo)
+{
+  VALUE ret;
+  int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
+  uint32_t c;
+
+  ret = rb_ary_new_capa(ncolors);
+
+  switch (ncompo) {
+  case 1:
+    for (i = 0; i < ncolors; i++) {
+      c = map[0][i];
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  case 2:
+    for (i = 0; i < ncolors; i++) {
+      c = (map[0][i] << 8) | (map[1][i] << 0);
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  case 3:
+    for (i = 0; i < ncolors; i++) {
+      c = (map[0][i] << 16) | (map[1][i] << 8) | (map[2][i] << 0);
+
+      rb_ary_push(ret, INT2FIX(c));
+    }
+    break;
+
+  default:
+    RUNTIME_ERROR("this number of components is not implemented yet");
+  }
+
+  return ret;
+}
+
+static VALUE
+rb_meta_exif_tags(VALUE self)
+{
+  return rb_ivar_get(self, id_exif_tags);
+}
+
+static size_t
+row_size(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo, int wd)
+{
+  /*
+   * 出力画像の一行のバイト数。YUYVは2画素単位なので幅を偶数に切り上げる
+   * (奇数幅の場合、右端の画素は複製して組にする)
+   */
+
+  size_t ret;
+
+  switch (ptr->format) {
+  case FMT_YUV422:
+    ret = (size_t)((wd + 1) / 2) * 4;
+    break;
+
+  case FMT_RGB565:
+    ret = (size_t)wd * 2;
+    break;
+
+  default:
+    ret = (size_t)wd * cinfo->output_components;
+    break;
+  }
+
+  return ret;
+}
+
+static VALUE
+create_meta(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo, int o9n)
+{
+  VALUE ret;
+  int width;
+  int height;
+  int stride;
+
+  ret    = rb_obj_alloc(meta_klass);
+
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (o9n & 4)) {
+    width  = cinfo->output_height;
+    height = cinfo->output_width;
+  } else {
+    width  = cinfo->output_width;
+    height = cinfo->output_height;
+  }
+
+  stride = row_size(ptr, cinfo, width);
+
+  rb_ivar_set(ret, id_width, INT2FIX(width));
+  rb_ivar_set(ret, id_stride, INT2FIX(stride));
+  rb_ivar_set(ret, id_height, INT2FIX(height));
+
+  rb_ivar_set(ret, id_orig_cs, get_colorspace_str(cinfo->jpeg_color_space));
+
+  if (ptr->format == FMT_YVU) {
+    rb_ivar_set(ret, id_out_cs, rb_str_new_cstr("YCrCb"));
+  } else if (ptr->format == FMT_YUV422) {
+    rb_ivar_set(ret, id_out_cs, rb_str_new_cstr("YUV422"));
+  } else if (ptr->format == FMT_RGB565) {
+    rb_ivar_set(ret, id_out_cs, rb_str_new_cstr("RGB565"));
+  } else {
+    rb_ivar_set(ret, id_out_cs, get_colorspace_str(cinfo->out_color_space));
+  }
+
+  if (TEST_FLAG_ALL(ptr, F_DITHER | F_EXPAND_COLORMAP)) {
+    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->out_color_components));
+  } else {
+    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->output_components));
+  }
+
+  if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
+    rb_ivar_set(ret, id_exif_tags, create_exif_tags_hash(cinfo));
+    rb_define_singleton_method(ret, "exif_tags", rb_meta_exif_tags, 0);
+    rb_define_singleton_method(ret, "exif", rb_meta_exif_tags, 0);
+  } 
+
+  if (TEST_FLAG(ptr, F_DITHER)) {
+    /*
+     * ヘッダのみ読んだ場合はカラーマップが未作成 (プールから取り出した
+     * cinfoのactual_number_of_colorsには前回の値が残っている)
+     */
+    rb_ivar_set(ret, id_colormap,
+                create_colormap(cinfo->colormap,
+                                (cinfo->colormap != NULL)?
+                                          cinfo->actual_number_of_colors: 0,
+                                cinfo->out_color_components));
+  }
+  
+  return ret;
+}
+
+static VALUE
+do_read_header(jpeg_decode_t* ptr, decode_ctx_t* ctx,
+               uint8_t* jpg, size_t jpg_sz)
+{
+  VALUE ret;
+  struct jpeg_decompress_struct* cinfo;
+  int o9n;
+
+  if (open_decode_context(ctx)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
+
+  cinfo = &ctx->cinfo;
+
+  cinfo->raw_data_out = FALSE;
+  cinfo->dct_method   = JDCT_FLOAT;
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  } else {
+    jpeg_mem_src(cinfo, jpg, jpg_sz);
+
+    /* 再利用するcinfoには前回の設定が残っているので毎回設定する */
+    jpeg_save_markers(cinfo, JPEG_APP1,
+                      TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)?
+                                                                0xFFFF: 0);
+
+    jpeg_read_header(cinfo, TRUE);
+    jpeg_calc_output_dimensions(cinfo);
+
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+      o9n = pick_exif_orientation(cinfo);
+    } else {
+      o9n = 0;
+    }
+
+    ret = create_meta(ptr, cinfo, o9n);
+  }
+
+  return ret;
+}
+
+typedef struct {
+  jpeg_decode_t* ptr;         // decoder object (owner of the pool)
+  jpeg_decode_t cfg;          // snapshot of the settings
+  decode_ctx_t* ctx;
+  VALUE data;
+  void* opt;                  // additional argument for func (or NULL)
+} decode_arg_t;
+
+static VALUE
+decode_ensure(VALUE _arg)
+{
+  decode_arg_t* arg;
+
+  arg = (decode_arg_t*)_arg;
+  release_decode_context(arg->ptr, arg->ctx);
+
+  return Qnil;
+}
+
+static VALUE
+read_header_protect(VALUE _arg)
+{
+  decode_arg_t* arg;
+
+  arg = (decode_arg_t*)_arg;
+
+  return do_read_header(&arg->cfg, arg->ctx,
+                        (uint8_t*)RSTRING_PTR(arg->data),
+                        RSTRING_LEN(arg->data));
+}
+
+static void
+check_decode_format(jpeg_decode_t* ptr)
+{
+  if ((ptr->format == FMT_YUV422 || ptr->format == FMT_RGB565) &&
+      ptr->quantize_colors) {
+    NOT_IMPLEMENTED_ERROR(":dither can not be used with YUV422 or RGB565.");
+  }
+
+  /* 誤差拡散やカラーマップの生成は画像全体を前提としている */
+  if (TEST_FLAG(ptr, F_CROP | F_RESAMPLE) && ptr->quantize_colors) {
+    NOT_IMPLEMENTED_ERROR(":crop, :fit, :fill and :resize can not be used "
+                          "with :dither.");
+  }
+
+  if (TEST_FLAG(ptr, F_CROP) && TEST_FLAG(ptr, F_RESAMPLE)) {
+    NOT_IMPLEMENTED_ERROR(":crop can not be used with :fit, :fill or :resize.");
+  }
+}
+
+static VALUE
+call_with_decode_context(jpeg_decode_t* ptr,
+                         VALUE (*func)(VALUE), VALUE data, void* opt)
+{
+  /*
+   * 設定値の複製とプールから取り出した作業領域でfuncを呼び出す。作業
+   * 領域は例外発生時も含めて必ずプールに返却する。
+   */
+
+  VALUE ret;
+  decode_arg_t arg;
+
+  check_decode_format(ptr);
+
+  arg.ptr  = ptr;
+  arg.cfg  = *ptr;
+  arg.data = data;
+  arg.opt  = opt;
+  arg.ctx  = acquire_decode_context(ptr);
+
+  ret = rb_ensure(func, (VALUE)&arg, decode_ensure, (VALUE)&arg);
+
+  RB_GC_GUARD(data);
+
+  return ret;
+}
+
+/**
+ * read meta data
+ *
+ * @overload read_header(jpeg)
+ *
+ *   @param jpeg [String] input data.
+ *
+ *   @return [JPEG::Meta] metadata.
+ */
+static VALUE
+rb_decoder_read_header(VALUE self, VALUE data)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  /*
+   * do read
+   */
+  ret = call_with_decode_context(ptr, read_header_protect, data, NULL);
+
+  return ret;
+}
+
+static VALUE
+rb_decode_result_meta(VALUE self)
+{
+  return rb_ivar_get(self, id_meta);
+}
+
+static void
+add_meta(VALUE obj, VALUE meta)
+{
+  rb_ivar_set(obj, id_meta, meta);
+  rb_define_singleton_method(obj, "meta", rb_decode_result_meta, 0);
+}
+
+static void
+expand_colormap(struct jpeg_decompress_struct* cinfo, uint8_t* src,
+                uint8_t* dst, int rows)
+{
+  /*
+   * 本関数はcinfo->out_color_componentsが1または3であることを前提に
+   * 作成されています。
+   * GVLを解放した状態で呼び出されるので、Rubyのオブジェクトを操作しては
+   * ならない。
+   */
+
+  volatile int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
+  int n;
+  JSAMPARRAY map;
+
+  n   = cinfo->output_width * rows;
+  map = cinfo->colormap;
+
+  switch (cinfo->out_color_components) {
+  case 1:
+    for (i = 0; i < n; i++) {
+      dst[i] = map[0][src[i]];
+    }
+    break;
+
+  case 2:
+    for (i = 0; i < n; i++) {
+      dst[0] = map[0][src[i]];
+      dst[1] = map[1][src[i]];
+
+      dst += 2;
+    }
+    break;
+
+  case 3:
+    for (i = 0; i < n; i++) {
+      dst[0] = map[0][src[i]];
+      dst[1] = map[1][src[i]];
+      dst[2] = map[2][src[i]];
+
+      dst += 3;
+    }
+    break;
+  }
+}
+
+static void
+swap_cbcr(uint8_t* p, size_t size)
+{
+  int i;
+  uint8_t tmp;
+
+  for (i = 0; i < (int)size; i++) {
+    tmp  = p[1];
+    p[1] = p[2];
+    p[2] = tmp;
+  }
+}
+
+static void
+do_transpose8(uint8_t* img, int wd, int ht, void* dst)
+{
+  int x;
+  int y;
+
+  uint8_t* sp;
+  uint8_t* dp;
+
+  sp = (uint8_t*)img;
+
+  for (y = 0; y < ht; y++) {
+    dp = (uint8_t*)dst + y;
+
+    for (x = 0; x < wd; x++) {
+      *dp = *sp;
+
+      sp++;
+      dp += ht;
+    }
+  }
+}
+
+static void
+do_transpose16(void* img, int wd, int ht, void* dst)
+{
+  int x;
+  int y;
+
+  uint16_t* sp;
+  uint16_t* dp;
+
+  sp = (uint16_t*)img;
+
+  for (y = 0; y < ht; y++) {
+    dp = (uint16_t*)dst + y;
+
+    for (x = 0; x < wd; x++) {
+      *dp = *sp;
+
+      sp++;
+      dp += ht;
+    }
+  }
+}
+
+static void
+do_transpose24(void* img, int wd, int ht, void* dst)
+{
+  int x;
+  int y;
+  int st;
+
+  uint8_t* sp;
+  uint8_t* dp;
+
+  sp = (uint8_t*)img;
+  st = ht * 3;
+
+  for (y = 0; y < ht; y++) {
+    dp = (uint8_t*)dst + (y * 3);
+
+    for (x = 0; x < wd; x++) {
+      dp[0] = sp[0];
+      dp[1] = sp[1];
+      dp[2] = sp[2];
+
+      sp += 3;
+      dp += st;
+    }
+  }
+}
+
+static void
+do_transpose32(void* img, int wd, int ht, void* dst)
+{
+  int x;
+  int y;
+
+  uint32_t* sp;
+  uint32_t* dp;
+
+  sp = (uint32_t*)img;
+
+  for (y = 0; y < ht; y++) {
+    dp = (uint32_t*)dst + y;
+
+    for (x = 0; x < wd; x++) {
+      *dp = *sp;
+
+      sp++;
+      dp += ht;
+    }
+  }
+}
+
+static void
+do_transpose(void* img, int wd, int ht, int nc, void* dst)
+{
+  switch (nc) {
+  case 1:
+    do_transpose8(img, wd, ht, dst);
+    break;
+
+  case 2:
+    do_transpose16(img, wd, ht, dst);
+    break;
+
+  case 3:
+    do_transpose24(img, wd, ht, dst);
+    break;
+
+  case 4:
+    do_transpose32(img, wd, ht, dst);
+    break;
+  }
+}
+
+static void
+do_upside_down8(void* img, int wd, int ht)
+{
+  uint8_t* sp;
+  uint8_t* dp;
+
+  sp = (uint8_t*)img;
+  dp = (uint8_t*)img + ((wd * ht) - 1);
+
+  while (sp < dp) {
+    SWAP(*sp, *dp, uint8_t);
+
+    sp++;
+    dp--;
+  }
+}
+
+static void
+do_upside_down16(void* img, int wd, int ht)
+{
+  uint16_t* sp;
+  uint16_t* dp;
+
+  sp = (uint16_t*)img;
+  dp = (uint16_t*)img + ((wd * ht) - 1);
+
+  while (sp < dp) {
+    SWAP(*sp, *dp, uint16_t);
+
+    sp++;
+    dp--;
+  }
+}
+
+static void
+do_upside_down24(void* img, int wd, int ht)
+{
+  uint8_t* sp;
+  uint8_t* dp;
+
+  sp = (uint8_t*)img;
+  dp = (uint8_t*)img + ((wd * ht * 3) - 3);
+
+  while (sp < dp) {
+    SWAP(sp[0], dp[0], uint8_t);
+    SWAP(sp[1], dp[1], uint8_t);
+    SWAP(sp[2], dp[2], uint8_t);
+
+    sp += 3;
+    dp -= 3;
+  }
+}
+
+static void
+do_upside_down32(void* img, int wd, int ht)
+{
+  uint32_t* sp;
+  uint32_t* dp;
+
+  sp = (uint32_t*)img;
+  dp = (uint32_t*)img + ((wd * ht) - 1);
+
+  ht /= 2;
+
+  while (sp < dp) {
+    SWAP(*sp, *dp, uint32_t);
+
+    sp++;
+    dp--;
+  }
+}
+
+static void
+do_upside_down(void* img, int wd, int ht, int nc)
+{
+  switch (nc) {
+  case 1:
+    do_upside_down8(img, wd, ht);
+    break;
+
+  case 2:
+    do_upside_down16(img, wd, ht);
+    break;
+
+  case 3:
+    do_upside_down24(img, wd, ht);
+    break;
+
+  case 4:
+    do_upside_down32(img, wd, ht);
+    break;
+  }
+}
+
+static void
+do_flip_horizon8(void* img, int wd, int ht)
+{
+  int y;
+  int st;
+
+  uint8_t* sp;
+  uint8_t* dp;
+
+  st  = wd;
+  wd /= 2;
+
+  sp = (uint8_t*)img;
+  dp = (uint8_t*)img + (st - 1);
+
+  for (y = 0; y < ht; y++) {
+    while (sp < dp) {
+      SWAP(*sp, *dp, uint8_t);
+
+      sp++;
+      dp--;
+    }
+
+    sp = sp - wd + st;
+    dp = sp + (st - 1);
+  }
+}
+
+static void
+do_flip_horizon16(void* img, int wd, int ht)
+{
+  int y;
+  int st;
+
+  uint16_t* sp;
+  uint16_t* dp;
+
+  st  = wd;
+  wd /= 2;
+
+  sp = (uint16_t*)img;
+  dp = (uint16_t*)img + (st - 1);
+
+  for (y = 0; y < ht; y++) {
+    while (sp < dp) {
+      SWAP(*sp, *dp, uint16_t);
+
+      sp++;
+      dp--;
+    }
+
+    sp = sp - wd + st;
+    dp = sp + (st - 1);
+  }
+}
+
+static void
+do_flip_horizon24(void* img, int wd, int ht)
+{
+  int y;
+  int st;
+
+  uint8_t* sp;
+  uint8_t* dp;
+
+  st  = wd * 3;
+  wd /= 2;
+
+  sp = (uint8_t*)img;
+  dp = (uint8_t*)img + (st - 3);
+
+  for (y = 0; y < ht; y++) {
+    while (sp < dp) {
+      SWAP(sp[0], dp[0], uint8_t);
+      SWAP(sp[1], dp[1], uint8_t);
+      SWAP(sp[2], dp[2], uint8_t);
+
+      sp += 3;
+      dp -= 3;
+    }
+
+    sp = (sp - (wd * 3)) + st;
+    dp = sp + (st - 3);
+  }
+}
+
+static void
+do_flip_horizon32(void* img, int wd, int ht)
+{
+  int y;
+  int st;
+
+  uint32_t* sp;
+  uint32_t* dp;
+
+  st  = wd;
+  wd /= 2;
+
+  sp = (uint32_t*)img;
+  dp = (uint32_t*)img + (st - 1);
+
+  for (y = 0; y < ht; y++) {
+    while (sp < dp) {
+      SWAP(*sp, *dp, uint32_t);
+
+      sp++;
+      dp--;
+    }
+
+    sp = sp - wd + st;
+    dp = sp + (st - 1);
+  }
+}
+
+static void
+do_flip_horizon(void* img, int wd, int ht, int nc)
+{
+  switch (nc) {
+  case 1:
+    do_flip_horizon8(img, wd, ht);
+    break;
+
+  case 2:
+    do_flip_horizon16(img, wd, ht);
+    break;
+
+  case 3:
+    do_flip_horizon24(img, wd, ht);
+    break;
+
+  case 4:
+    do_flip_horizon32(img, wd, ht);
+    break;
+  }
+}
+
+static VALUE
+alloc_orientation_buffer(VALUE img)
+{
+  VALUE ret;
+  int len;
+
+  /* YUYVは詰める前の大きさで回転するので容量を合わせる */
+  len = RSTRING_LEN(img);
+  ret = rb_str_buf_new(rb_str_capacity(img));
+
+  rb_str_set_len(ret, len);
+
+  return ret;
+}
+
+static uint8_t*
+apply_orientation(int o9n, uint8_t* img, uint8_t* tmp, int wd, int ht, int nc)
+{
+  if (o9n & 4) {
+    /* 転置は交換アルゴリズムでは実装できないので新規バッファを
+       用意する */
+    do_transpose(img, wd, ht, nc, tmp); 
+    SWAP(wd, ht, int);
+
+    img = tmp;
+  }
+
+  if (o9n & 2) {
+    do_upside_down(img, wd, ht, nc); 
+  }
+
+  if (o9n & 1) {
+    do_flip_horizon(img, wd, ht, nc); 
+  }
+
+  return img;
+}
+
+#define WILL_BE_COLORMAPPED(ci)    (((ci)->quantize_colors) && \
+                                    ((ci)->output_components == 1) && \
+                                       (((ci)->out_color_components == 1) || \
+                                        ((ci)->out_color_components == 3)))
+
+static void
+apply_decoder_context(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo)
+{
+  cinfo->raw_data_out              = FALSE;
+  cinfo->dct_method                = ptr->dct_method;
+
+  cinfo->out_color_space           = ptr->out_color_space;
+  cinfo->out_color_components      = ptr->out_color_components;
+  cinfo->scale_num                 = ptr->scale_num;
+  cinfo->scale_denom               = ptr->scale_denom;
+  cinfo->output_gamma              = ptr->output_gamma;
+  cinfo->buffered_image            = ptr->buffered_image;
+  cinfo->do_fancy_upsampling       = ptr->do_fancy_upsampling;
+  cinfo->do_block_smoothing        = ptr->do_block_smoothing;
+  cinfo->quantize_colors           = ptr->quantize_colors;
+  cinfo->dither_mode               = ptr->dither_mode;
+  cinfo->two_pass_quantize         = ptr->two_pass_quantize;
+  cinfo->desired_number_of_colors  = ptr->desired_number_of_colors;
+  cinfo->enable_1pass_quant        = ptr->enable_1pass_quant;
+  cinfo->enable_external_quant     = ptr->enable_external_quant;
+  cinfo->enable_2pass_quant        = ptr->enable_2pass_quant;
+
+#ifdef USE_JCS_RGB565
+  /* リサンプルは8bitの各成分に対して行うので、RGBで伸長して後で詰める */
+  if (ptr->format == FMT_RGB565 && TEST_FLAG(ptr, F_RESAMPLE)) {
+    cinfo->out_color_space         = JCS_RGB;
+  }
+#endif /* defined(USE_JCS_RGB565) */
+}
+
+static int
+apply_crop(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo)
+{
+  /*
+   * :cropの領域を検証し、出力サイズを切り出す領域の大きさに置き換える。
+   * jpeg_calc_output_dimensions()の後で呼び出すこと (出力サイズは
+   * jpeg_start_decompress()で再計算されるので伸長処理には影響しない)
+   * 領域が画像からはみ出す場合は!0を返す。
+   */
+
+  if (!TEST_FLAG(ptr, F_CROP)) return 0;
+
+  if ((JDIMENSION)(ptr->crop[0] + ptr->crop[2]) > cinfo->output_width ||
+      (JDIMENSION)(ptr->crop[1] + ptr->crop[3]) > cinfo->output_height) {
+    return !0;
+  }
+
+  cinfo->output_width  = ptr->crop[2];
+  cinfo->output_height = ptr->crop[3];
+
+  return 0;
+}
+
+/*
+ * YUV422 (YUYV) / RGB565への詰め込み
+ *
+ * libjpegが出力した3成分の行 (YCbCrまたはRGB) を2バイト/画素の形式に
+ * 詰める。伸長した行を読み込む度に処理するので、3成分の画像全体を保持
+ * することはない。YUYVの色差は組になる2画素の平均とする。
+ */
+
+#if defined(__SSE2__)
+static void
+load_rgb24_sse2(uint8_t* src, __m128i* c0, __m128i* c1, __m128i* c2)
+{
+  /*
+   * 3成分×16画素 (48バイト) を成分毎に分ける。下位64bitの交互配置を
+   * 4回繰り返すと各成分が揃う。
+   */
+
+  __m128i t0;
+  __m128i t1;
+  __m128i t2;
+  __m128i u0;
+  __m128i u1;
+  int i;
+
+  t0 = _mm_loadu_si128((__m128i*)(src + 0));
+  t1 = _mm_loadu_si128((__m128i*)(src + 16));
+  t2 = _mm_loadu_si128((__m128i*)(src + 32));
+
+  for (i = 0; i < 4; i++) {
+    u0 = _mm_unpacklo_epi8(t0, _mm_unpackhi_epi64(t1, t1));
+    u1 = _mm_unpacklo_epi8(_mm_unpackhi_epi64(t0, t0), t2);
+    t2 = _mm_unpacklo_epi8(t1, _mm_unpackhi_epi64(t2, t2));
+    t0 = u0;
+    t1 = u1;
+  }
+
+  *c0 = t0;
+  *c1 = t1;
+  *c2 = t2;
+}
+#endif /* defined(__SSE2__) */
+
+static void
+pack_yuyv(uint8_t* src, uint8_t* dst, int wd)
+{
+  /*
+   * YCbCrの一行をYUYVに詰める。dstはsrcと同じか前方であってもよい
+   * (回転後の画像をその場で詰める場合)。
+   */
+
+  int i;
+  int cb;
+  int cr;
+  uint8_t y0;
+  uint8_t y1;
+
+  i = 0;
+
+#if defined(__SSE2__)
+  {
+    __m128i y;
+    __m128i u;
+    __m128i v;
+    __m128i uv;
+    __m128i one;
+    __m128i mask;
+
+    one  = _mm_set1_epi16(1);
+    mask = _mm_set1_epi16(0x00ff);
+
+    for (; i + 16 <= wd; i += 16) {
+      load_rgb24_sse2(src, &y, &u, &v);
+
+      /* 隣接する2画素の色差の平均 (16bitの各要素に一組ずつ) */
+      u  = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_and_si128(u, mask),
+                                                      _mm_srli_epi16(u, 8)),
+                                        one), 1);
+      v  = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(_mm_and_si128(v, mask),
+                                                      _mm_srli_epi16(v, 8)),
+                                        one), 1);
+      uv = _mm_or_si128(u, _mm_slli_epi16(v, 8));
+
+      _mm_storeu_si128((__m128i*)(dst + 0), _mm_unpacklo_epi8(y, uv));
+      _mm_storeu_si128((__m128i*)(dst + 16), _mm_unpackhi_epi8(y, uv));
+
+      src += 48;
+      dst += 32;
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint8x16x3_t in;
+    uint8x16x2_t out;
+    uint8x8x2_t uv;
+
+    for (; i + 16 <= wd; i += 16) {
+      in         = vld3q_u8(src);
+
+      uv         = vzip_u8(vrshrn_n_u16(vpaddlq_u8(in.val[1]), 1),
+                           vrshrn_n_u16(vpaddlq_u8(in.val[2]), 1));
+
+      out.val[0] = in.val[0];
+      out.val[1] = vcombine_u8(uv.val[0], uv.val[1]);
+
+      vst2q_u8(dst, out);
+
+      src += 48;
+      dst += 32;
+    }
+  }
+#endif
+
+  for (; i + 2 <= wd; i += 2) {
+    y0     = src[0];
+    y1     = src[3];
+    cb     = (src[1] + src[4] + 1) >> 1;
+    cr     = (src[2] + src[5] + 1) >> 1;
+
+    dst[0] = y0;
+    dst[1] = (uint8_t)cb;
+    dst[2] = y1;
+    dst[3] = (uint8_t)cr;
+
+    src += 6;
+    dst += 4;
+  }
+
+  if (i < wd) {
+    /* 奇数幅の右端は同じ画素を組にする */
+    y0     = src[0];
+    cb     = src[1];
+    cr     = src[2];
+
+    dst[0] = y0;
+    dst[1] = (uint8_t)cb;
+    dst[2] = y0;
+    dst[3] = (uint8_t)cr;
+  }
+}
+
+static void
+pack_rgb565(uint8_t* src, uint8_t* dst, int wd)
+{
+  /*
+   * RGBの一行をRGB565 (リトルエンディアン) に詰める。下位ビットは切り
+   * 捨てる (JCS_RGB565と同じ結果になる)。
+   */
+
+  int i;
+  int v;
+
+  i = 0;
+
+#if defined(__SSE2__)
+  {
+    __m128i r;
+    __m128i g;
+    __m128i b;
+    __m128i zero;
+    __m128i mr;
+    __m128i mg;
+
+    zero = _mm_setzero_si128();
+    mr   = _mm_set1_epi16((short)0xf800);
+    mg   = _mm_set1_epi16(0x07e0);
+
+    for (; i + 16 <= wd; i += 16) {
+      load_rgb24_sse2(src, &r, &g, &b);
+
+      _mm_storeu_si128((__m128i*)(dst + 0),
+            _mm_or_si128(
+              _mm_or_si128(
+                _mm_and_si128(_mm_slli_epi16(_mm_unpacklo_epi8(r, zero), 8),
+                              mr),
+                _mm_and_si128(_mm_slli_epi16(_mm_unpacklo_epi8(g, zero), 3),
+                              mg)),
+              _mm_srli_epi16(_mm_unpacklo_epi8(b, zero), 3)));
+
+      _mm_storeu_si128((__m128i*)(dst + 16),
+            _mm_or_si128(
+              _mm_or_si128(
+                _mm_and_si128(_mm_slli_epi16(_mm_unpackhi_epi8(r, zero), 8),
+                              mr),
+                _mm_and_si128(_mm_slli_epi16(_mm_unpackhi_epi8(g, zero), 3),
+                              mg)),
+              _mm_srli_epi16(_mm_unpackhi_epi8(b, zero), 3)));
+
+      src += 48;
+      dst += 32;
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    uint8x16x3_t in;
+    uint16x8_t lo;
+    uint16x8_t hi;
+
+    for (; i + 16 <= wd; i += 16) {
+      in = vld3q_u8(src);
+
+      /* vsriで上位ビットから順に詰めていく */
+      lo = vshll_n_u8(vget_low_u8(in.val[0]), 8);
+      lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(in.val[1]), 8), 5);
+      lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(in.val[2]), 8), 11);
+
+      hi = vshll_n_u8(vget_high_u8(in.val[0]), 8);
+      hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(in.val[1]), 8), 5);
+      hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(in.val[2]), 8), 11);
+
+      vst1q_u8(dst + 0, vreinterpretq_u8_u16(lo));
+      vst1q_u8(dst + 16, vreinterpretq_u8_u16(hi));
+
+      src += 48;
+      dst += 32;
+    }
+  }
+#endif
+
+  for (; i < wd; i++) {
+    v      = ((src[0] & 0xf8) << 8) | ((src[1] & 0xfc) << 3) | (src[2] >> 3);
+
+    dst[0] = (uint8_t)(v & 0xff);
+    dst[1] = (uint8_t)(v >> 8);
+
+    src += 3;
+    dst += 2;
+  }
+}
+
+static int
+plan_pack(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo, int o9n)
+{
+  /*
+   * YUV422/RGB565に詰める時期を決める (apply_decoder_context()の後に
+   * 呼び出すこと)。libjpegがRGB565で直接出力する場合は不要。YUYVは
+   * 2画素で色差を共有するので、回転する場合はYCbCrのまま回転した後で
+   * 画像全体を詰める (RGB565は画素毎なので詰めた後に回転できる)。
+   */
+
+  int ret;
+
+  switch (ptr->format) {
+  case FMT_YUV422:
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && o9n != 0) {
+      ret = PACK_IMAGE;
+    } else {
+      ret = PACK_ROWS;
+    }
+    break;
+
+  case FMT_RGB565:
+    ret = (cinfo->out_color_space == JCS_RGB)? PACK_ROWS: PACK_NONE;
+    break;
+
+  default:
+    ret = PACK_NONE;
+    break;
+  }
+
+  return ret;
+}
+
+static int
+sample_size(struct jpeg_decompress_struct* cinfo)
+{
+  /*
+   * libjpegが出力する一画素のバイト数
+   */
+
+#ifdef USE_JCS_RGB565
+  if (cinfo->out_color_space == JCS_RGB565) return 2;
+#endif /* defined(USE_JCS_RGB565) */
+
+  return cinfo->output_components;
+}
+
+static JSAMPARRAY
+alloc_stage(struct jpeg_decompress_struct* cinfo, JDIMENSION wd)
+{
+  /*
+   * 詰める前の行を受ける作業用の行バッファ (JPOOL_IMAGEから確保するので
+   * jpeg_start_decompress()の後に呼び出すこと)
+   */
+
+  return (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                     wd * cinfo->output_components,
+                                     UNIT_LINES);
+}
+
+static void
+pack_row(jpeg_decode_t* ptr, uint8_t* src, uint8_t* dst, int wd)
+{
+  if (ptr->format == FMT_YUV422) {
+    pack_yuyv(src, dst, wd);
+  } else {
+    pack_rgb565(src, dst, wd);
+  }
+}
+
+static void
+pack_image(jpeg_decode_t* ptr, uint8_t* img, int wd, int ht)
+{
+  /*
+   * 回転済みのYCbCr画像をその場でYUYVに詰める。詰めた行は元の行より
+   * 短いので先頭から処理する (幅が1の場合のみ長くなるので末尾から)。
+   */
+
+  size_t src;
+  size_t dst;
+  int y;
+
+  src = (size_t)wd * 3;
+  dst = row_size(ptr, NULL, wd);
+
+  if (dst <= src) {
+    for (y = 0; y < ht; y++) {
+      pack_yuyv(img + (y * src), img + (y * dst), wd);
+    }
+  } else {
+    for (y = ht - 1; y >= 0; y--) {
+      pack_yuyv(img + (y * src), img + (y * dst), wd);
+    }
+  }
+}
+
+static JDIMENSION
+read_rows(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo,
+          JSAMPARRAY array, JSAMPARRAY stage, JDIMENSION n)
+{
+  /*
+   * jpeg_read_scanlines()の代わりに使う。stageが指定されている場合は
+   * stageに読み込んでからarrayの各行に詰める。
+   */
+
+  JDIMENSION i;
+
+  if (stage == NULL) return jpeg_read_scanlines(cinfo, array, n);
+
+  n = jpeg_read_scanlines(cinfo, stage, n);
+
+  for (i = 0; i < n; i++) {
+    pack_row(ptr, stage[i], array[i], cinfo->output_width);
+  }
+
+  return n;
+}
+
+static VALUE
+prepare_output(jpeg_decode_t* ptr, decode_job_t* job, VALUE* raw, VALUE* cmap)
+{
+  /*
+   * 出力先のバッファを確保する (GVL保持)
+   * jpeg_calc_output_dimensions()の呼び出し後であること
+   */
+
+  VALUE ret;
+  struct jpeg_decompress_struct* cinfo;
+  size_t raw_sz;
+  size_t cmap_sz;
+  size_t len;
+
+  cinfo = job->cinfo;
+
+  if (job->pack == PACK_IMAGE) {
+    /*
+     * YCbCrのまま伸長・回転した後で詰めるので、バッファはその大きさで
+     * 確保して文字列の長さは詰めた後の大きさにする
+     */
+    job->stride = (size_t)cinfo->output_width * cinfo->output_components;
+    raw_sz      = job->stride * cinfo->output_height;
+
+    if (job->o9n & 4) {
+      len = row_size(ptr, cinfo, cinfo->output_height) * cinfo->output_width;
+    } else {
+      len = row_size(ptr, cinfo, cinfo->output_width) * cinfo->output_height;
+    }
+
+  } else {
+    job->stride = row_size(ptr, cinfo, cinfo->output_width);
+    raw_sz      = job->stride * cinfo->output_height;
+    len         = raw_sz;
+  }
+
+  *raw        = rb_str_buf_new(raw_sz);
+  job->raw    = (uint8_t*)RSTRING_PTR(*raw);
+  ret         = *raw;
+
+  rb_str_set_len(*raw, len);
+
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && WILL_BE_COLORMAPPED(cinfo)) {
+    cmap_sz   = cinfo->output_width * cinfo->output_height *
+                                          cinfo->out_color_components;
+    *cmap     = rb_str_buf_new(cmap_sz);
+    job->cmap = (uint8_t*)RSTRING_PTR(*cmap);
+    ret       = *cmap;
+
+    rb_str_set_len(*cmap, cmap_sz);
+
+  } else {
+    *cmap     = Qnil;
+  }
+
+  return ret;
+}
+
+static void
+read_scanlines(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo,
+               JSAMPARRAY array, JSAMPARRAY stage, uint8_t* dst, size_t stride)
+{
+  int i;
+  int j;
+
+  while (cinfo->output_scanline < cinfo->output_height) {
+    for (i = 0, j = cinfo->output_scanline; i < UNIT_LINES; i++, j++) {
+      array[i] = dst + (j * stride);
+    }
+
+    read_rows(ptr, cinfo, array, stage, UNIT_LINES);
+  }
+}
+
+static void
+read_direct_scanlines(decode_job_t* job)
+{
+  /*
+   * 出力先に順に伸長する (YUV422/RGB565は作業用の行バッファを経由して
+   * 詰める)
+   */
+
+  struct jpeg_decompress_struct* cinfo;
+
+  cinfo = job->cinfo;
+
+  if (job->pack == PACK_ROWS && job->stage == NULL) {
+    job->stage = alloc_stage(cinfo, cinfo->output_width);
+  }
+
+  read_scanlines(job->ptr, cinfo, job->array, job->stage,
+                 job->raw, job->stride);
+}
+
+static void
+post_process(decode_job_t* job)
+{
+  /*
+   * 伸長後の後処理 (カラーマップの展開、CbCrの入れ替え、回転)
+   */
+
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  uint8_t* img;
+  int wd;
+  int ht;
+  int nc;
+  int y;
+
+  ptr   = job->ptr;
+  cinfo = job->cinfo;
+
+  img   = job->raw;
+  wd    = cinfo->output_width;
+  ht    = cinfo->output_height;
+  nc    = (ptr->format == FMT_RGB565)? 2: cinfo->output_components;
+
+  if (job->cmap != NULL) {
+    expand_colormap(cinfo, img, job->cmap, ht);
+
+    img = job->cmap;
+    nc  = cinfo->out_color_components;
+  }
+
+  if (ptr->format == FMT_YVU) {
+    if (job->stride == (size_t)wd * cinfo->output_components) {
+      swap_cbcr(job->raw, job->stride * ht);
+
+    } else {
+      /* 呼び出し元から行間隔が指定されている場合は行毎に処理する */
+      for (y = 0; y < ht; y++) {
+        swap_cbcr(job->raw + (y * job->stride),
+                  wd * cinfo->output_components);
+      }
+    }
+  }
+
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+    img = apply_orientation(job->o9n, img, job->rot, wd, ht, nc);
+    if (job->o9n & 4) SWAP(wd, ht, int);
+  }
+
+  if (job->pack == PACK_IMAGE) {
+    pack_image(ptr, img, wd, ht);
+  }
+}
+
+static void
+skip_rows(struct jpeg_decompress_struct* cinfo, JSAMPARRAY tmp, JDIMENSION n)
+{
+  /*
+   * buffered-imageモードではjpeg_skip_scanlines()が使えないので、読み
+   * 込んで捨てる
+   */
+
+  JDIMENSION end;
+
+  if (!cinfo->buffered_image) {
+    jpeg_skip_scanlines(cinfo, n);
+
+  } else {
+    end = cinfo->output_scanline + n;
+
+    while (cinfo->output_scanline < end) {
+      jpeg_read_scanlines(cinfo, tmp, 1);
+    }
+  }
+}
+
+static void
+read_cropped_scanlines(decode_job_t* job)
+{
+  /*
+   * :cropの領域を含むMCUの列と行だけを伸長し、作業用の行バッファから
+   * 領域の部分を出力先に切り出す。領域より下の行は読み飛ばす。
+   */
+
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_decode_t* ptr;
+  JSAMPARRAY tmp;
+  JDIMENSION xoff;
+  JDIMENSION wd;
+  JDIMENSION end;
+  size_t dx;
+  size_t line;
+  int y;
+  int n;
+  int i;
+
+  cinfo = job->cinfo;
+  ptr   = job->ptr;
+
+  /* 開始位置はiMCUの境界に切り下げられ、その分幅が広がる */
+  xoff  = ptr->crop[0];
+  wd    = ptr->crop[2];
+
+  jpeg_crop_scanline(cinfo, &xoff, &wd);
+
+  dx    = (ptr->crop[0] - xoff) * sample_size(cinfo);
+  line  = ptr->crop[2] * sample_size(cinfo);
+  tmp   = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                wd * sample_size(cinfo), UNIT_LINES);
+
+  skip_rows(cinfo, tmp, ptr->crop[1]);
+
+  end   = ptr->crop[1] + ptr->crop[3];
+  y     = 0;
+
+  while (cinfo->output_scanline < end) {
+    n = end - cinfo->output_scanline;
+    if (n > UNIT_LINES) n = UNIT_LINES;
+
+    n = jpeg_read_scanlines(cinfo, tmp, n);
+
+    for (i = 0; i < n; i++, y++) {
+      if (job->pack == PACK_ROWS) {
+        pack_row(ptr, tmp[i] + dx, job->raw + (y * job->stride),
+                 ptr->crop[2]);
+      } else {
+        memcpy(job->raw + (y * job->stride), tmp[i] + dx, line);
+      }
+    }
+  }
+
+  if (!cinfo->buffered_image) {
+    skip_rows(cinfo, tmp, cinfo->output_height - cinfo->output_scanline);
+  }
+
+  /* 後処理とメタ情報は切り出した大きさで扱う */
+  cinfo->output_width  = ptr->crop[2];
+  cinfo->output_height = ptr->crop[3];
+}
+
+/*
+ * リサンプリング (:fit / :fill / :resize)
+ *
+ * 分離可能なフィルタの畳み込みで水平方向、垂直方向の順に処理する。縮小
+ * 時はフィルタの幅を縮小率に合わせて広げるので、縮小率が大きい場合でも
+ * 面積平均に近い結果になる。
+ * 伸長した行は順に水平方向の処理を行い、垂直方向のタップ数分の行だけを
+ * リングバッファに保持する。出力の各行は参照する行が揃った時点で求める
+ * ので、DCTスケーリング後の画像全体を保持することはない。作業領域は
+ * libjpegのJPOOL_IMAGEから確保する (GVLを解放した状態で呼び出される)。
+ */
+
+#define RESAMPLE_SHIFT             14
+#define RESAMPLE_ONE               (1 << RESAMPLE_SHIFT)
+#define RESAMPLE_TAP_ALIGN         16
+#define RESAMPLE_PAD               64
+
+typedef struct {
+  int* start;                 // first source index of each output pixel
+  int* count;                 // number of taps of each output pixel
+  int16_t* weight;            // taps (fixed point, "size" per output pixel)
+  int size;                   // multiple of RESAMPLE_TAP_ALIGN (0 padded)
+} resample_coef_t;
+
+static double
+triangle_filter(double x)
+{
+  if (x < 0.0) x = -x;
+
+  return (x < 1.0)? 1.0 - x: 0.0;
+}
+
+static double
+bicubic_filter(double x)
+{
+  /* Catmull-Rom (a = -0.5) */
+  if (x < 0.0) x = -x;
+
+  if (x < 1.0) {
+    return ((1.5 * x - 2.5) * x) * x + 1.0;
+  } else if (x < 2.0) {
+    return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+  } else {
+    return 0.0;
+  }
+}
+
+static inline double
+sinc(double x)
+{
+  if (x == 0.0) return 1.0;
+
+  x *= M_PI;
+
+  return sin(x) / x;
+}
+
+static double
+lanczos_filter(double x)
+{
+  if (x < 0.0) x = -x;
+
+  return (x < 3.0)? sinc(x) * sinc(x / 3.0): 0.0;
+}
+
+static const struct {
+  double (*func)(double);
+  double support;
+} resample_filters[] = {
+  {triangle_filter, 1.0},     // RESAMPLE_BILINEAR
+  {bicubic_filter,  2.0},     // RESAMPLE_BICUBIC
+  {lanczos_filter,  3.0},     // RESAMPLE_LANCZOS
+};
+
+static void
+make_resample_coef(j_common_ptr cinfo, resample_coef_t* coef, int filter,
+                   int src, int dst, int off, int total)
+{
+  /*
+   * 出力のoff番目からdst個分の画素について、入力(src画素)を拡大縮小後の
+   * 大きさtotalに対応付けた場合の重みを求める
+   */
+
+  double (*func)(double);
+  double scale;
+  double fscale;
+  double support;
+  double center;
+  double sum;
+  double* w;
+  int16_t* wp;
+  int lo;
+  int hi;
+  int i;
+  int j;
+
+  func    = resample_filters[filter].func;
+  scale   = (double)src / total;
+  fscale  = (scale > 1.0)? scale: 1.0;
+  support = resample_filters[filter].support * fscale;
+
+  /*
+   * SIMDでタップをまとめて処理できる様に、各画素の重みの数は切り上げて
+   * 余りを0で埋めておく
+   */
+  coef->size   = ((int)support * 2 + 3 + (RESAMPLE_TAP_ALIGN - 1)) &
+                                               ~(RESAMPLE_TAP_ALIGN - 1);
+  coef->start  = (int*)(*cinfo->mem->alloc_large)(cinfo, JPOOL_IMAGE,
+                                                  sizeof(int) * dst);
+  coef->count  = (int*)(*cinfo->mem->alloc_large)(cinfo, JPOOL_IMAGE,
+                                                  sizeof(int) * dst);
+  coef->weight = (int16_t*)(*cinfo->mem->alloc_large)(cinfo, JPOOL_IMAGE,
+                                         sizeof(int16_t) * dst * coef->size);
+  w            = (double*)(*cinfo->mem->alloc_large)(cinfo, JPOOL_IMAGE,
+                                         sizeof(double) * coef->size);
+
+  memset(coef->weight, 0, sizeof(int16_t) * dst * coef->size);
+
+  for (i = 0; i < dst; i++) {
+    center = (i + off + 0.5) * scale;
+
+    lo = (int)(center - support + 0.5);
+    hi = (int)(center + support + 0.5);
+
+    if (center - support + 0.5 < 0.0) lo = 0;
+    if (hi > src) hi = src;
+    if (hi - lo > coef->size) hi = lo + coef->size;
+
+    for (j = lo, sum = 0.0; j < hi; j++) {
+      w[j - lo] = func((j + 0.5 - center) / fscale);
+      sum      += w[j - lo];
+    }
+
+    /* 重みが全て0になる場合は最も近い画素を使う */
+    if (sum == 0.0) {
+      lo   = (int)center;
+      if (lo >= src) lo = src - 1;
+      hi   = lo + 1;
+      w[0] = sum = 1.0;
+    }
+
+    coef->start[i] = lo;
+    coef->count[i] = hi - lo;
+    wp             = coef->weight + (i * coef->size);
+
+    for (j = 0; j < hi - lo; j++) {
+      wp[j] = (int16_t)((w[j] / sum) * RESAMPLE_ONE +
+                        ((w[j] < 0.0)? -0.5: 0.5));
+    }
+  }
+}
+
+static inline uint8_t
+clip_sample(int v)
+{
+  v = (v + (RESAMPLE_ONE / 2)) >> RESAMPLE_SHIFT;
+
+  return (v < 0)? 0: (v > 255)? 255: (uint8_t)v;
+}
+
+/*
+ * 横方向の畳み込みは出力1画素毎にタップ数が異なるので、画素単位で
+ * 16bitの積和 (pmaddwd) を使う。1成分の場合は連続する8タップ (AVX2は
+ * 16タップ) を一度に、3/4成分の場合は隣り合う2タップ (AVX2は4タップ) の
+ * 同じ成分を組にして処理する。重みは0で埋めてあり、入力行の後ろには
+ * RESAMPLE_PADバイトの余白があるので、タップ数は切り上げて処理してよい。
+ * 各関数は成分毎の積和をaccに格納する。
+ */
+
+#if defined(__SSE2__)
+static inline void
+horizontal_taps_sse2(uint8_t* sp, int16_t* wp, int n, int nc, int* acc)
+{
+  __m128i sum;
+  __m128i zero;
+  __m128i a;
+  __m128i w;
+  int32_t pair;
+  int32_t tmp[4];
+  int k;
+
+  sum  = _mm_setzero_si128();
+  zero = _mm_setzero_si128();
+
+  switch (nc) {
+  case 1:
+    for (k = 0; k < n; k += 8) {
+      a   = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(sp + k)), zero);
+      w   = _mm_loadu_si128((__m128i*)(wp + k));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(a, w));
+    }
+
+    _mm_storeu_si128((__m128i*)tmp, sum);
+    acc[0] = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    break;
+
+  case 3:
+  case 4:
+    for (k = 0; k < n; k += 2) {
+      memcpy(&pair, wp + k, sizeof(pair));
+
+      /* 2画素分を読み込み、成分毎に2画素を組にする */
+      a   = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(sp + (k * nc))),
+                              zero);
+      a   = (nc == 4)? _mm_unpacklo_epi16(a, _mm_srli_si128(a, 8)):
+                       _mm_unpacklo_epi16(a, _mm_srli_si128(a, 6));
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(a, _mm_set1_epi32(pair)));
+    }
+
+    _mm_storeu_si128((__m128i*)tmp, sum);
+    memcpy(acc, tmp, sizeof(int) * nc);
+    break;
+  }
+}
+#elif defined(__ARM_NEON)
+static inline void
+horizontal_taps_neon(uint8_t* sp, int16_t* wp, int n, int nc, int* acc)
+{
+  int32x4_t sum;
+  int16x8_t a;
+  int16x8_t w;
+  int32_t tmp[4];
+  int k;
+
+  sum = vdupq_n_s32(0);
+
+  switch (nc) {
+  case 1:
+    for (k = 0; k < n; k += 8) {
+      a   = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(sp + k)));
+      w   = vld1q_s16(wp + k);
+      sum = vmlal_s16(sum, vget_low_s16(a), vget_low_s16(w));
+      sum = vmlal_s16(sum, vget_high_s16(a), vget_high_s16(w));
+    }
+
+    acc[0] = vgetq_lane_s32(sum, 0) + vgetq_lane_s32(sum, 1) +
+             vgetq_lane_s32(sum, 2) + vgetq_lane_s32(sum, 3);
+    return;
+
+  case 3:
+    /* 4要素目は次の画素の成分なので使わない */
+    for (k = 0; k < n; k += 2) {
+      a   = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(sp + (k * 3))));
+      sum = vmlal_n_s16(sum, vget_low_s16(a), wp[k]);
+      sum = vmlal_n_s16(sum, vget_low_s16(vextq_s16(a, a, 3)), wp[k + 1]);
+    }
+    break;
+
+  case 4:
+    for (k = 0; k < n; k += 2) {
+      a   = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(sp + (k * 4))));
+      sum = vmlal_n_s16(sum, vget_low_s16(a), wp[k]);
+      sum = vmlal_n_s16(sum, vget_high_s16(a), wp[k + 1]);
+    }
+    break;
+
+  default:
+    return;
+  }
+
+  vst1q_s32(tmp, sum);
+  memcpy(acc, tmp, sizeof(int) * nc);
+}
+#endif
+
+#ifdef USE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static inline void
+horizontal_taps_avx2(uint8_t* sp, int16_t* wp, int n, int nc, int* acc)
+{
+  __m256i sum;
+  __m256i idx;
+  __m256i sel;
+  __m256i a;
+  __m256i w;
+  __m128i t;
+  int64_t quad;
+  int32_t tmp[4];
+  int k;
+
+  sum = _mm256_setzero_si256();
+
+  switch (nc) {
+  case 1:
+    for (k = 0; k < n; k += 16) {
+      a   = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(sp + k)));
+      w   = _mm256_loadu_si256((__m256i*)(wp + k));
+      sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, w));
+    }
+
+    t = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                      _mm256_extracti128_si256(sum, 1));
+    _mm_storeu_si128((__m128i*)tmp, t);
+
+    acc[0] = tmp[0] + tmp[1] + tmp[2] + tmp[3];
+    return;
+
+  /*
+   * 4画素分を両方のレーンに読み込み、下位レーンは1,2画素目、上位レーン
+   * は3,4画素目の同じ成分を16bitの組に並べる (-1の位置は0になる)
+   */
+  case 3:
+    sel = _mm256_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1,
+                           2, -1, 5, -1, -1, -1, -1, -1,
+                           6, -1, 9, -1, 7, -1, 10, -1,
+                           8, -1, 11, -1, -1, -1, -1, -1);
+    break;
+
+  case 4:
+    sel = _mm256_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1,
+                           2, -1, 6, -1, 3, -1, 7, -1,
+                           8, -1, 12, -1, 9, -1, 13, -1,
+                           10, -1, 14, -1, 11, -1, 15, -1);
+    break;
+
+  default:
+    return;
+  }
+
+  idx = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+
+  for (k = 0; k < n; k += 4) {
+    memcpy(&quad, wp + k, sizeof(quad));
+
+    a   = _mm256_broadcastsi128_si256(
+              _mm_loadu_si128((__m128i*)(sp + (k * nc))));
+    a   = _mm256_shuffle_epi8(a, sel);
+    w   = _mm256_permutevar8x32_epi32(
+              _mm256_castsi128_si256(_mm_cvtsi64_si128(quad)), idx);
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, w));
+  }
+
+  t = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                    _mm256_extracti128_si256(sum, 1));
+  _mm_storeu_si128((__m128i*)tmp, t);
+
+  memcpy(acc, tmp, sizeof(int) * nc);
+}
+
+__attribute__((target("avx2")))
+static int
+resample_horizontal_avx2(resample_coef_t* hc, uint8_t* src, uint8_t* dst,
+                         int dw, int nc)
+{
+  /*
+   * resample_horizontal()のAVX2版。対応しない成分数の場合は0を返す。
+   */
+
+  int acc[4];
+  int x;
+  int c;
+
+  if (nc != 1 && nc != 3 && nc != 4) return 0;
+
+  for (x = 0; x < dw; x++) {
+    horizontal_taps_avx2(src + (hc->start[x] * nc),
+                         hc->weight + (x * hc->size), hc->count[x], nc, acc);
+
+    for (c = 0; c < nc; c++) *dst++ = clip_sample(acc[c]);
+  }
+
+  return !0;
+}
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+static void
+resample_horizontal(resample_coef_t* hc, uint8_t* src, uint8_t* dst,
+                    int dw, int nc)
+{
+  /*
+   * 一行を横方向に畳み込む。SSE2/NEON (AVX2) が使える場合は1, 3, 4成分の
+   * タップをまとめて処理する (丸めと飽和の扱いはclip_sample()と同じ結果
+   * になる)。
+   */
+
+  int16_t* wp;
+  uint8_t* sp;
+  int acc[4];
+  int x;
+  int c;
+  int k;
+
+#ifdef USE_AVX2_DISPATCH
+  if (have_avx2 && resample_horizontal_avx2(hc, src, dst, dw, nc)) return;
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+  for (x = 0; x < dw; x++) {
+    wp = hc->weight + (x * hc->size);
+    sp = src + (hc->start[x] * nc);
+
+#if defined(__SSE2__) || defined(__ARM_NEON)
+    if (nc == 1 || nc == 3 || nc == 4) {
+#if defined(__SSE2__)
+      horizontal_taps_sse2(sp, wp, hc->count[x], nc, acc);
+#else
+      horizontal_taps_neon(sp, wp, hc->count[x], nc, acc);
+#endif
+      for (c = 0; c < nc; c++) *dst++ = clip_sample(acc[c]);
+      continue;
+    }
+#endif
+
+    for (c = 0; c < nc; c++) acc[c] = 0;
+
+    for (k = 0; k < hc->count[x]; k++) {
+      for (c = 0; c < nc; c++) acc[c] += sp[c] * wp[k];
+      sp += nc;
+    }
+
+    for (c = 0; c < nc; c++) *dst++ = clip_sample(acc[c]);
+  }
+}
+
+#ifdef USE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static int
+resample_vertical_avx2(JSAMPROW* rows, int16_t* wp, int n, uint8_t* dst,
+                       int len)
+{
+  /*
+   * resample_vertical()のAVX2版 (16画素ずつ)。処理した画素数を返す。
+   */
+
+  __m256i rnd;
+  __m256i lo;
+  __m256i hi;
+  __m256i a;
+  __m256i b;
+  __m256i w;
+  int x;
+  int k;
+
+  rnd = _mm256_set1_epi32(RESAMPLE_ONE / 2);
+
+  for (x = 0; x + 16 <= len; x += 16) {
+    lo = rnd;
+    hi = rnd;
+
+    /*
+     * unpacklo/hiは128bitのレーン毎なので、loは0-3と8-11、hiは4-7と
+     * 12-15の画素になる (packsで元の順に戻る)
+     */
+    for (k = 0; k + 1 < n; k += 2) {
+      a  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(rows[k] + x)));
+      b  = _mm256_cvtepu8_epi16(
+               _mm_loadu_si128((__m128i*)(rows[k + 1] + x)));
+      w  = _mm256_set1_epi32((int)(((uint32_t)wp[k] & 0xffff) |
+                                   ((uint32_t)wp[k + 1] << 16)));
+
+      lo = _mm256_add_epi32(lo,
+                            _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      hi = _mm256_add_epi32(hi,
+                            _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    if (k < n) {
+      a  = _mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i*)(rows[k] + x)));
+      b  = _mm256_setzero_si256();
+      w  = _mm256_set1_epi32((int)((uint32_t)wp[k] & 0xffff));
+
+      lo = _mm256_add_epi32(lo,
+                            _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+      hi = _mm256_add_epi32(hi,
+                            _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+    }
+
+    lo = _mm256_srai_epi32(lo, RESAMPLE_SHIFT);
+    hi = _mm256_srai_epi32(hi, RESAMPLE_SHIFT);
+    a  = _mm256_packs_epi32(lo, hi);
+    a  = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, a), 0xd8);
+
+    _mm_storeu_si128((__m128i*)(dst + x), _mm256_castsi256_si128(a));
+  }
+
+  return x;
+}
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+static void
+resample_vertical(JSAMPROW* rows, int16_t* wp, int n, uint8_t* dst, int len)
+{
+  /*
+   * n行の同じ位置の画素を畳み込む。SSE2/NEONが使える場合は8画素ずつ、
+   * AVX2が使える場合は16画素ずつ処理する (丸めと飽和の扱いは
+   * clip_sample()と同じ結果になる)。
+   */
+
+  int acc;
+  int x;
+  int k;
+
+  x = 0;
+
+#ifdef USE_AVX2_DISPATCH
+  if (have_avx2) x = resample_vertical_avx2(rows, wp, n, dst, len);
+#endif /* defined(USE_AVX2_DISPATCH) */
+
+#if defined(__SSE2__)
+  {
+    __m128i zero;
+    __m128i rnd;
+    __m128i lo;
+    __m128i hi;
+    __m128i a;
+    __m128i b;
+    __m128i w;
+
+    zero = _mm_setzero_si128();
+    rnd  = _mm_set1_epi32(RESAMPLE_ONE / 2);
+
+    for (; x + 8 <= len; x += 8) {
+      lo = rnd;
+      hi = rnd;
+
+      /* 2行ずつ16bitの積和 (pmaddwd) で処理する */
+      for (k = 0; k + 1 < n; k += 2) {
+        a  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(rows[k] + x)),
+                               zero);
+        b  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(rows[k + 1] + x)),
+                               zero);
+        w  = _mm_set1_epi32((int)(((uint32_t)wp[k] & 0xffff) |
+                                  ((uint32_t)wp[k + 1] << 16)));
+
+        lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+        hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+      }
+
+      if (k < n) {
+        a  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)(rows[k] + x)),
+                               zero);
+        w  = _mm_set1_epi32((int)((uint32_t)wp[k] & 0xffff));
+
+        lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero),
+                                              w));
+        hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero),
+                                              w));
+      }
+
+      lo = _mm_srai_epi32(lo, RESAMPLE_SHIFT);
+      hi = _mm_srai_epi32(hi, RESAMPLE_SHIFT);
+      a  = _mm_packs_epi32(lo, hi);
+
+      _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(a, a));
+    }
+  }
+#elif defined(__ARM_NEON)
+  {
+    int32x4_t lo;
+    int32x4_t hi;
+    int16x8_t a;
+
+    for (; x + 8 <= len; x += 8) {
+      lo = vdupq_n_s32(RESAMPLE_ONE / 2);
+      hi = vdupq_n_s32(RESAMPLE_ONE / 2);
+
+      for (k = 0; k < n; k++) {
+        a  = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + x)));
+        lo = vmlal_n_s16(lo, vget_low_s16(a), (int16_t)wp[k]);
+        hi = vmlal_n_s16(hi, vget_high_s16(a), (int16_t)wp[k]);
+      }
+
+      lo = vshrq_n_s32(lo, RESAMPLE_SHIFT);
+      hi = vshrq_n_s32(hi, RESAMPLE_SHIFT);
+
+      vst1_u8(dst + x, vqmovun_s16(vcombine_s16(vqmovn_s32(lo),
+                                                vqmovn_s32(hi))));
+    }
+  }
+#endif
+
+  for (; x < len; x++) {
+    for (k = 0, acc = 0; k < n; k++) {
+      acc += rows[k][x] * wp[k];
+    }
+
+    dst[x] = clip_sample(acc);
+  }
+}
+
+static void
+read_resampled_scanlines(decode_job_t* job)
+{
+  /*
+   * DCTスケーリングした画像を行単位で伸長しながら出力サイズにリサンプル
+   * する。
+   */
+
+  struct jpeg_decompress_struct* cinfo;
+  fit_plan_t* fit;
+  resample_coef_t hc;
+  resample_coef_t vc;
+  JSAMPARRAY in;
+  JSAMPARRAY out;
+  JSAMPROW* taps;
+  uint8_t* ring;
+  size_t tstride;
+  int nring;
+  int top;
+  int bottom;
+  int nc;
+  int sy;
+  int y;
+  int n;
+  int i;
+  int k;
+
+  cinfo = job->cinfo;
+  fit   = &job->fit;
+  nc    = cinfo->output_components;
+
+  make_resample_coef((j_common_ptr)cinfo, &hc, fit->filter,
+                     fit->sw, fit->tw, fit->x0, fit->cw);
+  make_resample_coef((j_common_ptr)cinfo, &vc, fit->filter,
+                     fit->sh, fit->th, fit->y0, fit->ch);
+
+  /*
+   * 作業領域 (入力行、水平方向の処理結果のリングバッファ)
+   */
+  for (y = 0, nring = 1; y < fit->th; y++) {
+    if (vc.count[y] > nring) nring = vc.count[y];
+  }
+
+  tstride = (size_t)fit->tw * nc;
+  in      = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                        fit->sw * nc + RESAMPLE_PAD,
+                                        UNIT_LINES);
+  ring    = (uint8_t*)(*cinfo->mem->alloc_large)((j_common_ptr)cinfo,
+                                          JPOOL_IMAGE, tstride * nring);
+  taps    = (JSAMPROW*)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+                                          JPOOL_IMAGE,
+                                          sizeof(JSAMPROW) * nring);
+
+  /* 余白はタップの切り上げで読まれる (重みは0) ので初期化しておく */
+  for (i = 0; i < UNIT_LINES; i++) {
+    memset(in[i] + (fit->sw * nc), 0, RESAMPLE_PAD);
+  }
+
+  /* YUV422/RGB565は一行ずつ求めてから詰める */
+  if (job->pack == PACK_ROWS) {
+    out   = (*cinfo->mem->alloc_sarray)((j_common_ptr)cinfo, JPOOL_IMAGE,
+                                        (JDIMENSION)tstride, 1);
+  } else {
+    out   = NULL;
+  }
+
+  /*
+   * 参照されない先頭の行は読み飛ばす
+   */
+  top    = vc.start[0];
+  bottom = vc.start[fit->th - 1] + vc.count[fit->th - 1];
+
+  skip_rows(cinfo, in, top);
+
+  y = 0;
+
+  while (y < fit->th) {
+    sy = cinfo->output_scanline;
+    n  = jpeg_read_scanlines(cinfo, in, UNIT_LINES);
+
+    for (i = 0; i < n && sy + i < bottom; i++) {
+      resample_horizontal(&hc, in[i],
+                          ring + (((sy + i) % nring) * tstride),
+                          fit->tw, nc);
+
+      /* この行で参照する行が揃う出力行を求める */
+      while (y < fit->th && vc.start[y] + vc.count[y] <= sy + i + 1) {
+        for (k = 0; k < vc.count[y]; k++) {
+          taps[k] = ring + (((vc.start[y] + k) % nring) * tstride);
+        }
+
+        if (out != NULL) {
+          resample_vertical(taps, vc.weight + (y * vc.size), vc.count[y],
+                            out[0], (int)tstride);
+          pack_row(job->ptr, out[0], job->raw + (y * job->stride), fit->tw);
+        } else {
+          resample_vertical(taps, vc.weight + (y * vc.size), vc.count[y],
+                            job->raw + (y * job->stride), (int)tstride);
+        }
+        y++;
+      }
+    }
+  }
+
+  /*
+   * 残りの行は読み飛ばす
+   */
+  skip_rows(cinfo, in, cinfo->output_height - cinfo->output_scanline);
+}
+
+static void
+plan_fit(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo,
+         int o9n, fit_plan_t* fit)
 {
-  if (opt != Qundef) {
-    ptr->do_block_smoothing = (RTEST(opt))? TRUE: FALSE;
+  /*
+   * :fit/:fill/:resizeの出力サイズを求め、出力を覆うことのできる最小のDCT
+   * スケーリング(1/8〜16/8)を選ぶ。出力サイズは回転後の画像に対して
+   * 求める。apply_decoder_context()の後に呼び出すこと (出力サイズは
+   * 最終的な大きさに置き換える)。
+   */
+
+  int iw;
+  int ih;
+  int bw;
+  int bh;
+  double sx;
+  double sy;
+  double s;
+  int num;
+
+  if (!TEST_FLAG(ptr, F_RESAMPLE)) return;
+
+  iw = cinfo->image_width;
+  ih = cinfo->image_height;
+
+  if (o9n & 4) {
+    bw = ptr->box[1];
+    bh = ptr->box[0];
+  } else {
+    bw = ptr->box[0];
+    bh = ptr->box[1];
+  }
+
+  sx = (double)bw / iw;
+  sy = (double)bh / ih;
+
+  if (TEST_FLAG(ptr, F_FIT)) {
+    s       = (sx < sy)? sx: sy;
+    fit->tw = (int)(iw * s + 0.5);
+    fit->th = (int)(ih * s + 0.5);
+
+    if (fit->tw < 1) fit->tw = 1;
+    if (fit->th < 1) fit->th = 1;
+    if (fit->tw > bw) fit->tw = bw;
+    if (fit->th > bh) fit->th = bh;
+
+    fit->cw = fit->tw;
+    fit->ch = fit->th;
+    fit->x0 = 0;
+    fit->y0 = 0;
+
+  } else if (TEST_FLAG(ptr, F_RESIZE)) {
+    fit->tw = bw;
+    fit->th = bh;
+    fit->cw = bw;
+    fit->ch = bh;
+    fit->x0 = 0;
+    fit->y0 = 0;
+
+  } else {
+    s       = (sx > sy)? sx: sy;
+    fit->cw = (int)(iw * s + 0.5);
+    fit->ch = (int)(ih * s + 0.5);
+
+    if (fit->cw < bw) fit->cw = bw;
+    if (fit->ch < bh) fit->ch = bh;
+
+    fit->tw = bw;
+    fit->th = bh;
+    fit->x0 = (fit->cw - bw) / 2;
+    fit->y0 = (fit->ch - bh) / 2;
+  }
+
+  for (num = 1; num < 16; num++) {
+    if ((iw * num + 7) / 8 >= fit->cw && (ih * num + 7) / 8 >= fit->ch) break;
+  }
+
+  cinfo->scale_num   = num;
+  cinfo->scale_denom = 8;
+
+  jpeg_calc_output_dimensions(cinfo);
+
+  fit->num             = num;
+  fit->filter          = ptr->filter;
+  fit->sw              = cinfo->output_width;
+  fit->sh              = cinfo->output_height;
+
+  cinfo->output_width  = fit->tw;
+  cinfo->output_height = fit->th;
+}
+
+static void
+read_fitted_scanlines(decode_job_t* job)
+{
+  /*
+   * DCTスケーリングした画像を出力サイズにリサンプルする。大きさが一致
+   * する場合は出力先に直接伸長する。
+   */
+
+  struct jpeg_decompress_struct* cinfo;
+  fit_plan_t* fit;
+
+  cinfo = job->cinfo;
+  fit   = &job->fit;
+
+  if (fit->sw == fit->tw && fit->sh == fit->th) {
+    read_direct_scanlines(job);
+  } else {
+    read_resampled_scanlines(job);
+  }
+
+  /*
+   * 後処理とメタ情報は出力サイズで扱う (拡大した場合にjpeg_finish_
+   * decompress()で行数不足と判定されない様に出力済みの行数も合わせる)
+   */
+  cinfo->output_width    = fit->tw;
+  cinfo->output_height   = fit->th;
+  cinfo->output_scanline = fit->th;
+}
+
+static void
+read_pixels(decode_job_t* job)
+{
+  /*
+   * 伸長処理本体。GVLを解放した状態で呼び出される。
+   * job->cinfoのエラーマネージャのjmpbufが設定済みであること。
+   */
+
+  struct jpeg_decompress_struct* cinfo;
+
+  cinfo        = job->cinfo;
+  job->limited = (job->ptr->max_scans > 0 && cinfo->progressive_mode);
+
+  /* apply_decoder_context()で設定したスケーリングを:fit/:fill用に置き換える */
+  if (job->fit.num > 0) {
+    cinfo->scale_num   = job->fit.num;
+    cinfo->scale_denom = 8;
+  }
+
+  if (job->limited) {
+    /*
+     * buffered-imageモードで指定したスキャンまでを出力する。残りの入力は
+     * 読まないので、後始末はjpeg_finish_decompress()ではなく
+     * jpeg_abort_decompress()で行うこと。
+     */
+    cinfo->buffered_image = TRUE;
+
+    jpeg_start_decompress(cinfo);
+    jpeg_start_output(cinfo, job->ptr->max_scans);
+
+  } else {
+    jpeg_start_decompress(cinfo);
+  }
+
+  if (TEST_FLAG(job->ptr, F_CROP)) {
+    read_cropped_scanlines(job);
+  } else if (job->fit.num > 0) {
+    read_fitted_scanlines(job);
+  } else {
+    read_direct_scanlines(job);
+  }
+
+  post_process(job);
+}
+
+/*
+ * リスタートマーカを利用した並列伸長
+ *
+ * エントロピー符号化データをMCU行の境界に一致するRSTnマーカで帯状に
+ * 分割し、各帯をヘッダ(SOFの高さを書き換えたもの)と連結して独立した
+ * JPEGデータとして別スレッドで伸長する。各帯の出力は出力バッファの
+ * 重ならない領域に直接書き込む。
+ */
+
+typedef struct {
+  decode_job_t* job;
+
+  uint8_t* jpg;
+  size_t sof;                 // offset of SOF marker
+  size_t sos;                 // offset of entropy coded data
+  size_t eoi;                 // end of entropy coded data
+  size_t* rst;                // offsets of RSTn markers
+  int nrst;
+
+  int interval;               // restart interval (in MCUs)
+  int mcus_per_row;
+  int mcu_ht;                 // height of MCU row (in pixels)
+  int scaled;                 // DCT scaled size (1..16)
+
+  int nbands;
+  int band_mcu_rows;
+
+  int next;
+  int failed;
+} band_plan_t;
+
+static int
+gcd(int a, int b)
+{
+  int t;
+
+  while (b != 0) {
+    t = a % b;
+    a = b;
+    b = t;
+  }
+
+  return a;
+}
+
+static int
+scan_markers(band_plan_t* plan, size_t jpg_sz)
+{
+  /*
+   * マーカを走査してSOF/SOSの位置とRSTnマーカの位置を得る。
+   * 並列化できないデータの場合は非0を返す。
+   */
+
+  uint8_t* p;
+  size_t pos;
+  size_t len;
+  size_t cap;
+  size_t* rst;
+  int ncomps;
+  int m;
+
+  p      = plan->jpg;
+  pos    = 2;
+  ncomps = 0;
+
+  if (jpg_sz < 4 || p[0] != 0xff || p[1] != 0xd8) return !0;
+
+  /* ヘッダ部 */
+  while (1) {
+    while (pos < jpg_sz && p[pos] != 0xff) pos++;
+    while (pos + 1 < jpg_sz && p[pos + 1] == 0xff) pos++;
+    if (pos + 4 > jpg_sz) return !0;
+
+    m   = p[pos + 1];
+    len = (p[pos + 2] << 8) | p[pos + 3];
+
+    if (pos + 2 + len > jpg_sz) return !0;
+
+    switch (m) {
+    case 0xc0:                // baseline
+    case 0xc1:                // extended sequential (huffman)
+      if (len < 8) return !0;
+      plan->sof = pos;
+      ncomps    = p[pos + 9];
+      break;
+
+    case 0xc2: case 0xc3: case 0xc5: case 0xc6: case 0xc7:
+    case 0xc9: case 0xca: case 0xcb: case 0xcd: case 0xce: case 0xcf:
+      /* progressive, lossless, hierarchical or arithmetic */
+      return !0;
+
+    case 0xda:                // SOS
+      /* 全コンポーネントを一つのスキャンで持つ場合のみ */
+      if (plan->sof == 0 || p[pos + 4] != ncomps) return !0;
+      plan->sos = pos + 2 + len;
+      break;
+    }
+
+    if (plan->sos != 0) break;
+
+    pos += 2 + len;
+  }
+
+  /* エントロピー符号化データ部 */
+  cap       = 256;
+  plan->rst = (size_t*)malloc(sizeof(size_t) * cap);
+  if (plan->rst == NULL) return !0;
+
+  pos       = plan->sos;
+  plan->eoi = jpg_sz;
+
+  while (1) {
+    p = memchr(plan->jpg + pos, 0xff, jpg_sz - pos);
+    if (p == NULL) break;
+
+    pos = p - plan->jpg;
+    if (pos + 1 >= jpg_sz) break;
+
+    m = p[1];
+
+    if (m == 0x00 || m == 0xff) {
+      pos += 1;
+      continue;
+    }
+
+    if (m >= 0xd0 && m <= 0xd7) {
+      if (plan->nrst == (int)cap) {
+        rst = (size_t*)realloc(plan->rst, sizeof(size_t) * cap * 2);
+        if (rst == NULL) return !0;
+
+        plan->rst = rst;
+        cap      *= 2;
+      }
+
+      plan->rst[plan->nrst++] = pos;
+      pos += 2;
+      continue;
+    }
+
+    if (m == 0xd9) {
+      plan->eoi = pos;
+      break;
+    }
+
+    /* DNLや後続のスキャンがある */
+    return !0;
+  }
+
+  return 0;
+}
+
+static int
+make_band_plan(band_plan_t* plan, decode_job_t* job)
+{
+  struct jpeg_decompress_struct* cinfo;
+  int mcu_wd;
+  int mcu_rows;
+  int nint;
+  int unit;
+  int units;
+  int per_band;
+
+  cinfo = job->cinfo;
+
+  if (cinfo->progressive_mode || cinfo->arith_code) return !0;
+  if (cinfo->restart_interval == 0) return !0;
+  if (TEST_FLAG(job->ptr, F_CROP | F_RESAMPLE)) return !0;
+  if (cinfo->quantize_colors) return !0;
+
+  /* 縦方向の補間付きアップサンプリングは隣接するMCU行を参照する */
+  if (cinfo->do_fancy_upsampling && cinfo->max_v_samp_factor > 1) return !0;
+
+  if (cinfo->num_components == 1) {
+    mcu_wd       = DCTSIZE;
+    plan->mcu_ht = DCTSIZE;
+  } else {
+    mcu_wd       = cinfo->max_h_samp_factor * DCTSIZE;
+    plan->mcu_ht = cinfo->max_v_samp_factor * DCTSIZE;
+  }
+
+  plan->interval     = cinfo->restart_interval;
+  plan->mcus_per_row = (cinfo->image_width + mcu_wd - 1) / mcu_wd;
+  plan->scaled       = cinfo->min_DCT_scaled_size;
+
+  mcu_rows = (cinfo->image_height + plan->mcu_ht - 1) / plan->mcu_ht;
+  nint     = ((plan->mcus_per_row * mcu_rows) + plan->interval - 1) /
+                                                            plan->interval;
+
+  /* 帯の境界に出来るMCU行の単位 */
+  unit     = plan->interval / gcd(plan->interval, plan->mcus_per_row);
+  units    = (mcu_rows + unit - 1) / unit;
+
+  if (units < 2) return !0;
+
+  per_band            = (units + job->threads - 1) / job->threads;
+  plan->band_mcu_rows = per_band * unit;
+  plan->nbands        = (mcu_rows + plan->band_mcu_rows - 1) /
+                                                        plan->band_mcu_rows;
+
+  if (plan->nbands < 2) return !0;
+
+  /* データの検証 */
+  if (scan_markers(plan, job->jpg_sz)) return !0;
+  if (plan->nrst != nint - 1) return !0;
+
+  return 0;
+}
+
+static uint8_t*
+make_band_data(band_plan_t* plan, int band, size_t* size)
+{
+  /*
+   * 帯一つ分のJPEGデータを作成する (mallocで確保)
+   */
+
+  uint8_t* ret;
+  uint8_t* p;
+  int row0;
+  int row1;
+  int k0;
+  int k1;
+  int ht;
+  int ht0;
+  int k;
+  size_t head;
+  size_t tail;
+  size_t len;
+
+  row0 = band * plan->band_mcu_rows;
+  row1 = row0 + plan->band_mcu_rows;
+  k0   = (int)(((long)row0 * plan->mcus_per_row) / plan->interval);
+  k1   = (int)(((long)row1 * plan->mcus_per_row) / plan->interval);
+
+  ht0  = (plan->jpg[plan->sof + 5] << 8) | plan->jpg[plan->sof + 6];
+  ht   = row1 * plan->mcu_ht;
+  if (ht > ht0) ht = ht0;
+  ht  -= row0 * plan->mcu_ht;
+
+  if (band == plan->nbands - 1) k1 = plan->nrst + 1;
+
+  head = (k0 == 0)? plan->sos: plan->rst[k0 - 1] + 2;
+  tail = (k1 == plan->nrst + 1)? plan->eoi: plan->rst[k1 - 1];
+
+  ret  = (uint8_t*)malloc(plan->sos + (tail - head) + 2);
+  if (ret == NULL) return NULL;
+
+  /* header (SOFの高さを書き換える) */
+  memcpy(ret, plan->jpg, plan->sos);
+
+  ret[plan->sof + 5] = (ht >> 8) & 0xff;
+  ret[plan->sof + 6] = (ht >> 0) & 0xff;
+
+  /* entropy coded data (RSTnを0から振り直す) */
+  p = ret + plan->sos;
+
+  for (k = k0; k < k1 - 1; k++) {
+    len = plan->rst[k] - head;
+    memcpy(p, plan->jpg + head, len);
+
+    p   += len;
+    *p++ = 0xff;
+    *p++ = 0xd0 + ((k - k0) & 7);
+
+    head = plan->rst[k] + 2;
+  }
+
+  len = tail - head;
+  memcpy(p, plan->jpg + head, len);
+  p += len;
+
+  *p++ = 0xff;
+  *p++ = 0xd9;
+
+  *size = p - ret;
+
+  return ret;
+}
+
+static int
+decode_band(band_plan_t* plan, decode_ctx_t* ctx, uint8_t* data, size_t size,
+            uint8_t* dst, int rows)
+{
+  int ret;
+  struct jpeg_decompress_struct* cinfo;
+
+  cinfo = &ctx->cinfo;
+
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    jpeg_abort_decompress(cinfo);
+    ret = !0;
+
+  } else {
+    jpeg_mem_src(cinfo, data, size);
+
+    /* プールから取り出したcinfoには前回の設定が残っている */
+    jpeg_save_markers(cinfo, JPEG_APP1, 0);
+    jpeg_read_header(cinfo, TRUE);
+
+    apply_decoder_context(plan->job->ptr, cinfo);
+    jpeg_start_decompress(cinfo);
+
+    if ((int)cinfo->output_height != rows ||
+        cinfo->output_width != plan->job->cinfo->output_width) {
+      jpeg_abort_decompress(cinfo);
+      ret = !0;
+
+    } else {
+      read_scanlines(plan->job->ptr, cinfo, ctx->array,
+                     (plan->job->pack == PACK_ROWS)?
+                                alloc_stage(cinfo, cinfo->output_width): NULL,
+                     dst, plan->job->stride);
+      jpeg_finish_decompress(cinfo);
+      ret = 0;
+    }
+  }
+
+  return ret;
+}
+
+static void*
+decode_band_worker(void* _plan)
+{
+  band_plan_t* plan;
+  decode_ctx_t* ctx;
+  uint8_t* data;
+  size_t size;
+  int out_ht;
+  int rows;
+  int i;
+
+  plan = (band_plan_t*)_plan;
+  ctx  = take_decode_context(&plan->job->set);
+
+  if (open_decode_context(ctx)) {
+    plan->failed = !0;
+    return NULL;
+  }
+
+  out_ht = plan->job->cinfo->output_height;
+  rows   = (plan->band_mcu_rows * plan->mcu_ht * plan->scaled) / DCTSIZE;
+
+  while ((i = __atomic_fetch_add(&plan->next, 1, __ATOMIC_RELAXED)) <
+                                                              plan->nbands) {
+    if (plan->failed) break;
+
+    data = make_band_data(plan, i, &size);
+    if (data == NULL) {
+      plan->failed = !0;
+      break;
+    }
+
+    if (decode_band(plan, ctx, data, size,
+                    plan->job->raw + ((size_t)i * rows * plan->job->stride),
+                    (i == plan->nbands - 1)? out_ht - (i * rows): rows)) {
+      plan->failed = !0;
+    }
+
+    free(data);
+  }
+
+  return NULL;
+}
+
+static int
+decode_in_parallel(decode_job_t* job)
+{
+  /*
+   * 並列伸長を試みる。並列化できない場合や失敗した場合は非0を返すので、
+   * 呼び出し元で逐次処理を行うこと。
+   */
+
+  int ret;
+  band_plan_t plan;
+
+  memset(&plan, 0, sizeof(plan));
+  plan.job = job;
+  plan.jpg = job->jpg;
+
+  if (make_band_plan(&plan, job)) {
+    ret = !0;
+
+  } else {
+    run_workers(decode_band_worker, &plan,
+                (job->threads < plan.nbands)? job->threads: plan.nbands);
+
+    ret = plan.failed;
+  }
+
+  if (plan.rst != NULL) free(plan.rst);
+
+  return ret;
+}
+
+static void*
+decode_body(void* _job)
+{
+  /*
+   * GVLを解放した状態で実行される部分。
+   * 出力バッファはすべて呼び出し前に確保済みであること。またエラーは
+   * longjmpでこの関数内に戻した上でステータスとして呼び出し元に返し、
+   * 例外の発生はGVLを再取得した後に行う。
+   */
+
+  decode_job_t* job;
+  ext_error_t* err;
+
+  job = (decode_job_t*)_job;
+  err = (ext_error_t*)job->cinfo->err;
+
+  if (job->threads > 1 && !decode_in_parallel(job)) {
+    post_process(job);
+
+    job->parallel = !0;
+    job->status   = 0;
+
+  } else if (setjmp(err->jmpbuf)) {
+    job->status = !0;
+
+  } else {
+    read_pixels(job);
+    job->status = 0;
   }
+
+  return NULL;
 }
 
-static void
-eval_decoder_opt_dither( jpeg_decode_t* ptr, VALUE opt)
+static int
+finish_decode(struct jpeg_decompress_struct* cinfo)
 {
-  VALUE dmode;
-  VALUE pass2;
-  VALUE n_col;
+  int ret;
+  ext_error_t* err;
 
-  if (opt != Qundef) {
-    if (TYPE(opt) != T_ARRAY) {
-      TYPE_ERROR("Unsupportd :dither option value.");
-    }
+  err = (ext_error_t*)cinfo->err;
 
-    if (RARRAY_LEN(opt) != 3) {
-      ARGUMENT_ERROR(":dither is illeagal length (shall be 3 entries).");
-    }
+  if (setjmp(err->jmpbuf)) {
+    ret = !0;
+  } else {
+    jpeg_finish_decompress(cinfo);
+    ret = 0;
+  }
 
-    dmode = RARRAY_AREF(opt, 0);
-    pass2 = RARRAY_AREF(opt, 1);
-    n_col = RARRAY_AREF(opt, 2);
-    
-    if (EQ_STR(dmode, "NONE")) {
-      ptr->dither_mode     = JDITHER_NONE;
-      ptr->quantize_colors = FALSE;
+  return ret;
+}
 
-    } else if(EQ_STR(dmode, "ORDERED")) {
-      ptr->dither_mode     = JDITHER_ORDERED;
-      ptr->quantize_colors = TRUE;
+static int
+check_decode_dest(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo,
+                  int o9n, decode_dest_t* dest)
+{
+  /*
+   * 出力先の大きさを検査し、デコード結果を直接書き込めるか否かを返す
+   * (GVL保持)。カラーマップの展開と回転はバッファ全体に対して行うので、
+   * その場合は一旦内部のバッファに展開した後に複写する。
+   */
 
-    } else if(EQ_STR(dmode, "FS")) {
-      ptr->dither_mode     = JDITHER_FS;
-      ptr->quantize_colors = TRUE;
+  int wd;
+  int ht;
+  int cmap;
+  size_t stride;
 
-    } else {
-      ARGUMENT_ERROR("dither mode is illeagal value.");
-    }
+  cmap = TEST_FLAG(ptr, F_EXPAND_COLORMAP) && WILL_BE_COLORMAPPED(cinfo);
 
-    ptr->two_pass_quantize = (RTEST(pass2))? TRUE: FALSE;
+  wd = cinfo->output_width;
+  ht = cinfo->output_height;
 
-    if (TYPE(n_col) == T_FIXNUM) {
-      ptr->desired_number_of_colors = FIX2INT(n_col);
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (o9n & 4)) {
+    SWAP(wd, ht, int);
+  }
 
-      if (ptr->desired_number_of_colors < 8 ||
-          ptr->desired_number_of_colors > 256) {
-        RANGE_ERROR("number of dithered colors shall be from 8 to 256.");
-      } 
+  if (cmap) {
+    dest->row = (size_t)wd * cinfo->out_color_components;
+  } else {
+    dest->row = row_size(ptr, cinfo, wd);
+  }
+  stride    = (dest->stride > 0)? dest->stride: dest->row;
 
-    } else {
-      TYPE_ERROR("number of dithered colors is illeagal value.");
-    }
+  if (stride < dest->row) {
+    ARGUMENT_ERROR("stride is too small.");
+  }
 
-    SET_FLAG(ptr, F_DITHER);
+  if (dest->offset > dest->size ||
+      dest->size - dest->offset < (stride * (ht - 1)) + dest->row) {
+    ARGUMENT_ERROR("buffer is too small.");
   }
+
+  dest->stride = stride;
+
+  return !cmap && !(TEST_FLAG(ptr, F_APPLY_ORIENTATION) && o9n != 0);
 }
 
-#if 0
 static void
-eval_decoder_opt_use_1pass_quantizer(jpeg_decode_t* ptr, VALUE opt)
+copy_to_dest(decode_dest_t* dest, VALUE img)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      ptr->enable_1pass_quant = TRUE;
-      ptr->buffered_image     = TRUE;
-    } else {
-      ptr->enable_1pass_quant = FALSE;
-    }
+  uint8_t* src;
+  uint8_t* dst;
+  size_t n;
+  size_t i;
+
+  src = (uint8_t*)RSTRING_PTR(img);
+  dst = dest->ptr + dest->offset;
+  n   = RSTRING_LEN(img) / dest->row;
+
+  for (i = 0; i < n; i++) {
+    memcpy(dst, src, dest->row);
+
+    src += dest->row;
+    dst += dest->stride;
   }
 }
 
-static void
-eval_decoder_opt_use_external_colormap(jpeg_decode_t* ptr, VALUE opt)
+static VALUE
+set_thumb_exif(VALUE meta, thumb_t* thumb)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      ptr->enable_external_quant = TRUE;
-      ptr->buffered_image        = TRUE;
-    } else {
-      ptr->enable_external_quant = FALSE;
-    }
+  /* サムネイルを伸長した場合、Exifタグは本体のものに差し替える */
+  if (thumb->data != Qnil && thumb->exif != Qnil) {
+    rb_ivar_set(meta, id_exif_tags, thumb->exif);
   }
+
+  return meta;
 }
 
-static void
-eval_decoder_opt_use_2pass_quantizer(jpeg_decode_t* ptr, VALUE opt)
+static int
+probe_thumbnail(jpeg_decode_t* ptr, struct jpeg_decompress_struct* cinfo,
+                uint8_t* jpg, size_t jpg_sz, thumb_t* thumb)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      ptr->enable_2pass_quant = TRUE;
-      ptr->buffered_image     = TRUE;
-    } else {
-      ptr->enable_2pass_quant = FALSE;
+  /*
+   * Exifのサムネイルが:prefer_thumbnailの大きさを満たすか調べる。サムネ
+   * イルにはOrientationなどのタグが無いので本体のものを控えておく。
+   * 読み込みに失敗した場合は本体を伸長する (本体のエラーはそちらで報告
+   * される)。
+   */
+
+  ext_error_t* err;
+  uint8_t* p;
+  size_t n;
+  int wd;
+  int ht;
+
+  err         = (ext_error_t*)cinfo->err;
+
+  thumb->data = Qnil;
+  thumb->o9n  = 0;
+  thumb->exif = Qnil;
+
+  if (setjmp(err->jmpbuf)) {
+    jpeg_abort_decompress(cinfo);
+    thumb->data = Qnil;
+
+  } else {
+    jpeg_mem_src(cinfo, jpg, jpg_sz);
+    jpeg_save_markers(cinfo, JPEG_APP1, 0xFFFF);
+    jpeg_read_header(cinfo, TRUE);
+
+    if (pick_exif_thumbnail(cinfo, &p, &n)) {
+      if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+        thumb->o9n = pick_exif_orientation(cinfo);
+      }
+
+      if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
+        thumb->exif = create_exif_tags_hash(cinfo);
+      }
+
+      /* マーカーの領域は次のjpeg_abort_decompress()で解放されるので複製 */
+      thumb->data = rb_str_new((char*)p, n);
+      rb_obj_freeze(thumb->data);
+
+      jpeg_abort_decompress(cinfo);
+      jpeg_mem_src(cinfo, (uint8_t*)RSTRING_PTR(thumb->data),
+                   RSTRING_LEN(thumb->data));
+      jpeg_read_header(cinfo, TRUE);
+
+      if (thumb->o9n & 4) {
+        wd = cinfo->image_height;
+        ht = cinfo->image_width;
+      } else {
+        wd = cinfo->image_width;
+        ht = cinfo->image_height;
+      }
+
+      if (wd < ptr->thumb[0] || ht < ptr->thumb[1]) thumb->data = Qnil;
     }
+
+    jpeg_abort_decompress(cinfo);
   }
+
+  return (thumb->data != Qnil);
 }
-#endif
 
-static void
-eval_decoder_opt_without_meta(jpeg_decode_t* ptr, VALUE opt)
+static VALUE
+do_decode(jpeg_decode_t* owner, jpeg_decode_t* ptr, decode_ctx_t* ctx,
+          uint8_t* jpg, size_t jpg_sz, decode_dest_t* dest, thumb_t* thumb)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      CLR_FLAG(ptr, F_NEED_META);
-    } else {
-      SET_FLAG(ptr, F_NEED_META);
-    }
+  VALUE ret;
+  VALUE raw;
+  VALUE cmap;
+  struct jpeg_decompress_struct* cinfo;
+  decode_job_t job;
+  int direct;
+
+  if (open_decode_context(ctx)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
   }
-}
 
-static void
-eval_decoder_opt_expand_colormap(jpeg_decode_t* ptr, VALUE opt)
-{
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      SET_FLAG(ptr, F_EXPAND_COLORMAP);
-    } else {
-      CLR_FLAG(ptr, F_EXPAND_COLORMAP);
+  cinfo = &ctx->cinfo;
+
+  memset(&job, 0, sizeof(job));
+  job.ptr    = ptr;
+  job.cinfo  = cinfo;
+  job.array  = ctx->array;
+  job.jpg    = jpg;
+  job.jpg_sz = jpg_sz;
+
+  /*
+   * ヘッダの解析と出力バッファの確保 (GVL保持)
+   * 作業領域の後始末は呼び出し元 (decode_ensure()) で行う
+   */
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
+
+  jpeg_mem_src(cinfo, jpg, jpg_sz);
+
+  /* 再利用するcinfoには前回の設定が残っているので毎回設定する */
+  jpeg_save_markers(cinfo, JPEG_APP1,
+                    TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)?
+                                                              0xFFFF: 0);
+
+  jpeg_read_header(cinfo, TRUE);
+
+  apply_decoder_context(ptr, cinfo);
+  jpeg_calc_output_dimensions(cinfo);
+
+  if (thumb->data != Qnil) {
+    job.o9n = thumb->o9n;
+
+  } else if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+    job.o9n = pick_exif_orientation(cinfo);
+  }
+
+  if (apply_crop(ptr, cinfo)) {
+    ARGUMENT_ERROR("crop region is out of the image.");
+  }
+
+  plan_fit(ptr, cinfo, job.o9n, &job.fit);
+
+  job.pack = plan_pack(ptr, cinfo, job.o9n);
+  direct   = (dest != NULL) && check_decode_dest(ptr, cinfo, job.o9n, dest);
+
+  if (direct) {
+    /* 呼び出し元のバッファに直接書き込む */
+    job.raw    = dest->ptr + dest->offset;
+    job.stride = dest->stride;
+
+    ret        = Qnil;
+    raw        = Qnil;
+    cmap       = Qnil;
+
+  } else {
+    ret = prepare_output(ptr, &job, &raw, &cmap);
+
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (job.o9n & 4)) {
+      ret     = alloc_orientation_buffer(ret);
+      job.rot = (uint8_t*)RSTRING_PTR(ret);
     }
   }
+
+  if (ptr->threads > 0) {
+    job.threads = ptr->threads;
+
+  } else if ((long)cinfo->image_width * cinfo->image_height >=
+                                                  PARALLEL_DECODE_THRESHOLD) {
+    job.threads = get_ncpus();
+  }
+
+  /*
+   * 帯状の並列伸長で各スレッドが使う作業領域 (リスタートマーカが無い
+   * 場合は並列化できないので取り出さない)
+   */
+  if (job.threads > 1 && cinfo->restart_interval > 0) {
+    job.set.owner = owner;
+    job.set.n     = job.threads;
+  }
+
+  /*
+   * 伸長処理本体 (GVL解放)
+   */
+  call_without_gvl_with_decode_contexts(&job.set, decode_body, &job);
+
+  RB_GC_GUARD(raw);
+  RB_GC_GUARD(cmap);
+
+  if (job.status) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
+
+  /*
+   * 後処理 (GVL保持)
+   */
+  if (dest != NULL) {
+    if (!direct) copy_to_dest(dest, ret);
+    ret = create_meta(ptr, cinfo, job.o9n);
+    set_thumb_exif(ret, thumb);
+
+  } else if (TEST_FLAG(ptr, F_NEED_META)) {
+    add_meta(ret, set_thumb_exif(create_meta(ptr, cinfo, job.o9n), thumb));
+  }
+
+  if (job.parallel || job.limited) {
+    /*
+     * 並列伸長の場合、本体のcinfoはヘッダの読み込みのみ行っている。
+     * :max_scansで打ち切った場合は残りの入力を読まずに終える。
+     */
+    jpeg_abort_decompress(cinfo);
+
+  } else if (finish_decode(cinfo)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
+
+  return ret;
 }
 
-static void
-eval_decoder_opt_scale(jpeg_decode_t* ptr, VALUE opt)
+static VALUE
+decode_protect(VALUE _arg)
 {
-  switch (TYPE(opt)) {
-  case T_UNDEF:
-    // Nothing
-    break;
-
-  case T_FLOAT:
-    ptr->scale_num   = (int)(NUM2DBL(opt) * 1000.0);
-    ptr->scale_denom = 1000;
-    break;
+  VALUE ret;
+  VALUE data;
+  decode_arg_t* arg;
+  thumb_t thumb;
 
-  case T_RATIONAL:
-    ptr->scale_num   = FIX2INT(rb_rational_num(opt));
-    ptr->scale_denom = FIX2INT(rb_rational_den(opt));
-    break;
+  arg        = (decode_arg_t*)_arg;
+  data       = arg->data;
+  thumb.data = Qnil;
 
-  case T_ARRAY:
-    if (RARRAY_LEN(opt) != 2) {
-      ARGUMENT_ERROR("invalid length");
+  /*
+   * :prefer_thumbnailの条件を満たすサムネイルがあればそれを入力にする
+   */
+  if (TEST_FLAG(&arg->cfg, F_PREFER_THUMB)) {
+    if (open_decode_context(arg->ctx)) {
+      rb_raise(decerr_klass, "%s", arg->ctx->err_mgr.msg);
     }
-    ptr->scale_num   = FIX2INT(RARRAY_AREF(opt, 0));
-    ptr->scale_denom = FIX2INT(RARRAY_AREF(opt, 1));
-    break;
 
-  default:
-    TYPE_ERROR("Unsupportd :exapnd_colormap option value.");
-    break;
+    if (probe_thumbnail(&arg->cfg, &arg->ctx->cinfo,
+                        (uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data),
+                        &thumb)) {
+      data = thumb.data;
+    }
   }
+
+  ret = do_decode(arg->ptr, &arg->cfg, arg->ctx,
+                  (uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data),
+                  (decode_dest_t*)arg->opt, &thumb);
+
+  RB_GC_GUARD(data);
+
+  return ret;
 }
 
-static void
-eval_decoder_opt_dct_method(jpeg_decode_t* ptr, VALUE opt)
+/**
+ * decode JPEG data
+ *
+ * @overload decode(jpeg)
+ *
+ *   @param jpeg [String]  JPEG data to decode.
+ *
+ *   @return [String] decoded raw image data.
+ *
+ *   @note The decoding itself runs without holding the GVL, so other
+ *     Ruby threads keep running while a large image is decoded.
+ *     The working state is taken from a lock-free pool held by the
+ *     decoder, so one decoder object can be used from several threads
+ *     (or Ractors, once made shareable) at the same time. #feed is an
+ *     exception: it keeps the state of one stream in the decoder.
+ */
+static VALUE
+rb_decoder_decode(VALUE self, VALUE data)
 {
-  if (opt != Qundef) {
-    if (EQ_STR(opt, "ISLOW")) {
-      ptr->dct_method = JDCT_ISLOW;
+    VALUE ret;
+    jpeg_decode_t* ptr;
 
-    } else if (EQ_STR(opt, "IFAST")) {
-      ptr->dct_method = JDCT_IFAST;
+    /*
+     * initialize
+     */
+    TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-    } else if (EQ_STR(opt, "FLOAT")) {
-      ptr->dct_method = JDCT_FLOAT;
+    /*
+     * argument check
+     */
+    Check_Type(data, T_STRING);
 
-    } else if (EQ_STR(opt, "FASTEST")) {
-      ptr->dct_method = JDCT_FASTEST;
+    /*
+     * do decode
+     *
+     * GVLを解放している間にdataが変更されない様にロックしておく。また
+     * 設定値は#setで変更されても影響を受けない様に複製して使用する。
+     */
+    data = rb_str_new_frozen(data);
+    ret  = call_with_decode_context(ptr, decode_protect, data, NULL);
 
-    } else {
-      ARGUMENT_ERROR("Unsupportd :dct_method option value.");
-    }
-  }
+    return ret;
 }
 
 static void
-eval_decoder_opt_with_exif_tags(jpeg_decode_t* ptr, VALUE opt)
+lock_decode_dest(decode_dest_t* dest, VALUE buf)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      SET_FLAG(ptr, F_PARSE_EXIF);
-    } else {
-      CLR_FLAG(ptr, F_PARSE_EXIF);
-    }
+  /*
+   * GVLを解放している間に出力先が変更・解放されない様にロックする
+   */
+
+  void* base;
+  size_t size;
+
+  if (RB_TYPE_P(buf, T_STRING)) {
+    rb_str_modify(buf);
+    rb_str_locktmp(buf);
+
+    base = RSTRING_PTR(buf);
+    size = RSTRING_LEN(buf);
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  } else if (rb_obj_is_kind_of(buf, rb_cIOBuffer)) {
+    rb_io_buffer_get_bytes_for_writing(buf, &base, &size);
+    rb_io_buffer_lock(buf);
+#endif /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
+
+  } else {
+    TYPE_ERROR("buffer shall be String or IO::Buffer.");
   }
+
+  dest->buf  = buf;
+  dest->ptr  = (uint8_t*)base;
+  dest->size = size;
 }
 
-static void
-eval_decoder_opt_orientation(jpeg_decode_t* ptr, VALUE opt)
+static VALUE
+unlock_decode_dest(VALUE _dest)
 {
-  if (opt != Qundef) {
-    if (RTEST(opt)) {
-      SET_FLAG(ptr, F_APPLY_ORIENTATION);
-    } else {
-      CLR_FLAG(ptr, F_APPLY_ORIENTATION);
-    }
+  decode_dest_t* dest;
+
+  dest = (decode_dest_t*)_dest;
+
+  if (RB_TYPE_P(dest->buf, T_STRING)) {
+    rb_str_unlocktmp(dest->buf);
+
+#ifdef HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+  } else {
+    rb_io_buffer_unlock(dest->buf);
+#endif /* defined(HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING) */
   }
+
+  return Qnil;
 }
 
-static void
-set_decoder_context( jpeg_decode_t* ptr, VALUE opt)
+typedef struct {
+  jpeg_decode_t* ptr;
+  VALUE data;
+  decode_dest_t dest;
+} decode_into_arg_t;
+
+static VALUE
+decode_into_body(VALUE _arg)
 {
-  VALUE opts[N(decoder_opts_ids)];
+  decode_into_arg_t* arg;
 
-  /*
-   * parse options
-   */
-  rb_get_kwargs(opt, decoder_opts_ids, 0, N(decoder_opts_ids), opts);
+  arg = (decode_into_arg_t*)_arg;
 
-  /*
-   * set context
-   */
-  eval_decoder_opt_pixel_format(ptr, opts[0]);
-  eval_decoder_opt_output_gamma(ptr, opts[1]);
-  eval_decoder_opt_do_fancy_upsampling(ptr, opts[2]);
-  eval_decoder_opt_do_smoothing(ptr, opts[3]);
-  eval_decoder_opt_dither(ptr, opts[4]);
-#if 0
-  eval_decoder_opt_use_1pass_quantizer(ptr, opts[5]);
-  eval_decoder_opt_use_external_colormap(ptr, opts[6]);
-  eval_decoder_opt_use_2pass_quantizer(ptr, opts[7]);
-#endif
-  eval_decoder_opt_without_meta(ptr, opts[5]);
-  eval_decoder_opt_expand_colormap(ptr, opts[6]);
-  eval_decoder_opt_scale(ptr, opts[7]);
-  eval_decoder_opt_dct_method(ptr, opts[8]);
-  eval_decoder_opt_with_exif_tags(ptr, opts[9]);
-  eval_decoder_opt_with_exif_tags(ptr, opts[10]);
-  eval_decoder_opt_orientation(ptr, opts[11]);
+  return call_with_decode_context(arg->ptr, decode_protect,
+                                  arg->data, &arg->dest);
 }
 
 /**
- * initialize decoder object
- *
- * @overload initialize(opts)
- *
- *   @param opts [Hash] options to initialize object
- *
- *   @option opts [Symbol] :pixel_format
- *     specifies the format of the output image. possible values are:
- *     YUV422 YUYV RGB565 RGB RGB24 BGR BGR24 YUV444 YCbCr
- *     RGBX RGB32 BGRX BGR32 GRAYSCALE
- *
- *   @option opts [Float] :output_gamma
- *
- *   @option opts [Boolean] :fancy_upsampling
- *
- *   @option opts [Boolean] :do_smoothing
+ * decode JPEG data into the given buffer
  *
- *   @option opts [Array] :dither
- *     specifies dithering parameters. A 3-elements array.
- *     specify the dither type as a string for the 1st element,
- *     whether to use 2-pass quantize for the 2nd element as a boolean,
- *     and the number of colors used for the 3rd element as an integer
- *     from 16 to 256.
+ * @overload decode_into(jpeg, buffer, offset: 0, stride: nil)
  *
- *   @option opts [Boolean] :without_meta
- *     specifies whether or not to include meta information in the
- *     output data. If true, no meta-information is output.
+ *   @param jpeg [String]  JPEG data to decode.
  *
- *   @option opts [Boolean] :expand_colormap
- *     specifies whether to expand the color map. If dither is specified,
- *     the output will be a color number of 1 byte per pixel, but if this
- *     option is set to true, the output will be expanded to color information.
+ *   @param buffer [String, IO::Buffer]  destination of the decoded raw
+ *     image data. the buffer is not resized, so it shall be large enough
+ *     to hold the whole image.
  *
- *   @option opts [Ratioanl] :scale
+ *   @param offset [Integer]  byte offset of the first row in the buffer.
  *
- *   @option opts [Symbol] :dct_method
- *     specifies how decoding is handled. possible values are:
- *     FASTEST ISLOW IFAST FLOAT
+ *   @param stride [Integer]  byte distance between the heads of two
+ *     adjacent rows in the buffer. if omitted, the rows are packed.
  *
- *   @option opts [Boolean] :with_exif_tags
- *     specifies whether to include Exif tag information in the output data.
- *     set this option to true to parse the Exif tag information and include
- *     it in the meta information output.
+ *   @return [JPEG::Meta] metadata of the decoded image.
  *
- *   @option opts [Boolean] :with_exif
- *     alias to :with_exif_tags option.
+ *   @note The bytes between rows (when a stride larger than the row size
+ *     is given) are left untouched. The buffer is locked while decoding,
+ *     so that it can not be modified from other threads.
  */
 static VALUE
-rb_decoder_initialize( int argc, VALUE *argv, VALUE self)
+rb_decoder_decode_into(int argc, VALUE* argv, VALUE self)
 {
+  VALUE ret;
   jpeg_decode_t* ptr;
+  VALUE data;
+  VALUE buf;
   VALUE opt;
+  VALUE opts[N(decode_into_opts_ids)];
+  decode_into_arg_t arg;
+  long val;
 
   /*
    * initialize
    */
-  Data_Get_Struct(self, jpeg_decode_t, ptr);
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  memset(&arg, 0, sizeof(arg));
 
   /*
    * parse arguments
    */
-  rb_scan_args( argc, argv, "01", &opt);
+  rb_scan_args(argc, argv, "2:", &data, &buf, &opt);
 
-  if (opt != Qnil) Check_Type(opt, T_HASH);
+  Check_Type(data, T_STRING);
+  rb_get_kwargs(opt, decode_into_opts_ids, 0, N(decode_into_opts_ids), opts);
 
-  /*
-   * set context
-   */ 
-  set_decoder_context(ptr, opt);
+  if (opts[0] != Qundef) {
+    val = NUM2LONG(opts[0]);
+    if (val < 0) {
+      RANGE_ERROR(":offset shall be 0 or more.");
+    }
 
-  return Qtrue;
-}
+    arg.dest.offset = val;
+  }
 
-static VALUE
-rb_decoder_set(VALUE self, VALUE opt)
-{
-  jpeg_decode_t* ptr;
+  if (opts[1] != Qundef && !NIL_P(opts[1])) {
+    val = NUM2LONG(opts[1]);
+    if (val < 1) {
+      RANGE_ERROR(":stride shall be 1 or more.");
+    }
 
-  /*
-   * initialize
-   */
-  Data_Get_Struct(self, jpeg_decode_t, ptr);
+    arg.dest.stride = val;
+  }
 
   /*
-   * check argument
+   * do decode
    */
-  Check_Type(opt, T_HASH);
-
-  /*
-   * set context
-   */ 
-  set_decoder_context(ptr, opt);
-
-  return Qtrue;
-}
-
-static VALUE
-get_colorspace_str( J_COLOR_SPACE cs)
-{
-  const char* cstr;
-
-  switch (cs) {
-  case JCS_GRAYSCALE:
-    cstr = "GRAYSCALE";
-    break;
-
-  case JCS_RGB:
-    cstr = "RGB";
-    break;
-
-  case JCS_YCbCr:
-    cstr = "YCbCr";
-    break;
-
-  case JCS_CMYK:
-    cstr = "CMYK";
-    break;
-
-  case JCS_YCCK:
-    cstr = "YCCK";
-    break;
-#if JPEG_LIB_VERSION < 90
-  case JCS_EXT_RGB:
-    cstr = "RGB";
-    break;
-
-  case JCS_EXT_RGBX:
-    cstr = "RGBX";
-    break;
-
-  case JCS_EXT_BGR:
-    cstr = "BGR";
-    break;
-
-  case JCS_EXT_BGRX:
-    cstr = "BGRX";
-    break;
-
-  case JCS_EXT_XBGR:
-    cstr = "XBGR";
-    break;
-
-  case JCS_EXT_XRGB:
-    cstr = "XRGB";
-    break;
+  arg.ptr  = ptr;
+  arg.data = rb_str_new_frozen(data);
 
-  case JCS_EXT_RGBA:
-    cstr = "RGBA";
-    break;
+  lock_decode_dest(&arg.dest, buf);
 
-  case JCS_EXT_BGRA:
-    cstr = "BGRA";
-    break;
+  ret = rb_ensure(decode_into_body, (VALUE)&arg,
+                  unlock_decode_dest, (VALUE)&arg.dest);
 
-  case JCS_EXT_ABGR:
-    cstr = "ABGR";
-    break;
+  RB_GC_GUARD(arg.data);
+  RB_GC_GUARD(buf);
 
-  case JCS_EXT_ARGB:
-    cstr = "ARGB";
-    break;
-#endif /* JPEG_LIB_VERSION < 90 */
+  return ret;
+}
 
-  default:
-    cstr = "UNKNOWN";
-    break;
-  }
+/*
+ * ストリーム伸長 (decode_io / feed)
+ *
+ * 入力を断片毎に受け取りながら伸長を進める。入力が不足した場合は
+ * libjpegのサスペンド機能で処理を中断し、次の断片を受け取った時点で
+ * 再開する。中断時に未消費だった入力はバッファに残しておく。
+ */
 
-  return rb_str_new_cstr(cstr);
-}
+#define STREAM_HEADER              0
+#define STREAM_START               1
+#define STREAM_SCAN                2
+#define STREAM_FINISH              3
+#define STREAM_DONE                4
 
-typedef struct {
-  int be;
-  uint8_t* head;
-  uint8_t* cur;
-  size_t size;
+#define STREAM_READ_SIZE           (64 * 1024)
 
-  struct {
-    tag_entry_t* tbl;
-    size_t n;
-  } tags;
+typedef struct decode_stream {
+  struct jpeg_source_mgr pub;
+  struct jpeg_source_mgr* prev_src;   // source manager to be restored
 
-  int next;
-} exif_t;
+  jpeg_decode_t cfg;
+  jpeg_decode_t* owner;       // owner of ctx's pool (or NULL if private)
+  decode_ctx_t* ctx;
 
-static uint16_t
-get_u16(uint8_t* src, int be)
-{
-  uint16_t ret;
+  int state;
+  int started;                // jpeg_save_markers() was called
+  int eof;                    // end of input was notified
+  int busy;                   // the step without GVL is in progress
+  int status;                 // result of the step without GVL
+  size_t skip;                // bytes to be skipped from next input
 
-  if (be) {
-    ret = (((src[0] << 8) & 0xff00)|
-           ((src[1] << 0) & 0x00ff));
-  } else {
-    ret = (((src[1] << 8) & 0xff00)|
-           ((src[0] << 0) & 0x00ff));
-  }
+  uint8_t* buf;
+  size_t capa;
 
-  return ret;
-}
+  decode_job_t job;
 
-/*
-static int16_t
-get_s16(uint8_t* src, int be)
-{
-  int16_t ret;
+  VALUE ret;
+  VALUE raw;
+  VALUE cmap;
+  VALUE meta;
 
-  if (be) {
-    ret = (((src[0] << 8) & 0xff00)|
-           ((src[1] << 0) & 0x00ff));
-  } else {
-    ret = (((src[1] << 8) & 0xff00)|
-           ((src[0] << 0) & 0x00ff));
-  }
+  char msg[JMSG_LENGTH_MAX+10];
+} decode_stream_t;
 
-  return ret;
+static void
+stream_init_source(j_decompress_ptr cinfo)
+{
+  /* nothing to do */
 }
-*/
 
-static uint32_t
-get_u32(uint8_t* src, int be)
+static boolean
+stream_fill_input_buffer(j_decompress_ptr cinfo)
 {
-  uint32_t ret;
+  static const JOCTET eoi[] = {0xff, JPEG_EOI};
 
-  if (be) {
-    ret = (((src[0] << 24) & 0xff000000)|
-           ((src[1] << 16) & 0x00ff0000)|
-           ((src[2] <<  8) & 0x0000ff00)|
-           ((src[3] <<  0) & 0x000000ff));
-  } else {
-    ret = (((src[3] << 24) & 0xff000000)|
-           ((src[2] << 16) & 0x00ff0000)|
-           ((src[1] <<  8) & 0x0000ff00)|
-           ((src[0] <<  0) & 0x000000ff));
-  }
+  decode_stream_t* st;
 
-  return ret;
+  st = (decode_stream_t*)cinfo->src;
+
+  /* 次の入力を待つ (サスペンド) */
+  if (!st->eof) return FALSE;
+
+  /* 入力の終端に達した場合はjpeg_mem_src()と同様にEOIを補う */
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+
+  st->pub.next_input_byte = eoi;
+  st->pub.bytes_in_buffer = sizeof(eoi);
+
+  return TRUE;
 }
 
-static int32_t
-get_s32(uint8_t* src, int be)
+static void
+stream_skip_input_data(j_decompress_ptr cinfo, long n)
 {
-  int32_t ret;
+  decode_stream_t* st;
+
+  st = (decode_stream_t*)cinfo->src;
+
+  if (n <= 0) return;
+
+  if ((size_t)n <= st->pub.bytes_in_buffer) {
+    st->pub.next_input_byte += n;
+    st->pub.bytes_in_buffer -= n;
 
-  if (be) {
-    ret = (((src[0] << 24) & 0xff000000)|
-           ((src[1] << 16) & 0x00ff0000)|
-           ((src[2] <<  8) & 0x0000ff00)|
-           ((src[3] <<  0) & 0x000000ff));
   } else {
-    ret = (((src[3] << 24) & 0xff000000)|
-           ((src[2] << 16) & 0x00ff0000)|
-           ((src[1] <<  8) & 0x0000ff00)|
-           ((src[0] <<  0) & 0x000000ff));
-  }
+    /* バッファを越える分は次の入力から読み飛ばす */
+    st->skip += n - st->pub.bytes_in_buffer;
 
-  return ret;
+    st->pub.next_input_byte += st->pub.bytes_in_buffer;
+    st->pub.bytes_in_buffer  = 0;
+  }
 }
 
 static void
-exif_increase(exif_t* ptr, size_t size)
+stream_term_source(j_decompress_ptr cinfo)
 {
-  ptr->cur  += size;
-  ptr->size -= size;
+  /* nothing to do */
 }
 
 static void
-exif_init(exif_t* ptr, uint8_t* src, size_t size)
+mark_decode_stream(decode_stream_t* st)
 {
-  int be;
-  uint16_t ident;
-  uint32_t off;
-
-  /*
-   * Check Exif identifier
-   */
-  if (memcmp(src, "Exif\0\0", 6)) {
-    rb_raise(decerr_klass, "invalid exif identifier");
-  }
-
   /*
-   * Check TIFF header and judge endian
+   * ストリームの状態はデコーダ (#feed) またはdecode_ioのラッパが所有し、
+   * 伸長途中の出力バッファはその所有者のマーク関数からマークする。
    */
-  do {
-    if (!memcmp(src + 6, "MM", 2)) {
-      be = !0;
-      break;
-    }
 
-    if (!memcmp(src + 6, "II", 2)) {
-      be = 0;
-      break;
-    }
-
-    rb_raise(decerr_klass, "invalid tiff header");
-  } while (0);
-
-  /*
-   * Check TIFF identifier
-   */
-  ident = get_u16(src + 8, be);
-  if (ident != 0x002a) {
-    rb_raise(decerr_klass, "invalid tiff identifier");
-  }
+  rb_gc_mark(st->ret);
+  rb_gc_mark(st->raw);
+  rb_gc_mark(st->cmap);
+  rb_gc_mark(st->meta);
+}
 
-  /*
-   * get offset for 0th IFD
-   */
-  off = get_u32(src + 10, be);
-  if (off < 8 || off >= size - 6) {
-    rb_raise(decerr_klass, "invalid offset dentifier");
-  }
+static void
+free_decode_stream(decode_stream_t* st)
+{
+  /* プールから借りた作業領域は呼び出し元で返却済み */
+  if (st->ctx != NULL) free_decode_context(st->ctx);
+  if (st->buf != NULL) xfree(st->buf);
 
-  /*
-   * initialize Exif context
-   */
-  ptr->be       = be;
-  ptr->head     = src + 6;
-  ptr->cur      = ptr->head + off;
-  ptr->size     = size - (6 + off);
-  ptr->tags.tbl = tag_tiff;
-  ptr->tags.n   = N(tag_tiff);
-  ptr->next     = 0;
+  xfree(st);
 }
 
 static void
-exif_fetch_tag_header(exif_t* ptr, uint16_t* tag, uint16_t* type)
+rb_decode_stream_mark(void* _st)
 {
-  *tag  = get_u16(ptr->cur + 0, ptr->be);
-  *type = get_u16(ptr->cur + 2, ptr->be);
+  mark_decode_stream((decode_stream_t*)_st);
 }
 
+static void
+rb_decode_stream_free(void* _st)
+{
+  free_decode_stream((decode_stream_t*)_st);
+}
 
 static void
-exif_fetch_byte_data(exif_t* ptr, VALUE* dst)
+reset_decode_stream(decode_stream_t* st)
 {
-  VALUE obj;
+  /*
+   * 次の画像を受け付けられる状態に戻す
+   */
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  if (st->ctx->active) jpeg_abort_decompress(&st->ctx->cinfo);
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  memset(&st->job, 0, sizeof(st->job));
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  st->state               = STREAM_HEADER;
+  st->started             = 0;
+  st->eof                 = 0;
+  st->skip                = 0;
 
-  case 1:
-    obj = INT2FIX(*p);
-    break;
+  st->pub.next_input_byte = st->buf;
+  st->pub.bytes_in_buffer = 0;
 
-  default:
-    p = ptr->head + get_u32(p, ptr->be);
+  st->ret                 = Qnil;
+  st->raw                 = Qnil;
+  st->cmap                = Qnil;
+  st->meta                = Qnil;
+}
 
-  case 2:
-  case 3:
-  case 4:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(p[i]));
-    }
-    break;
-  }
+static decode_stream_t*
+alloc_decode_stream(void)
+{
+  decode_stream_t* st;
 
-  *dst = obj;
+  st  = ALLOC(decode_stream_t);
+  memset(st, 0, sizeof(*st));
+
+  st->ret  = Qnil;
+  st->raw  = Qnil;
+  st->cmap = Qnil;
+  st->meta = Qnil;
+
+  return st;
 }
 
-static void
-exif_fetch_ascii_data(exif_t* ptr, VALUE* dst)
+static int
+open_decode_stream(decode_stream_t* st, jpeg_decode_t* ptr,
+                   decode_ctx_t* ctx, jpeg_decode_t* owner)
 {
-  VALUE obj;
+  /*
+   * 作業領域を開いてストリームに結び付ける。失敗した場合は作業領域を
+   * 返却 (または解放) し、st->msgにエラーメッセージを設定して非0を返す。
+   */
 
-  uint32_t n;
-  uint8_t* p;
+  if (open_decode_context(ctx)) {
+    memcpy(st->msg, ctx->err_mgr.msg, sizeof(st->msg));
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+    if (owner != NULL) {
+      release_decode_context(owner, ctx);
+    } else {
+      free_decode_context(ctx);
+    }
 
-  if (n > 4) {
-    p = ptr->head + get_u32(p, ptr->be);
+    return !0;
   }
 
-  obj = rb_utf8_str_new((char*)p, n);
-  rb_funcall(obj, rb_intern("strip!"), 0);
+  st->cfg                     = *ptr;
+  st->owner                   = owner;
+  st->ctx                     = ctx;
+  st->prev_src                = ctx->cinfo.src;
 
-  *dst = obj;
+  st->pub.init_source         = stream_init_source;
+  st->pub.fill_input_buffer   = stream_fill_input_buffer;
+  st->pub.skip_input_data     = stream_skip_input_data;
+  st->pub.resync_to_restart   = jpeg_resync_to_restart;
+  st->pub.term_source         = stream_term_source;
+
+  ctx->cinfo.src              = &st->pub;
+
+  reset_decode_stream(st);
+
+  return 0;
 }
 
 static void
-exif_fetch_short_data(exif_t* ptr, VALUE* dst)
+append_stream_data(decode_stream_t* st, const uint8_t* data, size_t size)
 {
-  VALUE obj;
-
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  /*
+   * 未消費の入力をバッファの先頭に詰めて新しい入力を追加する (GVL保持)
+   */
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  size_t rest;
+  size_t n;
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  if (st->skip > 0) {
+    n          = (st->skip < size)? st->skip: size;
+    st->skip  -= n;
+    data      += n;
+    size      -= n;
+  }
 
-  case 1:
-    obj = INT2FIX(get_u16(p, ptr->be));
-    break;
+  rest = st->pub.bytes_in_buffer;
 
-  default:
-    p = ptr->head + get_u32(p, ptr->be);
+  if (rest > 0 && st->pub.next_input_byte != st->buf) {
+    memmove(st->buf, st->pub.next_input_byte, rest);
+  }
 
-  case 2:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_u16(p, ptr->be)));
-      p += 2;
-    }
-    break;
+  if (rest + size > st->capa) {
+    st->capa = (rest + size > st->capa * 2)? rest + size: st->capa * 2;
+    REALLOC_N(st->buf, uint8_t, st->capa);
   }
 
-  *dst = obj;
+  if (size > 0) memcpy(st->buf + rest, data, size);
+
+  st->pub.next_input_byte = st->buf;
+  st->pub.bytes_in_buffer = rest + size;
 }
 
-static void
-exif_fetch_long_data(exif_t* ptr, VALUE* dst)
+static int
+stream_read_header(decode_stream_t* st)
 {
-  VALUE obj;
+  /*
+   * ヘッダの読み込み (GVL保持)
+   * 完了した場合は1、入力待ちの場合は0、エラーの場合は-1を返す
+   */
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  int ret;
+  struct jpeg_decompress_struct* cinfo;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  cinfo = &st->ctx->cinfo;
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  if (setjmp(st->ctx->err_mgr.jmpbuf)) {
+    ret = -1;
 
-  case 1:
-    obj = INT2FIX(get_u32(p, ptr->be));
-    break;
+  } else if (jpeg_read_header(cinfo, TRUE) == JPEG_SUSPENDED) {
+    ret = 0;
 
-  default:
-    p   = ptr->head + get_u32(p, ptr->be);
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_u32(p, ptr->be)));
-      p += 4;
-    }
-    break;
+  } else {
+    apply_decoder_context(&st->cfg, cinfo);
+    jpeg_calc_output_dimensions(cinfo);
+    ret = 1;
   }
 
-  *dst = obj;
+  return ret;
 }
 
-static void
-exif_fetch_rational_data(exif_t* ptr, VALUE* dst)
+static void*
+stream_body(void* _st)
 {
-  VALUE obj;
+  /*
+   * 伸長処理 (GVL解放)
+   * 全ての行を読み込んで後処理を終えた場合はst->statusに1を設定する
+   */
 
+  decode_stream_t* st;
+  struct jpeg_decompress_struct* cinfo;
+  decode_job_t* job;
   int i;
-  uint32_t n;
-  uint8_t* p;
-  uint32_t deno;
-  uint32_t num;
-
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
-
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  int j;
 
-  case 1:
-    num  = get_u32(p + 0, ptr->be);
-    deno = get_u32(p + 4, ptr->be);
-    if (num == 0 && deno == 0) {
-      deno = 1;
-    }
-    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-    break;
+  st    = (decode_stream_t*)_st;
+  cinfo = &st->ctx->cinfo;
+  job   = &st->job;
 
-  default:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      num  = get_u32(p + 0, ptr->be);
-      deno = get_u32(p + 4, ptr->be);
-      if (num == 0 && deno == 0) {
-        deno = 1;
-      }
-      rb_ary_push(obj, rb_rational_new(INT2FIX(num), INT2FIX(deno)));
-      p += 8;
-    }
-    break;
+  if (setjmp(st->ctx->err_mgr.jmpbuf)) {
+    st->status = -1;
+    return NULL;
   }
 
-  *dst = obj;
-}
+  st->status = 0;
 
-static void
-exif_fetch_undefined_data(exif_t* ptr, VALUE* dst)
-{
-  VALUE obj;
+  if (st->state == STREAM_START) {
+    if (!jpeg_start_decompress(cinfo)) return NULL;
+    st->state = STREAM_SCAN;
 
-  uint32_t n;
-  uint8_t* p;
+    if (job->pack == PACK_ROWS) {
+      job->stage = alloc_stage(cinfo, cinfo->output_width);
+    }
+  }
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+  while (cinfo->output_scanline < cinfo->output_height) {
+    for (i = 0, j = cinfo->output_scanline; i < UNIT_LINES; i++, j++) {
+      job->array[i] = job->raw + (j * job->stride);
+    }
 
-  if (n > 4) {
-    p = ptr->head + get_u32(p, ptr->be);
+    if (read_rows(job->ptr, cinfo, job->array, job->stage, UNIT_LINES) == 0) {
+      return NULL;
+    }
   }
 
-  obj = rb_enc_str_new((char*)p, n, rb_ascii8bit_encoding());
+  post_process(job);
+  st->status = 1;
 
-  *dst = obj;
+  return NULL;
+}
+
+static int
+stream_finish(decode_stream_t* st)
+{
+  int ret;
+
+  if (setjmp(st->ctx->err_mgr.jmpbuf)) {
+    ret = -1;
+  } else {
+    ret = jpeg_finish_decompress(&st->ctx->cinfo)? 1: 0;
+  }
+
+  return ret;
 }
 
 static void
-exif_fetch_slong_data(exif_t* ptr, VALUE* dst)
+raise_stream_error(decode_stream_t* st)
 {
-  VALUE obj;
+  memcpy(st->msg, st->ctx->err_mgr.msg, sizeof(st->msg));
+  reset_decode_stream(st);
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
+  rb_raise(decerr_klass, "%s", st->msg);
+}
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->cur + 8;
+static VALUE
+feed_decode_stream(decode_stream_t* st, VALUE chunk)
+{
+  /*
+   * 入力の断片を渡して伸長を進める。画像が完成した場合は伸長結果を、
+   * 入力が不足している場合はnilを返す。chunkにnilを渡すと入力の終端と
+   * して扱う。
+   */
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+  VALUE ret;
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_decode_t* ptr;
+  const JOCTET* next;
+  size_t rest;
+  int stat;
 
-  case 1:
-    obj = INT2FIX(get_s32(p, ptr->be));
-    break;
+  cinfo = &st->ctx->cinfo;
+  ptr   = &st->cfg;
 
-  default:
-    p   = ptr->head + get_u32(p, ptr->be);
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      rb_ary_push(obj, INT2FIX(get_s32(p, ptr->be)));
-      p += 4;
-    }
-    break;
+  if (NIL_P(chunk)) {
+    st->eof = !0;
+  } else {
+    append_stream_data(st, (uint8_t*)RSTRING_PTR(chunk), RSTRING_LEN(chunk));
   }
 
-  *dst = obj;
-}
+  if (st->state == STREAM_HEADER) {
+    if (!st->started) {
+      if (TEST_FLAG(ptr, F_CROP | F_RESAMPLE)) {
+        reset_decode_stream(st);
+        NOT_IMPLEMENTED_ERROR("streaming decode does not support "
+                              ":crop, :fit, :fill and :resize.");
+      }
 
-static void
-exif_fetch_srational_data(exif_t* ptr, VALUE* dst)
-{
-  VALUE obj;
+      jpeg_save_markers(cinfo, JPEG_APP1,
+                        TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)?
+                                                                0xFFFF: 0);
+      st->started = !0;
+    }
 
-  int i;
-  uint32_t n;
-  uint8_t* p;
-  uint32_t deno;
-  uint32_t num;
+    stat = stream_read_header(st);
+    if (stat < 0) raise_stream_error(st);
+    if (stat == 0) return Qnil;
 
-  n = get_u32(ptr->cur + 4, ptr->be);
-  p = ptr->head + get_u32(ptr->cur + 8, ptr->be);
+    /*
+     * 出力バッファの確保 (GVL保持)
+     */
+    st->job.ptr   = ptr;
+    st->job.cinfo = cinfo;
+    st->job.array = st->ctx->array;
 
-  switch (n) {
-  case 0:
-    obj = Qnil;
-    break;
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+      st->job.o9n = pick_exif_orientation(cinfo);
+    }
 
-  case 1:
-    num  = get_s32(p + 0, ptr->be);
-    deno = get_s32(p + 4, ptr->be);
-    if (num == 0 && deno == 0) {
-      deno = 1;
+    st->job.pack = plan_pack(ptr, cinfo, st->job.o9n);
+    st->ret      = prepare_output(ptr, &st->job, &st->raw, &st->cmap);
+
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (st->job.o9n & 4)) {
+      st->ret     = alloc_orientation_buffer(st->ret);
+      st->job.rot = (uint8_t*)RSTRING_PTR(st->ret);
     }
-    obj = rb_rational_new(INT2FIX(num), INT2FIX(deno));
-    break;
 
-  default:
-    obj = rb_ary_new_capa(n);
-    for (i = 0; i < (int)n; i++) {
-      num  = get_s32(p + 0, ptr->be);
-      deno = get_s32(p + 4, ptr->be);
-      if (num == 0 && deno == 0) {
-        deno = 1;
-      }
-      rb_ary_push(obj, rb_rational_new(INT2FIX(num), INT2FIX(deno)));
-      p += 8;
+    st->state = STREAM_START;
+  }
+
+  if (st->state == STREAM_START || st->state == STREAM_SCAN) {
+    st->busy = !0;
+
+    rb_thread_call_without_gvl(stream_body, st, NULL, NULL);
+
+    st->busy = 0;
+
+    if (st->status < 0) raise_stream_error(st);
+    if (st->status == 0) return Qnil;
+
+    /* Exifのマーカはjpeg_finish_decompress()で解放されるので先に作る */
+    if (TEST_FLAG(ptr, F_NEED_META)) {
+      st->meta = create_meta(ptr, cinfo, st->job.o9n);
     }
-    break;
+
+    st->state = STREAM_FINISH;
   }
 
-  *dst = obj;
-}
+  if (st->state == STREAM_FINISH) {
+    stat = stream_finish(st);
+    if (stat < 0) raise_stream_error(st);
+    if (stat == 0) return Qnil;
 
-static void
-exif_fetch_child_ifd(exif_t* ptr, tag_entry_t* tbl, size_t n, exif_t* dst)
-{
-  uint32_t off;
+    st->state = STREAM_DONE;
+  }
 
-  off = get_u32(ptr->cur + 8, ptr->be); 
+  ret = st->ret;
+  if (!NIL_P(st->meta)) add_meta(ret, st->meta);
 
-  dst->be       = ptr->be;
-  dst->head     = ptr->head;
-  dst->cur      = ptr->head + off;
-  dst->size     = ptr->size - off;
-  dst->tags.tbl = tbl;
-  dst->tags.n   = n;
-  dst->next     = 0;
-}
+  /*
+   * EOI以降の入力は次の画像の先頭として残す (入力の終端で補ったEOIは
+   * バッファの外なので残さない)
+   */
+  next = st->pub.next_input_byte;
+  rest = st->pub.bytes_in_buffer;
 
-static int
-exif_read(exif_t* ptr, VALUE dst)
-{
-  int ret;
-  int i;
-  uint16_t ntag;
-  uint16_t tag;
-  uint16_t type;
-  uint32_t off;
+  reset_decode_stream(st);
 
-  exif_t child;
+  if (rest > 0 && next >= st->buf && next + rest <= st->buf + st->capa) {
+    st->pub.next_input_byte = next;
+    st->pub.bytes_in_buffer = rest;
+  }
 
-  VALUE key;
-  VALUE val;
+  return ret;
+}
 
-  ntag = get_u16(ptr->cur, ptr->be);
-  exif_increase(ptr, 2);
+static VALUE
+read_chunk_body(VALUE io)
+{
+  return rb_funcall(io, id_readpartial, 1, INT2FIX(STREAM_READ_SIZE));
+}
 
-  for (i = 0; i < ntag; i++) {
-    exif_fetch_tag_header(ptr, &tag, &type);
+static VALUE
+read_chunk_eof(VALUE io, VALUE exc)
+{
+  return Qnil;
+}
 
-    switch (tag) {
-    case 34665: // ExifIFDPointer
-      key = ID2SYM(rb_intern("exif"));
-      val = rb_hash_new();
+static VALUE
+decode_io_body(VALUE _arg)
+{
+  VALUE ret;
+  VALUE* arg;
+  decode_stream_t* st;
+  VALUE chunk;
 
-      exif_fetch_child_ifd(ptr, tag_exif, N(tag_exif), &child);
-      exif_read(&child, val);
-      break;
+  arg = (VALUE*)_arg;
+  st  = (decode_stream_t*)DATA_PTR(arg[0]);
 
-    case 34853: // GPSInfoIFDPointer
-      key = ID2SYM(rb_intern("gps"));
-      val = rb_hash_new();
+  do {
+    chunk = rb_rescue2(read_chunk_body, arg[1], read_chunk_eof, Qnil,
+                       rb_eEOFError, (VALUE)0);
 
-      exif_fetch_child_ifd(ptr, tag_gps, N(tag_gps), &child);
-      exif_read(&child, val);
-      break;
+    if (!NIL_P(chunk)) {
+      Check_Type(chunk, T_STRING);
+    }
 
-    case 40965: // InteroperabilityIFDPointer
-      key = ID2SYM(rb_intern("interoperability"));
-      val = rb_hash_new();
+    ret = feed_decode_stream(st, chunk);
+  } while (NIL_P(ret) && !NIL_P(chunk));
 
-      exif_fetch_child_ifd(ptr, tag_i14y, N(tag_i14y), &child);
-      exif_read(&child, val);
-      break;
+  if (NIL_P(ret)) {
+    rb_raise(decerr_klass, "unexpected end of data.");
+  }
 
-    default:
-      key = lookup_tag_symbol(ptr->tags.tbl, ptr->tags.n, tag);
+  return ret;
+}
 
-      switch (type) {
-      case 1:  // when BYTE
-        exif_fetch_byte_data(ptr, &val);
-        break;
+static VALUE
+decode_io_ensure(VALUE _arg)
+{
+  VALUE* arg;
+  decode_stream_t* st;
 
-      case 2:  // when ASCII
-        exif_fetch_ascii_data(ptr, &val);
-        break;
+  arg = (VALUE*)_arg;
+  st  = (decode_stream_t*)DATA_PTR(arg[0]);
 
-      case 3:  // when SHORT
-        exif_fetch_short_data(ptr, &val);
-        break;
+  /* 作業領域は元の入力マネージャに戻してからプールに返却する */
+  reset_decode_stream(st);
+  st->ctx->cinfo.src = st->prev_src;
 
-      case 4:  // when LONG
-        exif_fetch_long_data(ptr, &val);
-        break;
+  release_decode_context(st->owner, st->ctx);
+  st->ctx = NULL;
 
-      case 5:  // when RATIONAL
-        exif_fetch_rational_data(ptr, &val);
-        break;
+  return Qnil;
+}
 
-      case 7:  // when UNDEFINED
-        exif_fetch_undefined_data(ptr, &val);
-        break;
+/**
+ * decode JPEG data read from an IO
+ *
+ * @overload decode_io(io)
+ *
+ *   @param io [IO]  input stream. the data is read by `readpartial`
+ *     until the end of the image (or EOF).
+ *
+ *   @return [String] decoded raw image data.
+ *
+ *   @note Decoding proceeds as the data arrives, so the whole JPEG data
+ *     is never buffered at once. Bytes following the end of the image
+ *     may already have been consumed from the IO.
+ */
+static VALUE
+rb_decoder_decode_io(VALUE self, VALUE io)
+{
+  VALUE ret;
+  jpeg_decode_t* ptr;
+  decode_stream_t* st;
+  VALUE arg[2];
 
-      case 9:  // when SLONG
-        exif_fetch_slong_data(ptr, &val);
-        break;
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-      case 10: // when SRATIONAL
-        exif_fetch_srational_data(ptr, &val);
-        break;
+  check_decode_format(ptr);
 
-      default:
-        rb_raise(decerr_klass, "invalid tag data type");
-      }
-    }
+  /*
+   * do decode
+   */
+  st     = alloc_decode_stream();
+  arg[0] = Data_Wrap_Struct(0, rb_decode_stream_mark, rb_decode_stream_free,
+                            st);
+  arg[1] = io;
 
-    rb_hash_aset(dst, key, val);
-    exif_increase(ptr, 12);
+  if (open_decode_stream(st, ptr, acquire_decode_context(ptr), ptr)) {
+    rb_raise(decerr_klass, "%s", st->msg);
   }
 
-  off = get_u32(ptr->cur, ptr->be);
-  if (off != 0) {
-    ptr->cur  = ptr->head + off;
-    ptr->next = !0;
-  }
+  ret = rb_ensure(decode_io_body, (VALUE)arg, decode_io_ensure, (VALUE)arg);
+
+  RB_GC_GUARD(arg[0]);
 
   return ret;
 }
 
-#define THUMBNAIL_OFFSET    ID2SYM(rb_intern("jpeg_interchange_format"))
-#define THUMBNAIL_SIZE      ID2SYM(rb_intern("jpeg_interchange_format_length"))
-
+/**
+ * feed a fragment of JPEG data
+ *
+ * @overload feed(chunk)
+ *
+ *   @param chunk [String, nil]  a fragment of JPEG data. nil means the
+ *     end of input (the image is completed with the data received so
+ *     far).
+ *
+ *   @return [String, nil] decoded raw image data when the image is
+ *     completed by this chunk, otherwise nil.
+ *
+ *   @raise [RuntimeError] if #feed of the same decoder is running in
+ *     another thread.
+ *
+ *   @note Bytes following the end of an image are kept as the head of
+ *     the next image, so back-to-back images (e.g. MJPEG) can be fed
+ *     in chunks of any size. One call returns at most one image; when
+ *     a chunk may hold several images, call #feed with an empty string
+ *     (or nil at the end of input) until it returns nil. No data other
+ *     than the images may be placed between them.
+ *
+ *   @note The decoder keeps the state of the stream between calls, so a
+ *     frozen decoder can not be fed, and the stream can not be fed from
+ *     several threads at the same time. The settings at the time of the
+ *     first chunk of each image are used.
+ */
 static VALUE
-create_exif_tags_hash(jpeg_decode_t* ptr)
+rb_decoder_feed(VALUE self, VALUE chunk)
 {
   VALUE ret;
-  jpeg_saved_marker_ptr marker;
-  exif_t exif;
+  jpeg_decode_t* ptr;
+  decode_stream_t* st;
+  decode_ctx_t* ctx;
+  char msg[JMSG_LENGTH_MAX+10];
 
-  ret = rb_hash_new();
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
+
+  /*
+   * argument check
+   */
+  if (!NIL_P(chunk)) Check_Type(chunk, T_STRING);
+  rb_check_frozen(self);
+
+  /*
+   * GVLを解放している間は入力バッファと伸長の状態を他のスレッドから
+   * 変更させない
+   */
+  if (ptr->stream != NULL && ptr->stream->busy) {
+    RUNTIME_ERROR("decoder is busy.");
+  }
 
-  for (marker = ptr->cinfo.marker_list;
-            marker != NULL; marker = marker->next) {
+  /*
+   * do decode
+   */
+  if (ptr->stream == NULL) {
+    if (NIL_P(chunk) || RSTRING_LEN(chunk) == 0) return Qnil;
 
-    if (marker->data_length < 14) continue;
-    if (memcmp(marker->data, "Exif\0\0", 6)) continue;
+    check_decode_format(ptr);
 
-    /* 0th IFD */
-    exif_init(&exif, marker->data, marker->data_length);
-    exif_read(&exif, ret);
+    ctx         = ALLOC(decode_ctx_t);
+    ctx->active = 0;
 
-    if (exif.next) {
-      /* when 1th IFD (tumbnail) exist */
-      VALUE info;
-      VALUE off;
-      VALUE size;
-      VALUE data;
+    st          = alloc_decode_stream();
 
-      info = rb_hash_new();
+    if (open_decode_stream(st, ptr, ctx, NULL)) {
+      /* 作業領域は解放済みなのでメッセージを退避してから破棄する */
+      memcpy(msg, st->msg, sizeof(msg));
+      free_decode_stream(st);
 
-      exif_read(&exif, info);
+      rb_raise(decerr_klass, "%s", msg);
+    }
 
-      off  = rb_hash_lookup(info, THUMBNAIL_OFFSET);
-      size = rb_hash_lookup(info, THUMBNAIL_SIZE);
+    ptr->stream = st;
 
-      if (TYPE(off) == T_FIXNUM && TYPE(size) == T_FIXNUM) {
-        data = rb_enc_str_new((char*)exif.head + FIX2INT(off),
-                              FIX2INT(size), rb_ascii8bit_encoding());
+  } else {
+    st = ptr->stream;
 
-        rb_hash_lookup(info, THUMBNAIL_OFFSET);
-        rb_hash_lookup(info, THUMBNAIL_SIZE);
-        rb_hash_aset(info, ID2SYM(rb_intern("jpeg_interchange")), data);
-        rb_hash_aset(ret, ID2SYM(rb_intern("thumbnail")), info);
+    if (st->state == STREAM_HEADER && !st->started) {
+      /* 前の画像に続く入力が残っていれば入力の終端でも伸長する */
+      if ((NIL_P(chunk) || RSTRING_LEN(chunk) == 0) &&
+          st->pub.bytes_in_buffer == 0) {
+        return Qnil;
       }
+
+      check_decode_format(ptr);
+      st->cfg = *ptr;
     }
-    break;
   }
 
+  ret = feed_decode_stream(st, chunk);
+
   return ret;
 }
 
-static void
-pick_exif_orientation(jpeg_decode_t* ptr)
+/**
+ * freeze the decoder
+ *
+ * @return [JPEG::Decoder] self
+ *
+ * @raise [RuntimeError] if an image fed by #feed is not completed.
+ *
+ * @note A frozen decoder can be shared between Ractors. While an image
+ *   is fed by #feed, the decoder holds the pending output, so it can not
+ *   be frozen until the image is completed (or #feed(nil) is called).
+ */
+static VALUE
+rb_decoder_freeze(VALUE self)
 {
-  jpeg_saved_marker_ptr marker;
-  int o9n;
-  uint8_t* p;
-  int be;
-  uint32_t off;
-  int i;
-  int n;
-
-  o9n = 0;
-
-  for (marker = ptr->cinfo.marker_list;
-            marker != NULL; marker = marker->next) {
-
-    if (marker->data_length < 14) continue;
+  jpeg_decode_t* ptr;
+  decode_stream_t* st;
 
-    p = marker->data;
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-    /*
-     * check Exif identifier
-     */
-    if (memcmp(p, "Exif\0\0", 6)) continue;
+  st = ptr->stream;
 
+  if (st != NULL) {
     /*
-     * check endian marker
+     * Ractor.make_shareable()で伸長途中の出力バッファまでfreezeされ、
+     * 二度と完了できなくなるのを防ぐ
      */
-    if (!memcmp(p + 6, "MM", 2)) {
-      be = !0;
-
-    } else if (!memcmp(p + 6, "II", 2)) {
-      be = 0;
-
-    } else {
-      continue;
+    if (st->busy || st->started || st->pub.bytes_in_buffer > 0) {
+      RUNTIME_ERROR("feeding is in progress (complete the image first).");
     }
 
-    /*
-     * check TIFF identifier
-     */
-    if (get_u16(p + 8, be) != 0x002a) continue;
+    /* freeze後は#feedできないので作業領域を解放しておく */
+    ptr->stream = NULL;
+    free_decode_stream(st);
+  }
 
-    /*
-     * set 0th IFD address
-     */
-    off = get_u32(p + 10, be);
-    if (off < 8 || off >= marker->data_length - 6) continue;
+  return rb_call_super(0, NULL);
+}
 
-    p += (6 + off);
+/*
+ * 帯単位の伸長 (each_band)
+ *
+ * 画像全体のバッファを確保せず、指定行数の帯を一つのバッファに繰り返し
+ * 伸長してブロックに渡す。
+ */
 
-    /* ここまでくればAPP1がExifタグなので
-     * 0th IFDをなめてOrientationタグを探す */
+typedef struct {
+  struct jpeg_decompress_struct* cinfo;
+  jpeg_decode_t* ptr;
+  JSAMPARRAY array;
 
-    n = get_u16(p, be);
-    p += 2;
+  uint8_t* raw;               // scanline destination
+  uint8_t* cmap;              // destination of expand colormap (or NULL)
+  size_t stride;
+  int rows;                   // number of rows to read
+  int pack;                   // PACK_NONE or PACK_ROWS
+  JSAMPARRAY stage;           // rows read before packing (or NULL)
 
-    for (i = 0; i < n; i++) {
-      int tag;
-      int type;
-      int num;
+  int started;
+  int status;
+} band_job_t;
 
-      tag  = get_u16(p + 0, be);
-      type = get_u16(p + 2, be);
-      num  = get_u32(p + 4, be);
+static void*
+read_band_body(void* _job)
+{
+  /*
+   * 帯一つ分の伸長 (GVL解放)
+   */
 
-      if (tag == 0x0112) {
-        if (type == 3 && num == 1) {
-          o9n = get_u16(p + 8, be);
-          goto loop_out;
+  band_job_t* job;
+  struct jpeg_decompress_struct* cinfo;
+  ext_error_t* err;
+  JDIMENSION top;
+  int n;
+  int i;
+  int j;
 
-        } else {
-          fprintf(stderr,
-                  "Illeagal orientation tag found [type:%d, num:%d]\n",
-                  type,
-                  num);
-        }
-      }
+  job   = (band_job_t*)_job;
+  cinfo = job->cinfo;
+  err   = (ext_error_t*)cinfo->err;
 
-      p += 12;
-    }
+  if (setjmp(err->jmpbuf)) {
+    job->status = !0;
+    return NULL;
   }
-  loop_out:
 
-  ptr->orientation.value = (o9n >= 1 && o9n <= 8)? (o9n - 1): 0;
-}
+  if (!job->started) {
+    jpeg_start_decompress(cinfo);
+    job->started = !0;
 
-static VALUE
-create_colormap(jpeg_decode_t* ptr)
-{
-  VALUE ret;
-  struct jpeg_decompress_struct* cinfo;
-  JSAMPARRAY map;
-  int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
-  uint32_t c;
+    if (job->pack == PACK_ROWS) {
+      job->stage = alloc_stage(cinfo, cinfo->output_width);
+    }
+  }
 
-  cinfo = &ptr->cinfo;
-  ret   = rb_ary_new_capa(cinfo->actual_number_of_colors);
-  map   = cinfo->colormap;
+  top = cinfo->output_scanline;
 
-  switch (cinfo->out_color_components) {
-  case 1:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = map[0][i];
-      rb_ary_push(ret, INT2FIX(c));
-    }
-    break;
+  while ((n = top + job->rows - cinfo->output_scanline) > 0) {
+    if (n > UNIT_LINES) n = UNIT_LINES;
 
-  case 2:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = (map[0][i] << 8) | (map[1][i] << 0);
-      rb_ary_push(ret, INT2FIX(c));
+    for (i = 0, j = cinfo->output_scanline - top; i < n; i++, j++) {
+      job->array[i] = job->raw + (j * job->stride);
     }
-    break;
 
-  case 3:
-    for (i = 0; i < cinfo->actual_number_of_colors; i++) {
-      c = (map[0][i] << 16) | (map[1][i] << 8) | (map[2][i] << 0);
+    read_rows(job->ptr, cinfo, job->array, job->stage, n);
+  }
 
-      rb_ary_push(ret, INT2FIX(c));
-    }
-    break;
+  if (job->cmap != NULL) {
+    expand_colormap(cinfo, job->raw, job->cmap, job->rows);
+  }
 
-  default:
-    RUNTIME_ERROR("this number of components is not implemented yet");
+  if (job->ptr->format == FMT_YVU) {
+    swap_cbcr(job->raw, job->stride * job->rows);
   }
 
-  return ret;
-}
+  job->status = 0;
 
-static VALUE
-rb_meta_exif_tags(VALUE self)
-{
-  return rb_ivar_get(self, id_exif_tags);
+  return NULL;
 }
 
 static VALUE
-create_meta(jpeg_decode_t* ptr)
+do_each_band(jpeg_decode_t* ptr, decode_ctx_t* ctx,
+             uint8_t* jpg, size_t jpg_sz, int rows)
 {
   VALUE ret;
+  VALUE band;
+  VALUE work;
   struct jpeg_decompress_struct* cinfo;
-  int width;
-  int height;
-  int stride;
+  band_job_t job;
+  size_t line;
+  int ht;
+  int y;
 
-  ret    = rb_obj_alloc(meta_klass);
-  cinfo  = &ptr->cinfo;
+  if (open_decode_context(ctx)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
 
-  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (ptr->orientation.value & 4)) {
-    width  = cinfo->output_height;
-    height = cinfo->output_width;
-  } else {
-    width  = cinfo->output_width;
-    height = cinfo->output_height;
+  cinfo = &ctx->cinfo;
+
+  /*
+   * ヘッダの解析 (作業領域の後始末は呼び出し元で行う)
+   */
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
   }
 
-  stride = cinfo->output_width * cinfo->output_components;
+  jpeg_mem_src(cinfo, jpg, jpg_sz);
 
-  rb_ivar_set(ret, id_width, INT2FIX(width));
-  rb_ivar_set(ret, id_stride, INT2FIX(stride));
-  rb_ivar_set(ret, id_height, INT2FIX(height));
+  jpeg_save_markers(cinfo, JPEG_APP1,
+                    TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)?
+                                                              0xFFFF: 0);
 
-  rb_ivar_set(ret, id_orig_cs, get_colorspace_str(cinfo->jpeg_color_space));
+  jpeg_read_header(cinfo, TRUE);
 
-  if (ptr->format == FMT_YVU) {
-    rb_ivar_set(ret, id_out_cs, rb_str_new_cstr("YCrCb"));
-  } else {
-    rb_ivar_set(ret, id_out_cs, get_colorspace_str(cinfo->out_color_space));
-  }
+  apply_decoder_context(ptr, cinfo);
+  jpeg_calc_output_dimensions(cinfo);
 
-  if (TEST_FLAG_ALL(ptr, F_DITHER | F_EXPAND_COLORMAP)) {
-    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->out_color_components));
-  } else {
-    rb_ivar_set(ret, id_ncompo, INT2FIX(cinfo->output_components));
+  if (TEST_FLAG(ptr, F_CROP | F_RESAMPLE)) {
+    NOT_IMPLEMENTED_ERROR("each_band does not support "
+                          ":crop, :fit, :fill and :resize.");
   }
 
-  if (TEST_FLAG(ptr, F_PARSE_EXIF)) {
-    rb_ivar_set(ret, id_exif_tags, create_exif_tags_hash(ptr));
-    rb_define_singleton_method(ret, "exif_tags", rb_meta_exif_tags, 0);
-    rb_define_singleton_method(ret, "exif", rb_meta_exif_tags, 0);
-  } 
+  /* 回転は画像全体が揃わないと行えない */
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) &&
+      pick_exif_orientation(cinfo) != 0) {
+    NOT_IMPLEMENTED_ERROR("each_band does not support orientation.");
+  }
 
-  if (TEST_FLAG(ptr, F_DITHER)) {
-    rb_ivar_set(ret, id_colormap, create_colormap(ptr));
+  /*
+   * 帯のバッファの確保 (帯の間で使い回す)
+   */
+  memset(&job, 0, sizeof(job));
+  job.cinfo  = cinfo;
+  job.ptr    = ptr;
+  job.array  = ctx->array;
+  job.stride = row_size(ptr, cinfo, cinfo->output_width);
+  job.pack   = plan_pack(ptr, cinfo, 0);
+
+  if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && WILL_BE_COLORMAPPED(cinfo)) {
+    line = cinfo->output_width * cinfo->out_color_components;
+    work = rb_str_buf_new(job.stride * rows);
+  } else {
+    line = job.stride;
+    work = Qnil;
   }
-  
-  return ret;
-}
 
-static VALUE
-do_read_header(jpeg_decode_t* ptr, uint8_t* jpg, size_t jpg_sz)
-{
-  VALUE ret;
+  band = rb_str_buf_new(line * rows);
+  ret  = Qnil;
+  ht   = cinfo->output_height;
 
-  switch (ptr->format) {
-  case FMT_YUV422:
-  case FMT_RGB565:
-    NOT_IMPLEMENTED_ERROR( "not implemented colorspace");
-    break;
-  }
+  for (y = 0; y < ht; y += rows) {
+    job.rows = (ht - y < rows)? ht - y: rows;
 
-  jpeg_create_decompress(&ptr->cinfo);
+    /*
+     * ブロック内で変更・複製されている場合に備えて毎回確認する
+     * (複製とバッファを共有している場合はrb_str_modify()で分離される)
+     */
+    rb_str_resize(band, line * job.rows);
+    rb_str_modify(band);
+    rb_str_locktmp(band);
 
-  ptr->cinfo.err                   = jpeg_std_error(&ptr->err_mgr.jerr);
-  ptr->err_mgr.jerr.output_message = decode_output_message;
-  ptr->err_mgr.jerr.emit_message   = decode_emit_message;
-  ptr->err_mgr.jerr.error_exit     = decode_error_exit;
+    if (NIL_P(work)) {
+      job.raw  = (uint8_t*)RSTRING_PTR(band);
+    } else {
+      job.raw  = (uint8_t*)RSTRING_PTR(work);
+      job.cmap = (uint8_t*)RSTRING_PTR(band);
+    }
 
-  ptr->cinfo.raw_data_out          = FALSE;
-  ptr->cinfo.dct_method            = JDCT_FLOAT;
+    rb_thread_call_without_gvl(read_band_body, &job, NULL, NULL);
 
-  if (setjmp(ptr->err_mgr.jmpbuf)) {
-    jpeg_destroy_decompress(&ptr->cinfo);
-    rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
-  } else {
-    jpeg_mem_src(&ptr->cinfo, jpg, jpg_sz);
+    rb_str_unlocktmp(band);
 
-    if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)) {
-      jpeg_save_markers(&ptr->cinfo, JPEG_APP1, 0xFFFF);
+    if (job.status) {
+      rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
     }
 
-    jpeg_read_header(&ptr->cinfo, TRUE);
-    jpeg_calc_output_dimensions(&ptr->cinfo);
-
-    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
-      pick_exif_orientation(ptr);
+    /* カラーマップはjpeg_start_decompress()の後で確定する */
+    if (NIL_P(ret)) {
+      ret = create_meta(ptr, cinfo, 0);
+      if (TEST_FLAG(ptr, F_NEED_META)) add_meta(band, ret);
     }
 
-    ret = create_meta(ptr);
+    rb_yield_values(2, band, INT2FIX(y));
+  }
+
+  RB_GC_GUARD(work);
 
-    jpeg_destroy_decompress(&ptr->cinfo);
+  if (finish_decode(cinfo)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
   }
 
   return ret;
 }
 
+static VALUE
+each_band_protect(VALUE _arg)
+{
+  decode_arg_t* arg;
+
+  arg = (decode_arg_t*)_arg;
+
+  return do_each_band(&arg->cfg, arg->ctx,
+                      (uint8_t*)RSTRING_PTR(arg->data),
+                      RSTRING_LEN(arg->data), *(int*)arg->opt);
+}
+
 /**
- * read meta data
+ * decode JPEG data band by band
  *
- * @overload read_header(jpeg)
+ * @overload each_band(jpeg, rows: 16)
  *
- *   @param jpeg [String] input data.
+ *   @param jpeg [String]  JPEG data to decode.
  *
- *   @return [JPEG::Meta] metadata.
+ *   @param rows [Integer]  number of rows in a band (the last band may
+ *     be shorter).
+ *
+ *   @yieldparam band [String]  decoded raw image data of the band.
+ *   @yieldparam y [Integer]  row position of the top of the band.
+ *
+ *   @return [JPEG::Meta] metadata of the decoded image.
+ *
+ *   @note Only a band is held in memory at once. The same String object
+ *     is reused for every band, so dup it if it is needed after the
+ *     block returns. :orientation is not supported (NotImplementedError
+ *     is raised for an image that needs rotation).
  */
 static VALUE
-rb_decoder_read_header(VALUE self, VALUE data)
+rb_decoder_each_band(int argc, VALUE* argv, VALUE self)
 {
   VALUE ret;
   jpeg_decode_t* ptr;
+  VALUE data;
+  VALUE opt;
+  VALUE opts[N(each_band_opts_ids)];
+  int rows;
+
+  RETURN_ENUMERATOR_KW(self, argc, argv, rb_keyword_given_p());
 
   /*
    * initialize
    */
-  Data_Get_Struct(self, jpeg_decode_t, ptr);
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
   /*
-   * argument check
+   * parse arguments
    */
+  rb_scan_args(argc, argv, "1:", &data, &opt);
+
   Check_Type(data, T_STRING);
+  rb_get_kwargs(opt, each_band_opts_ids, 0, N(each_band_opts_ids), opts);
+
+  if (opts[0] == Qundef || NIL_P(opts[0])) {
+    rows = DEFAULT_BAND_ROWS;
+
+  } else {
+    rows = NUM2INT(opts[0]);
+    if (rows < 1) {
+      RANGE_ERROR(":rows shall be 1 or more.");
+    }
+  }
 
   /*
-   * do encode
+   * do decode
    */
-  ret = do_read_header(ptr, (uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data));
+  data = rb_str_new_frozen(data);
+  ret  = call_with_decode_context(ptr, each_band_protect, data, &rows);
 
   return ret;
 }
 
-static VALUE
-rb_decode_result_meta(VALUE self)
-{
-  return rb_ivar_get(self, id_meta);
-}
-
-static void
-add_meta(VALUE obj, jpeg_decode_t* ptr)
-{
-  VALUE meta;
+/*
+ * 段階的な伸長 (decode_progressive)
+ *
+ * libjpegのbuffered-imageモードを使い、プログレッシブJPEGのスキャンを
+ * 一つ読み込む毎に、その時点までのデータから画像全体を出力する。
+ * シーケンシャルJPEGの場合は出力は一回だけになる。
+ */
 
-  meta = create_meta(ptr);
+typedef struct {
+  decode_job_t job;
 
-  rb_ivar_set(obj, id_meta, meta);
-  rb_define_singleton_method(obj, "meta", rb_decode_result_meta, 0);
-}
+  int started;
+  int done;                   // all input has been consumed
+  int status;
+} pass_job_t;
 
-static VALUE
-expand_colormap(struct jpeg_decompress_struct* cinfo, uint8_t* src)
+static void*
+read_pass_body(void* _pass)
 {
-  /*
-   * 本関数はcinfo->out_color_componentsが1または3であることを前提に
-   * 作成されています。
+  /*
+   * 出力パス一回分の伸長 (GVL解放)
    */
 
-  VALUE ret;
-  volatile int i;   // volatileを外すとaarch64のgcc6でクラッシュする場合がある
-  int n;
-  uint8_t* dst;
-  JSAMPARRAY map;
+  pass_job_t* pass;
+  struct jpeg_decompress_struct* cinfo;
+  ext_error_t* err;
 
-  n   = cinfo->output_width * cinfo->output_height;
-  ret = rb_str_buf_new(n * cinfo->out_color_components);
-  dst = (uint8_t*)RSTRING_PTR(ret);
-  map = cinfo->colormap;
+  pass  = (pass_job_t*)_pass;
+  cinfo = pass->job.cinfo;
+  err   = (ext_error_t*)cinfo->err;
 
-  switch (cinfo->out_color_components) {
-  case 1:
-    for (i = 0; i < n; i++) {
-      dst[i] = map[0][src[i]];
-    }
-    break;
+  if (setjmp(err->jmpbuf)) {
+    pass->status = !0;
+    return NULL;
+  }
 
-  case 2:
-    for (i = 0; i < n; i++) {
-      dst[0] = map[0][src[i]];
-      dst[1] = map[1][src[i]];
+  if (!pass->started) {
+    jpeg_start_decompress(cinfo);
+    pass->started = !0;
 
-      dst += 2;
+    if (pass->job.pack == PACK_ROWS) {
+      pass->job.stage = alloc_stage(cinfo, cinfo->output_width);
     }
-    break;
+  }
 
-  case 3:
-    for (i = 0; i < n; i++) {
-      dst[0] = map[0][src[i]];
-      dst[1] = map[1][src[i]];
-      dst[2] = map[2][src[i]];
+  /*
+   * 入力済みの最新のスキャンまでを使って出力する。jpeg_finish_output()
+   * は次のスキャンの先頭(またはEOI)まで入力を読み進める。
+   */
+  jpeg_start_output(cinfo, cinfo->input_scan_number);
+  read_scanlines(pass->job.ptr, cinfo, pass->job.array, pass->job.stage,
+                 pass->job.raw, pass->job.stride);
+  jpeg_finish_output(cinfo);
 
-      dst += 3;
-    }
-    break;
+  post_process(&pass->job);
 
-  default:
-    RUNTIME_ERROR("this number of components is not implemented yet");
-  }
+  pass->done   = jpeg_input_complete(cinfo);
+  pass->status = 0;
 
-  rb_str_set_len(ret, n * cinfo->out_color_components);
+  if (!pass->done && pass->job.ptr->max_scans > 0 &&
+      cinfo->output_scan_number >= pass->job.ptr->max_scans) {
+    pass->done        = !0;
+    pass->job.limited = !0;
+  }
 
-  return ret;
+  return NULL;
 }
 
-static void
-swap_cbcr(uint8_t* p, size_t size)
+static VALUE
+do_decode_progressive(jpeg_decode_t* ptr, decode_ctx_t* ctx,
+                      uint8_t* jpg, size_t jpg_sz)
 {
+  VALUE ret;
+  VALUE raw;
+  VALUE cmap;
+  VALUE meta;
+  struct jpeg_decompress_struct* cinfo;
+  pass_job_t pass;
   int i;
-  uint8_t tmp;
 
-  for (i = 0; i < (int)size; i++) {
-    tmp  = p[1];
-    p[1] = p[2];
-    p[2] = tmp;
+  if (open_decode_context(ctx)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
   }
-}
 
-static void
-do_transpose8(uint8_t* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
+  cinfo = &ctx->cinfo;
 
-  uint8_t* sp;
-  uint8_t* dp;
+  /*
+   * ヘッダの解析 (作業領域の後始末は呼び出し元で行う)
+   */
+  if (setjmp(ctx->err_mgr.jmpbuf)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
 
-  sp = (uint8_t*)img;
+  jpeg_mem_src(cinfo, jpg, jpg_sz);
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint8_t*)dst + y;
+  jpeg_save_markers(cinfo, JPEG_APP1,
+                    TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)?
+                                                              0xFFFF: 0);
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+  jpeg_read_header(cinfo, TRUE);
 
-      sp++;
-      dp += ht;
-    }
+  if (TEST_FLAG(ptr, F_CROP | F_RESAMPLE)) {
+    NOT_IMPLEMENTED_ERROR("decode_progressive does not support "
+                          ":crop, :fit, :fill and :resize.");
   }
-}
 
-static void
-do_transpose16(void* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
+  ptr->buffered_image = TRUE;
 
-  uint16_t* sp;
-  uint16_t* dp;
+  apply_decoder_context(ptr, cinfo);
+  jpeg_calc_output_dimensions(cinfo);
 
-  sp = (uint16_t*)img;
+  memset(&pass, 0, sizeof(pass));
+  pass.job.ptr   = ptr;
+  pass.job.cinfo = cinfo;
+  pass.job.array = ctx->array;
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint16_t*)dst + y;
+  if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+    pass.job.o9n = pick_exif_orientation(cinfo);
+  }
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+  pass.job.pack = plan_pack(ptr, cinfo, pass.job.o9n);
 
-      sp++;
-      dp += ht;
-    }
-  }
-}
+  ret  = Qnil;
+  meta = Qnil;
 
-static void
-do_transpose24(void* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
-  int st;
+  for (i = 0; !pass.done; i++) {
+    /*
+     * 出力パス毎に新しいバッファを確保する (ブロックに渡した画像は
+     * 呼び出し元がそのまま保持できる)
+     */
+    ret = prepare_output(ptr, &pass.job, &raw, &cmap);
 
-  uint8_t* sp;
-  uint8_t* dp;
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (pass.job.o9n & 4)) {
+      ret          = alloc_orientation_buffer(ret);
+      pass.job.rot = (uint8_t*)RSTRING_PTR(ret);
+    } else {
+      pass.job.rot = NULL;
+    }
 
-  sp = (uint8_t*)img;
-  st = ht * 3;
+    rb_thread_call_without_gvl(read_pass_body, &pass, NULL, NULL);
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint8_t*)dst + (y * 3);
+    RB_GC_GUARD(raw);
+    RB_GC_GUARD(cmap);
 
-    for (x = 0; x < wd; x++) {
-      dp[0] = sp[0];
-      dp[1] = sp[1];
-      dp[2] = sp[2];
+    if (pass.status) {
+      rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+    }
 
-      sp += 3;
-      dp += st;
+    /* カラーマップはjpeg_start_decompress()の後で確定する */
+    if (TEST_FLAG(ptr, F_NEED_META)) {
+      if (NIL_P(meta)) meta = create_meta(ptr, cinfo, pass.job.o9n);
+      add_meta(ret, meta);
     }
+
+    rb_yield_values(2, INT2FIX(i), ret);
   }
-}
 
-static void
-do_transpose32(void* img, int wd, int ht, void* dst)
-{
-  int x;
-  int y;
+  if (pass.job.limited) {
+    jpeg_abort_decompress(cinfo);
 
-  uint32_t* sp;
-  uint32_t* dp;
+  } else if (finish_decode(cinfo)) {
+    rb_raise(decerr_klass, "%s", ctx->err_mgr.msg);
+  }
 
-  sp = (uint32_t*)img;
+  return ret;
+}
 
-  for (y = 0; y < ht; y++) {
-    dp = (uint32_t*)dst + y;
+static VALUE
+decode_progressive_protect(VALUE _arg)
+{
+  decode_arg_t* arg;
 
-    for (x = 0; x < wd; x++) {
-      *dp = *sp;
+  arg = (decode_arg_t*)_arg;
 
-      sp++;
-      dp += ht;
-    }
-  }
+  return do_decode_progressive(&arg->cfg, arg->ctx,
+                               (uint8_t*)RSTRING_PTR(arg->data),
+                               RSTRING_LEN(arg->data));
 }
 
-static void
-do_transpose(void* img, int wd, int ht, int nc, void* dst)
+/**
+ * decode JPEG data pass by pass
+ *
+ * @overload decode_progressive(jpeg)
+ *
+ *   @param jpeg [String]  JPEG data to decode.
+ *
+ *   @yieldparam pass [Integer]  index of the output pass (from 0).
+ *   @yieldparam img [String]  decoded raw image data of the whole image
+ *     made from the scans read so far.
+ *
+ *   @return [String] the final image (same as the last yielded one).
+ *
+ *   @note For a progressive JPEG an image is yielded for each scan, from
+ *     a coarse preview to the full quality one (up to :max_scans scans if
+ *     given). A sequential JPEG yields only once. The images are decoded
+ *     with the settings of the decoder (use :scale for reduced size
+ *     previews), and each one is a new String object.
+ */
+static VALUE
+rb_decoder_decode_progressive(VALUE self, VALUE data)
 {
-  switch (nc) {
-  case 1:
-    do_transpose8(img, wd, ht, dst);
-    break;
+  VALUE ret;
+  jpeg_decode_t* ptr;
 
-  case 2:
-    do_transpose16(img, wd, ht, dst);
-    break;
+  RETURN_ENUMERATOR(self, 1, &data);
 
-  case 3:
-    do_transpose24(img, wd, ht, dst);
-    break;
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-  case 4:
-    do_transpose32(img, wd, ht, dst);
-    break;
-  }
+  /*
+   * argument check
+   */
+  Check_Type(data, T_STRING);
+
+  /*
+   * do decode
+   */
+  data = rb_str_new_frozen(data);
+  ret  = call_with_decode_context(ptr, decode_progressive_protect, data, NULL);
+
+  return ret;
 }
 
-static void
-do_upside_down8(void* img, int wd, int ht)
-{
-  uint8_t* sp;
-  uint8_t* dp;
+typedef struct {
+  decode_job_t job;
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + ((wd * ht) - 1);
+  VALUE data;
+  VALUE raw;
+  VALUE cmap;
+  VALUE ret;
+  VALUE meta;
 
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint8_t);
+  char msg[JMSG_LENGTH_MAX+10];
 
-    sp++;
-    dp--;
-  }
-}
+  int ncolors;
+  JSAMPLE colormap[3][256];
+} batch_item_t;
+
+typedef struct {
+  jpeg_decode_t* ptr;
+  jpeg_decode_t cfg;
+
+  decode_ctx_t* ctx;          // context to read the headers (with GVL)
+  decode_ctx_set_t set;       // contexts of the workers
+
+  batch_item_t* items;
+  int n;
+  int next;
+} decode_batch_t;
 
 static void
-do_upside_down16(void* img, int wd, int ht)
+rb_decode_batch_mark(void* _batch)
 {
-  uint16_t* sp;
-  uint16_t* dp;
-
-  sp = (uint16_t*)img;
-  dp = (uint16_t*)img + ((wd * ht) - 1);
+  decode_batch_t* batch;
+  int i;
 
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint8_t);
+  batch = (decode_batch_t*)_batch;
 
-    sp++;
-    dp--;
+  /*
+   * GVL解放中に参照するバッファを移動させない様にrb_gc_mark()でピン留め
+   * しておく
+   */
+  for (i = 0; i < batch->n; i++) {
+    rb_gc_mark(batch->items[i].data);
+    rb_gc_mark(batch->items[i].raw);
+    rb_gc_mark(batch->items[i].cmap);
+    rb_gc_mark(batch->items[i].ret);
+    rb_gc_mark(batch->items[i].meta);
   }
 }
 
 static void
-do_upside_down24(void* img, int wd, int ht)
+rb_decode_batch_free(void* _batch)
 {
-  uint8_t* sp;
-  uint8_t* dp;
+  decode_batch_t* batch;
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + ((wd * ht * 3) - 3);
+  batch = (decode_batch_t*)_batch;
 
-  while (sp < dp) {
-    SWAP(sp[0], dp[0], uint8_t);
-    SWAP(sp[1], dp[1], uint8_t);
-    SWAP(sp[2], dp[2], uint8_t);
+  if (batch->items != NULL) xfree(batch->items);
 
-    sp += 3;
-    dp -= 3;
-  }
+  xfree(batch);
 }
 
-static void
-do_upside_down32(void* img, int wd, int ht)
+static int
+read_batch_header(decode_batch_t* batch, batch_item_t* item)
 {
-  uint32_t* sp;
-  uint32_t* dp;
+  int ret;
+  struct jpeg_decompress_struct* cinfo;
 
-  sp = (uint32_t*)img;
-  dp = (uint32_t*)img + ((wd * ht) - 1);
+  cinfo = &batch->ctx->cinfo;
 
-  ht /= 2;
+  if (setjmp(batch->ctx->err_mgr.jmpbuf)) {
+    jpeg_abort_decompress(cinfo);
+    memcpy(item->msg, batch->ctx->err_mgr.msg, sizeof(item->msg));
 
-  while (sp < dp) {
-    SWAP(*sp, *dp, uint32_t);
+    ret = !0;
 
-    sp++;
-    dp--;
+  } else {
+    jpeg_mem_src(cinfo, (uint8_t*)RSTRING_PTR(item->data),
+                 RSTRING_LEN(item->data));
+
+    jpeg_read_header(cinfo, TRUE);
+
+    apply_decoder_context(batch->ptr, cinfo);
+    jpeg_calc_output_dimensions(cinfo);
+
+    if (apply_crop(batch->ptr, cinfo)) {
+      jpeg_abort_decompress(cinfo);
+      sprintf(item->msg, "crop region is out of the image.");
+
+      ret = !0;
+
+    } else {
+      ret = 0;
+    }
   }
+
+  return ret;
 }
 
-static void
-do_upside_down(void* img, int wd, int ht, int nc)
+typedef struct {
+  decode_batch_t* batch;
+  batch_item_t* item;
+} batch_prepare_t;
+
+static VALUE
+prepare_batch_item_body(VALUE _arg)
 {
-  switch (nc) {
-  case 1:
-    do_upside_down8(img, wd, ht);
-    break;
+  batch_prepare_t* arg;
+  decode_batch_t* batch;
+  batch_item_t* item;
+  jpeg_decode_t* ptr;
+  struct jpeg_decompress_struct* cinfo;
+  thumb_t thumb;
 
-  case 2:
-    do_upside_down16(img, wd, ht);
-    break;
+  arg   = (batch_prepare_t*)_arg;
+  batch = arg->batch;
+  item  = arg->item;
+  ptr   = batch->ptr;
+  cinfo = &batch->ctx->cinfo;
 
-  case 3:
-    do_upside_down24(img, wd, ht);
-    break;
+  item->job.ptr   = ptr;
+  item->job.cinfo = cinfo;
 
-  case 4:
-    do_upside_down32(img, wd, ht);
-    break;
+  thumb.data      = Qnil;
+
+  if (TEST_FLAG(ptr, F_PREFER_THUMB) &&
+      probe_thumbnail(ptr, cinfo, (uint8_t*)RSTRING_PTR(item->data),
+                      RSTRING_LEN(item->data), &thumb)) {
+    /* 以降はサムネイルを入力として扱う */
+    item->data = thumb.data;
   }
-}
 
-static void
-do_flip_horizon8(void* img, int wd, int ht)
-{
-  int y;
-  int st;
+  if (read_batch_header(batch, item)) {
+    item->job.status = !0;
 
-  uint8_t* sp;
-  uint8_t* dp;
+  } else {
+    if (thumb.data != Qnil) {
+      item->job.o9n = thumb.o9n;
 
-  st  = wd;
-  wd /= 2;
+    } else if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
+      item->job.o9n = pick_exif_orientation(cinfo);
+    }
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + (st - 1);
+    plan_fit(ptr, cinfo, item->job.o9n, &item->job.fit);
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint8_t);
+    item->job.pack = plan_pack(ptr, cinfo, item->job.o9n);
+    item->ret      = prepare_output(ptr, &item->job, &item->raw, &item->cmap);
 
-      sp++;
-      dp--;
+    if (TEST_FLAG(ptr, F_APPLY_ORIENTATION) && (item->job.o9n & 4)) {
+      item->ret     = alloc_orientation_buffer(item->ret);
+      item->job.rot = (uint8_t*)RSTRING_PTR(item->ret);
     }
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+    if (TEST_FLAG(ptr, F_NEED_META)) {
+      item->meta = set_thumb_exif(create_meta(ptr, cinfo, item->job.o9n),
+                                  &thumb);
+    }
+
+    item->job.cinfo  = NULL;
+    item->job.status = 0;
+
+    jpeg_abort_decompress(cinfo);
   }
+
+  return Qnil;
 }
 
 static void
-do_flip_horizon16(void* img, int wd, int ht)
+prepare_batch_item(decode_batch_t* batch, batch_item_t* item)
 {
-  int y;
-  int st;
+  /*
+   * Exifの解析はrb_raise()でエラーを報告するので、rb_protect()で捕捉し
+   * てその入力だけをエラーとする (バッチ全体は中断しない)。DecodeError
+   * 以外の例外 (割り込みなど) はそのまま送出する。
+   */
 
-  uint16_t* sp;
-  uint16_t* dp;
+  batch_prepare_t arg;
+  VALUE exc;
+  int state;
 
-  st  = wd;
-  wd /= 2;
+  arg.batch = batch;
+  arg.item  = item;
 
-  sp = (uint16_t*)img;
-  dp = (uint16_t*)img + (st - 1);
+  rb_protect(prepare_batch_item_body, (VALUE)&arg, &state);
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint16_t);
+  if (state) {
+    exc = rb_errinfo();
 
-      sp++;
-      dp--;
-    }
+    if (!rb_obj_is_kind_of(exc, decerr_klass)) rb_jump_tag(state);
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+    rb_set_errinfo(Qnil);
+    jpeg_abort_decompress(&batch->ctx->cinfo);
+
+    exc = rb_obj_as_string(exc);
+    snprintf(item->msg, sizeof(item->msg), "%s", StringValueCStr(exc));
+
+    item->ret        = Qnil;
+    item->raw        = Qnil;
+    item->cmap       = Qnil;
+    item->meta       = 0;
+    item->job.cinfo  = NULL;
+    item->job.status = !0;
   }
 }
 
 static void
-do_flip_horizon24(void* img, int wd, int ht)
+decode_batch_item(decode_batch_t* batch, batch_item_t* item,
+                  struct jpeg_decompress_struct* cinfo, JSAMPARRAY array)
 {
-  int y;
-  int st;
+  ext_error_t* err;
+  int i;
 
-  uint8_t* sp;
-  uint8_t* dp;
+  err = (ext_error_t*)cinfo->err;
 
-  st  = wd * 3;
-  wd /= 2;
+  item->job.cinfo = cinfo;
+  item->job.array = array;
 
-  sp = (uint8_t*)img;
-  dp = (uint8_t*)img + (st - 3);
+  if (setjmp(err->jmpbuf)) {
+    jpeg_abort_decompress(cinfo);
+    memcpy(item->msg, err->msg, sizeof(item->msg));
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(sp[0], dp[0], uint8_t);
-      SWAP(sp[1], dp[1], uint8_t);
-      SWAP(sp[2], dp[2], uint8_t);
+    item->job.status = !0;
 
-      sp += 3;
-      dp -= 3;
+  } else {
+    jpeg_mem_src(cinfo, (uint8_t*)RSTRING_PTR(item->data),
+                 RSTRING_LEN(item->data));
+
+    /* プールから取り出したcinfoには前回の設定が残っている */
+    jpeg_save_markers(cinfo, JPEG_APP1, 0);
+    jpeg_read_header(cinfo, TRUE);
+    apply_decoder_context(batch->ptr, cinfo);
+
+    read_pixels(&item->job);
+
+    if (IS_COLORMAPPED(cinfo)) {
+      item->ncolors = cinfo->actual_number_of_colors;
+
+      for (i = 0; i < cinfo->out_color_components; i++) {
+        memcpy(item->colormap[i], cinfo->colormap[i], item->ncolors);
+      }
     }
 
-    sp = (sp - (wd * 3)) + st;
-    dp = sp + (st - 3);
+    if (item->job.limited) {
+      jpeg_abort_decompress(cinfo);
+    } else {
+      jpeg_finish_decompress(cinfo);
+    }
   }
+
+  item->job.cinfo = NULL;
+  item->job.array = NULL;
 }
 
-static void
-do_flip_horizon32(void* img, int wd, int ht)
+static void*
+decode_batch_worker(void* _batch)
 {
-  int y;
-  int st;
+  /*
+   * バッチ処理のワーカ (GVL解放状態で実行される)
+   * ワーカ毎に固有の作業領域を持ち、入力を順次取り出して処理する。
+   */
 
-  uint32_t* sp;
-  uint32_t* dp;
+  decode_batch_t* batch;
+  decode_ctx_t* ctx;
+  batch_item_t* item;
+  int failed;
+  int i;
 
-  st  = wd;
-  wd /= 2;
+  batch  = (decode_batch_t*)_batch;
+  ctx    = take_decode_context(&batch->set);
+  failed = open_decode_context(ctx);
 
-  sp = (uint32_t*)img;
-  dp = (uint32_t*)img + (st - 1);
+  while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+                                                                  batch->n) {
+    item = batch->items + i;
 
-  for (y = 0; y < ht; y++) {
-    while (sp < dp) {
-      SWAP(*sp, *dp, uint32_t);
+    if (item->job.status) continue;
 
-      sp++;
-      dp--;
-    }
+    if (failed) {
+      memcpy(item->msg, ctx->err_mgr.msg, sizeof(item->msg));
+      item->job.status = !0;
 
-    sp = sp - wd + st;
-    dp = sp + (st - 1);
+    } else {
+      decode_batch_item(batch, item, &ctx->cinfo, ctx->array);
+    }
   }
+
+  return NULL;
 }
 
-static void
-do_flip_horizon(void* img, int wd, int ht, int nc)
-{
-  switch (nc) {
-  case 1:
-    do_flip_horizon8(img, wd, ht);
-    break;
+typedef struct {
+  decode_batch_t* batch;
+  int threads;
+} batch_run_t;
 
-  case 2:
-    do_flip_horizon16(img, wd, ht);
-    break;
+static void*
+decode_batch_body(void* _run)
+{
+  batch_run_t* run;
 
-  case 3:
-    do_flip_horizon24(img, wd, ht);
-    break;
+  run = (batch_run_t*)_run;
+  run_workers(decode_batch_worker, run->batch, run->threads);
 
-  case 4:
-    do_flip_horizon32(img, wd, ht);
-    break;
-  }
+  return NULL;
 }
 
 static VALUE
-shift_orientation_buffer(jpeg_decode_t* ptr, VALUE img)
+decode_batch_protect(VALUE _run)
 {
-  VALUE ret;
-  int len;
+  batch_run_t* run;
+  decode_batch_t* batch;
+  int i;
 
-  ret = ptr->orientation.buf;
-  len = RSTRING_LEN(img);
+  run   = (batch_run_t*)_run;
+  batch = run->batch;
 
-  if (ret == Qnil || RSTRING_LEN(ret) != len) {
-    ret = rb_str_buf_new(len);
-    rb_str_set_len(ret, len);
+  /*
+   * read headers and allocate output buffers (with GVL)
+   */
+  if (open_decode_context(batch->ctx)) {
+    rb_raise(decerr_klass, "%s", batch->ctx->err_mgr.msg);
   }
 
-  ptr->orientation.buf = img;
+  /* 再利用するcinfoには前回の設定が残っているので毎回設定する */
+  jpeg_save_markers(&batch->ctx->cinfo, JPEG_APP1,
+                    TEST_FLAG(batch->ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION |
+                                          F_PREFER_THUMB)? 0xFFFF: 0);
 
-  return ret;
+  for (i = 0; i < batch->n; i++) {
+    prepare_batch_item(batch, batch->items + i);
+  }
+
+  /*
+   * decode (without GVL)
+   */
+  if (run->threads > 0) {
+    batch->set.n = run->threads;
+    call_without_gvl_with_decode_contexts(&batch->set, decode_batch_body, run);
+  }
+
+  return Qnil;
 }
 
 static VALUE
-apply_orientation(jpeg_decode_t* ptr, VALUE img)
+decode_batch_ensure(VALUE _run)
 {
-  struct jpeg_decompress_struct* cinfo;
-  int wd;
-  int ht;
-  int nc;
-  VALUE tmp;
-
-  cinfo = &ptr->cinfo;
-  wd    = cinfo->output_width;
-  ht    = cinfo->output_height;
-  nc    = cinfo->output_components;
-
-  if (ptr->orientation.value & 4) {
-    /* 転置は交換アルゴリズムでは実装できないので新規バッファを
-       用意する */
-    tmp = img;
-    img = shift_orientation_buffer(ptr, tmp);
-    SWAP(wd, ht, int);
-
-    do_transpose(RSTRING_PTR(tmp), ht, wd, nc, RSTRING_PTR(img)); 
-  }
+  decode_batch_t* batch;
 
-  if (ptr->orientation.value & 2) {
-    do_upside_down(RSTRING_PTR(img), wd, ht, nc); 
-  }
+  batch = ((batch_run_t*)_run)->batch;
 
-  if (ptr->orientation.value & 1) {
-    do_flip_horizon(RSTRING_PTR(img), wd, ht, nc); 
-  }
+  release_decode_context(batch->set.owner, batch->ctx);
+  batch->ctx = NULL;
 
-  return img;
+  return Qnil;
 }
 
 static VALUE
-do_decode(jpeg_decode_t* ptr, uint8_t* jpg, size_t jpg_sz)
+do_decode_batch(jpeg_decode_t* ptr, VALUE list, int threads)
 {
   VALUE ret;
-  struct jpeg_decompress_struct* cinfo;
-  JSAMPARRAY array;
-
-  size_t stride;
-  size_t raw_sz;
-  uint8_t* raw;
+  VALUE obj;
+  VALUE data;
+  decode_batch_t* batch;
+  batch_item_t* item;
+  batch_run_t run;
+  JSAMPROW map[3];
   int i;
-  int j;
 
-  ret   = Qundef; // warning対策
-  cinfo = &ptr->cinfo;
-  array = ALLOC_ARRAY();
-                  
-  switch (ptr->format) {
-  case FMT_YUV422:
-  case FMT_RGB565:
-    NOT_IMPLEMENTED_ERROR( "not implemented colorspace");
-    break;
+  /*
+   * create batch context
+   */
+  batch  = ALLOC(decode_batch_t);
+  memset(batch, 0, sizeof(*batch));
 
-  case FMT_GRAYSCALE:
-  case FMT_YUV:
-  case FMT_RGB:
-  case FMT_BGR:
-  case FMT_YVU:
-  case FMT_RGB32:
-  case FMT_BGR32:
-    jpeg_create_decompress(cinfo);
+  obj    = Data_Wrap_Struct(0, rb_decode_batch_mark, rb_decode_batch_free,
+                            batch);
 
-    cinfo->err                       = jpeg_std_error(&ptr->err_mgr.jerr);
-    ptr->err_mgr.jerr.output_message = decode_output_message;
-    ptr->err_mgr.jerr.emit_message   = decode_emit_message;
-    ptr->err_mgr.jerr.error_exit     = decode_error_exit;
+  batch->cfg   = *ptr;
+  batch->ptr   = &batch->cfg;
+  batch->items = ALLOC_N(batch_item_t, RARRAY_LEN(list));
+  memset(batch->items, 0, sizeof(batch_item_t) * RARRAY_LEN(list));
 
-    if (setjmp(ptr->err_mgr.jmpbuf)) {
-      jpeg_abort_decompress(cinfo);
-      jpeg_destroy_decompress(&ptr->cinfo);
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    data = RARRAY_AREF(list, i);
+    Check_Type(data, T_STRING);
 
-      free(array);
-      rb_raise(decerr_klass, "%s", ptr->err_mgr.msg);
+    batch->items[i].data = rb_str_new_frozen(data);
+    batch->n++;
+  }
 
-    } else {
-      jpeg_mem_src(cinfo, jpg, jpg_sz);
+  /*
+   * 作業領域はヘッダの読み込み用もワーカ用もデコーダのプールから取り
+   * 出し、例外発生時も含めて必ず返却する
+   */
+  run.batch   = batch;
+  run.threads = (threads < batch->n)? threads: batch->n;
 
-      if (TEST_FLAG(ptr, F_PARSE_EXIF | F_APPLY_ORIENTATION)) {
-        jpeg_save_markers(&ptr->cinfo, JPEG_APP1, 0xFFFF);
-      }
+  batch->set.owner = ptr;
+  batch->ctx       = acquire_decode_context(ptr);
 
-      jpeg_read_header(cinfo, TRUE);
+  rb_ensure(decode_batch_protect, (VALUE)&run, decode_batch_ensure,
+            (VALUE)&run);
 
-      cinfo->raw_data_out              = FALSE;
-      cinfo->dct_method                = ptr->dct_method;
-
-      cinfo->out_color_space           = ptr->out_color_space;
-      cinfo->out_color_components      = ptr->out_color_components;
-      cinfo->scale_num                 = ptr->scale_num;
-      cinfo->scale_denom               = ptr->scale_denom;
-      cinfo->output_gamma              = ptr->output_gamma;
-      cinfo->do_fancy_upsampling       = ptr->do_fancy_upsampling;
-      cinfo->do_block_smoothing        = ptr->do_block_smoothing;
-      cinfo->quantize_colors           = ptr->quantize_colors;
-      cinfo->dither_mode               = ptr->dither_mode;
-      cinfo->two_pass_quantize         = ptr->two_pass_quantize;
-      cinfo->desired_number_of_colors  = ptr->desired_number_of_colors;
-      cinfo->enable_1pass_quant        = ptr->enable_1pass_quant;
-      cinfo->enable_external_quant     = ptr->enable_external_quant;
-      cinfo->enable_2pass_quant        = ptr->enable_2pass_quant;
-
-      jpeg_calc_output_dimensions(cinfo);
-      jpeg_start_decompress(cinfo);
-
-      stride = cinfo->output_components * cinfo->output_width;
-      raw_sz = stride * cinfo->output_height;
-      ret    = rb_str_buf_new(raw_sz);
-      raw    = (uint8_t*)RSTRING_PTR(ret);
-
-      while (cinfo->output_scanline < cinfo->output_height) {
-        for (i = 0, j = cinfo->output_scanline; i < UNIT_LINES; i++, j++) {
-          array[i] = raw + (j * stride);
-        }
+  /*
+   * create result
+   */
+  ret = rb_ary_new_capa(batch->n);
 
-        jpeg_read_scanlines(cinfo, array, UNIT_LINES);
-      }
+  for (i = 0; i < batch->n; i++) {
+    item = batch->items + i;
 
-      if (TEST_FLAG(ptr, F_EXPAND_COLORMAP) && IS_COLORMAPPED(cinfo)) {
-        ret = expand_colormap(cinfo, raw);
-      } else {
-        rb_str_set_len(ret, raw_sz);
-      }
+    if (item->job.status) {
+      rb_ary_push(ret, rb_exc_new_cstr(decerr_klass, item->msg));
+      continue;
+    }
 
-      if (ptr->format == FMT_YVU) swap_cbcr(raw, raw_sz);
+    if (item->meta != 0 && item->ncolors > 0) {
+      map[0] = item->colormap[0];
+      map[1] = item->colormap[1];
+      map[2] = item->colormap[2];
 
-      if (TEST_FLAG(ptr, F_APPLY_ORIENTATION)) {
-        pick_exif_orientation(ptr);
-        ret = apply_orientation(ptr, ret);
-      }
+      rb_ivar_set(item->meta, id_colormap,
+                  create_colormap(map, item->ncolors,
+                                  ptr->out_color_components));
+    }
 
-      if (TEST_FLAG(ptr, F_NEED_META)) add_meta(ret, ptr);
+    if (item->meta != 0) add_meta(item->ret, item->meta);
 
-      jpeg_finish_decompress(cinfo);
-      jpeg_destroy_decompress(&ptr->cinfo);
-    }
-    break;
+    rb_ary_push(ret, item->ret);
   }
 
-  free(array);
+  RB_GC_GUARD(obj);
 
   return ret;
 }
 
 /**
- * decode JPEG data
+ * decode multiple JPEG data in parallel
  *
- * @overload decode(jpeg)
+ * @overload decode_batch(list, threads: nil)
  *
- *   @param jpeg [String]  JPEG data to decode.
+ *   @param list [Array<String>]  JPEG data to decode.
  *
- *   @return [String] decoded raw image data.
+ *   @param threads [Integer]  number of native worker threads.
+ *     defaults to the number of online processors.
+ *
+ *   @return [Array<String, JPEG::DecodeError>]
+ *     decoded raw image data in the same order as the input. an entry
+ *     that could not be decoded is a JPEG::DecodeError object (it is not
+ *     raised, so one broken image does not fail the whole batch).
+ *
+ *   @note Each worker takes its own libjpeg context from the pool of the
+ *     decoder and configures it with the same options as #decode. The
+ *     workers run without holding the GVL.
  */
 static VALUE
-rb_decoder_decode(VALUE self, VALUE data)
+rb_decoder_decode_batch(int argc, VALUE* argv, VALUE self)
 {
-    VALUE ret;
-    jpeg_decode_t* ptr;
+  VALUE ret;
+  jpeg_decode_t* ptr;
+  VALUE list;
+  VALUE opt;
+  VALUE opts[N(batch_opts_ids)];
 
-    /*
-     * initialize
-     */
-    Data_Get_Struct(self, jpeg_decode_t, ptr);
+  /*
+   * initialize
+   */
+  TypedData_Get_Struct(self, jpeg_decode_t, &jpeg_decoder_data_type, ptr);
 
-    /*
-     * argument check
-     */
-    Check_Type(data, T_STRING);
+  /*
+   * parse arguments
+   */
+  rb_scan_args(argc, argv, "1:", &list, &opt);
 
-    /*
-     * do encode
-     */
-    ret = do_decode(ptr, (uint8_t*)RSTRING_PTR(data), RSTRING_LEN(data));
+  Check_Type(list, T_ARRAY);
+  rb_get_kwargs(opt, batch_opts_ids, 0, N(batch_opts_ids), opts);
 
-    return ret;
+  check_decode_format(ptr);
+
+  /*
+   * do decode
+   */
+  list = rb_ary_dup(list);
+  ret  = do_decode_batch(ptr, list, eval_threads_opt(opts[0]));
+
+  RB_GC_GUARD(list);
+
+  return ret;
 }
 
 static VALUE
@@ -3036,11 +10819,38 @@ rb_test_image(VALUE self, VALUE data)
   return ret;
 }
 
+static void
+intern_tag_table(tag_entry_t* tbl, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (tbl[i].name) tbl[i].id = rb_intern_const(tbl[i].name);
+  }
+}
+
 void
 Init_jpeg()
 {
   int i;
 
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  /*
+   * グローバル変数はすべてこの関数内でのみ設定し、以降は参照のみ行う。
+   * またオブジェクトは設定値のみを保持するのでRactorセーフとして宣言する。
+   */
+  rb_ext_ractor_safe(true);
+#endif /* defined(HAVE_RB_EXT_RACTOR_SAFE) */
+
+#ifdef USE_AVX2_DISPATCH
+  /*
+   * AVX2はx86-64のベースラインに含まれないので、使えるかどうかを実行時
+   * に確認する。
+   */
+  __builtin_cpu_init();
+  have_avx2 = __builtin_cpu_supports("avx2");
+#endif /* defined(USE_AVX2_DISPATCH) */
+
   module = rb_define_module("JPEG");
   rb_define_singleton_method(module, "broken?", rb_test_image, 1);
 
@@ -3048,6 +10858,11 @@ Init_jpeg()
   rb_define_alloc_func(encoder_klass, rb_encoder_alloc);
   rb_define_method(encoder_klass, "initialize", rb_encoder_initialize, -1);
   rb_define_method(encoder_klass, "encode", rb_encoder_encode, 1);
+  rb_define_method(encoder_klass, "encode_batch", rb_encoder_encode_batch, -1);
+  rb_define_method(encoder_klass, "start", rb_encoder_start, 1);
+  rb_define_method(encoder_klass, "write_rows", rb_encoder_write_rows, 1);
+  rb_define_method(encoder_klass, "finish", rb_encoder_finish, 0);
+  rb_define_method(encoder_klass, "freeze", rb_encoder_freeze, 0);
   rb_define_alias(encoder_klass, "compress", "encode");
   rb_define_alias(encoder_klass, "<<", "encode");
 
@@ -3060,6 +10875,14 @@ Init_jpeg()
   rb_define_method(decoder_klass, "set", rb_decoder_set, 1);
   rb_define_method(decoder_klass, "read_header", rb_decoder_read_header, 1);
   rb_define_method(decoder_klass, "decode", rb_decoder_decode, 1);
+  rb_define_method(decoder_klass, "decode_batch", rb_decoder_decode_batch, -1);
+  rb_define_method(decoder_klass, "decode_into", rb_decoder_decode_into, -1);
+  rb_define_method(decoder_klass, "decode_io", rb_decoder_decode_io, 1);
+  rb_define_method(decoder_klass, "feed", rb_decoder_feed, 1);
+  rb_define_method(decoder_klass, "freeze", rb_decoder_freeze, 0);
+  rb_define_method(decoder_klass, "each_band", rb_decoder_each_band, -1);
+  rb_define_method(decoder_klass, "decode_progressive",
+                   rb_decoder_decode_progressive, 1);
   rb_define_alias(decoder_klass, "decompress", "decode");
   rb_define_alias(decoder_klass, "<<", "decode");
 
@@ -3088,6 +10911,18 @@ Init_jpeg()
       decoder_opts_ids[i] = rb_intern_const(decoder_opts_keys[i]);
   }
 
+  for (i = 0; i < (int)N(batch_opts_keys); i++) {
+      batch_opts_ids[i] = rb_intern_const(batch_opts_keys[i]);
+  }
+
+  for (i = 0; i < (int)N(decode_into_opts_keys); i++) {
+      decode_into_opts_ids[i] = rb_intern_const(decode_into_opts_keys[i]);
+  }
+
+  for (i = 0; i < (int)N(each_band_opts_keys); i++) {
+      each_band_opts_ids[i] = rb_intern_const(each_band_opts_keys[i]);
+  }
+
   id_meta      = rb_intern_const("@meta");
   id_width     = rb_intern_const("@width");
   id_stride    = rb_intern_const("@stride");
@@ -3097,4 +10932,20 @@ Init_jpeg()
   id_ncompo    = rb_intern_const("@num_components");
   id_exif_tags = rb_intern_const("@exif_tags");
   id_colormap  = rb_intern_const("@colormap");
+
+  id_exif         = rb_intern_const("exif");
+  id_gps          = rb_intern_const("gps");
+  id_i14y         = rb_intern_const("interoperability");
+  id_thumbnail    = rb_intern_const("thumbnail");
+  id_thumb_data   = rb_intern_const("jpeg_interchange");
+  id_thumb_offset = rb_intern_const("jpeg_interchange_format");
+  id_thumb_size   = rb_intern_const("jpeg_interchange_format_length");
+  id_strip_bang   = rb_intern_const("strip!");
+  id_readpartial  = rb_intern_const("readpartial");
+  id_write        = rb_intern_const("write");
+
+  intern_tag_table(tag_tiff, N(tag_tiff));
+  intern_tag_table(tag_exif, N(tag_exif));
+  intern_tag_table(tag_gps, N(tag_gps));
+  intern_tag_table(tag_i14y, N(tag_i14y));
 }
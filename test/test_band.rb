@@ -0,0 +1,81 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestBand < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  test "each band" do
+    [
+      ["DSC_0215_small.JPG", {}],
+      ["progressive.jpg", {:pixel_format => :YCbCr}],
+      ["restart-gray.jpg", {:pixel_format => :GRAYSCALE}],
+      ["DSC_0215_small.JPG", {:dither => [:FS, true, 32],
+                              :expand_colormap => true}],
+      ["DSC_0215_small.JPG", {:scale => Rational(3, 8)}],
+    ].each {|name, opt|
+      dat = (DATA_DIR + name).binread
+      dec = JPEG::Decoder.new(opt)
+      exp = dec << dat
+      row = exp.bytesize / exp.meta.height
+
+      [1, 7, 16, 10000].each {|n|
+        img = "".b
+        pos = []
+        obj = []
+
+        met = dec.each_band(dat, :rows => n) {|band, y|
+          pos << y
+          obj << band.object_id
+          img << band
+
+          assert_true(band.bytesize <= row * n)
+        }
+
+        assert_equal(exp, img, "#{name} #{opt} #{n}")
+        assert_equal((0...exp.meta.height).step(n).to_a, pos)
+        assert_equal(1, obj.uniq.size)
+        assert_equal(exp.meta.width, met.width)
+        assert_equal(exp.meta.height, met.height)
+      }
+    }
+  end
+
+  test "each band (enumerator)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    enum = dec.each_band(dat, :rows => 50)
+    assert_kind_of(Enumerator, enum)
+    assert_equal(exp, enum.map {|band, y| band.dup}.join)
+  end
+
+  test "each band (break)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    n = 0
+    dec.each_band(dat, :rows => 10) {|band, y| n += 1; break if y >= 20}
+    assert_equal(3, n)
+
+    # 中断後も使用できること
+    img = "".b
+    dec.each_band(dat, :rows => 10) {|band, y| img << band}
+    assert_equal(dec << dat, img)
+  end
+
+  test "each band (invalid argument)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(RangeError) {dec.each_band(dat, :rows => 0) {}}
+    assert_raise_kind_of(TypeError) {dec.each_band(nil) {}}
+    assert_raise_kind_of(ArgumentError) {dec.each_band(dat, :foo => 1) {}}
+    assert_raise_kind_of(JPEG::DecodeError) {dec.each_band(dat[0, 100]) {}}
+
+    dec = JPEG::Decoder.new(:orientation => true)
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    assert_raise_kind_of(NotImplementedError) {dec.each_band(dat) {}}
+  end
+end
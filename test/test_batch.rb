@@ -0,0 +1,153 @@
+require 'test/unit'
+require 'pathname'
+require 'objspace'
+require 'jpeg'
+
+class TestBatch < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # decode_batch
+  #
+
+  test "decode batch" do
+    list = (1..8).map {|i| (DATA_DIR + "orientation-#{i}.jpg").binread}
+    dec  = JPEG::Decoder.new(:orientation => true, :with_exif_tags => true)
+    exp  = list.map {|dat| dec << dat}
+
+    [1, 3, 16].each {|n|
+      ret = dec.decode_batch(list, :threads => n)
+
+      assert_kind_of(Array, ret)
+      assert_equal(list.size, ret.size)
+
+      exp.zip(ret) {|e, r|
+        assert_equal(e, r)
+        assert_equal(e.meta.width, r.meta.width)
+        assert_equal(e.meta.height, r.meta.height)
+        assert_equal(e.meta.exif_tags, r.meta.exif_tags)
+      }
+    }
+  end
+
+  test "decode batch repeatedly with pooled contexts" do
+    list = (1..8).map {|i| (DATA_DIR + "orientation-#{i}.jpg").binread}
+    dec  = JPEG::Decoder.new(:orientation => true)
+    exp  = list.map {|dat| JPEG::Decoder.new(:orientation => true) << dat}
+    sz   = ObjectSpace.memsize_of(dec)
+
+    # ヘッダの読み込み用とワーカ用の作業領域はデコーダのプールから取り
+    # 出され、単独の伸長と交互に使っても結果は変わらない
+    3.times {
+      assert_equal(exp, dec.decode_batch(list, :threads => 3))
+      assert_equal(exp.first, dec << list.first)
+    }
+
+    assert_operator(ObjectSpace.memsize_of(dec), :>, sz)
+  end
+
+  test "decode batch (colormap)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:dither => [:FS, false, 64])
+    exp = dec << dat
+    ret = dec.decode_batch([dat, dat], :threads => 2)
+
+    ret.each {|img|
+      assert_equal(exp, img)
+      assert_equal(exp.meta.colormap, img.meta.colormap)
+    }
+  end
+
+  test "decode batch (broken data)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+    ret = dec.decode_batch([dat, dat[0, 100], "", dat], :threads => 2)
+
+    assert_equal(4, ret.size)
+    assert_equal(dec << dat, ret[0])
+    assert_kind_of(JPEG::DecodeError, ret[1])
+    assert_kind_of(JPEG::DecodeError, ret[2])
+    assert_equal(ret[0], ret[3])
+  end
+
+  test "decode batch (broken exif)" do
+    # Exifの解析に失敗した入力だけがエラーになる (#decodeと同じ扱い)
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    bad = dat.sub(/Exif\0\0(II|MM)/n, "Exif\0\0XX")
+    assert_not_equal(dat, bad)
+
+    [
+      {:with_exif_tags => true},
+      {:prefer_thumbnail => 1, :with_exif_tags => true},
+    ].each {|opt|
+      dec = JPEG::Decoder.new(**opt)
+      ret = dec.decode_batch([dat, bad, dat], :threads => 2)
+
+      assert_raise_kind_of(JPEG::DecodeError) {dec << bad}
+
+      assert_equal(3, ret.size)
+      assert_equal(dec << dat, ret[0])
+      assert_kind_of(JPEG::DecodeError, ret[1])
+      assert_equal(ret[0], ret[2])
+    }
+
+    # Orientationの読み取りは壊れたExifを無視する
+    dec = JPEG::Decoder.new(:orientation => true)
+    assert_equal([dec << bad], dec.decode_batch([bad]))
+  end
+
+  test "decode batch (empty)" do
+    assert_equal([], JPEG::Decoder.new.decode_batch([]))
+  end
+
+  test "decode batch (invalid argument)" do
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(TypeError) {dec.decode_batch("foo")}
+    assert_raise_kind_of(TypeError) {dec.decode_batch([1])}
+    assert_raise_kind_of(TypeError) {dec.decode_batch([], :threads => "1")}
+    assert_raise_kind_of(RangeError) {dec.decode_batch([], :threads => 0)}
+    assert_raise_kind_of(ArgumentError) {dec.decode_batch([], :foo => 1)}
+  end
+
+  #
+  # encode_batch
+  #
+
+  test "encode batch" do
+    dat  = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img  = JPEG::Decoder.new << dat
+    met  = img.meta
+    enc  = JPEG::Encoder.new(met.width, met.height,
+                             :pixel_format => :RGB,
+                             :quality => 80,
+                             :orientation => 6)
+
+    list = [img, img.reverse, img]
+    exp  = list.map {|raw| enc << raw}
+
+    [1, 2, 8].each {|n|
+      ret = enc.encode_batch(list, :threads => n)
+
+      assert_kind_of(Array, ret)
+      assert_equal(exp, ret)
+    }
+
+    ret = JPEG::Decoder.new(:orientation => true).decode_batch(exp)
+    assert_equal(met.height, ret[0].meta.width)
+  end
+
+  test "encode batch (empty)" do
+    assert_equal([], JPEG::Encoder.new(16, 16).encode_batch([]))
+  end
+
+  test "encode batch (invalid argument)" do
+    enc = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE)
+
+    assert_raise_kind_of(TypeError) {enc.encode_batch("foo")}
+    assert_raise_kind_of(TypeError) {enc.encode_batch([1])}
+    assert_raise_kind_of(ArgumentError) {enc.encode_batch(["\0" * 255])}
+    assert_raise_kind_of(ArgumentError) {enc.encode_batch(["\0" * 257])}
+    assert_raise_kind_of(RangeError) {enc.encode_batch([], :threads => 0)}
+  end
+end
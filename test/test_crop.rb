@@ -0,0 +1,101 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestCrop < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def trim(img, x, y, w, h)
+    wd = img.meta.width
+    nc = img.bytesize / (wd * img.meta.height)
+
+    (y...(y + h)).map {|r| img.byteslice(((r * wd) + x) * nc, w * nc)}.join
+  end
+
+  test "crop" do
+    rng = Random.new(0)
+
+    ["DSC_0215_small.JPG", "progressive.jpg"].each {|file|
+      dat = (DATA_DIR + file).binread
+
+      [
+        {},
+        {:scale => 0.5},
+        {:pixel_format => :GRAYSCALE},
+        {:pixel_format => :BGRX},
+        {:max_scans => 2},
+      ].each {|opt|
+        full = JPEG::Decoder.new(**opt) << dat
+        wd   = full.meta.width
+        ht   = full.meta.height
+
+        ([[0, 0, wd, ht], [wd - 1, ht - 1, 1, 1]] + 10.times.map {
+          x = rng.rand(wd)
+          y = rng.rand(ht)
+          [x, y, rng.rand(1..(wd - x)), rng.rand(1..(ht - y))]
+        }).each {|x, y, w, h|
+          img = JPEG::Decoder.new(**opt, :crop => [x, y, w, h]) << dat
+
+          assert_equal(trim(full, x, y, w, h), img, [file, opt, x, y, w, h])
+          assert_equal(w, img.meta.width)
+          assert_equal(h, img.meta.height)
+        }
+      }
+    }
+  end
+
+  test "crop with orientation" do
+    # 切り出しは回転前の座標で指定する
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    dec = JPEG::Decoder.new(:orientation => true, :crop => [0, 0, 8, 4])
+    img = dec << dat
+
+    assert_equal(4, img.meta.width)
+    assert_equal(8, img.meta.height)
+  end
+
+  test "crop with decode_into and decode_batch" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:crop => [10, 20, 30, 40])
+    exp = dec << dat
+    buf = "\0".b * exp.bytesize
+
+    met = dec.decode_into(dat, buf)
+    assert_equal(exp, buf)
+    assert_equal(30, met.width)
+
+    ret = dec.decode_batch([dat, dat[0, 100]])
+    assert_equal(exp, ret[0])
+    assert_kind_of(JPEG::DecodeError, ret[1])
+  end
+
+  test "crop region out of the image" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:crop => [290, 0, 20, 1])
+
+    assert_raise_kind_of(ArgumentError) {dec << dat}
+    assert_kind_of(JPEG::DecodeError, dec.decode_batch([dat])[0])
+  end
+
+  test "crop (invalid value)" do
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:crop => "1")}
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:crop => [0, 0, 1, "1"])}
+    assert_raise_kind_of(ArgumentError) {JPEG::Decoder.new(:crop => [0, 0, 1])}
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:crop => [-1, 0, 1, 1])}
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:crop => [0, 0, 0, 1])}
+    assert_nothing_raised {JPEG::Decoder.new(:crop => nil)}
+  end
+
+  test "crop is not supported" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:crop => [0, 0, 16, 16])
+
+    assert_raise_kind_of(NotImplementedError) {dec.each_band(dat) {}}
+    assert_raise_kind_of(NotImplementedError) {dec.decode_progressive(dat) {}}
+    assert_raise_kind_of(NotImplementedError) {dec.feed(dat)}
+
+    dec = JPEG::Decoder.new(:crop => [0, 0, 16, 16],
+                            :dither => [:FS, false, 64])
+    assert_raise_kind_of(NotImplementedError) {dec << dat}
+  end
+end
@@ -0,0 +1,112 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+Warning[:experimental] = false
+
+class TestDecodeInto < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+  TEST_DATA = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+  test "decode into string" do
+    dec = JPEG::Decoder.new
+    exp = dec << TEST_DATA
+    buf = "\0".b * exp.bytesize
+
+    met = dec.decode_into(TEST_DATA, buf)
+
+    assert_kind_of(JPEG::Meta, met)
+    assert_equal(exp.meta.width, met.width)
+    assert_equal(exp.meta.height, met.height)
+    assert_equal(exp, buf)
+    assert_equal(exp.bytesize, buf.bytesize)
+
+    # 同じバッファを繰り返し使用する
+    buf2 = buf
+    3.times {
+      dec.decode_into(TEST_DATA, buf)
+      assert_same(buf2, buf)
+      assert_equal(exp, buf)
+    }
+  end
+
+  test "decode into io buffer" do
+    omit("IO::Buffer is not available") unless defined?(IO::Buffer)
+
+    dec = JPEG::Decoder.new(:pixel_format => :BGRX)
+    exp = dec << TEST_DATA
+    buf = IO::Buffer.new(exp.bytesize)
+
+    dec.decode_into(TEST_DATA, buf)
+
+    assert_equal(exp, buf.get_string)
+    assert_false(buf.locked?)
+  end
+
+  test "decode into (offset and stride)" do
+    dec = JPEG::Decoder.new
+    exp = dec << TEST_DATA
+    row = exp.meta.width * 3
+    ht  = exp.meta.height
+    pad = 13
+    off = 7
+    buf = "\xff".b * (off + (row + pad) * ht)
+
+    dec.decode_into(TEST_DATA, buf, :offset => off, :stride => row + pad)
+
+    assert_equal("\xff".b * off, buf[0, off])
+
+    ht.times {|y|
+      pos = off + y * (row + pad)
+      assert_equal(exp[y * row, row], buf[pos, row])
+      assert_equal("\xff".b * pad, buf[pos + row, pad])
+    }
+  end
+
+  test "decode into (orientation and colormap)" do
+    [
+      {:orientation => true},
+      {:dither => [:FS, false, 64], :expand_colormap => true},
+    ].each {|opt|
+      dat = (DATA_DIR + "orientation-6.jpg").binread
+      dec = JPEG::Decoder.new(opt)
+      exp = dec << dat
+      row = exp.meta.width * exp.meta.num_components
+      buf = "\0".b * ((row + 1) * exp.meta.height)
+
+      met = dec.decode_into(dat, buf, :stride => row + 1)
+      assert_equal(exp.meta.width, met.width)
+
+      exp.meta.height.times {|y|
+        assert_equal(exp[y * row, row], buf[y * (row + 1), row])
+      }
+    }
+  end
+
+  test "decode into (invalid argument)" do
+    dec = JPEG::Decoder.new
+    exp = dec << TEST_DATA
+
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(TEST_DATA, "\0".b * (exp.bytesize - 1))
+    }
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(TEST_DATA, "\0".b * exp.bytesize, :offset => 1)
+    }
+    assert_raise_kind_of(ArgumentError) {
+      dec.decode_into(TEST_DATA, "\0".b * exp.bytesize * 2, :stride => 3)
+    }
+    assert_raise_kind_of(RangeError) {
+      dec.decode_into(TEST_DATA, "\0".b * exp.bytesize, :offset => -1)
+    }
+    assert_raise_kind_of(TypeError) {
+      dec.decode_into(TEST_DATA, [])
+    }
+    assert_raise_kind_of(FrozenError) {
+      dec.decode_into(TEST_DATA, ("\0".b * exp.bytesize).freeze)
+    }
+    assert_raise_kind_of(JPEG::DecodeError) {
+      dec.decode_into(TEST_DATA[0, 100], "\0".b * exp.bytesize)
+    }
+  end
+end
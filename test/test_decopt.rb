@@ -280,10 +280,26 @@ class TestDecodeOptions < Test::Unit::TestCase
 
   data {
     {
-      # 以下は未実装
-      # "YUV422"    => {:fomrat => :YUV422,    :n_comp => 3, :times => 2},
-      # "YUYV"      => {:format => :YUYV,      :n_comp => 3, :times => 2},
-      # "RGB565"    => {:format => :RGB565,    :n_comp => 3, :times => 2},
+      "YUV422"    => {
+        :in     => :YUV422,
+        :out    => "YUV422",
+        :n_comp => 3,
+        :times  => 2
+      },
+
+      "YUYV"      => {
+        :in     => :YUYV,
+        :out    => "YUV422",
+        :n_comp => 3,
+        :times  => 2
+      },
+
+      "RGB565"    => {
+        :in     => :RGB565,
+        :out    => "RGB565",
+        :n_comp => 3,
+        :times  => 2
+      },
 
       "RGB"       => {
         :in     => :RGB,
@@ -400,23 +416,6 @@ class TestDecodeOptions < Test::Unit::TestCase
     assert_equal(info[:out], met.output_colorspace);
   end
 
-  #
-  # pixel_format (not implemented value)
-  #
-  data {
-    {
-      "YUV422"    => :YUV422,
-      "YUYV"      => :YUYV,
-      "RGB565"    => :RGB565,
-    }
-  }
-
-  test "pixel_format (not implemented value)" do |val|
-    assert_raise_kind_of(NotImplementedError ) {
-      JPEG::Decoder.new(:pixel_format => val)
-    }
-  end
-
   #
   # pixel_format (invalid value)
   #
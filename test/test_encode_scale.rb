@@ -0,0 +1,151 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+class TestEncodeScale < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    # 200x300
+    @raw = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    @wd  = @raw.meta.width
+    @ht  = @raw.meta.height
+  end
+
+  #
+  # 箱型フィルタによる縮小 (拡張ライブラリと同じ領域の取り方をする)
+  #
+  def reduce(raw, wd, ht, nc, sw, sh)
+    xb = (0..sw).map {|i| i * wd / sw}
+    yb = (0..sh).map {|i| i * ht / sh}
+    px = raw.unpack("C*")
+
+    (0...sh).map {|oy|
+      (0...sw).map {|ox|
+        n = (xb[ox + 1] - xb[ox]) * (yb[oy + 1] - yb[oy])
+
+        (0...nc).map {|c|
+          sum = 0
+
+          (yb[oy]...yb[oy + 1]).each {|y|
+            (xb[ox]...xb[ox + 1]).each {|x| sum += px[((y * wd) + x) * nc + c]}
+          }
+
+          (sum + (n / 2)) / n
+        }
+      }
+    }.flatten.pack("C*")
+  end
+
+  def scaled_size(scale)
+    [(@wd * scale).ceil, (@ht * scale).ceil]
+  end
+
+  test "scale" do
+    [Rational(1, 2), Rational(1, 3), Rational(2, 3), 0.25, 1.0].each {|scale|
+      sw, sh = scaled_size(scale)
+
+      enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB, :scale => scale)
+      exp = JPEG::Encoder.new(sw, sh, :pixel_format => :RGB) <<
+                                      reduce(@raw, @wd, @ht, 3, sw, sh)
+      jpg = enc << @raw
+
+      # 縮小した入力を圧縮した結果と一致する
+      assert_equal(exp, jpg, scale)
+
+      img = JPEG::Decoder.new << jpg
+      assert_equal([sw, sh], [img.meta.width, img.meta.height])
+    }
+  end
+
+  test "scale with pixel formats" do
+    gray = JPEG::Decoder.new(:pixel_format => :GRAYSCALE) <<
+                                (DATA_DIR + "DSC_0215_small.JPG").binread
+    rgbx = @raw.unpack("C*").each_slice(3).map {|c| c + [0]}.flatten.pack("C*")
+    sw   = 67
+    sh   = 100
+
+    [[:GRAYSCALE, gray, 1], [:RGBX, rgbx, 4]].each {|fmt, raw, nc|
+      enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => fmt,
+                              :scale => Rational(1, 3))
+      exp = JPEG::Encoder.new(sw, sh, :pixel_format => fmt) <<
+                                      reduce(raw, @wd, @ht, nc, sw, sh)
+
+      assert_equal(exp, enc << raw, fmt)
+    }
+  end
+
+  test "scale with staged pixel formats" do
+    # YUV422/RGB565は変換してから縮小する
+    rng = Random.new(0)
+    raw = rng.bytes(64 * 48 * 2)
+
+    yuv = raw.unpack("C*").each_slice(4).map {|y0, u, y1, v|
+      [y0, u, v, y1, u, v]
+    }.flatten.pack("C*")
+
+    rgb = raw.unpack("v*").map {|c|
+      [(c >> 8) & 0xf8, (c >> 3) & 0xfc, (c << 3) & 0xf8]
+    }.flatten.pack("C*")
+
+    [[:YUV422, :YCbCr, yuv], [:RGB565, :RGB, rgb]].each {|fmt, base, conv|
+      enc = JPEG::Encoder.new(64, 48, :pixel_format => fmt, :scale => 0.5)
+      exp = JPEG::Encoder.new(32, 24, :pixel_format => base) <<
+                                      reduce(conv, 64, 48, 3, 32, 24)
+
+      assert_equal(exp, enc << raw, fmt)
+    }
+  end
+
+  test "scale with threads" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB,
+                            :scale => Rational(1, 3))
+    exp = JPEG::Decoder.new << (enc << @raw)
+
+    [2, 4].each {|n|
+      enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB,
+                              :scale => Rational(1, 3), :threads => n)
+
+      assert_equal(exp, JPEG::Decoder.new << (enc << @raw), n)
+    }
+  end
+
+  test "scale with encode_batch and streaming" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB, :scale => 0.4)
+    exp = enc << @raw
+
+    assert_equal([exp, exp], enc.encode_batch([@raw, @raw], :threads => 2))
+
+    # 行を分割して与えても結果は同じになる
+    [1, 7, 64].each {|n|
+      io = StringIO.new("".b)
+      enc.start(io)
+
+      (0...@ht).step(n) {|y|
+        enc.write_rows(@raw.byteslice(y * @wd * 3, n * @wd * 3))
+      }
+
+      enc.finish
+      assert_equal(exp, io.string, n)
+    }
+  end
+
+  test "scale with orientation" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB,
+                            :scale => 0.5, :orientation => 6)
+    img = JPEG::Decoder.new(:orientation => true) << (enc << @raw)
+
+    assert_equal([150, 100], [img.meta.width, img.meta.height])
+  end
+
+  test "scale (invalid value)" do
+    [0.0, 1.5, Rational(3, 2), Rational(-1, 2)].each {|scale|
+      assert_raise_kind_of(RangeError) {
+        JPEG::Encoder.new(16, 16, :scale => scale)
+      }
+    }
+
+    assert_raise_kind_of(ArgumentError) {JPEG::Encoder.new(16, 16, :scale => "1")}
+  end
+end
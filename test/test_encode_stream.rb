@@ -0,0 +1,134 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+class TestEncodeStream < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    @raw = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    @wd  = @raw.meta.width
+    @ht  = @raw.meta.height
+  end
+
+  def encode_in_rows(enc, raw, line, step)
+    io = StringIO.new("".b)
+
+    enc.start(io)
+    (0...raw.bytesize).step(line * step) {|pos|
+      enc.write_rows(raw.byteslice(pos, line * step))
+    }
+
+    size = enc.finish
+    assert_equal(io.string.bytesize, size)
+
+    io.string
+  end
+
+  #
+  # start / write_rows / finish
+  #
+
+  test "encode in rows" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB, :quality => 80)
+    exp = enc << @raw
+
+    [1, 7, 16, 100, @ht].each {|n|
+      assert_equal(exp, encode_in_rows(enc, @raw, @wd * 3, n))
+    }
+  end
+
+  test "encode in rows (staged pixel format)" do
+    # YUV422は行毎に変換して圧縮する
+    raw = "\x80\x10\x80\xf0".b * (@wd / 2 * @ht)
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :YUV422)
+
+    assert_equal(enc << raw, encode_in_rows(enc, raw, @wd * 2, 5))
+  end
+
+  test "encode in rows (orientation)" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB,
+                            :orientation => 6)
+    jpg = encode_in_rows(enc, @raw, @wd * 3, 32)
+
+    assert_equal(enc << @raw, jpg)
+    img = JPEG::Decoder.new(:orientation => true) << jpg
+    assert_equal(@ht, img.meta.width)
+  end
+
+  test "encode in rows (large output)" do
+    # 出力バッファ (64KiB) を越える場合は途中で書き出される
+    raw = Random.new(0).bytes(512 * 512 * 3)
+    enc = JPEG::Encoder.new(512, 512, :pixel_format => :RGB, :quality => 100)
+    io  = Object.new
+    log = []
+    io.define_singleton_method(:write) {|s| log << s.bytesize; s.bytesize}
+
+    enc.start(io)
+    enc.write_rows(raw)
+    enc.finish
+
+    assert_operator(log.size, :>, 1)
+    assert_equal((enc << raw).bytesize, log.sum)
+  end
+
+  test "encoder is reusable after finish" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB)
+    exp = enc << @raw
+
+    2.times {assert_equal(exp, encode_in_rows(enc, @raw, @wd * 3, 64))}
+  end
+
+  #
+  # errors
+  #
+
+  test "write_rows without start" do
+    enc = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE)
+
+    assert_raise_kind_of(RuntimeError) {enc.write_rows("\0" * 16)}
+    assert_raise_kind_of(RuntimeError) {enc.finish}
+  end
+
+  test "invalid arguments" do
+    enc = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE)
+
+    assert_raise_kind_of(TypeError) {enc.start(1)}
+
+    enc.start(StringIO.new)
+    assert_raise_kind_of(RuntimeError) {enc.start(StringIO.new)}
+    assert_raise_kind_of(TypeError) {enc.write_rows(1)}
+    assert_raise_kind_of(ArgumentError) {enc.write_rows("\0" * 15)}
+    assert_raise_kind_of(ArgumentError) {enc.write_rows("\0" * 16 * 17)}
+
+    # 行が不足している場合はエラーになるが、続きを書き込めば完了できる
+    enc.write_rows("\0" * 16 * 8)
+    assert_raise_kind_of(JPEG::EncodeError) {enc.finish}
+
+    enc.write_rows("\0" * 16 * 8)
+    assert_kind_of(Integer, enc.finish)
+  end
+
+  test "frozen encoder" do
+    enc = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE).freeze
+
+    assert_raise_kind_of(FrozenError) {enc.start(StringIO.new)}
+  end
+
+  test "error in output stream" do
+    enc = JPEG::Encoder.new(16, 16, :pixel_format => :GRAYSCALE)
+    io  = Object.new
+    io.define_singleton_method(:write) {|s| raise IOError, "broken"}
+
+    enc.start(io)
+    enc.write_rows("\0" * 256)
+    assert_raise_kind_of(IOError) {enc.finish}
+
+    # エラーの後は新たに開始できる
+    assert_raise_kind_of(RuntimeError) {enc.finish}
+    enc.start(StringIO.new)
+    enc.write_rows("\0" * 256)
+    assert_kind_of(Integer, enc.finish)
+  end
+end
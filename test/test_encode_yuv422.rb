@@ -0,0 +1,151 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+class TestEncodeYUV422 < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    # 200x300
+    @rgb = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    @ycc = JPEG::Decoder.new(:pixel_format => :YCbCr) <<
+                                 (DATA_DIR + "DSC_0215_small.JPG").binread
+    @wd  = @ycc.meta.width
+    @ht  = @ycc.meta.height
+    @raw = to_yuyv(@ycc, @wd, @ht)
+  end
+
+  def to_yuyv(ycc, wd, ht)
+    ycc.bytes.each_slice(6).map {|y0, u, v, y1, _, _|
+      [y0, u, y1, v]
+    }.flatten.pack("C*")
+  end
+
+  def sampling_factors(jpg)
+    # SOF0の各成分の標本化係数 (水平, 垂直)
+    pos = jpg.index("\xff\xc0".b)
+    jpg.byteslice(pos + 10, 9).bytes.each_slice(3).map {|_, f, _|
+      [f >> 4, f & 15]
+    }
+  end
+
+  test "encode with 4:2:2 sampling" do
+    jpg = JPEG::Encoder.new(@wd, @ht, :pixel_format => :YUV422) << @raw
+
+    assert_equal([[2, 1], [1, 1], [1, 1]], sampling_factors(jpg))
+  end
+
+  test "encode result is close to the input" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :YUV422,
+                            :quality => 100)
+    dec = JPEG::Decoder.new(:pixel_format => :YCbCr, :dct_method => :ISLOW)
+    img = dec << (enc << @raw)
+
+    # 色差は横2画素で共有されるので輝度のみ画素毎に比較する
+    dif = img.bytes.each_slice(3).zip(@ycc.bytes.each_slice(3)).map {|a, b|
+      (a[0] - b[0]).abs
+    }
+
+    assert_operator(dif.max, :<=, 1)
+    assert_operator(dif.sum.fdiv(dif.size), :<, 0.1)
+  end
+
+  test "edge columns and rows" do
+    # MCUの境界に揃わない大きさ (右端と下端は複製して埋める)
+    [[2, 1], [18, 9], [34, 17], [100, 30]].each {|wd, ht|
+      raw = "\xa0\x30\xa0\xd0".b * (wd / 2 * ht)
+      enc = JPEG::Encoder.new(wd, ht, :pixel_format => :YUV422,
+                              :quality => 100)
+      img = JPEG::Decoder.new(:pixel_format => :YCbCr) << (enc << raw)
+
+      assert_equal([wd, ht], [img.meta.width, img.meta.height])
+
+      img.bytes.each_slice(3).to_a.transpose.zip([0xa0, 0x30, 0xd0]) {|c, v|
+        assert_in_delta(v, c.min, 1, [wd, ht])
+        assert_in_delta(v, c.max, 1, [wd, ht])
+      }
+    }
+  end
+
+  test "odd width is encoded as 4:4:4" do
+    raw = "\x80\x10\x80\xf0".b * (31 * 8)
+    jpg = JPEG::Encoder.new(61, 8, :pixel_format => :YUV422) <<
+                                            raw.byteslice(0, 61 * 2 * 8)
+
+    assert_equal([[2, 2], [1, 1], [1, 1]], sampling_factors(jpg))
+  end
+
+  test "odd width rows are paired from the head" do
+    # 画素の組は行毎に作り、右端の画素はCrを直前の組から借りる
+    [[3, 1], [33, 1], [65, 3], [33, 9, {:scale => 0.5}]].each {|wd, ht, opt|
+      row = ("\xa0\x30\xa0\xd0".b * wd).byteslice(0, wd * 2)
+      enc = JPEG::Encoder.new(wd, ht, :pixel_format => :YUV422,
+                              :quality => 100, **(opt || {}))
+      img = JPEG::Decoder.new(:pixel_format => :YCbCr) << (enc << row * ht)
+
+      img.bytes.each_slice(3).to_a.transpose.zip([0xa0, 0x30, 0xd0]) {|c, v|
+        assert_in_delta(v, c.min, 1, [wd, ht])
+        assert_in_delta(v, c.max, 1, [wd, ht])
+      }
+    }
+
+    # 一行ずつ渡しても同じ結果になる
+    raw = Random.new(1).bytes(61 * 9 * 2)
+    enc = JPEG::Encoder.new(61, 9, :pixel_format => :YUV422)
+    io  = StringIO.new("".b)
+
+    enc.start(io)
+    9.times {|y| enc.write_rows(raw.byteslice(y * 61 * 2, 61 * 2))}
+    enc.finish
+
+    assert_equal(enc << raw, io.string)
+  end
+
+  test "encode with other methods" do
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :YUV422)
+    exp = enc << @raw
+
+    # 帯状分割
+    jpg = JPEG::Encoder.new(@wd, @ht, :pixel_format => :YUV422,
+                            :threads => 3) << @raw
+    img = JPEG::Decoder.new << jpg
+    assert_equal(JPEG::Decoder.new << exp, img)
+
+    # 一括圧縮
+    assert_equal([exp, exp], enc.encode_batch([@raw, @raw], :threads => 2))
+
+    # 逐次圧縮 (iMCU行の途中で区切る)
+    [1, 5, 8, 64].each {|n|
+      io = StringIO.new("".b)
+      enc.start(io)
+      (0...@ht).step(n) {|y|
+        enc.write_rows(@raw.byteslice(y * @wd * 2, n * @wd * 2))
+      }
+      enc.finish
+
+      assert_equal(exp, io.string, n)
+    }
+  end
+
+  test "RGB565 gives the same result as RGB" do
+    rgb = @rgb.bytes.each_slice(3).map {|r, g, b|
+      [r & 0xf8, g & 0xfc, b & 0xf8]
+    }.flatten.pack("C*")
+
+    raw = rgb.bytes.each_slice(3).map {|r, g, b|
+      (r << 8) | (g << 3) | (b >> 3)
+    }.pack("v*")
+
+    exp = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB) << rgb
+
+    [1, 3].each {|n|
+      enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB565,
+                              :threads => n)
+      assert_equal(JPEG::Decoder.new << exp, JPEG::Decoder.new << (enc << raw))
+    }
+
+    enc = JPEG::Encoder.new(@wd, @ht, :pixel_format => :RGB565)
+    assert_equal(exp, enc << raw)
+  end
+end
@@ -0,0 +1,236 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestFit < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    # 200x300
+    @dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+  end
+
+  def size_of(img)
+    [img.meta.width, img.meta.height]
+  end
+
+  def average(img)
+    img.bytes.sum.fdiv(img.bytesize)
+  end
+
+  #
+  # :fit
+  #
+
+  test "fit" do
+    full = JPEG::Decoder.new << @dat
+
+    {
+      [100, 100]   => [67, 100],
+      [150, 1000]  => [150, 225],
+      [299, 199]   => [133, 199],
+      [64, 30]     => [20, 30],
+      [1, 1]       => [1, 1],
+      [1000, 1000] => [667, 1000],
+    }.each {|box, exp|
+      img = JPEG::Decoder.new(:fit => box) << @dat
+
+      assert_equal(exp, size_of(img), box)
+      assert_equal(exp[0] * exp[1] * 3, img.bytesize)
+      assert_in_delta(average(full), average(img), 3.0)
+    }
+  end
+
+  test "fit (exact DCT scaling)" do
+    # DCTスケーリングで大きさが一致する場合はリサンプルしない
+    assert_equal(JPEG::Decoder.new(:scale => 0.5) << @dat,
+                 JPEG::Decoder.new(:fit => [100, 150]) << @dat)
+
+    assert_equal(JPEG::Decoder.new << @dat,
+                 JPEG::Decoder.new(:fit => [200, 300], :scale => 0.5) << @dat)
+  end
+
+  test "fit with pixel formats" do
+    [:GRAYSCALE, :RGBX, :BGR].each {|fmt|
+      exp = JPEG::Decoder.new(:pixel_format => fmt) << @dat
+      img = JPEG::Decoder.new(:pixel_format => fmt, :fit => [50, 50]) << @dat
+
+      assert_equal([33, 50], size_of(img))
+      assert_equal(33 * 50 * (exp.bytesize / (200 * 300)), img.bytesize)
+    }
+  end
+
+  test "fit with orientation" do
+    # 回転後の画像を枠に収める (orientation-6は160x160を90度回転する)
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    dec = JPEG::Decoder.new(:orientation => true, :fit => [40, 20])
+
+    assert_equal([20, 20], size_of(dec << dat))
+  end
+
+  #
+  # :fill
+  #
+
+  test "fill" do
+    [[100, 100], [64, 30], [1, 1], [1000, 1000], [200, 300]].each {|box|
+      img = JPEG::Decoder.new(:fill => box) << @dat
+
+      assert_equal(box, size_of(img))
+      assert_equal(box[0] * box[1] * 3, img.bytesize)
+    }
+
+    assert_equal(JPEG::Decoder.new << @dat,
+                 JPEG::Decoder.new(:fill => [200, 300]) << @dat)
+  end
+
+  test "fit and fill replace each other" do
+    dec = JPEG::Decoder.new(:fit => [100, 100])
+    assert_equal([67, 100], size_of(dec << @dat))
+
+    dec.set(:fill => [100, 100])
+    assert_equal([100, 100], size_of(dec << @dat))
+
+    dec.set(:fill => nil)
+    assert_equal([200, 300], size_of(dec << @dat))
+  end
+
+  #
+  # :resize
+  #
+
+  test "resize" do
+    [[100, 100], [64, 30], [1, 1], [400, 100], [200, 300]].each {|box|
+      img = JPEG::Decoder.new(:resize => box) << @dat
+
+      assert_equal(box, size_of(img))
+      assert_equal(box[0] * box[1] * 3, img.bytesize)
+    }
+
+    # 縦横比が同じ場合は:fitと同じ結果になる
+    assert_equal(JPEG::Decoder.new(:fit => [100, 100]) << @dat,
+                 JPEG::Decoder.new(:resize => [67, 100]) << @dat)
+  end
+
+  test "resize with orientation" do
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    dec = JPEG::Decoder.new(:orientation => true, :resize => [40, 20])
+
+    assert_equal([40, 20], size_of(dec << dat))
+  end
+
+  #
+  # resampling filters
+  #
+
+  test "resampling filters" do
+    full = JPEG::Decoder.new << @dat
+
+    [:fit, :fill, :resize].each {|opt|
+      exp  = JPEG::Decoder.new(opt => [60, 70]) << @dat
+      imgs = [:BILINEAR, :BICUBIC, :LANCZOS].map {|filter|
+        img = JPEG::Decoder.new(opt => [60, 70, filter]) << @dat
+
+        assert_equal(size_of(exp), size_of(img), [opt, filter])
+        assert_in_delta(average(full), average(img), 3.0)
+
+        img
+      }
+
+      # BILINEARは既定値
+      assert_equal(exp, imgs[0])
+      assert_equal(3, imgs.uniq.size)
+    }
+  end
+
+  test "resampling filters keep flat color" do
+    # 重みの合計は1なので単色の画像は単色のまま (拡大でも縮小でも)
+    raw = "\x40\x80\xc0".b * (64 * 48)
+    jpg = JPEG::Encoder.new(64, 48, :pixel_format => :RGB, :quality => 100) << raw
+    exp = (JPEG::Decoder.new << jpg).bytes.first(3)
+
+    [[20, 15], [100, 10], [300, 200]].each {|box|
+      [:BICUBIC, :LANCZOS].each {|filter|
+        img = JPEG::Decoder.new(:resize => box + [filter]) << jpg
+        px  = img.bytes.each_slice(3).to_a.transpose
+
+        exp.each_with_index {|v, c|
+          assert_in_delta(v, px[c].min, 1, [box, filter])
+          assert_in_delta(v, px[c].max, 1, [box, filter])
+        }
+      }
+    }
+  end
+
+  test "resampling gives the same result for any number of components" do
+    # 1, 3, 4成分はタップの処理が異なるので互いに比較する
+    gray = (DATA_DIR + "restart-gray.jpg").binread
+
+    [[61, 47], [300, 200], [17, 333]].each {|box|
+      [:BILINEAR, :BICUBIC, :LANCZOS].each {|filter|
+        opt  = box + [filter]
+        rgb  = JPEG::Decoder.new(:resize => opt) << @dat
+        rgbx = JPEG::Decoder.new(:resize => opt, :pixel_format => :RGBX) << @dat
+
+        assert_equal(rgb.bytes,
+                     rgbx.bytes.each_slice(4).flat_map {|px| px[0, 3]},
+                     [box, filter])
+
+        y    = JPEG::Decoder.new(:resize => opt,
+                                 :pixel_format => :GRAYSCALE) << gray
+        yyy  = JPEG::Decoder.new(:resize => opt) << gray
+
+        assert_equal(y.bytes.flat_map {|v| [v] * 3}, yyy.bytes, [box, filter])
+      }
+    }
+  end
+
+  test "resampling filter (invalid value)" do
+    assert_raise_kind_of(ArgumentError) {
+      JPEG::Decoder.new(:resize => [1, 1, :NEAREST])
+    }
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:fit => [1, 1, 1])}
+    assert_raise_kind_of(ArgumentError) {
+      JPEG::Decoder.new(:fill => [1, 1, :LANCZOS, 1])
+    }
+    assert_nothing_raised {JPEG::Decoder.new(:fit => [1, 1, "BICUBIC"])}
+    assert_nothing_raised {JPEG::Decoder.new(:fit => [1, 1, nil])}
+  end
+
+  #
+  # other methods
+  #
+
+  test "fit with decode_into and decode_batch" do
+    dec = JPEG::Decoder.new(:fill => [50, 40])
+    exp = dec << @dat
+    buf = "\0".b * exp.bytesize
+
+    met = dec.decode_into(@dat, buf)
+    assert_equal([50, 40], [met.width, met.height])
+    assert_equal(exp, buf)
+
+    assert_equal([exp, exp], dec.decode_batch([@dat, @dat], :threads => 2))
+  end
+
+  test "fit (invalid value)" do
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:fit => 1)}
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:fit => [1, "1"])}
+    assert_raise_kind_of(ArgumentError) {JPEG::Decoder.new(:fill => [1])}
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:fill => [0, 1])}
+  end
+
+  test "fit is not supported" do
+    dec = JPEG::Decoder.new(:fit => [16, 16])
+
+    assert_raise_kind_of(NotImplementedError) {dec.each_band(@dat) {}}
+    assert_raise_kind_of(NotImplementedError) {dec.feed(@dat)}
+
+    dec = JPEG::Decoder.new(:fit => [16, 16], :crop => [0, 0, 8, 8])
+    assert_raise_kind_of(NotImplementedError) {dec << @dat}
+
+    dec = JPEG::Decoder.new(:resize => [16, 16, :LANCZOS])
+    assert_raise_kind_of(NotImplementedError) {dec.each_band(@dat) {}}
+    assert_raise_kind_of(NotImplementedError) {dec.decode_progressive(@dat) {}}
+  end
+end
@@ -0,0 +1,177 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+class TestPackedFormat < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    # 200x300
+    @dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+  end
+
+  #
+  # RGB/YCbCrの出力から期待値を作る
+  #
+
+  def to_rgb565(img)
+    img.bytes.each_slice(3).map {|r, g, b|
+      ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3)
+    }.pack("v*")
+  end
+
+  def to_yuyv(img)
+    wd = img.meta.width
+
+    img.bytes.each_slice(wd * 3).map {|row|
+      row.each_slice(6).map {|y0, u0, v0, y1, u1, v1|
+        if y1
+          [y0, (u0 + u1 + 1) / 2, y1, (v0 + v1 + 1) / 2]
+        else
+          [y0, u0, y0, v0]
+        end
+      }
+    }.flatten.pack("C*")
+  end
+
+  def expected(fmt, dat, **opt)
+    if fmt == :RGB565
+      to_rgb565(JPEG::Decoder.new(**opt, :pixel_format => :RGB) << dat)
+    else
+      to_yuyv(JPEG::Decoder.new(**opt, :pixel_format => :YCbCr) << dat)
+    end
+  end
+
+  #
+  # decode
+  #
+
+  data("RGB565" => :RGB565, "YUYV" => :YUYV)
+
+  test "packed output" do |fmt|
+    [
+      {},
+      {:scale => 0.5},
+      {:do_fancy_upsampling => true},
+      {:dct_method => :ISLOW},
+    ].each {|opt|
+      img = JPEG::Decoder.new(**opt, :pixel_format => fmt) << @dat
+
+      assert_equal(expected(fmt, @dat, **opt), img, opt)
+      assert_equal(img.meta.width * 2, img.meta.stride)
+      assert_equal(img.meta.stride * img.meta.height, img.bytesize)
+    }
+  end
+
+  data("RGB565" => :RGB565, "YUYV" => :YUYV)
+
+  test "packed output with crop and resampling" do |fmt|
+    [
+      {:crop => [11, 20, 33, 40]},
+      {:crop => [0, 0, 200, 300]},
+      {:fit => [60, 60]},
+      {:fill => [51, 40, :LANCZOS]},
+      {:resize => [100, 150]},
+    ].each {|opt|
+      img = JPEG::Decoder.new(**opt, :pixel_format => fmt) << @dat
+
+      assert_equal(expected(fmt, @dat, **opt), img, opt)
+    }
+  end
+
+  data("RGB565" => :RGB565, "YUYV" => :YUYV)
+
+  test "packed output with parallel decoding" do |fmt|
+    dat = (DATA_DIR + "restart-420.jpg").binread
+    exp = JPEG::Decoder.new(:pixel_format => fmt, :threads => 1) << dat
+
+    assert_equal(expected(fmt, dat), exp)
+
+    [{}, {:orientation => true}].each {|opt|
+      exp = JPEG::Decoder.new(**opt, :pixel_format => fmt, :threads => 1) << dat
+      img = JPEG::Decoder.new(**opt, :pixel_format => fmt, :threads => 3) << dat
+
+      assert_equal(exp, img, opt)
+    }
+  end
+
+  test "odd width of YUYV" do
+    # 右端の画素は複製して組にする (行は偶数幅に切り上げる)
+    img = JPEG::Decoder.new(:pixel_format => :YUYV,
+                            :crop => [0, 0, 33, 10]) << @dat
+
+    assert_equal(33, img.meta.width)
+    assert_equal(68, img.meta.stride)
+    assert_equal(68 * 10, img.bytesize)
+  end
+
+  data("RGB565" => :RGB565, "YUYV" => :YUYV)
+
+  test "packed output with orientation" do |fmt|
+    (1..8).each {|n|
+      dat = (DATA_DIR + "orientation-#{n}.jpg").binread
+
+      # 幅1の画像はYUYVに詰めると行が長くなる (その場で詰める順序の確認)
+      [{}, {:crop => [3, 5, 1, 7]}, {:crop => [0, 0, 37, 3]}].each {|opt|
+        exp = expected(fmt, dat, **opt, :orientation => true)
+        img = JPEG::Decoder.new(**opt, :pixel_format => fmt,
+                                :orientation => true) << dat
+
+        assert_equal(exp, img, [n, opt])
+      }
+    }
+  end
+
+  data("RGB565" => :RGB565, "YUYV" => :YUYV)
+
+  test "packed output with other methods" do |fmt|
+    dec = JPEG::Decoder.new(:pixel_format => fmt)
+    exp = dec << @dat
+
+    # decode_into
+    buf = "\0".b * (exp.bytesize + 300 * 4)
+    dec.decode_into(@dat, buf, :stride => 404)
+    assert_equal(exp, (0...300).map {|y| buf.byteslice(y * 404, 400)}.join)
+
+    # decode_batch
+    assert_equal([exp, exp], dec.decode_batch([@dat, @dat], :threads => 2))
+
+    # each_band
+    bands = []
+    dec.each_band(@dat, :rows => 7) {|band, y| bands << band.dup}
+    assert_equal(exp, bands.join)
+
+    # feed / decode_io
+    assert_equal(exp, dec.decode_io(StringIO.new(@dat)))
+
+    # decode_progressive
+    dat = (DATA_DIR + "progressive.jpg").binread
+    ret = dec.decode_progressive(dat) {}
+    assert_equal(dec << dat, ret)
+  end
+
+  test "encode and decode YUYV" do
+    wd  = 64
+    ht  = 48
+    raw = (0...ht).map {|y|
+      (0...(wd / 2)).map {|x| [x * 8, 64 + y, x * 8 + 4, 192 - y]}
+    }.flatten.pack("C*")
+
+    jpg = JPEG::Encoder.new(wd, ht, :pixel_format => :YUYV,
+                            :quality => 100) << raw
+    img = JPEG::Decoder.new(:pixel_format => :YUYV,
+                            :dct_method => :ISLOW) << jpg
+
+    assert_equal(raw.bytesize, img.bytesize)
+    assert_operator(raw.bytes.zip(img.bytes).map {|a, b| (a - b).abs}.max,
+                    :<=, 2)
+  end
+
+  test "packed output with dither" do
+    [:YUYV, :RGB565].each {|fmt|
+      dec = JPEG::Decoder.new(:pixel_format => fmt, :dither => [:FS, false, 64])
+      assert_raise_kind_of(NotImplementedError) {dec << @dat}
+    }
+  end
+end
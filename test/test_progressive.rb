@@ -0,0 +1,118 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestProgressive < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  test "decode pass by pass" do
+    dat = (DATA_DIR + "progressive.jpg").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+    log = []
+
+    ret = dec.decode_progressive(dat) {|i, img|
+      assert_equal(exp.bytesize, img.bytesize)
+      assert_equal(exp.meta.width, img.meta.width)
+      log << [i, img]
+    }
+
+    assert_operator(log.size, :>, 1)
+    assert_equal((0...log.size).to_a, log.map(&:first))
+
+    # 最後のパスは通常の伸長結果と一致する
+    assert_same(log.last[1], ret)
+    assert_equal(exp, ret)
+    assert_not_equal(exp, log.first[1])
+  end
+
+  test "decode sequential jpeg" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:orientation => true)
+    ret = dec.decode_progressive(dat).to_a
+
+    assert_equal(1, ret.size)
+    assert_equal(dec << dat, ret[0][1])
+  end
+
+  test "decode pass by pass with options" do
+    dat = (DATA_DIR + "progressive.jpg").binread
+
+    [
+      {:scale => 0.25},
+      {:pixel_format => :GRAYSCALE},
+      {:dither => [:FS, false, 64]},
+    ].each {|opt|
+      dec = JPEG::Decoder.new(**opt)
+      exp = dec << dat
+      ret = dec.decode_progressive(dat) {|i, img|
+        assert_equal(exp.meta.width, img.meta.width)
+      }
+
+      assert_equal(exp, ret)
+    }
+  end
+
+  test "decode normally after decode_progressive" do
+    # 作業領域を再利用してもbuffered-imageモードが残らないこと
+    dat = (DATA_DIR + "progressive.jpg").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    dec.decode_progressive(dat) {}
+    assert_equal(exp, dec << dat)
+  end
+
+  #
+  # :max_scans
+  #
+
+  test "max_scans" do
+    dat    = (DATA_DIR + "progressive.jpg").binread
+    passes = JPEG::Decoder.new.decode_progressive(dat).map {|i, img| img}
+
+    [1, 2, 5, passes.size, passes.size + 3].each {|n|
+      dec = JPEG::Decoder.new(:max_scans => n)
+      exp = passes[[n, passes.size].min - 1]
+
+      assert_equal(exp, dec << dat)
+      assert_equal([exp], dec.decode_batch([dat]))
+      assert_equal([n, passes.size].min, dec.decode_progressive(dat).count)
+    }
+  end
+
+  test "max_scans with scale and partial data" do
+    dat = (DATA_DIR + "progressive.jpg").binread
+    dec = JPEG::Decoder.new(:max_scans => 2, :scale => 0.25)
+    img = dec << dat
+
+    assert_equal((JPEG::Decoder.new(:scale => 0.25) << dat).meta.width,
+                 img.meta.width)
+
+    # 途中までの入力でも指定したスキャンまでは同じ結果になる
+    assert_equal(img, dec << dat[0, dat.bytesize / 2])
+  end
+
+  test "max_scans does not affect sequential jpeg" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+
+    assert_equal(JPEG::Decoder.new << dat,
+                 JPEG::Decoder.new(:max_scans => 1) << dat)
+  end
+
+  test "max_scans (invalid value)" do
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:max_scans => 0)}
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:max_scans => "1")}
+    assert_nothing_raised {JPEG::Decoder.new(:max_scans => nil)}
+  end
+
+  test "decode broken data pass by pass" do
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(JPEG::DecodeError) {
+      dec.decode_progressive("foo") {}
+    }
+
+    assert_raise_kind_of(TypeError) {dec.decode_progressive(1) {}}
+  end
+end
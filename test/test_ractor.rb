@@ -0,0 +1,97 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+Warning[:experimental] = false
+
+class TestRactor < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  test "shareable decoder" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:orientation => true, :with_exif_tags => true)
+    exp = dec << dat
+
+    assert_true(Ractor.shareable?(Ractor.make_shareable(dec)))
+
+    rs = 3.times.map {
+      Ractor.new(dec, dat) {|d, s|
+        img = d << s
+        [img.to_s, img.meta.width, img.meta.height, img.meta.exif_tags]
+      }
+    }
+
+    rs.each {|r|
+      img, wd, ht, tags = r.take
+
+      assert_equal(exp, img)
+      assert_equal(exp.meta.width, wd)
+      assert_equal(exp.meta.height, ht)
+      assert_equal(exp.meta.exif_tags, tags)
+    }
+  end
+
+  test "shareable decoder after feed" do
+    # #feedの途中は出力バッファを保持しているのでfreezeできない
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    assert_equal(exp, dec.feed(dat))
+    assert_nil(dec.feed(dat[0, dat.bytesize / 2]))
+
+    assert_raise_kind_of(RuntimeError) {Ractor.make_shareable(dec)}
+    assert_false(dec.frozen?)
+
+    assert_equal(exp, dec.feed(dat[(dat.bytesize / 2)..-1]))
+    assert_nil(dec.feed(""))
+
+    assert_true(Ractor.shareable?(Ractor.make_shareable(dec)))
+    assert_raise_kind_of(FrozenError) {dec.feed(dat)}
+
+    r = Ractor.new(dec, dat) {|d, s| (d << s).to_s}
+    assert_equal(exp, r.take)
+  end
+
+  test "shareable encoder" do
+    img = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    met = img.meta
+    enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+    exp = enc << img
+
+    assert_true(Ractor.shareable?(Ractor.make_shareable(enc)))
+
+    rs = 3.times.map {Ractor.new(enc, img.to_s) {|e, s| e << s}}
+    rs.each {|r| assert_equal(exp, r.take)}
+  end
+
+  test "shareable encoder after start" do
+    # #startからの#finishまでは出力先のIOを参照するのでfreezeできない
+    img = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    met = img.meta
+    enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+    exp = enc << img
+    io  = StringIO.new("".b)
+
+    enc.start(io)
+    assert_raise_kind_of(RuntimeError) {Ractor.make_shareable(enc)}
+    assert_false(enc.frozen?)
+    assert_false(io.frozen?)
+
+    enc.write_rows(img)
+    enc.finish
+    assert_equal(exp, io.string)
+
+    assert_true(Ractor.shareable?(Ractor.make_shareable(enc)))
+    assert_false(io.frozen?)
+
+    r = Ractor.new(enc, img.to_s) {|e, s| e << s}
+    assert_equal(exp, r.take)
+  end
+
+  test "frozen decoder" do
+    dec = JPEG::Decoder.new.freeze
+    assert_raise_kind_of(FrozenError) {dec.set(:orientation => true)}
+  end
+end
@@ -0,0 +1,118 @@
+require 'test/unit'
+require 'pathname'
+require 'objspace'
+require 'jpeg'
+
+class TestRestart < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # parallel decoding with restart markers
+  #
+
+  data("4:2:0 (restart in rows)"      => "restart-420.jpg",
+       "4:4:4 (restart interval 4)"   => "restart-444.jpg",
+       "grayscale (restart in rows)"  => "restart-gray.jpg",
+       "without restart marker"       => "DSC_0215_small.JPG")
+
+  test "parallel decode" do |name|
+    dat = (DATA_DIR + name).binread
+
+    [
+      {},
+      {:pixel_format => :BGRX},
+      {:pixel_format => :GRAYSCALE},
+      {:pixel_format => :RGB565},
+      {:scale => Rational(1, 2)},
+      {:scale => Rational(3, 8)},
+      {:orientation => true},
+      {:do_fancy_upsampling => true},
+    ].each {|opt|
+      exp = JPEG::Decoder.new(opt.merge(:threads => 1)) << dat
+
+      [2, 3, 64].each {|n|
+        img = JPEG::Decoder.new(opt.merge(:threads => n)) << dat
+
+        assert_equal(exp, img, "#{opt} :threads => #{n}")
+        assert_equal(exp.meta.width, img.meta.width)
+        assert_equal(exp.meta.height, img.meta.height)
+      }
+    }
+  end
+
+  test "parallel decode (broken data)" do
+    dat = (DATA_DIR + "restart-420.jpg").binread
+    dat = dat[0, dat.bytesize * 2 / 3]
+    exp = JPEG::Decoder.new(:threads => 1) << dat
+
+    assert_equal(exp, JPEG::Decoder.new(:threads => 4) << dat)
+  end
+
+  test "parallel decode repeatedly with pooled contexts" do
+    dat = (DATA_DIR + "restart-420.jpg").binread
+    exp = JPEG::Decoder.new(:threads => 1) << dat
+    dec = JPEG::Decoder.new(:threads => 3)
+    sz  = ObjectSpace.memsize_of(dec)
+
+    # 各帯の作業領域もデコーダのプールに戻されて次の呼び出しで再利用される
+    3.times {
+      assert_equal(exp, dec << dat)
+      assert_equal(exp.meta.width, dec.read_header(dat).width)
+    }
+
+    assert_operator(ObjectSpace.memsize_of(dec), :>, sz)
+  end
+
+  test "threads option" do
+    assert_nothing_raised {JPEG::Decoder.new(:threads => nil)}
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:threads => 0)}
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:threads => "2")}
+  end
+
+  #
+  # parallel striped encoding
+  #
+
+  data("RGB"       => [:RGB, 3],
+       "BGRX"      => [:BGRX, 4],
+       "YUV422"    => [:YUV422, 2],
+       "GRAYSCALE" => [:GRAYSCALE, 1])
+
+  test "striped encode" do |info|
+    fmt, bpp = *info
+    raw = JPEG::Decoder.new(:pixel_format => :RGB) <<
+                                (DATA_DIR + "restart-420.jpg").binread
+    wd  = raw.meta.width - 3
+    ht  = raw.meta.height - 5
+    raw = Random.new(1).bytes(wd * ht * bpp) if fmt != :RGB
+    raw = raw[0, wd * ht * bpp]
+
+    exp = JPEG::Encoder.new(wd, ht, :pixel_format => fmt) << raw
+    exp = JPEG::Decoder.new << exp
+
+    [2, 5, 64].each {|n|
+      enc = JPEG::Encoder.new(wd, ht, :pixel_format => fmt, :threads => n)
+      jpg = enc << raw
+
+      assert_equal(exp, JPEG::Decoder.new << jpg)
+      assert_equal(exp, JPEG::Decoder.new(:threads => 3) << jpg)
+    }
+  end
+
+  test "striped encode (orientation)" do
+    raw = "\x80" * (64 * 48 * 3)
+    enc = JPEG::Encoder.new(64, 48, :pixel_format => :RGB,
+                            :orientation => 6, :threads => 3)
+    dec = JPEG::Decoder.new(:with_exif_tags => true)
+
+    assert_equal(6, dec.read_header(enc << raw).exif_tags[:orientation])
+  end
+
+  test "encoder threads option" do
+    assert_nothing_raised {JPEG::Encoder.new(16, 16, :threads => nil)}
+    assert_raise_kind_of(RangeError) {JPEG::Encoder.new(16, 16, :threads => 0)}
+    assert_raise_kind_of(TypeError) {
+      JPEG::Encoder.new(16, 16, :threads => "2")
+    }
+  end
+end
@@ -1,8 +1,13 @@
 require 'test/unit'
+require 'pathname'
 require 'base64'
+require 'stringio'
+require 'objspace'
 require 'jpeg'
 
 class TestSimple < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
   TEST_DATA = Base64.decode64(<<~EOD)
     /9j/4AAQSkZJRgABAQAAAQABAAD/2wBDAAgGBgcGBQgHBwcJCQgKDBQNDAsLDBkS
     Ew8UHRofHh0aHBwgJC4nICIsIxwcKDcpLDAxNDQ0Hyc5PTgyPC4zNDL/2wBDAQkJ
@@ -276,6 +281,74 @@ class TestSimple < Test::Unit::TestCase
     assert_equal(met.stride * met.height, img.bytesize)
   end
 
+  test "decode repeatedly" do
+    dec = JPEG::Decoder.new
+    exp = dec << TEST_DATA
+
+    10.times {
+      assert_equal(exp, dec << TEST_DATA)
+      assert_raise_kind_of(JPEG::DecodeError) {dec << TEST_DATA[0, 100]}
+      assert_equal(256, dec.read_header(TEST_DATA).width)
+    }
+
+    dec.set(:scale => Rational(1, 2), :with_exif_tags => true)
+    img = dec << TEST_DATA
+    assert_equal(128, img.meta.width)
+    assert_kind_of(Hash, img.meta.exif_tags)
+
+    dec.set(:scale => Rational(1, 1), :with_exif_tags => false)
+    img = dec << TEST_DATA
+    assert_equal(exp, img)
+    assert_false(img.meta.respond_to?(:exif_tags))
+  end
+
+  test "decode progressive and baseline alternately" do
+    prog = (DATA_DIR + "progressive.jpg").binread
+    dec  = JPEG::Decoder.new(:dither => [:FS, true, 64])
+    exp1 = dec << prog
+    exp2 = dec << TEST_DATA
+
+    # 作業領域のメモリは画像間で再利用される
+    5.times {
+      assert_equal(exp1, dec << prog)
+      assert_equal(exp2, dec << TEST_DATA)
+    }
+  end
+
+  test "read header after decode with dither" do
+    dec = JPEG::Decoder.new(:dither => [:FS, false, 64])
+    img = dec << TEST_DATA
+
+    # ヘッダのみの読み込みではカラーマップは作られない
+    assert_equal(64, img.meta.colormap.size)
+    assert_equal([], dec.read_header(TEST_DATA).colormap)
+    assert_equal(img, dec << TEST_DATA)
+  end
+
+  test "encode repeatedly with pooled contexts" do
+    img = JPEG::Decoder.new << (DATA_DIR + "DSC_0215_small.JPG").binread
+    met = img.meta
+    wd  = met.width
+    ht  = met.height
+    enc = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB, :threads => 3)
+    seq = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB) << img
+    exp = JPEG::Encoder.new(wd, ht, :pixel_format => :RGB,
+                            :threads => 3) << img
+    sz  = ObjectSpace.memsize_of(enc)
+
+    # 作業領域はエンコーダのプールに戻されて次の呼び出しで再利用される
+    3.times {
+      assert_equal(exp, enc << img)
+      assert_equal([seq, seq], enc.encode_batch([img, img], :threads => 2))
+
+      io = StringIO.new("".b)
+      enc.start(io).write_rows(img).finish
+      assert_equal(seq, io.string)
+    }
+
+    assert_operator(ObjectSpace.memsize_of(enc), :>, sz)
+  end
+
   test "encode simple" do
     dec = JPEG::Decoder.new(:pixel_format => :YCbCr)
 
@@ -288,4 +361,36 @@ class TestSimple < Test::Unit::TestCase
     assert_true(dat.bytesize < img.bytesize)
     # IO.binwrite("output.png", dat)
   end
+
+  test "encode repeatedly" do
+    flat  = "\x80" * (512 * 512 * 3)
+    noise = Random.new(0).bytes(512 * 512 * 3)
+    enc   = JPEG::Encoder.new(512, 512, :pixel_format => :RGB)
+
+    exp_f = enc << flat
+    exp_n = enc << noise
+
+    # 前回より大きな出力 (出力先の伸長) と小さな出力を交互に行う
+    3.times {
+      assert_equal(exp_f, enc << flat)
+      assert_equal(exp_n, enc << noise)
+    }
+
+    assert_true(exp_f.bytesize < exp_n.bytesize)
+    assert_equal(512, JPEG::Decoder.new.read_header(exp_n).width)
+  end
+
+  test "encode pixel formats" do
+    rgb  = Random.new(1).bytes(61 * 47 * 3)
+    bgr  = rgb.unpack("C*").each_slice(3).map(&:reverse).flatten.pack("C*")
+    rgbx = rgb.unpack("C*").each_slice(3).map {|a| a + [0]}.flatten.pack("C*")
+    bgrx = bgr.unpack("C*").each_slice(3).map {|a| a + [0]}.flatten.pack("C*")
+
+    exp  = JPEG::Encoder.new(61, 47, :pixel_format => :RGB) << rgb
+
+    {:BGR => bgr, :RGBX => rgbx, :BGRX => bgrx}.each {|fmt, raw|
+      enc = JPEG::Encoder.new(61, 47, :pixel_format => fmt)
+      assert_equal(exp, enc << raw, fmt.to_s)
+    }
+  end
 end
@@ -0,0 +1,159 @@
+require 'test/unit'
+require 'pathname'
+require 'stringio'
+require 'jpeg'
+
+class TestStream < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  FILES     = [
+    "DSC_0215_small.JPG",
+    "progressive.jpg",
+    "orientation-6.jpg",
+    "restart-420.jpg",
+  ]
+
+  OPTIONS   = [
+    {},
+    {:orientation => true, :with_exif_tags => true},
+    {:dither => [:FS, true, 64], :expand_colormap => true},
+    {:pixel_format => :GRAYSCALE, :scale => Rational(1, 2)},
+  ]
+
+  #
+  # decode_io
+  #
+
+  test "decode io" do
+    FILES.product(OPTIONS) {|name, opt|
+      dat = (DATA_DIR + name).binread
+      dec = JPEG::Decoder.new(opt)
+      exp = dec << dat
+
+      img = (DATA_DIR + name).open("rb") {|f| dec.decode_io(f)}
+      assert_equal(exp, img, "#{name} #{opt}")
+      assert_equal(exp.meta.width, img.meta.width)
+      assert_equal(exp.meta.height, img.meta.height)
+
+      img = dec.decode_io(StringIO.new(dat))
+      assert_equal(exp, img, "#{name} #{opt}")
+    }
+  end
+
+  test "decode io (pipe)" do
+    dat = (DATA_DIR + "progressive.jpg").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    IO.pipe {|r, w|
+      thr = Thread.new {
+        dat.bytes.each_slice(1000) {|a| w.write(a.pack("C*")); sleep 0.001}
+        w.close
+      }
+
+      assert_equal(exp, dec.decode_io(r))
+      thr.join
+    }
+  end
+
+  test "decode io (broken data)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(JPEG::DecodeError) {
+      dec.decode_io(StringIO.new(dat[0, 100]))
+    }
+    assert_raise_kind_of(JPEG::DecodeError) {
+      dec.decode_io(StringIO.new(""))
+    }
+
+    # 失敗後も使用できること
+    assert_equal(dec << dat, dec.decode_io(StringIO.new(dat)))
+  end
+
+  #
+  # feed
+  #
+
+  test "feed" do
+    FILES.product(OPTIONS) {|name, opt|
+      dat = (DATA_DIR + name).binread
+      dec = JPEG::Decoder.new(opt)
+      exp = dec << dat
+
+      [1, 7, 512, dat.bytesize].each {|n|
+        ret = []
+        dat.bytes.each_slice(n) {|a| ret << dec.feed(a.pack("C*"))}
+
+        assert_equal([nil] * (ret.size - 1), ret[0..-2])
+        assert_equal(exp, ret.last, "#{name} #{opt} #{n}")
+        assert_equal(exp.meta.width, ret.last.meta.width)
+      }
+    }
+  end
+
+  test "feed multiple images" do
+    dat1 = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dat2 = (DATA_DIR + "orientation-3.jpg").binread
+    dec  = JPEG::Decoder.new
+
+    assert_equal(dec << dat1, dec.feed(dat1))
+    assert_equal(dec << dat2, dec.feed(dat2))
+    assert_nil(dec.feed(nil))
+  end
+
+  test "feed back-to-back images" do
+    # EOI以降の入力は次の画像の先頭として扱う
+    dat1 = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dat2 = (DATA_DIR + "orientation-3.jpg").binread
+    dec  = JPEG::Decoder.new
+    exp1 = dec << dat1
+    exp2 = dec << dat2
+
+    assert_equal(exp1, dec.feed(dat1 + dat2[0, 1000]))
+    assert_equal(exp2, dec.feed(dat2[1000..-1]))
+    assert_nil(dec.feed(nil))
+
+    # 一度に複数の画像を渡した場合は一つずつ返す
+    assert_equal(exp1, dec.feed(dat1 + dat2 + dat1))
+    assert_equal(exp2, dec.feed(""))
+    assert_equal(exp1, dec.feed(nil))
+    assert_nil(dec.feed(nil))
+
+    # 任意の位置で区切っても同じ
+    ret = (dat1 + dat2).bytes.each_slice(4096).map {|a|
+      dec.feed(a.pack("C*"))
+    }
+
+    assert_equal([exp1, exp2], ret.compact)
+  end
+
+  test "feed (end of input)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    # 途中で打ち切られたデータは#decodeと同様に補完される
+    exp = dec << dat[0, dat.bytesize - 5000]
+
+    assert_nil(dec.feed(dat[0, dat.bytesize - 5000]))
+    assert_equal(exp, dec.feed(nil))
+  end
+
+  test "feed (broken data)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+
+    assert_raise_kind_of(JPEG::DecodeError) {
+      dec.feed("\0" * 100)
+    }
+
+    assert_equal(dec << dat, dec.feed(dat))
+  end
+
+  test "feed (frozen decoder)" do
+    dec = JPEG::Decoder.new.freeze
+
+    assert_raise_kind_of(FrozenError) {dec.feed("\xff\xd8")}
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new.feed(1)}
+  end
+end
@@ -0,0 +1,134 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestThread < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  #
+  # decode in multiple threads
+  #
+
+  test "decode in threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    exp = JPEG::Decoder.new(:orientation => true) << dat
+
+    thr = 4.times.map {
+      Thread.new {
+        dec = JPEG::Decoder.new(:orientation => true)
+        3.times.map {dec << dat}
+      }
+    }
+
+    thr.each {|t| t.value.each {|img| assert_equal(exp, img)}}
+  end
+
+  test "decode broken data in threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread[0, 100]
+
+    thr = 4.times.map {
+      Thread.new {
+        dec = JPEG::Decoder.new
+        assert_raise_kind_of(JPEG::DecodeError) {dec << dat}
+      }
+    }
+
+    thr.each(&:join)
+  end
+
+  test "share a decoder between threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new(:orientation => true, :with_exif_tags => true)
+    exp = dec << dat
+    hdr = dec.read_header(dat)
+
+    thr = 8.times.map {
+      Thread.new {
+        5.times.map {[dec << dat, dec.read_header(dat)]}
+      }
+    }
+
+    thr.each {|t|
+      t.value.each {|img, met|
+        assert_equal(exp, img)
+        assert_equal(exp.meta.exif_tags, img.meta.exif_tags)
+        assert_equal(hdr.width, met.width)
+        assert_equal(hdr.height, met.height)
+      }
+    }
+  end
+
+  test "share a decoder between threads (broken data)" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    thr = 4.times.map {|i|
+      Thread.new {
+        10.times {
+          if i.even?
+            assert_equal(exp, dec << dat)
+          else
+            assert_raise_kind_of(JPEG::DecodeError) {dec << dat[0, 100]}
+          end
+        }
+      }
+    }
+
+    thr.each(&:join)
+  end
+
+  test "feed a decoder from threads" do
+    # 伸長中の#feedに重ねて呼んだ場合は例外になり、状態は壊れない
+    # (伸長に時間が掛かる様に大きめの画像を使う)
+    raw = Random.new(1).bytes(1000 * 1000 * 3)
+    dat = JPEG::Encoder.new(1000, 1000, :pixel_format => :RGB) << raw
+    dec = JPEG::Decoder.new
+    exp = dec << dat
+
+    thr = 4.times.map {
+      Thread.new {
+        5.times.map {
+          begin
+            dec.feed(dat)
+          rescue RuntimeError => e
+            e
+          end
+        }
+      }
+    }
+
+    thr.flat_map(&:value).each {|ret|
+      case ret
+      when String
+        assert_equal(exp.bytesize, ret.bytesize)
+      when JPEG::DecodeError
+        # 他のスレッドの入力と混ざった場合
+      when RuntimeError
+        assert_equal("decoder is busy.", ret.message)
+      else
+        assert_nil(ret)
+      end
+    }
+  end
+
+  #
+  # encode in multiple threads
+  #
+
+  test "encode in threads" do
+    dat = (DATA_DIR + "DSC_0215_small.JPG").binread
+    img = JPEG::Decoder.new << dat
+    met = img.meta
+    exp = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB) << img
+
+    thr = 4.times.map {
+      Thread.new {
+        enc = JPEG::Encoder.new(met.width, met.height, :pixel_format => :RGB)
+        3.times.map {enc << img}
+      }
+    }
+
+    thr.each {|t| t.value.each {|jpg| assert_equal(exp, jpg)}}
+  end
+end
@@ -0,0 +1,148 @@
+require 'test/unit'
+require 'pathname'
+require 'jpeg'
+
+class TestThumbnail < Test::Unit::TestCase
+  DATA_DIR  = Pathname($0).expand_path.dirname + "data"
+
+  def setup
+    # 200x300 (サムネイルは80x120)
+    @dat   = (DATA_DIR + "DSC_0215_small.JPG").binread
+    @thumb = JPEG::Decoder.new(:with_exif => true).read_header(@dat)
+                 .exif_tags[:thumbnail][:jpeg_interchange]
+  end
+
+  def size_of(img)
+    [img.meta.width, img.meta.height]
+  end
+
+  #
+  # Orientationとサムネイルを持つExif (APP1) を付加したJPEGを作る
+  #
+  def with_exif(jpg, thumb, o9n, be)
+    s = be ? "n" : "v"
+    l = be ? "N" : "V"
+
+    tiff  = (be ? "MM" : "II") + [0x2a, 8].pack("#{s}#{l}")
+    tiff += [1, 0x0112, 3, 1, o9n, 0, 26].pack("#{s}#{s}#{s}#{l}#{s}#{s}#{l}")
+    tiff += [2].pack(s)
+    tiff += [0x0201, 4, 1, 56].pack("#{s}#{s}#{l}#{l}")
+    tiff += [0x0202, 4, 1, thumb.bytesize].pack("#{s}#{s}#{l}#{l}")
+    tiff += [0].pack(l)
+    tiff += thumb
+
+    app1 = "Exif\0\0".b + tiff.b
+
+    jpg.byteslice(0, 2) + [0xffe1, app1.bytesize + 2].pack("nn") + app1 +
+      jpg.byteslice(2..-1)
+  end
+
+  def gray_jpeg(wd, ht, opts = {})
+    raw = (0...ht).map {|y| (0...wd).map {|x| (x * 7 + y * 3) & 0xff}}
+    enc = JPEG::Encoder.new(wd, ht, :pixel_format => :GRAYSCALE, **opts)
+
+    enc << raw.flatten.pack("C*")
+  end
+
+  test "prefer_thumbnail" do
+    exp = JPEG::Decoder.new << @thumb
+
+    [80, [80, 120], [1, 1]].each {|min|
+      img = JPEG::Decoder.new(:prefer_thumbnail => min) << @dat
+
+      assert_equal(exp, img, min)
+      assert_equal([80, 120], size_of(img))
+    }
+
+    # サムネイルが小さい場合は本体を伸長する
+    exp = JPEG::Decoder.new << @dat
+
+    [81, [120, 80], [80, 121]].each {|min|
+      img = JPEG::Decoder.new(:prefer_thumbnail => min) << @dat
+      assert_equal(exp, img, min)
+    }
+  end
+
+  test "prefer_thumbnail with other options" do
+    # 他のオプションはサムネイルに適用される
+    dec = JPEG::Decoder.new(:prefer_thumbnail => 80, :fit => [40, 40])
+    assert_equal(JPEG::Decoder.new(:fit => [40, 40]) << @thumb, dec << @dat)
+
+    dec = JPEG::Decoder.new(:prefer_thumbnail => 80,
+                            :pixel_format => :GRAYSCALE)
+    assert_equal(80 * 120, (dec << @dat).bytesize)
+  end
+
+  test "prefer_thumbnail with orientation" do
+    # サムネイルには本体のOrientationを適用する
+    [true, false].each {|be|
+      jpg = with_exif(gray_jpeg(64, 32), gray_jpeg(32, 16), 6, be)
+      exp = JPEG::Decoder.new(:orientation => true) <<
+                                    gray_jpeg(32, 16, :orientation => 6)
+
+      dec = JPEG::Decoder.new(:orientation => true, :prefer_thumbnail => [16, 32])
+      img = dec << jpg
+
+      assert_equal([16, 32], size_of(img))
+      assert_equal(exp, img)
+
+      # 回転後の大きさで比較する
+      dec = JPEG::Decoder.new(:orientation => true, :prefer_thumbnail => [32, 16])
+      assert_equal([32, 64], size_of(dec << jpg))
+    }
+  end
+
+  test "prefer_thumbnail with exif tags" do
+    # Exifタグは本体のものを返す
+    exp = (JPEG::Decoder.new(:with_exif => true) << @dat).meta.exif_tags
+    img = JPEG::Decoder.new(:with_exif => true, :prefer_thumbnail => 80) << @dat
+
+    assert_equal([80, 120], size_of(img))
+    assert_equal(exp, img.meta.exif_tags)
+  end
+
+  test "prefer_thumbnail with decode_into and decode_batch" do
+    dec = JPEG::Decoder.new(:prefer_thumbnail => 80)
+    exp = JPEG::Decoder.new << @thumb
+    buf = "\0".b * exp.bytesize
+
+    met = dec.decode_into(@dat, buf)
+    assert_equal([80, 120], [met.width, met.height])
+    assert_equal(exp, buf)
+
+    jpg = with_exif(gray_jpeg(64, 32), gray_jpeg(32, 16), 1, true)
+    ret = dec.decode_batch([@dat, jpg, @dat[0, 100]], :threads => 2)
+
+    assert_equal(exp, ret[0])
+    assert_equal([64, 32], size_of(ret[1]))
+    assert_kind_of(JPEG::DecodeError, ret[2])
+  end
+
+  test "image without thumbnail" do
+    dat = (DATA_DIR + "orientation-6.jpg").binread
+    dec = JPEG::Decoder.new(:prefer_thumbnail => 1)
+
+    assert_equal(JPEG::Decoder.new << dat, dec << dat)
+  end
+
+  test "broken thumbnail" do
+    # 壊れたサムネイルは無視して本体を伸長する
+    jpg = with_exif(gray_jpeg(64, 32), "\xff\xd8broken".b, 1, false)
+    dec = JPEG::Decoder.new(:prefer_thumbnail => 1)
+
+    assert_equal([64, 32], size_of(dec << jpg))
+    assert_equal([64, 32], size_of(dec.decode_batch([jpg])[0]))
+  end
+
+  test "prefer_thumbnail (invalid value)" do
+    assert_raise_kind_of(TypeError) {JPEG::Decoder.new(:prefer_thumbnail => "1")}
+    assert_raise_kind_of(TypeError) {
+      JPEG::Decoder.new(:prefer_thumbnail => [1, "1"])
+    }
+    assert_raise_kind_of(ArgumentError) {
+      JPEG::Decoder.new(:prefer_thumbnail => [1])
+    }
+    assert_raise_kind_of(RangeError) {JPEG::Decoder.new(:prefer_thumbnail => 0)}
+    assert_nothing_raised {JPEG::Decoder.new(:prefer_thumbnail => nil)}
+  end
+end